@@ -138,6 +138,35 @@ static int check_key_size(size_t keylen, const char *alg_name,
 	return 0;
 }
 
+/* A request of out's own on its tfm */
+static int cipher_alloc_request(struct cipher_data *out)
+{
+	init_completion(&out->async.result.completion);
+
+	if (out->aead == 0) {
+		out->async.request = cryptodev_blkcipher_request_alloc(out->async.s, GFP_KERNEL);
+		if (unlikely(!out->async.request)) {
+			derr(1, "error allocating async crypto request");
+			return -ENOMEM;
+		}
+
+		cryptodev_blkcipher_request_set_callback(out->async.request,
+					CRYPTO_TFM_REQ_MAY_BACKLOG,
+					cryptodev_complete, &out->async.result);
+	} else {
+		out->async.arequest = aead_request_alloc(out->async.as, GFP_KERNEL);
+		if (unlikely(!out->async.arequest)) {
+			derr(1, "error allocating async crypto request");
+			return -ENOMEM;
+		}
+
+		aead_request_set_callback(out->async.arequest,
+					CRYPTO_TFM_REQ_MAY_BACKLOG,
+					cryptodev_complete, &out->async.result);
+	}
+	return 0;
+}
+
 int cryptodev_cipher_init(struct cipher_data *out, const char *alg_name,
 				uint8_t *keyp, size_t keylen, int stream, int aead)
 {
@@ -217,31 +246,9 @@ int cryptodev_cipher_init(struct cipher_data *out, const char *alg_name,
 	out->stream = stream;
 	out->aead = aead;
 
-	init_completion(&out->async.result.completion);
-
-	if (aead == 0) {
-		out->async.request = cryptodev_blkcipher_request_alloc(out->async.s, GFP_KERNEL);
-		if (unlikely(!out->async.request)) {
-			derr(1, "error allocating async crypto request");
-			ret = -ENOMEM;
-			goto error;
-		}
-
-		cryptodev_blkcipher_request_set_callback(out->async.request,
-					CRYPTO_TFM_REQ_MAY_BACKLOG,
-					cryptodev_complete, &out->async.result);
-	} else {
-		out->async.arequest = aead_request_alloc(out->async.as, GFP_KERNEL);
-		if (unlikely(!out->async.arequest)) {
-			derr(1, "error allocating async crypto request");
-			ret = -ENOMEM;
-			goto error;
-		}
-
-		aead_request_set_callback(out->async.arequest,
-					CRYPTO_TFM_REQ_MAY_BACKLOG,
-					cryptodev_complete, &out->async.result);
-	}
+	ret = cipher_alloc_request(out);
+	if (unlikely(ret))
+		goto error;
 
 	out->init = 1;
 	return 0;
@@ -263,12 +270,14 @@ void cryptodev_cipher_deinit(struct cipher_data *cdata)
 {
 	if (cdata->init) {
 		if (cdata->aead == 0) {
-			cryptodev_blkcipher_request_free(cdata->async.request);
-			cryptodev_crypto_free_blkcipher(cdata->async.s);
+			if (cdata->async.request)
+				cryptodev_blkcipher_request_free(cdata->async.request);
+			if (!cdata->shared)
+				cryptodev_crypto_free_blkcipher(cdata->async.s);
 		} else {
 			if (cdata->async.arequest)
 				aead_request_free(cdata->async.arequest);
-			if (cdata->async.as)
+			if (cdata->async.as && !cdata->shared)
 				crypto_free_aead(cdata->async.as);
 		}
 
@@ -276,6 +285,34 @@ void cryptodev_cipher_deinit(struct cipher_data *cdata)
 	}
 }
 
+/* Another cipher_data on from's keyed tfm, with requests of its own.
+ * The tfm stays from's to free.
+ */
+int cryptodev_cipher_clone(struct cipher_data *out, const struct cipher_data *from)
+{
+	int ret;
+
+	memset(out, 0, sizeof(*out));
+	if (!from->init)
+		return 0;
+
+	out->blocksize = from->blocksize;
+	out->aead = from->aead;
+	out->stream = from->stream;
+	out->ivsize = from->ivsize;
+	out->alignmask = from->alignmask;
+	out->async.s = from->async.s;
+	out->async.as = from->async.as;
+	out->shared = 1;
+
+	ret = cipher_alloc_request(out);
+	if (unlikely(ret))
+		return ret;
+
+	out->init = 1;
+	return 0;
+}
+
 static inline int waitfor(struct cryptodev_result *cr, ssize_t ret)
 {
 	switch (ret) {
@@ -350,6 +387,23 @@ ssize_t cryptodev_cipher_decrypt(struct cipher_data *cdata,
 
 /* Hash functions */
 
+/* A request of hdata's own on its tfm */
+static int hash_alloc_request(struct hash_data *hdata)
+{
+	init_completion(&hdata->async.result.completion);
+
+	hdata->async.request = ahash_request_alloc(hdata->async.s, GFP_KERNEL);
+	if (unlikely(!hdata->async.request)) {
+		derr(0, "error allocating async crypto request");
+		return -ENOMEM;
+	}
+
+	ahash_request_set_callback(hdata->async.request,
+			CRYPTO_TFM_REQ_MAY_BACKLOG,
+			cryptodev_complete, &hdata->async.result);
+	return 0;
+}
+
 int cryptodev_hash_init(struct hash_data *hdata, const char *alg_name,
 			int hmac_mode, void *mackey, size_t mackeylen)
 {
@@ -375,18 +429,10 @@ int cryptodev_hash_init(struct hash_data *hdata, const char *alg_name,
 	hdata->digestsize = crypto_ahash_digestsize(hdata->async.s);
 	hdata->alignmask = crypto_ahash_alignmask(hdata->async.s);
 
-	init_completion(&hdata->async.result.completion);
-
-	hdata->async.request = ahash_request_alloc(hdata->async.s, GFP_KERNEL);
-	if (unlikely(!hdata->async.request)) {
-		derr(0, "error allocating async crypto request");
-		ret = -ENOMEM;
+	ret = hash_alloc_request(hdata);
+	if (unlikely(ret))
 		goto error;
-	}
 
-	ahash_request_set_callback(hdata->async.request,
-			CRYPTO_TFM_REQ_MAY_BACKLOG,
-			cryptodev_complete, &hdata->async.result);
 	hdata->init = 1;
 	return 0;
 
@@ -398,12 +444,38 @@ error:
 void cryptodev_hash_deinit(struct hash_data *hdata)
 {
 	if (hdata->init) {
-		ahash_request_free(hdata->async.request);
-		crypto_free_ahash(hdata->async.s);
+		if (hdata->async.request)
+			ahash_request_free(hdata->async.request);
+		if (!hdata->shared)
+			crypto_free_ahash(hdata->async.s);
 		hdata->init = 0;
 	}
 }
 
+/* Another hash_data on from's tfm (and HMAC key), with a request and
+ * hash state of its own. The tfm stays from's to free.
+ */
+int cryptodev_hash_clone(struct hash_data *out, const struct hash_data *from)
+{
+	int ret;
+
+	memset(out, 0, sizeof(*out));
+	if (!from->init)
+		return 0;
+
+	out->digestsize = from->digestsize;
+	out->alignmask = from->alignmask;
+	out->async.s = from->async.s;
+	out->shared = 1;
+
+	ret = hash_alloc_request(out);
+	if (unlikely(ret))
+		return ret;
+
+	out->init = 1;
+	return 0;
+}
+
 int cryptodev_hash_reset(struct hash_data *hdata)
 {
 	int ret;
@@ -443,6 +515,53 @@ int cryptodev_hash_final(struct hash_data *hdata, void *output)
 	return waitfor(&hdata->async.result, ret);
 }
 
+/* Digests of n independent messages, sg[i] of len[i] bytes, to out at
+ * digestsize strides. Every request is issued before any is waited
+ * for, so an asynchronous or multi-buffer driver gets them together.
+ */
+int cryptodev_hash_digest_batch(struct hash_data *hdata, struct scatterlist *sg,
+			const unsigned int *len, unsigned int n, u8 *out)
+{
+	struct {
+		struct ahash_request *request;
+		struct cryptodev_result result;
+		int ret;
+	} *batch;
+	unsigned int i, issued;
+	int ret = 0, err;
+
+	batch = kcalloc(n, sizeof(*batch), GFP_KERNEL);
+	if (unlikely(!batch))
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		batch[i].request = ahash_request_alloc(hdata->async.s, GFP_KERNEL);
+		if (unlikely(!batch[i].request)) {
+			derr(0, "error allocating async crypto request");
+			ret = -ENOMEM;
+			break;
+		}
+		init_completion(&batch[i].result.completion);
+		ahash_request_set_callback(batch[i].request,
+				CRYPTO_TFM_REQ_MAY_BACKLOG,
+				cryptodev_complete, &batch[i].result);
+		ahash_request_set_crypt(batch[i].request, &sg[i],
+				out + i * hdata->digestsize, len[i]);
+		batch[i].ret = crypto_ahash_digest(batch[i].request);
+	}
+	issued = i;
+
+	/* Whatever was issued has to finish before its request is freed */
+	for (i = 0; i < issued; i++) {
+		err = waitfor(&batch[i].result, batch[i].ret);
+		if (unlikely(err) && !ret)
+			ret = err;
+		ahash_request_free(batch[i].request);
+	}
+	kfree(batch);
+	return ret;
+}
+
 #ifdef CIOCCPHASH
 /* import the current hash state of src to dst */
 int cryptodev_hash_copy(struct hash_data *dst, struct hash_data *src)
@@ -12,6 +12,7 @@ struct cryptodev_result {
 
 struct cipher_data {
 	int init; /* 0 uninitialized */
+	int shared; /* the tfm belongs to a session export */
 	int blocksize;
 	int aead;
 	int stream;
@@ -34,6 +35,7 @@ struct cipher_data {
 int cryptodev_cipher_init(struct cipher_data *out, const char *alg_name,
 			  uint8_t *key, size_t keylen, int stream, int aead);
 void cryptodev_cipher_deinit(struct cipher_data *cdata);
+int cryptodev_cipher_clone(struct cipher_data *out, const struct cipher_data *from);
 int cryptodev_get_cipher_key(uint8_t *key, struct session_op *sop, int aead);
 int cryptodev_get_cipher_keylen(unsigned int *keylen, struct session_op *sop,
 		int aead);
@@ -85,6 +87,7 @@ static inline void cryptodev_cipher_get_iv(struct cipher_data *cdata,
 /* Hash */
 struct hash_data {
 	int init; /* 0 uninitialized */
+	int shared; /* the tfm belongs to a session export */
 	int digestsize;
 	int alignmask;
 	struct {
@@ -98,7 +101,10 @@ int cryptodev_hash_final(struct hash_data *hdata, void *output);
 ssize_t cryptodev_hash_update(struct hash_data *hdata,
 			struct scatterlist *sg, size_t len);
 int cryptodev_hash_reset(struct hash_data *hdata);
+int cryptodev_hash_digest_batch(struct hash_data *hdata, struct scatterlist *sg,
+			const unsigned int *len, unsigned int n, u8 *out);
 void cryptodev_hash_deinit(struct hash_data *hdata);
+int cryptodev_hash_clone(struct hash_data *out, const struct hash_data *from);
 int cryptodev_hash_init(struct hash_data *hdata, const char *alg_name,
 			int hmac_mode, void *mackey, size_t mackeylen);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29))
@@ -157,6 +157,33 @@ struct crypt_auth_op {
 	__u32   iv_len;
 };
 
+/* input of CIOCHASHBATCH: one message of a batch */
+struct hash_batch_item {
+	__u32	len;		/* at most a page */
+	__u32	__reserved;
+	__u8	__user *src;
+	__u8	__user *mac;	/* digest size bytes */
+};
+
+/* input of CIOCHASHBATCH
+ * count independent digests (or MACs) with the hash session ses,
+ * in one call.
+ */
+struct hash_batch_op {
+	__u32	ses;
+	__u32	count;		/* at most HASH_BATCH_MAX */
+	struct hash_batch_item __user *items;
+};
+
+#define HASH_BATCH_MAX	256
+
+/* input of CIOCEXPORTSESSION and CIOCIMPORTSESSION */
+struct session_export_op {
+	__u32	ses;		/* session to export, or the imported one */
+	__u32	__reserved;
+	__u64	handle;		/* what CIOCEXPORTSESSION gives out */
+};
+
 /* In plain AEAD mode the following are required:
  *  flags   : 0
  *  iv      : the initialization vector (12 bytes)
@@ -312,4 +339,21 @@ struct cphash_op {
 #define CIOCCPHASH	_IOW('c', 112, struct cphash_op)
 #endif
 
+/* additional ioctl for hashing many small messages at once.
+ * Every message is hashed from scratch; the session's own state
+ * is left alone.
+ */
+#define CIOCHASHBATCH	_IOW('c', 113, struct hash_batch_op)
+
+/* additional ioctls for sharing a session between fds and processes.
+ * CIOCEXPORTSESSION gives a handle for a session; CIOCIMPORTSESSION,
+ * on any fd of a process with the same effective uid, makes a new
+ * session from it on the same keyed transforms, without setting the
+ * key up again. The sessions run concurrently, and each is closed
+ * with CIOCFSESSION as usual. The handle stays valid as long as any
+ * of them is open.
+ */
+#define CIOCEXPORTSESSION	_IOWR('c', 114, struct session_export_op)
+#define CIOCIMPORTSESSION	_IOWR('c', 115, struct session_export_op)
+
 #endif /* L_CRYPTODEV_H */
@@ -73,11 +73,26 @@ struct compat_crypt_op {
 	compat_uptr_t	iv;/* initialization vector for encryption operations */
 };
 
+/* input of CIOCHASHBATCH */
+struct compat_hash_batch_item {
+	uint32_t	len;
+	uint32_t	__reserved;
+	compat_uptr_t	src;
+	compat_uptr_t	mac;
+};
+
+struct compat_hash_batch_op {
+	uint32_t	ses;
+	uint32_t	count;
+	compat_uptr_t	items;		/* struct compat_hash_batch_item */
+};
+
 /* compat ioctls, defined for the above structs */
 #define COMPAT_CIOCGSESSION    _IOWR('c', 102, struct compat_session_op)
 #define COMPAT_CIOCCRYPT       _IOWR('c', 104, struct compat_crypt_op)
 #define COMPAT_CIOCASYNCCRYPT  _IOW('c', 107, struct compat_crypt_op)
 #define COMPAT_CIOCASYNCFETCH  _IOR('c', 108, struct compat_crypt_op)
+#define COMPAT_CIOCHASHBATCH   _IOW('c', 113, struct compat_hash_batch_op)
 
 #endif /* CONFIG_COMPAT */
 
@@ -114,10 +129,13 @@ int kcaop_to_user(struct kernel_crypt_auth_op *kcaop,
 		struct fcrypt *fcr, void __user *arg);
 int crypto_auth_run(struct fcrypt *fcr, struct kernel_crypt_auth_op *kcaop);
 int crypto_run(struct fcrypt *fcr, struct kernel_crypt_op *kcop);
+int crypto_hash_batch(struct fcrypt *fcr, struct hash_batch_op *hbop, int compat);
 
 #include <cryptlib.h>
 
 /* other internal structs */
+struct session_export;
+
 struct csession {
 	struct list_head entry;
 	struct mutex sem;
@@ -125,6 +143,7 @@ struct csession {
 	struct hash_data hdata;
 	uint32_t sid;
 	uint32_t alignmask;
+	struct session_export *export; /* owns the tfms, if exported */
 
 	unsigned int array_size;
 	unsigned int used_pages; /* the number of pages that are used */
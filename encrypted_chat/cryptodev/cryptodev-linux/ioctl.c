@@ -34,6 +34,8 @@
  */
 
 #include <crypto/hash.h>
+#include <linux/cred.h>
+#include <linux/kref.h>
 #include <linux/mm.h>
 #include <linux/highmem.h>
 #include <linux/ioctl.h>
@@ -57,6 +59,7 @@
 MODULE_AUTHOR("Nikos Mavrogiannopoulos <nmav@gnutls.org>");
 MODULE_DESCRIPTION("CryptoDev driver");
 MODULE_LICENSE("GPL");
+MODULE_VERSION(VERSION);
 
 /* ====== Compile-time config ====== */
 
@@ -102,11 +105,86 @@ struct crypt_priv {
 /* cryptodev's own workqueue, keeps crypto tasks from disturbing the force */
 static struct workqueue_struct *cryptodev_wq;
 
+/* The keyed tfms of an exported session. Every session exported or
+ * imported with the handle holds a reference; the last one frees them.
+ * Those sessions have requests of their own and run concurrently on
+ * the tfms. (For AEAD the tag size is a tfm setting, so they had all
+ * better use the same one.)
+ */
+struct session_export {
+	struct list_head entry;
+	struct kref ref;
+	uint64_t handle;
+	kuid_t owner;
+	struct cipher_data cdata;	/* the tfms, no requests */
+	struct hash_data hdata;
+	uint32_t alignmask;
+};
+
+static LIST_HEAD(session_exports);
+static DEFINE_MUTEX(session_exports_lock);
+
+/* Called with session_exports_lock held, as kref_put_mutex() does */
+static void session_export_release(struct kref *ref)
+{
+	struct session_export *exp = container_of(ref, struct session_export, ref);
+
+	list_del(&exp->entry);
+	mutex_unlock(&session_exports_lock);
+
+	ddebug(2, "Freeing export 0x%016llX", (unsigned long long)exp->handle);
+	cryptodev_cipher_deinit(&exp->cdata);
+	cryptodev_hash_deinit(&exp->hdata);
+	kfree(exp);
+}
+
+static inline void session_export_put(struct session_export *exp)
+{
+	kref_put_mutex(&exp->ref, session_export_release, &session_exports_lock);
+}
+
+/* Page arrays and a unique SID for ses_new, and onto fcr's list */
+static int crypto_add_session(struct fcrypt *fcr, struct csession *ses_new)
+{
+	struct csession *ses_ptr;
+
+	ses_new->array_size = DEFAULT_PREALLOC_PAGES;
+	ddebug(2, "preallocating for %d user pages", ses_new->array_size);
+	ses_new->pages = kzalloc(ses_new->array_size *
+			sizeof(struct page *), GFP_KERNEL);
+	ses_new->sg = kzalloc(ses_new->array_size *
+			sizeof(struct scatterlist), GFP_KERNEL);
+	if (ses_new->sg == NULL || ses_new->pages == NULL) {
+		ddebug(0, "Memory error");
+		return -ENOMEM;
+	}
+
+	/* put the new session to the list */
+	get_random_bytes(&ses_new->sid, sizeof(ses_new->sid));
+	mutex_init(&ses_new->sem);
+
+	mutex_lock(&fcr->sem);
+restart:
+	list_for_each_entry(ses_ptr, &fcr->list, entry) {
+		/* Check for duplicate SID */
+		if (unlikely(ses_new->sid == ses_ptr->sid)) {
+			get_random_bytes(&ses_new->sid, sizeof(ses_new->sid));
+			/* Unless we have a broken RNG this
+			   shouldn't loop forever... ;-) */
+			goto restart;
+		}
+	}
+
+	list_add(&ses_new->entry, &fcr->list);
+	mutex_unlock(&fcr->sem);
+	return 0;
+}
+
 /* Prepare session for future use. */
 static int
 crypto_create_session(struct fcrypt *fcr, struct session_op *sop)
 {
-	struct csession	*ses_new = NULL, *ses_ptr;
+	struct csession	*ses_new = NULL;
 	int ret = 0;
 	const char *alg_name = NULL;
 	const char *hash_name = NULL;
@@ -289,36 +367,9 @@ crypto_create_session(struct fcrypt *fcr, struct session_op *sop)
 	                                          ses_new->hdata.alignmask);
 	ddebug(2, "got alignmask %d", ses_new->alignmask);
 
-	ses_new->array_size = DEFAULT_PREALLOC_PAGES;
-	ddebug(2, "preallocating for %d user pages", ses_new->array_size);
-	ses_new->pages = kzalloc(ses_new->array_size *
-			sizeof(struct page *), GFP_KERNEL);
-	ses_new->sg = kzalloc(ses_new->array_size *
-			sizeof(struct scatterlist), GFP_KERNEL);
-	if (ses_new->sg == NULL || ses_new->pages == NULL) {
-		ddebug(0, "Memory error");
-		ret = -ENOMEM;
+	ret = crypto_add_session(fcr, ses_new);
+	if (unlikely(ret))
 		goto session_error;
-	}
-
-	/* put the new session to the list */
-	get_random_bytes(&ses_new->sid, sizeof(ses_new->sid));
-	mutex_init(&ses_new->sem);
-
-	mutex_lock(&fcr->sem);
-restart:
-	list_for_each_entry(ses_ptr, &fcr->list, entry) {
-		/* Check for duplicate SID */
-		if (unlikely(ses_new->sid == ses_ptr->sid)) {
-			get_random_bytes(&ses_new->sid, sizeof(ses_new->sid));
-			/* Unless we have a broken RNG this
-			   shouldn't loop forever... ;-) */
-			goto restart;
-		}
-	}
-
-	list_add(&ses_new->entry, &fcr->list);
-	mutex_unlock(&fcr->sem);
 
 	/* Fill in some values for the user. */
 	sop->ses = ses_new->sid;
@@ -351,6 +402,8 @@ crypto_destroy_session(struct csession *ses_ptr)
 	ddebug(2, "freeing space for %d user pages", ses_ptr->array_size);
 	kfree(ses_ptr->pages);
 	kfree(ses_ptr->sg);
+	if (ses_ptr->export)
+		session_export_put(ses_ptr->export);
 	mutex_unlock(&ses_ptr->sem);
 	mutex_destroy(&ses_ptr->sem);
 	kfree(ses_ptr);
@@ -424,6 +477,128 @@ crypto_get_session_by_sid(struct fcrypt *fcr, uint32_t sid)
 	return retval;
 }
 
+/* Hand out a handle to the session's tfms, for other fds to import */
+static int
+crypto_export_session(struct fcrypt *fcr, struct session_export_op *seop)
+{
+	struct csession *ses_ptr;
+	struct session_export *exp, *tmp;
+	int ret = 0;
+
+	/* this also enters ses_ptr->sem */
+	ses_ptr = crypto_get_session_by_sid(fcr, seop->ses);
+	if (unlikely(!ses_ptr)) {
+		derr(1, "invalid session ID=0x%08X", seop->ses);
+		return -EINVAL;
+	}
+
+	exp = ses_ptr->export;
+	if (exp)
+		goto out;
+
+	exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+	if (unlikely(!exp)) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+	kref_init(&exp->ref);
+	exp->owner = current_euid();
+	exp->alignmask = ses_ptr->alignmask;
+
+	/* The tfms move to exp, the session keeps its requests */
+	exp->cdata = ses_ptr->cdata;
+	exp->cdata.async.request = NULL;
+	exp->cdata.async.arequest = NULL;
+	exp->hdata = ses_ptr->hdata;
+	exp->hdata.async.request = NULL;
+	ses_ptr->cdata.shared = 1;
+	ses_ptr->hdata.shared = 1;
+	ses_ptr->export = exp;
+
+	mutex_lock(&session_exports_lock);
+restart:
+	get_random_bytes(&exp->handle, sizeof(exp->handle));
+	list_for_each_entry(tmp, &session_exports, entry) {
+		if (unlikely(tmp->handle == exp->handle))
+			goto restart;
+	}
+	list_add(&exp->entry, &session_exports);
+	mutex_unlock(&session_exports_lock);
+	ddebug(2, "Exported session 0x%08X as 0x%016llX", ses_ptr->sid,
+	       (unsigned long long)exp->handle);
+out:
+	seop->handle = exp->handle;
+out_unlock:
+	crypto_put_session(ses_ptr);
+	return ret;
+}
+
+/* A new session on this fd, on the tfms behind an exported handle */
+static int
+crypto_import_session(struct fcrypt *fcr, struct session_export_op *seop)
+{
+	struct session_export *exp, *found = NULL;
+	struct csession *ses_new;
+	int ret;
+
+	mutex_lock(&session_exports_lock);
+	list_for_each_entry(exp, &session_exports, entry) {
+		if (exp->handle == seop->handle) {
+			kref_get(&exp->ref);
+			found = exp;
+			break;
+		}
+	}
+	mutex_unlock(&session_exports_lock);
+
+	if (unlikely(!found)) {
+		ddebug(1, "no exported session 0x%016llX",
+		       (unsigned long long)seop->handle);
+		return -ENOENT;
+	}
+	if (unlikely(!uid_eq(found->owner, current_euid()) && !capable(CAP_SYS_ADMIN))) {
+		ret = -EPERM;
+		goto out_put;
+	}
+
+	ses_new = kzalloc(sizeof(*ses_new), GFP_KERNEL);
+	if (unlikely(!ses_new)) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+
+	ret = cryptodev_cipher_clone(&ses_new->cdata, &found->cdata);
+	if (unlikely(ret))
+		goto session_error;
+	ret = cryptodev_hash_clone(&ses_new->hdata, &found->hdata);
+	if (unlikely(ret))
+		goto session_error;
+	if (ses_new->hdata.init) {
+		ret = cryptodev_hash_reset(&ses_new->hdata);
+		if (unlikely(ret))
+			goto session_error;
+	}
+	ses_new->alignmask = found->alignmask;
+	ses_new->export = found;
+
+	ret = crypto_add_session(fcr, ses_new);
+	if (unlikely(ret))
+		goto session_error;
+
+	seop->ses = ses_new->sid;
+	return 0;
+
+session_error:
+	cryptodev_hash_deinit(&ses_new->hdata);
+	cryptodev_cipher_deinit(&ses_new->cdata);
+	kfree(ses_new->sg);
+	kfree(ses_new->pages);
+	kfree(ses_new);
+out_put:
+	session_export_put(found);
+	return ret;
+}
+
 #ifdef CIOCCPHASH
 /* Copy the hash state from one session to another */
 static int
@@ -841,6 +1016,8 @@ cryptodev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg_)
 	struct crypt_priv *pcr = filp->private_data;
 	struct fcrypt *fcr;
 	struct session_info_op siop;
+	struct hash_batch_op hbop;
+	struct session_export_op seop;
 #ifdef CIOCCPHASH
 	struct cphash_op cphop;
 #endif
@@ -900,6 +1077,27 @@ cryptodev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg_)
 			return -EFAULT;
 		return crypto_copy_hash_state(fcr, cphop.dst_ses, cphop.src_ses);
 #endif /* CIOCPHASH */
+	case CIOCEXPORTSESSION:
+	case CIOCIMPORTSESSION:
+		if (unlikely(copy_from_user(&seop, arg, sizeof(seop))))
+			return -EFAULT;
+
+		if (cmd == CIOCEXPORTSESSION)
+			ret = crypto_export_session(fcr, &seop);
+		else
+			ret = crypto_import_session(fcr, &seop);
+		if (unlikely(ret))
+			return ret;
+		if (unlikely(copy_to_user(arg, &seop, sizeof(seop)))) {
+			if (cmd == CIOCIMPORTSESSION)
+				crypto_finish_session(fcr, seop.ses);
+			return -EFAULT;
+		}
+		return 0;
+	case CIOCHASHBATCH:
+		if (unlikely(copy_from_user(&hbop, arg, sizeof(hbop))))
+			return -EFAULT;
+		return crypto_hash_batch(fcr, &hbop, 0);
 	case CIOCCRYPT:
 		if (unlikely(ret = kcop_from_user(&kcop, fcr, arg))) {
 			dwarning(1, "Error copying from user");
@@ -1040,6 +1238,8 @@ cryptodev_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg_)
 	struct fcrypt *fcr;
 	struct session_op sop;
 	struct compat_session_op compat_sop;
+	struct hash_batch_op hbop;
+	struct compat_hash_batch_op compat_hbop;
 	struct kernel_crypt_op kcop;
 	int ret;
 
@@ -1053,6 +1253,8 @@ cryptodev_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg_)
 	case CRIOGET:
 	case CIOCFSESSION:
 	case CIOCGSESSINFO:
+	case CIOCEXPORTSESSION:
+	case CIOCIMPORTSESSION:
 		return cryptodev_ioctl(file, cmd, arg_);
 
 	case COMPAT_CIOCGSESSION:
@@ -1083,6 +1285,15 @@ cryptodev_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg_)
 			return ret;
 
 		return compat_kcop_to_user(&kcop, fcr, arg);
+
+	case COMPAT_CIOCHASHBATCH:
+		if (unlikely(copy_from_user(&compat_hbop, arg,
+					    sizeof(compat_hbop))))
+			return -EFAULT;
+		hbop.ses = compat_hbop.ses;
+		hbop.count = compat_hbop.count;
+		hbop.items = compat_ptr(compat_hbop.items);
+		return crypto_hash_batch(fcr, &hbop, 1);
 #ifdef ENABLE_ASYNC
 	case COMPAT_CIOCASYNCCRYPT:
 		if (unlikely(ret = compat_kcop_from_user(&kcop, fcr, arg)))
@@ -39,6 +39,7 @@
 #include <linux/random.h>
 #include <linux/syscalls.h>
 #include <linux/pagemap.h>
+#include <linux/slab.h>
 #include <linux/poll.h>
 #include <linux/uaccess.h>
 #include <crypto/cryptodev.h>
@@ -265,3 +266,125 @@ out_unlock:
 	crypto_put_session(ses_ptr);
 	return ret;
 }
+
+/* Reads the n items of a batch, from a 32bit userland if compat. */
+static int hash_batch_items_from_user(struct hash_batch_item *items,
+		struct hash_batch_item __user *uitems, unsigned int n, int compat)
+{
+#ifdef CONFIG_COMPAT
+	struct compat_hash_batch_item __user *citems = (void __user *)uitems;
+	struct compat_hash_batch_item citem;
+	unsigned int i;
+
+	if (compat) {
+		for (i = 0; i < n; i++) {
+			if (unlikely(copy_from_user(&citem, &citems[i], sizeof(citem))))
+				return -EFAULT;
+			items[i].len = citem.len;
+			items[i].src = compat_ptr(citem.src);
+			items[i].mac = compat_ptr(citem.mac);
+		}
+		return 0;
+	}
+#endif
+	if (unlikely(copy_from_user(items, uitems, n * sizeof(*items))))
+		return -EFAULT;
+	return 0;
+}
+
+/* Independent digests of many small messages with one hash session.
+ * The messages are packed into pages, none may be longer than one.
+ */
+int crypto_hash_batch(struct fcrypt *fcr, struct hash_batch_op *hbop, int compat)
+{
+	struct csession *ses_ptr;
+	struct hash_batch_item *items = NULL;
+	struct scatterlist *sg = NULL;
+	unsigned long *pages = NULL;
+	unsigned int *len = NULL, i, npages = 0, used = 0, n = hbop->count;
+	char *page = NULL;
+	u8 *digests = NULL;
+	int ret;
+
+	if (unlikely(n == 0 || n > HASH_BATCH_MAX)) {
+		ddebug(1, "invalid batch size %u", n);
+		return -EINVAL;
+	}
+
+	/* this also enters ses_ptr->sem */
+	ses_ptr = crypto_get_session_by_sid(fcr, hbop->ses);
+	if (unlikely(!ses_ptr)) {
+		derr(1, "invalid session ID=0x%08X", hbop->ses);
+		return -EINVAL;
+	}
+	if (unlikely(ses_ptr->hdata.init == 0 || ses_ptr->cdata.init != 0)) {
+		derr(1, "session 0x%08X is not a hash session", hbop->ses);
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	items = kmalloc_array(n, sizeof(*items), GFP_KERNEL);
+	sg = kmalloc_array(n, sizeof(*sg), GFP_KERNEL);
+	len = kmalloc_array(n, sizeof(*len), GFP_KERNEL);
+	pages = kcalloc(n, sizeof(*pages), GFP_KERNEL);
+	digests = kmalloc_array(n, ses_ptr->hdata.digestsize, GFP_KERNEL);
+	if (unlikely(!items || !sg || !len || !pages || !digests)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = hash_batch_items_from_user(items, hbop->items, n, compat);
+	if (unlikely(ret))
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (unlikely(items[i].len > PAGE_SIZE)) {
+			derr(1, "batch message of %u bytes is longer than a page",
+			     items[i].len);
+			ret = -EINVAL;
+			goto out;
+		}
+		if (!page || used == PAGE_SIZE || used + items[i].len > PAGE_SIZE) {
+			pages[npages] = __get_free_page(GFP_KERNEL);
+			if (unlikely(!pages[npages])) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			page = (char *)pages[npages++];
+			used = 0;
+		}
+		if (unlikely(copy_from_user(page + used, items[i].src, items[i].len))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		sg_init_one(&sg[i], page + used, items[i].len);
+		len[i] = items[i].len;
+		used = ALIGN(used + items[i].len, ses_ptr->alignmask + 1);
+	}
+
+	ret = cryptodev_hash_digest_batch(&ses_ptr->hdata, sg, len, n, digests);
+	if (unlikely(ret))
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (unlikely(copy_to_user(items[i].mac,
+				digests + i * ses_ptr->hdata.digestsize,
+				ses_ptr->hdata.digestsize))) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+
+out:
+	if (pages)
+		for (i = 0; i < npages; i++)
+			free_page(pages[i]);
+	kfree(digests);
+	kfree(pages);
+	kfree(len);
+	kfree(sg);
+	kfree(items);
+out_unlock:
+	crypto_put_session(ses_ptr);
+	return ret;
+}
@@ -0,0 +1,748 @@
+/*
+ * OpenSSL 3 provider on top of /dev/crypto: AES-CBC, AES-CTR and
+ * AES-GCM.
+ *
+ * Placed under public domain.
+ *
+ * Every context has a software context of the same cipher beside it.
+ * Runs of whole blocks of at least the threshold go to the kernel,
+ * everything else to the software side; ctx->iv follows whichever did
+ * the last blocks, and the software side is given it again when it
+ * takes over. CBC padding is done here for the same reason.
+ *
+ * The kernel does GCM in one request, so only a message whose data
+ * comes in a single update can use it: the AAD is held back until the
+ * data arrives, and should more data follow, the software side
+ * replays the first part and carries on. Decryption needs the tag
+ * before the data for that. Anything this file does not know about,
+ * such as the TLS record parameters, hands the context over to the
+ * software side for good.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <crypto/cryptodev.h>
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/params.h>
+#include "cryptodev-prov.h"
+
+#define MIN(x,y) ((x)<(y)?(x):(y))
+
+#define GCM_TAG_LEN	16
+#define GCM_MAX_AAD	4096	/* the kernel takes at most a page */
+
+enum gcm_state { GCM_START, GCM_KERNEL, GCM_SOFTWARE };
+
+struct cipher_ctx {
+	struct cdev_prov *prov;
+	const struct cdev_alg *alg;
+	int enc;
+	int passthrough;		/* software side only, for good */
+	struct cdev_sess *sess;		/* NULL: no kernel for this key */
+	EVP_CIPHER_CTX *sw;
+	int sw_stale;			/* the kernel did the last blocks */
+	unsigned char iv[CDEV_MAX_IV];	/* next IV or counter */
+	unsigned char oiv[CDEV_MAX_IV];	/* the one given at init */
+	size_t ivlen;
+	int iv_set;
+
+	/* CBC */
+	int pad;
+	unsigned char buf[16];
+	size_t bufl;
+
+	/* GCM */
+	enum gcm_state gcm;
+	unsigned char *aad, *saved;	/* held back AAD, the kernel's input */
+	size_t aadl, savedl;
+	unsigned char tag[GCM_TAG_LEN];
+	size_t taglen;
+	int tag_set;
+};
+
+static void *cipher_newctx(void *provctx, const struct cdev_alg *alg)
+{
+	struct cipher_ctx *ctx;
+
+	if (!cdev_sw_cipher(provctx, alg))
+		return NULL;
+	if (!(ctx = calloc(1, sizeof(*ctx))))
+		return NULL;
+	ctx->prov = provctx;
+	ctx->alg = alg;
+	ctx->ivlen = alg->ivlen;
+	ctx->pad = 1;
+	ctx->taglen = GCM_TAG_LEN;
+	if (!(ctx->sw = EVP_CIPHER_CTX_new())) {
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void gcm_reset(struct cipher_ctx *ctx)
+{
+	OPENSSL_clear_free(ctx->aad, ctx->aadl);
+	OPENSSL_clear_free(ctx->saved, ctx->savedl);
+	ctx->aad = ctx->saved = NULL;
+	ctx->aadl = ctx->savedl = 0;
+	ctx->gcm = GCM_START;
+	ctx->tag_set = 0;
+}
+
+static void cipher_freectx(void *vctx)
+{
+	struct cipher_ctx *ctx = vctx;
+
+	cdev_cipher_sess_put(ctx->prov, ctx->sess);
+	gcm_reset(ctx);
+	EVP_CIPHER_CTX_free(ctx->sw);
+	OPENSSL_cleanse(ctx, sizeof(*ctx));
+	free(ctx);
+}
+
+static void *cipher_dupctx(void *vctx)
+{
+	struct cipher_ctx *ctx = vctx, *dup;
+
+	if (!(dup = malloc(sizeof(*dup))))
+		return NULL;
+	*dup = *ctx;
+	dup->aad = dup->saved = NULL;
+	if ((dup->sw = EVP_CIPHER_CTX_new()) && !EVP_CIPHER_CTX_copy(dup->sw, ctx->sw)) {
+		EVP_CIPHER_CTX_free(dup->sw);
+		dup->sw = NULL;
+	}
+	if (ctx->aad)
+		dup->aad = OPENSSL_memdup(ctx->aad, ctx->aadl);
+	if (ctx->saved)
+		dup->saved = OPENSSL_memdup(ctx->saved, ctx->savedl);
+	if (!dup->sw || (ctx->aad && !dup->aad) || (ctx->saved && !dup->saved)) {
+		dup->sess = NULL;
+		cipher_freectx(dup);
+		return NULL;
+	}
+	if (dup->sess) {
+		pthread_mutex_lock(&ctx->prov->lock);
+		dup->sess->refs++;
+		pthread_mutex_unlock(&ctx->prov->lock);
+	}
+	return dup;
+}
+
+static int cipher_set_ctx_params(void *vctx, const OSSL_PARAM params[]);
+
+static int cipher_init(struct cipher_ctx *ctx, const unsigned char *key, size_t keylen,
+		       const unsigned char *iv, size_t ivlen, const OSSL_PARAM params[],
+		       int enc)
+{
+	const struct cdev_alg *alg = ctx->alg;
+
+	ctx->enc = enc;
+	ctx->bufl = 0;
+	gcm_reset(ctx);
+	if (!EVP_CipherInit_ex2(ctx->sw, EVP_CIPHER_CTX_get0_cipher(ctx->sw) ? NULL :
+				cdev_sw_cipher(ctx->prov, alg), NULL, NULL, enc, NULL))
+		return 0;
+	/* An IV length has to be known before the IV */
+	if (!cipher_set_ctx_params(ctx, params))
+		return 0;
+	if (key) {
+		if (keylen != (size_t)alg->keylen)
+			return 0;
+		cdev_cipher_sess_put(ctx->prov, ctx->sess);
+		ctx->sess = cdev_cipher_sess_get(ctx->prov, alg, key);
+	}
+	if (iv) {
+		if (ivlen != ctx->ivlen || ivlen > CDEV_MAX_IV)
+			return 0;
+		memcpy(ctx->iv, iv, ivlen);
+		memcpy(ctx->oiv, iv, ivlen);
+		ctx->iv_set = 1;
+	} else if (ctx->iv_set && alg->mode == CDEV_CBC) {
+		/*
+		 * As the default provider does, CBC starts over from the IV.
+		 * The software side was given the kernel's IVs since, so its
+		 * own idea of the first one is off.
+		 */
+		memcpy(ctx->iv, ctx->oiv, ctx->ivlen);
+		iv = ctx->iv;
+	} else if (ctx->iv_set && alg->mode == CDEV_CTR && !ctx->passthrough) {
+		/* and CTR goes on from the counter, which the kernel may have moved */
+		iv = ctx->iv;
+	}
+	if (!EVP_CipherInit_ex2(ctx->sw, NULL, key, iv, enc, NULL))
+		return 0;
+	if (alg->mode == CDEV_CBC && !ctx->passthrough)
+		EVP_CIPHER_CTX_set_padding(ctx->sw, 0);
+	ctx->sw_stale = 0;
+	return 1;
+}
+
+static int cipher_einit(void *vctx, const unsigned char *key, size_t keylen,
+			const unsigned char *iv, size_t ivlen, const OSSL_PARAM params[])
+{
+	return cipher_init(vctx, key, keylen, iv, ivlen, params, 1);
+}
+
+static int cipher_dinit(void *vctx, const unsigned char *key, size_t keylen,
+			const unsigned char *iv, size_t ivlen, const OSSL_PARAM params[])
+{
+	return cipher_init(vctx, key, keylen, iv, ivlen, params, 0);
+}
+
+/* Give the software side the IV the kernel left behind */
+static int sw_sync(struct cipher_ctx *ctx)
+{
+	if (!ctx->sw_stale)
+		return 1;
+	ctx->sw_stale = 0;
+	return EVP_CipherInit_ex2(ctx->sw, NULL, NULL, ctx->iv, -1, NULL);
+}
+
+/* n bytes of CBC or CTR, in the kernel if they are worth it */
+static int bulk(struct cipher_ctx *ctx, unsigned char *out, const unsigned char *in, size_t n)
+{
+	struct cdev_prov *prov = ctx->prov;
+	int op = ctx->enc ? COP_ENCRYPT : COP_DECRYPT, l, ret;
+
+	if (!n)
+		return 1;
+	if (ctx->sess && !(n % 16) && (long)n >= cdev_threshold(prov, ctx->alg)) {
+		/* Only there is every request's IV known in advance */
+		if (ctx->alg->mode == CDEV_CTR || !ctx->enc)
+			ret = cdev_crypt_batch(prov, ctx->sess, op, in, out, n, ctx->iv);
+		else
+			ret = cdev_crypt(prov, ctx->sess, op, 0, in, out, n, ctx->iv, NULL);
+		if (!ret) {
+			ctx->sw_stale = 1;
+			return 1;
+		}
+		/* The kernel let us down, stay in software from now on */
+		cdev_cipher_sess_put(prov, ctx->sess);
+		ctx->sess = NULL;
+	}
+	if (!sw_sync(ctx) || !EVP_CipherUpdate(ctx->sw, out, &l, in, n) || (size_t)l != n)
+		return 0;
+	return EVP_CIPHER_CTX_get_updated_iv(ctx->sw, ctx->iv, ctx->ivlen);
+}
+
+static int cbc_update(struct cipher_ctx *ctx, unsigned char *out, size_t *outl,
+		      size_t outsize, const unsigned char *in, size_t inl)
+{
+	size_t done = 0, n;
+
+	if (outsize < ((ctx->bufl + inl) & ~15))
+		return 0;
+	/* Top up a partial block */
+	if (ctx->bufl) {
+		n = MIN(16 - ctx->bufl, inl);
+		memcpy(ctx->buf + ctx->bufl, in, n);
+		ctx->bufl += n;
+		in += n;
+		inl -= n;
+		/* Decrypting with padding holds the last block back for final() */
+		if (ctx->bufl == 16 && (inl || ctx->enc || !ctx->pad)) {
+			if (!bulk(ctx, out, ctx->buf, 16))
+				return 0;
+			out += 16;
+			done += 16;
+			ctx->bufl = 0;
+		}
+	}
+	n = inl & ~15;
+	if (n && n == inl && !ctx->enc && ctx->pad)
+		n -= 16;
+	if (!bulk(ctx, out, in, n))
+		return 0;
+	done += n;
+	memcpy(ctx->buf + ctx->bufl, in + n, inl - n);
+	ctx->bufl += inl - n;
+	*outl = done;
+	return 1;
+}
+
+static int cbc_final(struct cipher_ctx *ctx, unsigned char *out, size_t *outl, size_t outsize)
+{
+	unsigned char block[16];
+	size_t i, padl;
+
+	*outl = 0;
+	if (!ctx->pad)
+		return ctx->bufl == 0;
+	if (ctx->enc) {
+		padl = 16 - ctx->bufl;
+		for (i = ctx->bufl; i < 16; i++)
+			ctx->buf[i] = padl;
+		if (outsize < 16 || !bulk(ctx, out, ctx->buf, 16))
+			return 0;
+		ctx->bufl = 0;
+		*outl = 16;
+		return 1;
+	}
+	if (ctx->bufl != 16 || !bulk(ctx, block, ctx->buf, 16))
+		return 0;
+	ctx->bufl = 0;
+	padl = block[15];
+	if (padl == 0 || padl > 16)
+		return 0;
+	for (i = 16 - padl; i < 16; i++)
+		if (block[i] != padl)
+			return 0;
+	if (outsize < 16 - padl)
+		return 0;
+	memcpy(out, block, 16 - padl);
+	*outl = 16 - padl;
+	OPENSSL_cleanse(block, sizeof(block));
+	return 1;
+}
+
+static int ctr_update(struct cipher_ctx *ctx, unsigned char *out, size_t *outl,
+		      size_t outsize, const unsigned char *in, size_t inl)
+{
+	size_t n = 0;
+	int num;
+
+	if (outsize < inl)
+		return 0;
+	/* Use up a partly used counter block in software first */
+	if (!ctx->sw_stale && (num = EVP_CIPHER_CTX_get_num(ctx->sw)) > 0) {
+		n = MIN(inl, 16 - (size_t)num);
+		if (!bulk(ctx, out, in, n))
+			return 0;
+	}
+	if (!bulk(ctx, out + n, in + n, (inl - n) & ~15))
+		return 0;
+	n += (inl - n) & ~15;
+	if (!bulk(ctx, out + n, in + n, inl - n))
+		return 0;
+	*outl = inl;
+	return 1;
+}
+
+/* Leave the kernel behind: the software side catches up on what it did */
+static int gcm_to_software(struct cipher_ctx *ctx)
+{
+	unsigned char *scratch = NULL;
+	int l, ok = 1;
+
+	if (ctx->gcm == GCM_SOFTWARE)
+		return 1;
+	if (ctx->aadl)
+		ok = EVP_CipherUpdate(ctx->sw, NULL, &l, ctx->aad, ctx->aadl);
+	if (ok && ctx->savedl) {
+		ok = (scratch = OPENSSL_malloc(ctx->savedl)) &&
+		     EVP_CipherUpdate(ctx->sw, scratch, &l, ctx->saved, ctx->savedl);
+		OPENSSL_clear_free(scratch, ctx->savedl);
+	}
+	if (ok && !ctx->enc && ctx->tag_set)
+		ok = EVP_CIPHER_CTX_ctrl(ctx->sw, EVP_CTRL_AEAD_SET_TAG, ctx->taglen, ctx->tag);
+	OPENSSL_clear_free(ctx->aad, ctx->aadl);
+	OPENSSL_clear_free(ctx->saved, ctx->savedl);
+	ctx->aad = ctx->saved = NULL;
+	ctx->aadl = ctx->savedl = 0;
+	ctx->gcm = GCM_SOFTWARE;
+	return ok;
+}
+
+/* The whole message in one CIOCAUTHCRYPT */
+static int gcm_kernel(struct cipher_ctx *ctx, unsigned char *out, const unsigned char *in,
+		      size_t inl)
+{
+	struct crypt_auth_op cao;
+	unsigned char *buf, *saved;
+	int ret;
+
+	if (!(saved = OPENSSL_memdup(in, inl)))
+		return -1;
+	/* The kernel wants room for the tag after the data, either way */
+	if (!(buf = OPENSSL_malloc(inl + GCM_TAG_LEN))) {
+		OPENSSL_clear_free(saved, inl);
+		return -1;
+	}
+	memcpy(buf, in, inl);
+	if (!ctx->enc)
+		memcpy(buf + inl, ctx->tag, GCM_TAG_LEN);
+
+	memset(&cao, 0, sizeof(cao));
+	cao.ses = ctx->sess->ses;
+	cao.op = ctx->enc ? COP_ENCRYPT : COP_DECRYPT;
+	cao.len = ctx->enc ? inl : inl + GCM_TAG_LEN;
+	cao.auth_src = ctx->aad;
+	cao.auth_len = ctx->aadl;
+	cao.src = cao.dst = buf;
+	cao.iv = ctx->iv;
+	cao.iv_len = ctx->ivlen;
+	cao.tag_len = GCM_TAG_LEN;
+	/*
+	 * A bad tag may also mean more data is still to come; either way
+	 * the software side decrypts and final() checks.
+	 */
+	ret = ioctl(ctx->prov->fd, CIOCAUTHCRYPT, &cao);
+	if (!ret) {
+		memcpy(out, buf, inl);
+		if (ctx->enc)
+			memcpy(ctx->tag, buf + inl, GCM_TAG_LEN);
+		ctx->saved = saved;
+		ctx->savedl = inl;
+		ctx->gcm = GCM_KERNEL;
+	} else {
+		OPENSSL_clear_free(saved, inl);
+	}
+	OPENSSL_clear_free(buf, inl + GCM_TAG_LEN);
+	return ret ? -1 : 0;
+}
+
+static int gcm_update(struct cipher_ctx *ctx, unsigned char *out, size_t *outl,
+		      size_t outsize, const unsigned char *in, size_t inl)
+{
+	unsigned char *aad;
+	int l;
+
+	*outl = 0;
+	if (!inl)
+		return 1;
+	if (ctx->gcm == GCM_START && !out) {
+		/* AAD, held back until we know where the data goes */
+		if (!(aad = OPENSSL_realloc(ctx->aad, ctx->aadl + inl)))
+			return 0;
+		memcpy(aad + ctx->aadl, in, inl);
+		ctx->aad = aad;
+		ctx->aadl += inl;
+		*outl = inl;
+		return 1;
+	}
+	if (out && outsize < inl)
+		return 0;
+	if (ctx->gcm == GCM_START && ctx->sess && ctx->ivlen == 12 &&
+	    ctx->aadl <= GCM_MAX_AAD && (ctx->enc || (ctx->tag_set && ctx->taglen == GCM_TAG_LEN)) &&
+	    (long)inl >= cdev_threshold(ctx->prov, ctx->alg) &&
+	    !gcm_kernel(ctx, out, in, inl)) {
+		*outl = inl;
+		return 1;
+	}
+	if (!gcm_to_software(ctx) || !EVP_CipherUpdate(ctx->sw, out, &l, in, inl))
+		return 0;
+	*outl = l;
+	return 1;
+}
+
+static int gcm_final(struct cipher_ctx *ctx, unsigned char *out, size_t *outl, size_t outsize)
+{
+	int l;
+
+	*outl = 0;
+	if (ctx->gcm == GCM_KERNEL)
+		return 1;
+	if (!gcm_to_software(ctx) || !EVP_CipherFinal_ex(ctx->sw, out, &l))
+		return 0;
+	*outl = l;
+	if (ctx->enc)
+		return EVP_CIPHER_CTX_ctrl(ctx->sw, EVP_CTRL_AEAD_GET_TAG, GCM_TAG_LEN, ctx->tag);
+	return 1;
+}
+
+/* Hand the context to the software side for good */
+static int to_passthrough(struct cipher_ctx *ctx)
+{
+	if (ctx->passthrough)
+		return 1;
+	if (ctx->bufl || (ctx->alg->mode == CDEV_GCM && ctx->gcm == GCM_KERNEL))
+		return 0;
+	if (ctx->alg->mode == CDEV_GCM && !gcm_to_software(ctx))
+		return 0;
+	if (!sw_sync(ctx))
+		return 0;
+	if (ctx->alg->mode == CDEV_CBC)
+		EVP_CIPHER_CTX_set_padding(ctx->sw, ctx->pad);
+	ctx->passthrough = 1;
+	return 1;
+}
+
+static int cipher_update(void *vctx, unsigned char *out, size_t *outl, size_t outsize,
+			 const unsigned char *in, size_t inl)
+{
+	struct cipher_ctx *ctx = vctx;
+	int l;
+
+	if (ctx->passthrough) {
+		if (!EVP_CipherUpdate(ctx->sw, out, &l, in, inl))
+			return 0;
+		*outl = l;
+		return 1;
+	}
+	switch (ctx->alg->mode) {
+	case CDEV_CBC:
+		return cbc_update(ctx, out, outl, outsize, in, inl);
+	case CDEV_CTR:
+		return ctr_update(ctx, out, outl, outsize, in, inl);
+	default:
+		return gcm_update(ctx, out, outl, outsize, in, inl);
+	}
+}
+
+static int cipher_final(void *vctx, unsigned char *out, size_t *outl, size_t outsize)
+{
+	struct cipher_ctx *ctx = vctx;
+	int l;
+
+	if (ctx->passthrough) {
+		if (!EVP_CipherFinal_ex(ctx->sw, out, &l))
+			return 0;
+		*outl = l;
+		return 1;
+	}
+	switch (ctx->alg->mode) {
+	case CDEV_CBC:
+		return cbc_final(ctx, out, outl, outsize);
+	case CDEV_CTR:
+		*outl = 0;
+		return 1;
+	default:
+		return gcm_final(ctx, out, outl, outsize);
+	}
+}
+
+/* EVP_Cipher(): whole blocks, no padding, or whatever the software side does */
+static int cipher_cipher(void *vctx, unsigned char *out, size_t *outl, size_t outsize,
+			 const unsigned char *in, size_t inl)
+{
+	struct cipher_ctx *ctx = vctx;
+	int l;
+
+	if (ctx->alg->mode != CDEV_GCM && !ctx->passthrough && !ctx->bufl &&
+	    (ctx->alg->mode == CDEV_CTR || !(inl % 16))) {
+		if (outsize < inl)
+			return 0;
+		if (ctx->alg->mode == CDEV_CTR)
+			return ctr_update(ctx, out, outl, outsize, in, inl);
+		if (!bulk(ctx, out, in, inl))
+			return 0;
+		*outl = inl;
+		return 1;
+	}
+	if (!to_passthrough(ctx) || (l = EVP_Cipher(ctx->sw, out, in, inl)) < 0)
+		return 0;
+	*outl = l;
+	return 1;
+}
+
+static int cipher_get_params(const struct cdev_alg *alg, OSSL_PARAM params[])
+{
+	OSSL_PARAM *p;
+	unsigned mode = alg->mode == CDEV_CBC ? EVP_CIPH_CBC_MODE :
+			alg->mode == CDEV_CTR ? EVP_CIPH_CTR_MODE : EVP_CIPH_GCM_MODE;
+
+	if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_MODE)) &&
+	    !OSSL_PARAM_set_uint(p, mode))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_KEYLEN)) &&
+	    !OSSL_PARAM_set_size_t(p, alg->keylen))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_IVLEN)) &&
+	    !OSSL_PARAM_set_size_t(p, alg->ivlen))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_BLOCK_SIZE)) &&
+	    !OSSL_PARAM_set_size_t(p, alg->blocksize))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_AEAD)) &&
+	    !OSSL_PARAM_set_int(p, alg->mode == CDEV_GCM))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_CUSTOM_IV)) &&
+	    !OSSL_PARAM_set_int(p, alg->mode == CDEV_GCM))
+		return 0;
+	return 1;
+}
+
+static const OSSL_PARAM *cipher_gettable_params(void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_uint(OSSL_CIPHER_PARAM_MODE, NULL),
+		OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_KEYLEN, NULL),
+		OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_IVLEN, NULL),
+		OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_BLOCK_SIZE, NULL),
+		OSSL_PARAM_int(OSSL_CIPHER_PARAM_AEAD, NULL),
+		OSSL_PARAM_int(OSSL_CIPHER_PARAM_CUSTOM_IV, NULL),
+		OSSL_PARAM_END
+	};
+
+	return params;
+}
+
+static int cipher_get_ctx_params(void *vctx, OSSL_PARAM params[])
+{
+	struct cipher_ctx *ctx = vctx;
+	OSSL_PARAM *p;
+
+	if (ctx->passthrough)
+		return EVP_CIPHER_CTX_get_params(ctx->sw, params);
+
+	for (p = params; p->key; p++) {
+		if (!strcmp(p->key, OSSL_CIPHER_PARAM_KEYLEN)) {
+			if (!OSSL_PARAM_set_size_t(p, ctx->alg->keylen))
+				return 0;
+		} else if (!strcmp(p->key, OSSL_CIPHER_PARAM_IVLEN)) {
+			if (!OSSL_PARAM_set_size_t(p, ctx->ivlen))
+				return 0;
+		} else if (!strcmp(p->key, OSSL_CIPHER_PARAM_PADDING)) {
+			if (!OSSL_PARAM_set_uint(p, ctx->pad))
+				return 0;
+		} else if (!strcmp(p->key, OSSL_CIPHER_PARAM_UPDATED_IV) ||
+			   (!strcmp(p->key, OSSL_CIPHER_PARAM_IV) && ctx->alg->mode != CDEV_GCM)) {
+			if (!OSSL_PARAM_set_octet_string(p, ctx->iv, ctx->ivlen) &&
+			    !OSSL_PARAM_set_octet_ptr(p, ctx->iv, ctx->ivlen))
+				return 0;
+		} else if (!strcmp(p->key, OSSL_CIPHER_PARAM_NUM) && ctx->alg->mode == CDEV_CTR) {
+			if (!OSSL_PARAM_set_uint(p, ctx->sw_stale ? 0 :
+						    EVP_CIPHER_CTX_get_num(ctx->sw)))
+				return 0;
+		} else if (!strcmp(p->key, OSSL_CIPHER_PARAM_AEAD_TAGLEN)) {
+			if (!OSSL_PARAM_set_size_t(p, ctx->taglen))
+				return 0;
+		} else if (!strcmp(p->key, OSSL_CIPHER_PARAM_AEAD_TAG) && ctx->enc) {
+			/* A shorter tag is the start of the full one */
+			if (p->data_type != OSSL_PARAM_OCTET_STRING || !p->data_size ||
+			    p->data_size > GCM_TAG_LEN)
+				return 0;
+			memcpy(p->data, ctx->tag, p->data_size);
+			p->return_size = p->data_size;
+		} else {
+			OSSL_PARAM one[2] = { *p, OSSL_PARAM_END };
+
+			/* Something only the software side knows about */
+			if (!EVP_CIPHER_CTX_get_params(ctx->sw, one))
+				return 0;
+			p->return_size = one[0].return_size;
+		}
+	}
+	return 1;
+}
+
+static int cipher_set_ctx_params(void *vctx, const OSSL_PARAM params[])
+{
+	struct cipher_ctx *ctx = vctx;
+	const OSSL_PARAM *p;
+	unsigned int pad;
+	size_t len;
+
+	if (!params)
+		return 1;
+	if (ctx->passthrough)
+		return EVP_CIPHER_CTX_set_params(ctx->sw, params);
+
+	for (p = params; p->key; p++) {
+		OSSL_PARAM one[2] = { *p, OSSL_PARAM_END };
+
+		/* CTR has no use for it, but takes it like the default provider */
+		if (!strcmp(p->key, OSSL_CIPHER_PARAM_PADDING) && ctx->alg->mode != CDEV_GCM) {
+			if (!OSSL_PARAM_get_uint(p, &pad))
+				return 0;
+			if (ctx->alg->mode == CDEV_CBC)
+				ctx->pad = pad != 0;
+			continue;
+		}
+		if (!strcmp(p->key, OSSL_CIPHER_PARAM_KEYLEN)) {
+			if (!OSSL_PARAM_get_size_t(p, &len) || len != (size_t)ctx->alg->keylen)
+				return 0;
+			continue;
+		}
+		if (ctx->alg->mode == CDEV_GCM && !strcmp(p->key, OSSL_CIPHER_PARAM_AEAD_IVLEN)) {
+			if (!OSSL_PARAM_get_size_t(p, &len) || !len || len > CDEV_MAX_IV ||
+			    !EVP_CIPHER_CTX_set_params(ctx->sw, one))
+				return 0;
+			ctx->ivlen = len;
+			continue;
+		}
+		if (ctx->alg->mode == CDEV_GCM && !strcmp(p->key, OSSL_CIPHER_PARAM_AEAD_TAG)) {
+			/* Encrypting, only the length can be set */
+			if (p->data_type != OSSL_PARAM_OCTET_STRING || !p->data_size ||
+			    p->data_size > GCM_TAG_LEN)
+				return 0;
+			ctx->taglen = p->data_size;
+			if (p->data && !ctx->enc) {
+				memcpy(ctx->tag, p->data, p->data_size);
+				ctx->tag_set = 1;
+			}
+			if (!EVP_CIPHER_CTX_set_params(ctx->sw, one))
+				return 0;
+			/* Too late for the kernel's check, the software side redoes it */
+			if (ctx->gcm == GCM_KERNEL && !ctx->enc && !gcm_to_software(ctx))
+				return 0;
+			continue;
+		}
+		/* TLS records and the like: the software side does it all */
+		if (!to_passthrough(ctx) || !EVP_CIPHER_CTX_set_params(ctx->sw, one))
+			return 0;
+	}
+	return 1;
+}
+
+static const OSSL_PARAM *cipher_gettable_ctx_params(void *vctx, void *provctx)
+{
+	struct cipher_ctx *ctx = vctx;
+
+	return ctx ? EVP_CIPHER_CTX_gettable_params(ctx->sw) : NULL;
+}
+
+static const OSSL_PARAM *cipher_settable_ctx_params(void *vctx, void *provctx)
+{
+	struct cipher_ctx *ctx = vctx;
+
+	return ctx ? EVP_CIPHER_CTX_settable_params(ctx->sw) : NULL;
+}
+
+#define CIPHER(idx, fn)									\
+static void *fn##_newctx(void *provctx)							\
+{											\
+	return cipher_newctx(provctx, &cdev_algs[idx]);					\
+}											\
+static int fn##_get_params(OSSL_PARAM params[])						\
+{											\
+	return cipher_get_params(&cdev_algs[idx], params);				\
+}											\
+static const OSSL_DISPATCH fn##_functions[] = {						\
+	{ OSSL_FUNC_CIPHER_NEWCTX, (void (*)(void))fn##_newctx },			\
+	{ OSSL_FUNC_CIPHER_FREECTX, (void (*)(void))cipher_freectx },			\
+	{ OSSL_FUNC_CIPHER_DUPCTX, (void (*)(void))cipher_dupctx },			\
+	{ OSSL_FUNC_CIPHER_ENCRYPT_INIT, (void (*)(void))cipher_einit },		\
+	{ OSSL_FUNC_CIPHER_DECRYPT_INIT, (void (*)(void))cipher_dinit },		\
+	{ OSSL_FUNC_CIPHER_UPDATE, (void (*)(void))cipher_update },			\
+	{ OSSL_FUNC_CIPHER_FINAL, (void (*)(void))cipher_final },			\
+	{ OSSL_FUNC_CIPHER_CIPHER, (void (*)(void))cipher_cipher },			\
+	{ OSSL_FUNC_CIPHER_GET_PARAMS, (void (*)(void))fn##_get_params },		\
+	{ OSSL_FUNC_CIPHER_GETTABLE_PARAMS, (void (*)(void))cipher_gettable_params },	\
+	{ OSSL_FUNC_CIPHER_GET_CTX_PARAMS, (void (*)(void))cipher_get_ctx_params },	\
+	{ OSSL_FUNC_CIPHER_SET_CTX_PARAMS, (void (*)(void))cipher_set_ctx_params },	\
+	{ OSSL_FUNC_CIPHER_GETTABLE_CTX_PARAMS,						\
+	  (void (*)(void))cipher_gettable_ctx_params },					\
+	{ OSSL_FUNC_CIPHER_SETTABLE_CTX_PARAMS,						\
+	  (void (*)(void))cipher_settable_ctx_params },					\
+	{ 0, NULL }									\
+};
+
+CIPHER(0, aes128cbc)
+CIPHER(1, aes192cbc)
+CIPHER(2, aes256cbc)
+CIPHER(3, aes128ctr)
+CIPHER(4, aes192ctr)
+CIPHER(5, aes256ctr)
+CIPHER(6, aes128gcm)
+CIPHER(7, aes192gcm)
+CIPHER(8, aes256gcm)
+
+#define PROPS "provider=cryptodev"
+
+const OSSL_ALGORITHM cdev_cipher_algs[] = {
+	{ "AES-128-CBC:AES128:2.16.840.1.101.3.4.1.2", PROPS, aes128cbc_functions },
+	{ "AES-192-CBC:AES192:2.16.840.1.101.3.4.1.22", PROPS, aes192cbc_functions },
+	{ "AES-256-CBC:AES256:2.16.840.1.101.3.4.1.42", PROPS, aes256cbc_functions },
+	{ "AES-128-CTR", PROPS, aes128ctr_functions },
+	{ "AES-192-CTR", PROPS, aes192ctr_functions },
+	{ "AES-256-CTR", PROPS, aes256ctr_functions },
+	{ "AES-128-GCM:id-aes128-GCM:2.16.840.1.101.3.4.1.6", PROPS, aes128gcm_functions },
+	{ "AES-192-GCM:id-aes192-GCM:2.16.840.1.101.3.4.1.26", PROPS, aes192gcm_functions },
+	{ "AES-256-GCM:id-aes256-GCM:2.16.840.1.101.3.4.1.46", PROPS, aes256gcm_functions },
+	{ NULL, NULL, NULL }
+};
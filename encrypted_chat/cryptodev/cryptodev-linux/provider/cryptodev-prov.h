@@ -0,0 +1,114 @@
+/*
+ * OpenSSL 3 provider on top of /dev/crypto.
+ *
+ * Placed under public domain.
+ *
+ * The provider offers AES-CBC, AES-CTR, AES-GCM, SHA1, SHA256 and
+ * SHA512 under their usual names with the property
+ * "provider=cryptodev". Each context keeps a software implementation
+ * from the other loaded providers next to it, and only hands the
+ * kernel requests of at least the algorithm's threshold. By default
+ * the threshold is calibrated the first time an algorithm is used,
+ * by timing both sides, the way lib/threshold.c does.
+ *
+ * Cipher sessions do not carry state between requests, the IV goes
+ * with every request, so all contexts with the same algorithm and
+ * key share one cached session. Hash sessions do carry state and
+ * belong to one context at a time; free ones are kept for reuse.
+ */
+#ifndef CRYPTODEV_PROV_H
+# define CRYPTODEV_PROV_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <openssl/core.h>
+#include <openssl/evp.h>
+
+#define CDEV_MAX_KEY		32
+#define CDEV_MAX_IV		16
+#define CDEV_CACHE_MAX		64	/* idle cipher sessions kept around */
+
+/* Calibration sizes; a threshold past the last one means never */
+#define CDEV_CAL_MIN		64
+#define CDEV_CAL_MAX		(64 * 1024)
+#define CDEV_THRESHOLD_NEVER	(1L << 30)
+
+enum cdev_mode { CDEV_CBC, CDEV_CTR, CDEV_GCM, CDEV_DIGEST };
+
+struct cdev_alg {
+	const char *names;	/* OpenSSL name list */
+	const char *sw_name;	/* what to fetch for the software side */
+	enum cdev_mode mode;
+	int cipher, mac;	/* cryptodev ids */
+	int keylen, ivlen, blocksize;
+	int digestsize, digest_block;
+};
+
+/* A kernel session, for a cipher key or a hash state */
+struct cdev_sess {
+	struct cdev_sess *next;
+	const struct cdev_alg *alg;
+	unsigned char key[CDEV_MAX_KEY];
+	uint32_t ses;
+	uint16_t alignmask;
+	int refs;
+};
+
+struct cdev_prov {
+	const OSSL_CORE_HANDLE *handle;
+	OSSL_LIB_CTX *libctx;		/* child context, for the software side */
+	int fd;
+	char device[256];
+	long threshold;			/* -1 to calibrate each algorithm */
+	int batch;			/* async requests per batch, 0 for none */
+	long batch_chunk;		/* bytes per request of a batch */
+
+	pthread_mutex_t lock;		/* the lists and tables below */
+	pthread_mutex_t async_lock;	/* one batch at a time on fd */
+	struct cdev_sess *ciphers;	/* most recently used first */
+	int nciphers;
+	struct cdev_sess *free_hashes;
+	long thresholds[16];		/* per algorithm, 0 until known */
+	EVP_CIPHER *sw_cipher[16];
+	EVP_MD *sw_md[16];
+};
+
+extern const struct cdev_alg cdev_algs[];
+extern const OSSL_ALGORITHM cdev_cipher_algs[];
+extern const OSSL_ALGORITHM cdev_digest_algs[];
+
+static inline int cdev_alg_index(const struct cdev_alg *alg)
+{
+	return alg - cdev_algs;
+}
+
+/* Cipher session for alg and key, shared; NULL if the kernel has none */
+struct cdev_sess *cdev_cipher_sess_get(struct cdev_prov *prov, const struct cdev_alg *alg,
+				       const unsigned char *key);
+void cdev_cipher_sess_put(struct cdev_prov *prov, struct cdev_sess *s);
+/* Hash session of our own, reset on first use */
+struct cdev_sess *cdev_hash_sess_get(struct cdev_prov *prov, const struct cdev_alg *alg);
+void cdev_hash_sess_put(struct cdev_prov *prov, struct cdev_sess *s);
+
+/* Software implementation of alg from the other providers, NULL if none */
+EVP_CIPHER *cdev_sw_cipher(struct cdev_prov *prov, const struct cdev_alg *alg);
+EVP_MD *cdev_sw_md(struct cdev_prov *prov, const struct cdev_alg *alg);
+
+/* Smallest request worth sending to the kernel for alg */
+long cdev_threshold(struct cdev_prov *prov, const struct cdev_alg *alg);
+
+/* CIOCCRYPT; iv is updated with COP_FLAG_WRITE_IV when given */
+int cdev_crypt(struct cdev_prov *prov, struct cdev_sess *s, int op, uint16_t flags,
+	       const unsigned char *src, unsigned char *dst, size_t len,
+	       unsigned char *iv, unsigned char *mac);
+/*
+ * Like cdev_crypt() on a cipher session, but cut into batch_chunk
+ * requests that are queued together with CIOCASYNCCRYPT. Only for
+ * modes where every chunk's IV is known up front: CTR, and CBC
+ * decryption. Falls back to cdev_crypt() without ENABLE_ASYNC.
+ */
+int cdev_crypt_batch(struct cdev_prov *prov, struct cdev_sess *s, int op,
+		     const unsigned char *src, unsigned char *dst, size_t len,
+		     unsigned char *iv);
+
+#endif
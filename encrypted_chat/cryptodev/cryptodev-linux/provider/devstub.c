@@ -0,0 +1,281 @@
+/*
+ * A stand-in for /dev/crypto, to test the provider where the module is
+ * not loaded. Preloaded, it opens /dev/null for the device and answers
+ * the provider's ioctls on it with the default provider's AES and SHA.
+ * Async requests are done on the spot and fetched later.
+ *
+ * Placed under public domain.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <crypto/cryptodev.h>
+#include <openssl/evp.h>
+
+#define MAX_SESSIONS	256
+#define MAX_ASYNC	64
+
+struct stub_sess {
+	int used;
+	uint32_t cipher, mac;
+	unsigned char key[32];
+	EVP_CIPHER *evp;
+	EVP_MD *md;
+	EVP_MD_CTX *hash;		/* the hash going on, if live */
+	int live;
+};
+
+static struct stub_sess sessions[MAX_SESSIONS];
+static struct crypt_op async_done[MAX_ASYNC];
+static int nasync;
+static int dev_fd = -1;
+static long ciphers, hashes, aeads;
+
+static void report(void)
+{
+	fprintf(stderr, "devstub: %ld cipher, %ld hash and %ld AEAD requests\n",
+		ciphers, hashes, aeads);
+}
+
+int open(const char *path, int flags, ...)
+{
+	static int (*real_open)(const char *, int, ...);
+	mode_t mode = 0;
+	va_list ap;
+
+	if (!real_open)
+		real_open = dlsym(RTLD_NEXT, "open");
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	if (strcmp(path, "/dev/crypto"))
+		return real_open(path, flags, mode);
+	if (dev_fd < 0)
+		atexit(report);
+	return dev_fd = real_open("/dev/null", flags);
+}
+
+static int new_session(struct session_op *sop)
+{
+	struct stub_sess *s;
+	char name[32];
+	uint32_t i;
+
+	for (i = 1; i < MAX_SESSIONS && sessions[i].used; i++)
+		;
+	if (i == MAX_SESSIONS) {
+		errno = ENOMEM;
+		return -1;
+	}
+	s = &sessions[i];
+	memset(s, 0, sizeof(*s));
+	s->cipher = sop->cipher;
+	s->mac = sop->mac;
+	if (sop->cipher) {
+		if (sop->keylen > sizeof(s->key))
+			goto inval;
+		snprintf(name, sizeof(name), "AES-%u-%s", sop->keylen * 8,
+			 sop->cipher == CRYPTO_AES_CBC ? "CBC" :
+			 sop->cipher == CRYPTO_AES_CTR ? "CTR" : "GCM");
+		memcpy(s->key, sop->key, sop->keylen);
+		if (!(s->evp = EVP_CIPHER_fetch(NULL, name, "provider=default")))
+			goto inval;
+	} else {
+		snprintf(name, sizeof(name), "%s", sop->mac == CRYPTO_SHA1 ? "SHA1" :
+			 sop->mac == CRYPTO_SHA2_256 ? "SHA2-256" : "SHA2-512");
+		if (!(s->md = EVP_MD_fetch(NULL, name, "provider=default")) ||
+		    !(s->hash = EVP_MD_CTX_new()))
+			goto inval;
+	}
+	s->used = 1;
+	sop->ses = i;
+	return 0;
+inval:
+	EVP_CIPHER_free(s->evp);
+	EVP_MD_free(s->md);
+	errno = EINVAL;
+	return -1;
+}
+
+static struct stub_sess *get_session(uint32_t ses)
+{
+	if (ses >= MAX_SESSIONS || !sessions[ses].used) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return &sessions[ses];
+}
+
+static int do_cipher(struct stub_sess *s, struct crypt_op *cop)
+{
+	int cbc = s->cipher == CRYPTO_AES_CBC, enc = cop->op == COP_ENCRYPT, l, ok;
+	unsigned char last[16];
+	EVP_CIPHER_CTX *ctx;
+
+	if (!cop->len || cop->len % 16 || !cop->iv || !cop->dst) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* In place, the last block of ciphertext is gone afterwards */
+	if (cbc && !enc)
+		memcpy(last, cop->src + cop->len - 16, 16);
+	ok = (ctx = EVP_CIPHER_CTX_new()) &&
+	     EVP_CipherInit_ex2(ctx, s->evp, s->key, cop->iv, enc, NULL) &&
+	     EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+	     EVP_CipherUpdate(ctx, cop->dst, &l, cop->src, cop->len);
+	if (ok && (cop->flags & COP_FLAG_WRITE_IV)) {
+		if (!cbc)
+			ok = EVP_CIPHER_CTX_get_updated_iv(ctx, cop->iv, 16);
+		else
+			memcpy(cop->iv, enc ? cop->dst + cop->len - 16 : last, 16);
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	ciphers++;
+	if (!ok)
+		errno = EIO;
+	return ok ? 0 : -1;
+}
+
+/* Without COP_FLAG_UPDATE or COP_FLAG_FINAL, a hash of its own */
+static int do_hash(struct stub_sess *s, struct crypt_op *cop)
+{
+	int ok = 1;
+
+	if (!s->live || (cop->flags & COP_FLAG_RESET) ||
+	    !(cop->flags & (COP_FLAG_UPDATE | COP_FLAG_FINAL))) {
+		ok = EVP_DigestInit_ex2(s->hash, s->md, NULL);
+		s->live = 1;
+	}
+	if (ok && cop->len)
+		ok = EVP_DigestUpdate(s->hash, cop->src, cop->len);
+	if (ok && !(cop->flags & COP_FLAG_UPDATE)) {
+		ok = EVP_DigestFinal_ex(s->hash, cop->mac, NULL);
+		s->live = 0;
+	}
+	hashes++;
+	if (!ok)
+		errno = EIO;
+	return ok ? 0 : -1;
+}
+
+static int do_crypt(struct crypt_op *cop)
+{
+	struct stub_sess *s;
+
+	if (!(s = get_session(cop->ses)))
+		return -1;
+	return s->cipher ? do_cipher(s, cop) : do_hash(s, cop);
+}
+
+/* GCM: the tag follows the data, in dst encrypting and in src decrypting */
+static int do_aead(struct crypt_auth_op *cao)
+{
+	int enc = cao->op == COP_ENCRYPT, l, ok;
+	EVP_CIPHER_CTX *ctx;
+	struct stub_sess *s;
+	size_t n;
+
+	if (!(s = get_session(cao->ses)))
+		return -1;
+	if (s->cipher != CRYPTO_AES_GCM || cao->tag_len != 16 || (!enc && cao->len < 16)) {
+		errno = EINVAL;
+		return -1;
+	}
+	n = enc ? cao->len : cao->len - 16;
+	ok = (ctx = EVP_CIPHER_CTX_new()) &&
+	     EVP_CipherInit_ex2(ctx, s->evp, NULL, NULL, enc, NULL) &&
+	     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, cao->iv_len, NULL) &&
+	     EVP_CipherInit_ex2(ctx, NULL, s->key, cao->iv, enc, NULL) &&
+	     (!cao->auth_len || EVP_CipherUpdate(ctx, NULL, &l, cao->auth_src, cao->auth_len)) &&
+	     (enc || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16,
+					 (unsigned char *)cao->src + n)) &&
+	     EVP_CipherUpdate(ctx, cao->dst, &l, cao->src, n) &&
+	     EVP_CipherFinal_ex(ctx, cao->dst + n, &l) &&
+	     (!enc || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, 16, cao->dst + n));
+	EVP_CIPHER_CTX_free(ctx);
+	aeads++;
+	if (!ok)
+		errno = EBADMSG;
+	return ok ? 0 : -1;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	static int (*real_ioctl)(int, unsigned long, ...);
+	struct session_info_op *info;
+	struct cphash_op *cph;
+	struct stub_sess *s, *d;
+	uint32_t ses;
+	void *arg;
+	va_list ap;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+	if (fd != dev_fd || dev_fd < 0) {
+		if (!real_ioctl)
+			real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+		return real_ioctl(fd, request, arg);
+	}
+
+	switch (request) {
+	case CIOCGSESSION:
+		return new_session(arg);
+	case CIOCFSESSION:
+		if (!(s = get_session(*(uint32_t *)arg)))
+			return -1;
+		EVP_CIPHER_free(s->evp);
+		EVP_MD_free(s->md);
+		EVP_MD_CTX_free(s->hash);
+		memset(s, 0, sizeof(*s));
+		return 0;
+	case CIOCGSESSINFO:
+		info = arg;
+		ses = info->ses;
+		memset(info, 0, sizeof(*info));
+		info->ses = ses;
+		strcpy(info->cipher_info.cra_driver_name, "devstub");
+		strcpy(info->hash_info.cra_driver_name, "devstub");
+		return 0;
+	case CIOCCRYPT:
+		return do_crypt(arg);
+	case CIOCAUTHCRYPT:
+		return do_aead(arg);
+	case CIOCCPHASH:
+		cph = arg;
+		if (!(s = get_session(cph->src_ses)) || !(d = get_session(cph->dst_ses)))
+			return -1;
+		if (s->live && !EVP_MD_CTX_copy_ex(d->hash, s->hash)) {
+			errno = EIO;
+			return -1;
+		}
+		d->live = s->live;
+		return 0;
+	case CIOCASYNCCRYPT:
+		if (nasync == MAX_ASYNC) {
+			errno = EBUSY;
+			return -1;
+		}
+		if (do_crypt(arg))
+			return -1;
+		async_done[nasync++] = *(struct crypt_op *)arg;
+		return 0;
+	case CIOCASYNCFETCH:
+		if (!nasync) {
+			errno = EAGAIN;
+			return -1;
+		}
+		*(struct crypt_op *)arg = async_done[--nasync];
+		return 0;
+	}
+	errno = ENOTTY;
+	return -1;
+}
@@ -0,0 +1,258 @@
+/*
+ * OpenSSL 3 provider on top of /dev/crypto: SHA1, SHA256 and SHA512.
+ *
+ * Placed under public domain.
+ *
+ * Input is held back until there is at least the threshold of it;
+ * a message that stays shorter is hashed in software at final(). Once
+ * the kernel has part of a message it gets the rest too, in requests
+ * of at least the threshold, on a hash session of the context's own.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <crypto/cryptodev.h>
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/params.h>
+#include "cryptodev-prov.h"
+
+struct digest_ctx {
+	struct cdev_prov *prov;
+	const struct cdev_alg *alg;
+	EVP_MD_CTX *sw;
+	int software;			/* the software side has the message */
+	struct cdev_sess *sess;		/* the kernel has it, since first */
+	int first;
+	long threshold;
+	unsigned char *buf;
+	size_t bufl, bufsize;
+};
+
+static void *digest_newctx(void *provctx, const struct cdev_alg *alg)
+{
+	struct digest_ctx *ctx;
+
+	if (!cdev_sw_md(provctx, alg))
+		return NULL;
+	if (!(ctx = calloc(1, sizeof(*ctx))))
+		return NULL;
+	ctx->prov = provctx;
+	ctx->alg = alg;
+	if (!(ctx->sw = EVP_MD_CTX_new())) {
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void digest_freectx(void *vctx)
+{
+	struct digest_ctx *ctx = vctx;
+
+	cdev_hash_sess_put(ctx->prov, ctx->sess);
+	EVP_MD_CTX_free(ctx->sw);
+	OPENSSL_clear_free(ctx->buf, ctx->bufsize);
+	free(ctx);
+}
+
+static void *digest_dupctx(void *vctx)
+{
+	struct digest_ctx *ctx = vctx, *dup;
+#ifdef CIOCCPHASH
+	struct cphash_op cphash;
+#endif
+
+	if (!(dup = calloc(1, sizeof(*dup))))
+		return NULL;
+	*dup = *ctx;
+	dup->sess = NULL;
+	dup->buf = NULL;
+	dup->bufsize = 0;
+	if (!(dup->sw = EVP_MD_CTX_new()) ||
+	    (EVP_MD_CTX_get0_md(ctx->sw) && !EVP_MD_CTX_copy_ex(dup->sw, ctx->sw)))
+		goto fail;
+	if (ctx->buf) {
+		if (!(dup->buf = OPENSSL_memdup(ctx->buf, ctx->bufsize)))
+			goto fail;
+		dup->bufsize = ctx->bufsize;
+	}
+	if (ctx->sess) {
+		/* The partial hash is in the kernel, copy it to a session of its own */
+#ifdef CIOCCPHASH
+		if (!(dup->sess = cdev_hash_sess_get(ctx->prov, ctx->alg)))
+			goto fail;
+		cphash.dst_ses = dup->sess->ses;
+		cphash.src_ses = ctx->sess->ses;
+		if (ioctl(ctx->prov->fd, CIOCCPHASH, &cphash))
+			goto fail;
+#else
+		goto fail;
+#endif
+	}
+	return dup;
+fail:
+	digest_freectx(dup);
+	return NULL;
+}
+
+static int digest_init(void *vctx, const OSSL_PARAM params[])
+{
+	struct digest_ctx *ctx = vctx;
+
+	cdev_hash_sess_put(ctx->prov, ctx->sess);
+	ctx->sess = NULL;
+	ctx->first = 1;
+	ctx->bufl = 0;
+	ctx->threshold = ctx->prov->fd < 0 ? CDEV_THRESHOLD_NEVER :
+					      cdev_threshold(ctx->prov, ctx->alg);
+	/* Nothing to hold back for */
+	ctx->software = ctx->threshold >= CDEV_THRESHOLD_NEVER;
+	if (ctx->software)
+		return EVP_DigestInit_ex2(ctx->sw, cdev_sw_md(ctx->prov, ctx->alg), params);
+	return 1;
+}
+
+/* Hand the message to the software side, held back input first */
+static int to_software(struct digest_ctx *ctx)
+{
+	if (!EVP_DigestInit_ex2(ctx->sw, cdev_sw_md(ctx->prov, ctx->alg), NULL) ||
+	    (ctx->bufl && !EVP_DigestUpdate(ctx->sw, ctx->buf, ctx->bufl)))
+		return 0;
+	ctx->bufl = 0;
+	ctx->software = 1;
+	return 1;
+}
+
+static int kernel_update(struct digest_ctx *ctx, const unsigned char *in, size_t len)
+{
+	uint16_t flags = COP_FLAG_UPDATE | (ctx->first ? COP_FLAG_RESET : 0);
+
+	/* A request of no length would end the hash */
+	if (!len)
+		return 1;
+	if (cdev_crypt(ctx->prov, ctx->sess, COP_ENCRYPT, flags, in, NULL, len, NULL, NULL) < 0)
+		return 0;
+	ctx->first = 0;
+	return 1;
+}
+
+static int digest_update(void *vctx, const unsigned char *in, size_t inl)
+{
+	struct digest_ctx *ctx = vctx;
+	unsigned char *buf;
+
+	if (ctx->software)
+		return EVP_DigestUpdate(ctx->sw, in, inl);
+	if (ctx->bufl + inl < (size_t)ctx->threshold) {
+		if (ctx->bufl + inl > ctx->bufsize) {
+			if (!(buf = OPENSSL_clear_realloc(ctx->buf, ctx->bufsize, ctx->threshold)))
+				return 0;
+			ctx->buf = buf;
+			ctx->bufsize = ctx->threshold;
+		}
+		memcpy(ctx->buf + ctx->bufl, in, inl);
+		ctx->bufl += inl;
+		return 1;
+	}
+
+	if (!ctx->sess && !(ctx->sess = cdev_hash_sess_get(ctx->prov, ctx->alg)))
+		return to_software(ctx) && EVP_DigestUpdate(ctx->sw, in, inl);
+	if (!kernel_update(ctx, ctx->buf, ctx->bufl))
+		return 0;
+	ctx->bufl = 0;
+	return kernel_update(ctx, in, inl);
+}
+
+static int digest_final(void *vctx, unsigned char *out, size_t *outl, size_t outsize)
+{
+	struct digest_ctx *ctx = vctx;
+	unsigned int l;
+
+	if (outsize < (size_t)ctx->alg->digestsize)
+		return 0;
+	if (ctx->sess) {
+		if (cdev_crypt(ctx->prov, ctx->sess, COP_ENCRYPT, COP_FLAG_FINAL,
+			       ctx->buf, NULL, ctx->bufl, NULL, out) < 0)
+			return 0;
+		ctx->bufl = 0;
+		cdev_hash_sess_put(ctx->prov, ctx->sess);
+		ctx->sess = NULL;
+		*outl = ctx->alg->digestsize;
+		return 1;
+	}
+	/* Too short for the kernel after all */
+	if (!ctx->software && !to_software(ctx))
+		return 0;
+	if (!EVP_DigestFinal_ex(ctx->sw, out, &l))
+		return 0;
+	*outl = l;
+	return 1;
+}
+
+static int digest_get_params(const struct cdev_alg *alg, OSSL_PARAM params[])
+{
+	OSSL_PARAM *p;
+
+	if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_BLOCK_SIZE)) &&
+	    !OSSL_PARAM_set_size_t(p, alg->digest_block))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_SIZE)) &&
+	    !OSSL_PARAM_set_size_t(p, alg->digestsize))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_XOF)) &&
+	    !OSSL_PARAM_set_int(p, 0))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_ALGID_ABSENT)) &&
+	    !OSSL_PARAM_set_int(p, 1))
+		return 0;
+	return 1;
+}
+
+static const OSSL_PARAM *digest_gettable_params(void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_size_t(OSSL_DIGEST_PARAM_BLOCK_SIZE, NULL),
+		OSSL_PARAM_size_t(OSSL_DIGEST_PARAM_SIZE, NULL),
+		OSSL_PARAM_int(OSSL_DIGEST_PARAM_XOF, NULL),
+		OSSL_PARAM_int(OSSL_DIGEST_PARAM_ALGID_ABSENT, NULL),
+		OSSL_PARAM_END
+	};
+
+	return params;
+}
+
+#define DIGEST(idx, fn)									\
+static void *fn##_newctx(void *provctx)							\
+{											\
+	return digest_newctx(provctx, &cdev_algs[idx]);					\
+}											\
+static int fn##_get_params(OSSL_PARAM params[])						\
+{											\
+	return digest_get_params(&cdev_algs[idx], params);				\
+}											\
+static const OSSL_DISPATCH fn##_functions[] = {						\
+	{ OSSL_FUNC_DIGEST_NEWCTX, (void (*)(void))fn##_newctx },			\
+	{ OSSL_FUNC_DIGEST_FREECTX, (void (*)(void))digest_freectx },			\
+	{ OSSL_FUNC_DIGEST_DUPCTX, (void (*)(void))digest_dupctx },			\
+	{ OSSL_FUNC_DIGEST_INIT, (void (*)(void))digest_init },				\
+	{ OSSL_FUNC_DIGEST_UPDATE, (void (*)(void))digest_update },			\
+	{ OSSL_FUNC_DIGEST_FINAL, (void (*)(void))digest_final },			\
+	{ OSSL_FUNC_DIGEST_GET_PARAMS, (void (*)(void))fn##_get_params },		\
+	{ OSSL_FUNC_DIGEST_GETTABLE_PARAMS, (void (*)(void))digest_gettable_params },	\
+	{ 0, NULL }									\
+};
+
+DIGEST(9, sha1)
+DIGEST(10, sha256)
+DIGEST(11, sha512)
+
+#define PROPS "provider=cryptodev"
+
+const OSSL_ALGORITHM cdev_digest_algs[] = {
+	{ "SHA1:SHA-1:SSL3-SHA1:1.3.14.3.2.26", PROPS, sha1_functions },
+	{ "SHA2-256:SHA-256:SHA256:2.16.840.1.101.3.4.2.1", PROPS, sha256_functions },
+	{ "SHA2-512:SHA-512:SHA512:2.16.840.1.101.3.4.2.3", PROPS, sha512_functions },
+	{ NULL, NULL, NULL }
+};
@@ -0,0 +1,263 @@
+/*
+ * Checks the provider against the default one. The input is fed in
+ * pieces of random size, so that long runs go to the kernel and the
+ * rest to the software side: CBC and CTR, also on a context that is
+ * initialised again without an IV, GCM with the data in one update or
+ * two, and digests, also copied halfway. Run with check.cnf by
+ * "make check".
+ *
+ * Placed under public domain.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/provider.h>
+
+#define DATA_SIZE	(256 * 1024)
+
+static unsigned char key[32], iv[16];
+static int failures;
+
+#define CHECK(cond, ...) do {					\
+	if (!(cond)) {						\
+		printf("FAIL line %d: ", __LINE__);		\
+		printf(__VA_ARGS__);				\
+		printf("\n");					\
+		failures++;					\
+	}							\
+} while (0)
+
+/* Mostly runs of up to 3000 bytes, and now and then a few odd ones */
+static size_t piece(size_t left)
+{
+	size_t n = rand() % 3 ? rand() % 3000 : rand() % 40;
+
+	return n < left ? n : left;
+}
+
+/*
+ * inl bytes through name from props, in pieces picked from seed, passes
+ * times: the first pass with the key and IV, the others initialising
+ * the context again with neither. Returns the output length, -1 on error.
+ */
+static int crypt_pieces(const char *name, const char *props, int enc, int pad, int passes,
+			const unsigned char *in, size_t inl, unsigned char *out,
+			unsigned int seed)
+{
+	EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, name, props);
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	size_t off, n;
+	int l, total = 0, pass;
+
+	if (!cipher || !ctx)
+		return -1;
+	srand(seed);
+	for (pass = 0; pass < passes; pass++) {
+		if (!EVP_CipherInit_ex2(ctx, pass ? NULL : cipher, pass ? NULL : key,
+					pass ? NULL : iv, enc, NULL))
+			return -1;
+		EVP_CIPHER_CTX_set_padding(ctx, pad);
+		for (off = 0; off < inl; off += n) {
+			n = piece(inl - off);
+			if (!EVP_CipherUpdate(ctx, out + total, &l, in + off, n))
+				return -1;
+			total += l;
+		}
+		if (!EVP_CipherFinal_ex(ctx, out + total, &l))
+			return -1;
+		total += l;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	EVP_CIPHER_free(cipher);
+	return total;
+}
+
+static void test_cipher(const char *name, const unsigned char *data)
+{
+	static unsigned char a[2 * DATA_SIZE + 64], b[2 * DATA_SIZE + 64], c[2 * DATA_SIZE + 64];
+	int cbc = strstr(name, "CBC") != NULL, pad, passes, la, lb;
+	unsigned int seed;
+	size_t len;
+
+	for (seed = 1; seed < 8; seed++)
+		for (pad = 0; pad < 2; pad++)
+			for (passes = 1; passes <= 2; passes++) {
+				len = seed * 37813 % DATA_SIZE;
+				if (cbc && !pad)
+					len &= ~15;
+				la = crypt_pieces(name, "provider=cryptodev", 1, pad, passes,
+						  data, len, a, seed);
+				lb = crypt_pieces(name, "provider=default", 1, pad, passes,
+						  data, len, b, seed + 1);
+				CHECK(la >= 0 && la == lb && !memcmp(a, b, la),
+				      "%s encrypting %zu bytes, pad %d, %d passes", name, len,
+				      pad, passes);
+				if (la < 0 || la != lb)
+					continue;
+				/* Each pass gave the same ciphertext, or went on from the last */
+				la = crypt_pieces(name, "provider=cryptodev", 0, pad, passes,
+						  b, lb / passes, a, seed + 2);
+				CHECK(la >= 0 && (size_t)la == len * passes && !memcmp(a, data, len),
+				      "%s decrypting %zu bytes, pad %d, %d passes", name, len,
+				      pad, passes);
+				lb = crypt_pieces(name, "provider=default", 0, pad, passes,
+						  b, lb / passes, c, seed + 3);
+				CHECK(la == lb && !memcmp(a, c, la),
+				      "%s decrypting %zu bytes, pad %d, %d passes: differs", name,
+				      len, pad, passes);
+			}
+}
+
+/* The tag is set before the data if tag_first, split is where the data is cut */
+static int gcm(const char *props, int enc, const unsigned char *aad, size_t aadl,
+	       const unsigned char *in, size_t inl, unsigned char *out, unsigned char *tag,
+	       int tag_first, size_t split)
+{
+	EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, "AES-256-GCM", props);
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	int l, total = 0, ok;
+
+	if (!cipher || !ctx || !EVP_CipherInit_ex2(ctx, cipher, key, iv, enc, NULL))
+		return -1;
+	if (!enc && tag_first)
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16, tag);
+	if (aadl)
+		EVP_CipherUpdate(ctx, NULL, &l, aad, aadl);
+	if (split) {
+		EVP_CipherUpdate(ctx, out, &l, in, split);
+		total = l;
+	}
+	EVP_CipherUpdate(ctx, out + total, &l, in + split, inl - split);
+	total += l;
+	if (!enc && !tag_first)
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, 16, tag);
+	ok = EVP_CipherFinal_ex(ctx, out + total, &l);
+	if (enc)
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, 16, tag);
+	EVP_CIPHER_CTX_free(ctx);
+	EVP_CIPHER_free(cipher);
+	return ok ? total : -1;
+}
+
+static void test_gcm(const unsigned char *data)
+{
+	static unsigned char a[DATA_SIZE], b[DATA_SIZE];
+	static const size_t sizes[] = { 0, 5, 100, 5000, 100000 };
+	unsigned char tag_a[16], tag_b[16];
+	size_t len, split, aadl;
+	int i, s, tag_first, la, lb;
+
+	for (i = 0; i < 5; i++)
+		for (s = 0; s < 2; s++) {
+			len = sizes[i];
+			split = s && len > 10 ? len / 3 : 0;
+			aadl = i * 13;
+			la = gcm("provider=cryptodev", 1, data + 7, aadl, data, len, a, tag_a, 0,
+				 split);
+			lb = gcm("provider=default", 1, data + 7, aadl, data, len, b, tag_b, 0,
+				 split);
+			CHECK(la >= 0 && la == lb && !memcmp(a, b, la) && !memcmp(tag_a, tag_b, 16),
+			      "GCM encrypting %zu bytes, split at %zu", len, split);
+			for (tag_first = 0; tag_first < 2; tag_first++) {
+				la = gcm("provider=cryptodev", 0, data + 7, aadl, b, lb, a, tag_b,
+					 tag_first, split);
+				CHECK(la >= 0 && (size_t)la == len && !memcmp(a, data, len),
+				      "GCM decrypting %zu bytes, split at %zu, tag first %d", len,
+				      split, tag_first);
+				tag_b[3] ^= 1;
+				la = gcm("provider=cryptodev", 0, data + 7, aadl, b, lb, a, tag_b,
+					 tag_first, split);
+				tag_b[3] ^= 1;
+				CHECK(la < 0, "GCM took a bad tag on %zu bytes, split at %zu, tag first %d",
+				      len, split, tag_first);
+			}
+		}
+}
+
+/* name over len bytes in pieces, and a copy taken halfway that goes on with "x" */
+static int digest(const char *name, const char *props, const unsigned char *data,
+		  size_t len, unsigned int seed, unsigned char *md, unsigned char *copy_md)
+{
+	EVP_MD *type = EVP_MD_fetch(NULL, name, props);
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new(), *copy = EVP_MD_CTX_new();
+	int copied = 0, ok;
+	size_t off, n;
+
+	if (!type || !ctx || !copy || !EVP_DigestInit_ex2(ctx, type, NULL))
+		return 0;
+	srand(seed);
+	for (off = 0; off < len; off += n) {
+		n = piece(len - off);
+		if (!EVP_DigestUpdate(ctx, data + off, n))
+			return 0;
+		if (!copied && off + n > len / 2) {
+			if (!EVP_MD_CTX_copy_ex(copy, ctx))
+				return 0;
+			copied = 1;
+		}
+	}
+	ok = EVP_DigestFinal_ex(ctx, md, NULL);
+	if (ok && copied)
+		ok = EVP_DigestUpdate(copy, "x", 1) && EVP_DigestFinal_ex(copy, copy_md, NULL);
+	EVP_MD_CTX_free(ctx);
+	EVP_MD_CTX_free(copy);
+	EVP_MD_free(type);
+	return ok;
+}
+
+static void test_digest(const char *name, const unsigned char *data)
+{
+	unsigned char a[64], b[64], copy_a[64], copy_b[64];
+	unsigned int seed;
+	size_t len;
+	int ok;
+
+	for (seed = 0; seed < 6; seed++) {
+		len = seed * 31337 % DATA_SIZE;
+		memset(a, 0, sizeof(a));
+		memset(b, 0, sizeof(b));
+		memset(copy_a, 0, sizeof(copy_a));
+		memset(copy_b, 0, sizeof(copy_b));
+		ok = digest(name, "provider=cryptodev", data, len, seed, a, copy_a) &&
+		     digest(name, "provider=default", data, len, seed, b, copy_b);
+		CHECK(ok && !memcmp(a, b, sizeof(a)) && !memcmp(copy_a, copy_b, sizeof(copy_a)),
+		      "%s over %zu bytes", name, len);
+	}
+}
+
+int main(void)
+{
+	static const char *ciphers[] = {
+		"AES-128-CBC", "AES-192-CBC", "AES-256-CBC", "AES-128-CTR", "AES-256-CTR"
+	};
+	static const char *digests[] = { "SHA1", "SHA2-256", "SHA2-512" };
+	static unsigned char data[DATA_SIZE];
+	unsigned int i;
+
+	/* The settings come from check.cnf, the module from here */
+	if (!OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG, NULL) ||
+	    !OSSL_PROVIDER_set_default_search_path(NULL, ".") ||
+	    !OSSL_PROVIDER_load(NULL, "cryptodev") ||
+	    !OSSL_PROVIDER_available(NULL, "default")) {
+		fprintf(stderr, "Could not load ./cryptodev.so and the default provider\n");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = i * 7;
+	for (i = 0; i < sizeof(iv); i++)
+		iv[i] = 0xf0 + i;
+
+	for (i = 0; i < sizeof(ciphers) / sizeof(*ciphers); i++)
+		test_cipher(ciphers[i], data);
+	test_gcm(data);
+	for (i = 0; i < sizeof(digests) / sizeof(*digests); i++)
+		test_digest(digests[i], data);
+
+	printf("%d failures\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,596 @@
+/*
+ * OpenSSL 3 provider on top of /dev/crypto: entry point, sessions,
+ * calibration and requests.
+ *
+ * Placed under public domain.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <crypto/cryptodev.h>
+#include <openssl/core_dispatch.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/params.h>
+#include "cryptodev-prov.h"
+
+#define MIN(x,y) ((x)<(y)?(x):(y))
+#define MAX(x,y) ((x)>(y)?(x):(y))
+
+const struct cdev_alg cdev_algs[] = {
+	{ "AES-128-CBC:AES128:2.16.840.1.101.3.4.1.2", "AES-128-CBC",
+	  CDEV_CBC, CRYPTO_AES_CBC, 0, 16, 16, 16 },
+	{ "AES-192-CBC:AES192:2.16.840.1.101.3.4.1.22", "AES-192-CBC",
+	  CDEV_CBC, CRYPTO_AES_CBC, 0, 24, 16, 16 },
+	{ "AES-256-CBC:AES256:2.16.840.1.101.3.4.1.42", "AES-256-CBC",
+	  CDEV_CBC, CRYPTO_AES_CBC, 0, 32, 16, 16 },
+	{ "AES-128-CTR", "AES-128-CTR", CDEV_CTR, CRYPTO_AES_CTR, 0, 16, 16, 1 },
+	{ "AES-192-CTR", "AES-192-CTR", CDEV_CTR, CRYPTO_AES_CTR, 0, 24, 16, 1 },
+	{ "AES-256-CTR", "AES-256-CTR", CDEV_CTR, CRYPTO_AES_CTR, 0, 32, 16, 1 },
+	{ "AES-128-GCM:id-aes128-GCM:2.16.840.1.101.3.4.1.6", "AES-128-GCM",
+	  CDEV_GCM, CRYPTO_AES_GCM, 0, 16, 12, 1 },
+	{ "AES-192-GCM:id-aes192-GCM:2.16.840.1.101.3.4.1.26", "AES-192-GCM",
+	  CDEV_GCM, CRYPTO_AES_GCM, 0, 24, 12, 1 },
+	{ "AES-256-GCM:id-aes256-GCM:2.16.840.1.101.3.4.1.46", "AES-256-GCM",
+	  CDEV_GCM, CRYPTO_AES_GCM, 0, 32, 12, 1 },
+	{ "SHA1:SHA-1:SSL3-SHA1:1.3.14.3.2.26", "SHA1",
+	  CDEV_DIGEST, 0, CRYPTO_SHA1, 0, 0, 0, 20, 64 },
+	{ "SHA2-256:SHA-256:SHA256:2.16.840.1.101.3.4.2.1", "SHA2-256",
+	  CDEV_DIGEST, 0, CRYPTO_SHA2_256, 0, 0, 0, 32, 64 },
+	{ "SHA2-512:SHA-512:SHA512:2.16.840.1.101.3.4.2.3", "SHA2-512",
+	  CDEV_DIGEST, 0, CRYPTO_SHA2_512, 0, 0, 0, 64, 128 },
+	{ NULL }
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_session(struct cdev_prov *prov, struct cdev_sess *s)
+{
+	struct session_op sess;
+#ifdef CIOCGSESSINFO
+	struct session_info_op siop;
+#endif
+
+	memset(&sess, 0, sizeof(sess));
+	sess.cipher = s->alg->cipher;
+	sess.keylen = s->alg->keylen;
+	sess.key = s->key;
+	sess.mac = s->alg->mac;
+	if (ioctl(prov->fd, CIOCGSESSION, &sess))
+		return -1;
+	s->ses = sess.ses;
+	s->alignmask = 0;
+#ifdef CIOCGSESSINFO
+	memset(&siop, 0, sizeof(siop));
+	siop.ses = sess.ses;
+	if (!ioctl(prov->fd, CIOCGSESSINFO, &siop))
+		s->alignmask = siop.alignmask;
+#endif
+	return 0;
+}
+
+static void free_session(struct cdev_prov *prov, struct cdev_sess *s)
+{
+	ioctl(prov->fd, CIOCFSESSION, &s->ses);
+	OPENSSL_cleanse(s->key, sizeof(s->key));
+	free(s);
+}
+
+struct cdev_sess *cdev_cipher_sess_get(struct cdev_prov *prov, const struct cdev_alg *alg,
+				       const unsigned char *key)
+{
+	struct cdev_sess *s, **pp, **last = NULL;
+
+	if (prov->fd < 0)
+		return NULL;
+	pthread_mutex_lock(&prov->lock);
+	for (pp = &prov->ciphers; (s = *pp); pp = &s->next) {
+		if (s->alg == alg && !CRYPTO_memcmp(s->key, key, alg->keylen))
+			break;
+	}
+	if (s) {
+		/* To the front, so the idle tail is the least recently used */
+		*pp = s->next;
+	} else {
+		if (!(s = calloc(1, sizeof(*s))))
+			goto out;
+		s->alg = alg;
+		memcpy(s->key, key, alg->keylen);
+		if (open_session(prov, s) < 0) {
+			OPENSSL_cleanse(s->key, sizeof(s->key));
+			free(s);
+			s = NULL;
+			goto out;
+		}
+		prov->nciphers++;
+	}
+	s->refs++;
+	s->next = prov->ciphers;
+	prov->ciphers = s;
+
+	/* Drop idle sessions past the cache size, oldest first */
+	while (prov->nciphers > CDEV_CACHE_MAX) {
+		struct cdev_sess *victim;
+
+		last = NULL;
+		for (pp = &prov->ciphers; *pp; pp = &(*pp)->next)
+			if (!(*pp)->refs)
+				last = pp;
+		if (!last)
+			break;
+		victim = *last;
+		*last = victim->next;
+		free_session(prov, victim);
+		prov->nciphers--;
+	}
+out:
+	pthread_mutex_unlock(&prov->lock);
+	return s;
+}
+
+void cdev_cipher_sess_put(struct cdev_prov *prov, struct cdev_sess *s)
+{
+	if (!s)
+		return;
+	pthread_mutex_lock(&prov->lock);
+	s->refs--;
+	pthread_mutex_unlock(&prov->lock);
+}
+
+struct cdev_sess *cdev_hash_sess_get(struct cdev_prov *prov, const struct cdev_alg *alg)
+{
+	struct cdev_sess *s, **pp;
+
+	if (prov->fd < 0)
+		return NULL;
+	pthread_mutex_lock(&prov->lock);
+	for (pp = &prov->free_hashes; (s = *pp); pp = &s->next) {
+		if (s->alg == alg) {
+			*pp = s->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&prov->lock);
+	if (s)
+		return s;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return NULL;
+	s->alg = alg;
+	if (open_session(prov, s) < 0) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+void cdev_hash_sess_put(struct cdev_prov *prov, struct cdev_sess *s)
+{
+	if (!s)
+		return;
+	pthread_mutex_lock(&prov->lock);
+	s->next = prov->free_hashes;
+	prov->free_hashes = s;
+	pthread_mutex_unlock(&prov->lock);
+}
+
+EVP_CIPHER *cdev_sw_cipher(struct cdev_prov *prov, const struct cdev_alg *alg)
+{
+	int i = cdev_alg_index(alg);
+
+	pthread_mutex_lock(&prov->lock);
+	if (!prov->sw_cipher[i])
+		prov->sw_cipher[i] = EVP_CIPHER_fetch(prov->libctx, alg->sw_name,
+						      "provider!=cryptodev");
+	pthread_mutex_unlock(&prov->lock);
+	return prov->sw_cipher[i];
+}
+
+EVP_MD *cdev_sw_md(struct cdev_prov *prov, const struct cdev_alg *alg)
+{
+	int i = cdev_alg_index(alg);
+
+	pthread_mutex_lock(&prov->lock);
+	if (!prov->sw_md[i])
+		prov->sw_md[i] = EVP_MD_fetch(prov->libctx, alg->sw_name,
+					      "provider!=cryptodev");
+	pthread_mutex_unlock(&prov->lock);
+	return prov->sw_md[i];
+}
+
+int cdev_crypt(struct cdev_prov *prov, struct cdev_sess *s, int op, uint16_t flags,
+	       const unsigned char *src, unsigned char *dst, size_t len,
+	       unsigned char *iv, unsigned char *mac)
+{
+	struct crypt_op cop;
+
+	memset(&cop, 0, sizeof(cop));
+	cop.ses = s->ses;
+	cop.op = op;
+	cop.flags = flags | (iv ? COP_FLAG_WRITE_IV : 0);
+	cop.len = len;
+	cop.src = (unsigned char *)src;
+	cop.dst = dst;
+	cop.iv = iv;
+	cop.mac = mac;
+	return ioctl(prov->fd, CIOCCRYPT, &cop) ? -1 : 0;
+}
+
+#ifdef ENABLE_ASYNC
+/* The 128 bit big endian counter iv, n blocks on */
+static void ctr_add(unsigned char *iv, uint64_t n)
+{
+	int i;
+
+	for (i = 15; i >= 0 && n; i--) {
+		n += iv[i];
+		iv[i] = n;
+		n >>= 8;
+	}
+}
+
+int cdev_crypt_batch(struct cdev_prov *prov, struct cdev_sess *s, int op,
+		     const unsigned char *src, unsigned char *dst, size_t len,
+		     unsigned char *iv)
+{
+	struct pollfd pfd = { .fd = prov->fd, .events = POLLIN };
+	size_t chunk = prov->batch_chunk, nchunks, next = 0, off;
+	unsigned char (*ivs)[CDEV_MAX_IV], last[CDEV_MAX_IV];
+	struct crypt_op cop;
+	int inflight = 0, ret = 0;
+
+	if (!prov->batch || len <= chunk)
+		return cdev_crypt(prov, s, op, 0, src, dst, len, iv, NULL);
+
+	/*
+	 * Every chunk's IV before anything is queued: in place, CBC
+	 * decryption overwrites the ciphertext the next chunk starts from.
+	 */
+	nchunks = (len + chunk - 1) / chunk;
+	if (!(ivs = malloc(nchunks * sizeof(*ivs))))
+		return cdev_crypt(prov, s, op, 0, src, dst, len, iv, NULL);
+	for (off = 0; off < nchunks; off++) {
+		if (s->alg->mode == CDEV_CTR) {
+			memcpy(ivs[off], iv, CDEV_MAX_IV);
+			ctr_add(ivs[off], off * chunk / 16);
+		} else if (off == 0) {
+			memcpy(ivs[off], iv, CDEV_MAX_IV);
+		} else {
+			memcpy(ivs[off], src + off * chunk - 16, CDEV_MAX_IV);
+		}
+	}
+	memcpy(last, src + len - 16, CDEV_MAX_IV);
+
+	pthread_mutex_lock(&prov->async_lock);
+	while (next < nchunks || inflight) {
+		while (next < nchunks && inflight < prov->batch) {
+			off = next * chunk;
+			memset(&cop, 0, sizeof(cop));
+			cop.ses = s->ses;
+			cop.op = op;
+			cop.len = MIN(chunk, len - off);
+			cop.src = (unsigned char *)src + off;
+			cop.dst = dst + off;
+			cop.iv = ivs[next];
+			if (ioctl(prov->fd, CIOCASYNCCRYPT, &cop)) {
+				ret = -1;
+				next = nchunks;
+				break;
+			}
+			next++;
+			inflight++;
+		}
+		if (!inflight)
+			break;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+		if (pfd.revents & POLLIN) {
+			if (ioctl(prov->fd, CIOCASYNCFETCH, &cop))
+				ret = -1;
+			inflight--;
+		}
+	}
+	pthread_mutex_unlock(&prov->async_lock);
+
+	if (s->alg->mode == CDEV_CTR)
+		ctr_add(iv, len / 16);
+	else
+		memcpy(iv, last, CDEV_MAX_IV);
+	free(ivs);
+	return ret;
+}
+#else
+int cdev_crypt_batch(struct cdev_prov *prov, struct cdev_sess *s, int op,
+		     const unsigned char *src, unsigned char *dst, size_t len,
+		     unsigned char *iv)
+{
+	return cdev_crypt(prov, s, op, 0, src, dst, len, iv, NULL);
+}
+#endif
+
+/* ns per request of size bytes in the kernel, or 0 if it failed */
+static uint64_t time_kernel(struct cdev_prov *prov, struct cdev_sess *s,
+			    unsigned char *buf, size_t size, int iters)
+{
+	unsigned char iv[CDEV_MAX_IV], tag[64];
+	struct crypt_auth_op cao;
+	uint64_t start = now_ns();
+	int i;
+
+	memset(iv, 0x23, sizeof(iv));
+	for (i = 0; i < iters; i++) {
+		if (s->alg->mode == CDEV_GCM) {
+			memset(&cao, 0, sizeof(cao));
+			cao.ses = s->ses;
+			cao.op = COP_ENCRYPT;
+			cao.len = size;
+			cao.src = cao.dst = buf;
+			cao.iv = iv;
+			cao.iv_len = 12;
+			cao.tag_len = 16;
+			if (ioctl(prov->fd, CIOCAUTHCRYPT, &cao))
+				return 0;
+		} else if (cdev_crypt(prov, s, COP_ENCRYPT, 0, buf, s->alg->cipher ? buf : NULL,
+				      size, s->alg->cipher ? iv : NULL, s->alg->mac ? tag : NULL) < 0) {
+			return 0;
+		}
+	}
+	return (now_ns() - start) / iters;
+}
+
+static uint64_t time_software(struct cdev_prov *prov, const struct cdev_alg *alg,
+			      unsigned char *buf, size_t size, int iters)
+{
+	unsigned char key[CDEV_MAX_KEY], iv[CDEV_MAX_IV], md[EVP_MAX_MD_SIZE];
+	EVP_CIPHER_CTX *c = NULL;
+	EVP_MD_CTX *m = NULL;
+	uint64_t start, t = 0;
+	int i, l;
+
+	memset(key, 0x42, sizeof(key));
+	memset(iv, 0x23, sizeof(iv));
+	if (alg->mode == CDEV_DIGEST) {
+		if (!cdev_sw_md(prov, alg) || !(m = EVP_MD_CTX_new()))
+			goto out;
+		start = now_ns();
+		for (i = 0; i < iters; i++)
+			if (!EVP_DigestInit_ex2(m, cdev_sw_md(prov, alg), NULL) ||
+			    !EVP_DigestUpdate(m, buf, size) ||
+			    !EVP_DigestFinal_ex(m, md, NULL))
+				goto out;
+	} else {
+		if (!cdev_sw_cipher(prov, alg) || !(c = EVP_CIPHER_CTX_new()) ||
+		    !EVP_EncryptInit_ex2(c, cdev_sw_cipher(prov, alg), key, iv, NULL))
+			goto out;
+		EVP_CIPHER_CTX_set_padding(c, 0);
+		start = now_ns();
+		for (i = 0; i < iters; i++)
+			if (!EVP_EncryptInit_ex2(c, NULL, NULL, iv, NULL) ||
+			    !EVP_EncryptUpdate(c, buf, &l, buf, size))
+				goto out;
+	}
+	t = (now_ns() - start) / iters;
+out:
+	EVP_MD_CTX_free(m);
+	EVP_CIPHER_CTX_free(c);
+	return t;
+}
+
+/*
+ * Time both sides at sizes from CDEV_CAL_MIN to CDEV_CAL_MAX, and find
+ * the size from which the kernel stays ahead. Some tens of ms.
+ */
+static long calibrate(struct cdev_prov *prov, const struct cdev_alg *alg)
+{
+	unsigned char key[CDEV_MAX_KEY], *buf;
+	struct cdev_sess *s;
+	long threshold = CDEV_THRESHOLD_NEVER;
+	uint64_t tk, ts;
+	size_t size;
+	int iters;
+
+	memset(key, 0x42, sizeof(key));
+	s = alg->mode == CDEV_DIGEST ? cdev_hash_sess_get(prov, alg) :
+				       cdev_cipher_sess_get(prov, alg, key);
+	if (!s)
+		return threshold;
+	if (posix_memalign((void **)&buf, MAX(s->alignmask + 1, sizeof(void *)),
+			   CDEV_CAL_MAX + 64))
+		goto out;
+	memset(buf, 0x17, CDEV_CAL_MAX + 64);
+
+	for (size = CDEV_CAL_MAX; size >= CDEV_CAL_MIN; size /= 4) {
+		iters = MAX(4, (256 * 1024) / size);
+		tk = time_kernel(prov, s, buf, size, iters);
+		ts = time_software(prov, alg, buf, size, iters);
+		if (!tk || (ts && tk >= ts))
+			break;
+		threshold = size;
+	}
+	free(buf);
+out:
+	if (alg->mode == CDEV_DIGEST)
+		cdev_hash_sess_put(prov, s);
+	else
+		cdev_cipher_sess_put(prov, s);
+	return threshold;
+}
+
+long cdev_threshold(struct cdev_prov *prov, const struct cdev_alg *alg)
+{
+	int i = cdev_alg_index(alg);
+	long t;
+
+	if (prov->threshold >= 0)
+		return prov->threshold;
+	pthread_mutex_lock(&prov->lock);
+	t = prov->thresholds[i];
+	pthread_mutex_unlock(&prov->lock);
+	if (t)
+		return t;
+
+	/* Two threads may both calibrate the first time, which is harmless */
+	t = calibrate(prov, alg);
+	pthread_mutex_lock(&prov->lock);
+	prov->thresholds[i] = t;
+	pthread_mutex_unlock(&prov->lock);
+	return t;
+}
+
+static const OSSL_ALGORITHM *cdev_query(void *provctx, int operation_id, int *no_cache)
+{
+	*no_cache = 0;
+	switch (operation_id) {
+	case OSSL_OP_CIPHER:
+		return cdev_cipher_algs;
+	case OSSL_OP_DIGEST:
+		return cdev_digest_algs;
+	}
+	return NULL;
+}
+
+static const OSSL_PARAM *cdev_gettable_params(void *provctx)
+{
+	static const OSSL_PARAM params[] = {
+		OSSL_PARAM_DEFN(OSSL_PROV_PARAM_NAME, OSSL_PARAM_UTF8_PTR, NULL, 0),
+		OSSL_PARAM_DEFN(OSSL_PROV_PARAM_VERSION, OSSL_PARAM_UTF8_PTR, NULL, 0),
+		OSSL_PARAM_DEFN(OSSL_PROV_PARAM_STATUS, OSSL_PARAM_INTEGER, NULL, 0),
+		OSSL_PARAM_END
+	};
+
+	return params;
+}
+
+static int cdev_get_params(void *provctx, OSSL_PARAM params[])
+{
+	struct cdev_prov *prov = provctx;
+	OSSL_PARAM *p;
+
+	if ((p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_NAME)) &&
+	    !OSSL_PARAM_set_utf8_ptr(p, "cryptodev-linux provider"))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_VERSION)) &&
+	    !OSSL_PARAM_set_utf8_ptr(p, VERSION))
+		return 0;
+	if ((p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_STATUS)) &&
+	    !OSSL_PARAM_set_int(p, prov->fd >= 0))
+		return 0;
+	return 1;
+}
+
+static void cdev_teardown(void *provctx)
+{
+	struct cdev_prov *prov = provctx;
+	struct cdev_sess *s;
+	int i;
+
+	while ((s = prov->ciphers)) {
+		prov->ciphers = s->next;
+		free_session(prov, s);
+	}
+	while ((s = prov->free_hashes)) {
+		prov->free_hashes = s->next;
+		free_session(prov, s);
+	}
+	for (i = 0; i < 16; i++) {
+		EVP_CIPHER_free(prov->sw_cipher[i]);
+		EVP_MD_free(prov->sw_md[i]);
+	}
+	if (prov->fd >= 0)
+		close(prov->fd);
+	OSSL_LIB_CTX_free(prov->libctx);
+	pthread_mutex_destroy(&prov->lock);
+	pthread_mutex_destroy(&prov->async_lock);
+	free(prov);
+}
+
+static const OSSL_DISPATCH cdev_dispatch[] = {
+	{ OSSL_FUNC_PROVIDER_TEARDOWN, (void (*)(void))cdev_teardown },
+	{ OSSL_FUNC_PROVIDER_GETTABLE_PARAMS, (void (*)(void))cdev_gettable_params },
+	{ OSSL_FUNC_PROVIDER_GET_PARAMS, (void (*)(void))cdev_get_params },
+	{ OSSL_FUNC_PROVIDER_QUERY_OPERATION, (void (*)(void))cdev_query },
+	{ 0, NULL }
+};
+
+/*
+ * Settings from the provider's section in openssl.cnf:
+ *   device = /dev/crypto
+ *   threshold = auto | bytes
+ *   batch = requests in flight for large CTR and CBC decryption, 0 for off
+ *   batch_chunk = bytes per request of a batch
+ */
+static void read_config(struct cdev_prov *prov, const OSSL_DISPATCH *in)
+{
+	OSSL_FUNC_core_get_params_fn *get_params = NULL;
+	char *device = NULL, *threshold = NULL, *batch = NULL, *chunk = NULL;
+	OSSL_PARAM params[5];
+
+	for (; in->function_id; in++)
+		if (in->function_id == OSSL_FUNC_CORE_GET_PARAMS)
+			get_params = OSSL_FUNC_core_get_params(in);
+	if (!get_params)
+		return;
+	params[0] = OSSL_PARAM_construct_utf8_ptr("device", &device, 0);
+	params[1] = OSSL_PARAM_construct_utf8_ptr("threshold", &threshold, 0);
+	params[2] = OSSL_PARAM_construct_utf8_ptr("batch", &batch, 0);
+	params[3] = OSSL_PARAM_construct_utf8_ptr("batch_chunk", &chunk, 0);
+	params[4] = OSSL_PARAM_construct_end();
+	if (!get_params(prov->handle, params))
+		return;
+	if (device)
+		snprintf(prov->device, sizeof(prov->device), "%s", device);
+	if (threshold && strcmp(threshold, "auto"))
+		prov->threshold = atol(threshold);
+	if (batch)
+		prov->batch = atoi(batch);
+	if (chunk && atol(chunk) >= 16)
+		prov->batch_chunk = atol(chunk) & ~15L;
+}
+
+int OSSL_provider_init(const OSSL_CORE_HANDLE *handle, const OSSL_DISPATCH *in,
+		       const OSSL_DISPATCH **out, void **provctx)
+{
+	struct cdev_prov *prov;
+
+	if (!(prov = calloc(1, sizeof(*prov))))
+		return 0;
+	prov->handle = handle;
+	prov->fd = -1;
+	strcpy(prov->device, "/dev/crypto");
+	prov->threshold = -1;
+	prov->batch_chunk = 16 * 1024;
+	pthread_mutex_init(&prov->lock, NULL);
+	pthread_mutex_init(&prov->async_lock, NULL);
+	read_config(prov, in);
+
+	if (!(prov->libctx = OSSL_LIB_CTX_new_child(handle, in))) {
+		cdev_teardown(prov);
+		return 0;
+	}
+	/*
+	 * Without the device every context runs in software, so an
+	 * application configured for us still works on a machine without
+	 * the module loaded.
+	 */
+	prov->fd = open(prov->device, O_RDWR | O_CLOEXEC);
+
+	*out = cdev_dispatch;
+	*provctx = prov;
+	return 1;
+}
@@ -0,0 +1,1048 @@
+/*
+ * bench - benchmark driver for cryptodev
+ *
+ * Placed under public domain.
+ *
+ * One timing loop for everything the driver offers: ciphers, hashes
+ * and HMACs through CIOCCRYPT, AEAD through CIOCAUTHCRYPT, either
+ * synchronously or (with ENABLE_ASYNC) with a number of requests in
+ * flight, with and without zero-copy. Sizes and queue depths are
+ * swept and every point comes out as a table row, a CSV line or a
+ * JSON object, so that runs on different kernels and module versions
+ * can be compared by a script.
+ *
+ * With -j the same load runs on several threads at once, arranged in
+ * one of three ways (-p): all on one fd and one session (shared), one
+ * fd with a session per thread (sessions), or an fd per thread (fds).
+ * They contend on the fd's and the session's locks differently; the
+ * efficiency column is the per-thread throughput relative to the
+ * first thread count of the sweep.
+ *
+ * The time of every operation goes into a log-bucketed histogram, for
+ * latency percentiles next to the throughput. By default each thread
+ * issues its next request as soon as the last one is done (closed
+ * loop). With -r it issues them at a fixed rate instead (open loop),
+ * and latency is counted from when a request was due rather than
+ * from when it was sent, so a stall is charged to every request that
+ * should have gone out during it (coordinated omission).
+ *
+ * With -C each thread also counts cycles, instructions, cache misses,
+ * context switches and page faults over the measurement window
+ * (perfhelper.h), reported as cycles per byte, instructions per cycle
+ * and the rest per operation: whether a point got slower from more
+ * CPU work, worse cache behaviour or more scheduling.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <crypto/cryptodev.h>
+
+#include "perfhelper.h"
+
+#define MAX(x,y) ((x)>(y)?(x):(y))
+#define MIN(x,y) ((x)<(y)?(x):(y))
+
+#define MAX_DEPTH	64
+#define MAX_THREADS	256
+
+/* 16 buckets per power of two, within 6.25% up to 2^64 ns */
+#define HIST_SUB_BITS	4
+#define HIST_BUCKETS	(64 << HIST_SUB_BITS)
+#define AEAD_TAG_LEN	16
+#define AEAD_IV_LEN	12
+
+enum alg_kind { KIND_CIPHER, KIND_HASH, KIND_AEAD };
+enum out_format { FMT_TEXT, FMT_CSV, FMT_JSON };
+enum topology { TOPO_SHARED, TOPO_SESSIONS, TOPO_FDS };
+
+static const char *kind_names[] = { "cipher", "hash", "aead" };
+static const char *topo_names[] = { "shared", "sessions", "fds" };
+
+struct bench_alg {
+	const char *name;
+	enum alg_kind kind;
+	int cipher, keylen;
+	int mac, mackeylen;
+};
+
+static const struct bench_alg algs[] = {
+	{ "null",		KIND_CIPHER,	CRYPTO_NULL,	0,	0,			0 },
+	{ "aes-128-cbc",	KIND_CIPHER,	CRYPTO_AES_CBC,	16,	0,			0 },
+	{ "aes-256-cbc",	KIND_CIPHER,	CRYPTO_AES_CBC,	32,	0,			0 },
+	{ "aes-128-ctr",	KIND_CIPHER,	CRYPTO_AES_CTR,	16,	0,			0 },
+	{ "sha1",		KIND_HASH,	0,		0,	CRYPTO_SHA1,		0 },
+	{ "sha256",		KIND_HASH,	0,		0,	CRYPTO_SHA2_256,	0 },
+	{ "hmac-sha256",	KIND_HASH,	0,		0,	CRYPTO_SHA2_256_HMAC,	32 },
+	{ "aes-128-cbc-sha1",	KIND_CIPHER,	CRYPTO_AES_CBC,	16,	CRYPTO_SHA1,		0 },
+	{ "aes-256-cbc-sha256",	KIND_CIPHER,	CRYPTO_AES_CBC,	32,	CRYPTO_SHA2_256,	0 },
+	{ "aes-128-gcm",	KIND_AEAD,	CRYPTO_AES_GCM,	16,	0,			0 },
+	{ NULL }
+};
+
+/* Latencies in ns */
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n, max;
+};
+
+/* One point of the sweep */
+struct bench_point {
+	const struct bench_alg *alg;
+	const char *driver;
+	int async, zc;
+	int size, depth;
+	enum topology topo;
+	int threads;
+	unsigned rate;		/* ops/s per thread, 0 for closed loop */
+	uint64_t ops, bytes;
+	double secs;
+	double efficiency;
+	struct hist lat;
+	struct perf_counters perf;
+};
+
+/* An open session and the buffers to run it on */
+struct bench_sess {
+	int fdc;
+	struct session_op sess;
+	char driver[CRYPTODEV_MAX_ALG_NAME];
+	int align;
+	unsigned char *buf[MAX_DEPTH];
+	int nbuf;
+};
+
+/* A thread of a multi-threaded point, with what it set up for itself */
+struct bench_worker {
+	pthread_t tid;
+	struct bench_sess bs;
+	struct bench_point p;
+	int own_fd, own_sess;
+	int ret;
+};
+
+static pthread_barrier_t start_barrier;
+
+static enum out_format format = FMT_TEXT;
+static double point_secs = 1.0;
+static int min_size = 64, max_size = 65536, factor = 4;
+static int threads[16], nthreads;
+static int npoints;
+static int counters;
+static const char *counter_scope = "";
+static char kernel[65], version[64] = "unknown";
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A cryptodev fd of its own, with its own session list and locks */
+static int open_fdc(void)
+{
+	int fd, fdc = -1;
+
+	if ((fd = open("/dev/crypto", O_RDWR, 0)) < 0) {
+		perror("open(/dev/crypto)");
+		return -1;
+	}
+	if (ioctl(fd, CRIOGET, &fdc)) {
+		perror("ioctl(CRIOGET)");
+		fdc = -1;
+	}
+	/* The clone keeps the file open */
+	close(fd);
+	return fdc;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts;
+	uint64_t now = now_ns();
+
+	/* Sleep most of the way, the wakeup is late by tens of us */
+	if (t > now + 100000) {
+		t -= 50000;
+		ts.tv_sec = t / 1000000000ULL;
+		ts.tv_nsec = t % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		t += 50000;
+	}
+	while (now_ns() < t)
+		;
+}
+
+static int hist_bucket(uint64_t v)
+{
+	int shift;
+
+	if (v < (1 << HIST_SUB_BITS))
+		return v;
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* The highest value that falls in bucket b */
+static uint64_t hist_value(int b)
+{
+	int shift = (b >> HIST_SUB_BITS) - 1;
+
+	if (shift < 0)
+		return b;
+	return (((uint64_t)(b & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS) + 1) << shift) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->count[hist_bucket(v)]++;
+	h->n++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *h, const struct hist *o)
+{
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		h->count[b] += o->count[b];
+	h->n += o->n;
+	h->max = MAX(h->max, o->max);
+}
+
+/* Latency at quantile q, in us, by nearest rank: the ceil(q * n)-th sample */
+static double hist_quantile(const struct hist *h, double q)
+{
+	uint64_t want = q * h->n, seen = 0;
+	int b;
+
+	if (!h->n)
+		return 0;
+	if (want < q * h->n || !want)
+		want++;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->count[b];
+		if (seen >= want)
+			return MIN(hist_value(b), h->max) / 1e3;
+	}
+	return h->max / 1e3;
+}
+
+static const struct bench_alg *find_alg(const char *name)
+{
+	const struct bench_alg *a;
+
+	for (a = algs; a->name; a++)
+		if (!strcmp(a->name, name))
+			return a;
+	return NULL;
+}
+
+static int open_session(struct bench_sess *bs, const struct bench_alg *alg)
+{
+	static unsigned char key[64], mackey[64];
+#ifdef CIOCGSESSINFO
+	struct session_info_op siop;
+#endif
+
+	memset(key, 0x42, sizeof(key));
+	memset(mackey, 0x24, sizeof(mackey));
+	memset(&bs->sess, 0, sizeof(bs->sess));
+	bs->sess.cipher = alg->cipher;
+	bs->sess.keylen = alg->keylen;
+	bs->sess.key = key;
+	bs->sess.mac = alg->mac;
+	bs->sess.mackeylen = alg->mackeylen;
+	bs->sess.mackey = mackey;
+	if (ioctl(bs->fdc, CIOCGSESSION, &bs->sess)) {
+		fprintf(stderr, "%s: ", alg->name);
+		perror("ioctl(CIOCGSESSION)");
+		return -1;
+	}
+
+	strcpy(bs->driver, "unknown");
+	bs->align = sizeof(void *);
+#ifdef CIOCGSESSINFO
+	siop.ses = bs->sess.ses;
+	if (ioctl(bs->fdc, CIOCGSESSINFO, &siop)) {
+		perror("ioctl(CIOCGSESSINFO)");
+		return -1;
+	}
+	snprintf(bs->driver, sizeof(bs->driver), "%s",
+		 alg->kind == KIND_HASH ? siop.hash_info.cra_driver_name :
+					  siop.cipher_info.cra_driver_name);
+	bs->align = MAX(bs->align, siop.alignmask + 1);
+#endif
+	return 0;
+}
+
+static void free_bufs(struct bench_sess *bs)
+{
+	while (bs->nbuf)
+		free(bs->buf[--bs->nbuf]);
+}
+
+static void close_session(struct bench_sess *bs)
+{
+	free_bufs(bs);
+	ioctl(bs->fdc, CIOCFSESSION, &bs->sess.ses);
+}
+
+/* depth buffers of size bytes, with room for a tag after the data */
+static int alloc_bufs(struct bench_sess *bs, int size, int depth)
+{
+	static int val = 23;
+
+	free_bufs(bs);
+	for (; bs->nbuf < depth; bs->nbuf++) {
+		if (posix_memalign((void **)&bs->buf[bs->nbuf], bs->align, size + AEAD_TAG_LEN)) {
+			fprintf(stderr, "posix_memalign() failed, align: %d, size: %d\n",
+				bs->align, size);
+			return -1;
+		}
+		memset(bs->buf[bs->nbuf], val++, size + AEAD_TAG_LEN);
+	}
+	return 0;
+}
+
+static void fill_cop(struct bench_sess *bs, struct bench_point *p, struct crypt_op *cop,
+		     unsigned char *buf, unsigned char *iv, unsigned char *mac)
+{
+	memset(cop, 0, sizeof(*cop));
+	cop->ses = bs->sess.ses;
+	cop->op = COP_ENCRYPT;
+	cop->flags = p->zc ? 0 : COP_FLAG_NO_ZC;
+	cop->len = p->size;
+	cop->src = buf;
+	cop->dst = p->alg->kind == KIND_HASH ? NULL : buf;
+	cop->mac = p->alg->mac ? mac : NULL;
+	cop->iv = p->alg->kind == KIND_HASH ? NULL : iv;
+}
+
+static int do_op(struct bench_sess *bs, struct bench_point *p,
+		 unsigned char *iv, unsigned char *mac)
+{
+	struct crypt_auth_op cao;
+	struct crypt_op cop;
+
+	if (p->alg->kind == KIND_AEAD) {
+		memset(&cao, 0, sizeof(cao));
+		cao.ses = bs->sess.ses;
+		cao.op = COP_ENCRYPT;
+		cao.len = p->size;
+		cao.src = cao.dst = bs->buf[0];
+		cao.iv = iv;
+		cao.iv_len = AEAD_IV_LEN;
+		cao.tag_len = AEAD_TAG_LEN;
+		if (ioctl(bs->fdc, CIOCAUTHCRYPT, &cao)) {
+			perror("ioctl(CIOCAUTHCRYPT)");
+			return -1;
+		}
+	} else {
+		fill_cop(bs, p, &cop, bs->buf[0], iv, mac);
+		if (ioctl(bs->fdc, CIOCCRYPT, &cop)) {
+			perror("ioctl(CIOCCRYPT)");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int run_sync(struct bench_sess *bs, struct bench_point *p)
+{
+	unsigned char iv[32], mac[AALG_MAX_RESULT_LEN];
+	uint64_t start, end, deadline, due, interval = 0;
+
+	memset(iv, 0x23, sizeof(iv));
+	if (p->rate)
+		interval = 1000000000ULL / p->rate;
+	start = end = now_ns();
+	deadline = start + point_secs * 1e9;
+	do {
+		/* Open loop: the clock starts when the request was due */
+		if (interval) {
+			due = start + p->ops * interval;
+			if (due > end)
+				sleep_until(due);
+		} else {
+			due = end;
+		}
+		if (do_op(bs, p, iv, mac) < 0)
+			return -1;
+		end = now_ns();
+		hist_add(&p->lat, end - due);
+		p->ops++;
+	} while (end < deadline);
+
+	p->bytes = p->ops * p->size;
+	p->secs = (end - start) / 1e9;
+	return 0;
+}
+
+#ifdef ENABLE_ASYNC
+/*
+ * Keep up to depth requests queued until the time is up, then drain
+ * them. Open loop, a request goes out when it is due and a slot is
+ * free, and its latency runs from when it was due.
+ */
+static int run_async(struct bench_sess *bs, struct bench_point *p)
+{
+	unsigned char iv[32], mac[MAX_DEPTH][AALG_MAX_RESULT_LEN];
+	struct pollfd pfd = { .fd = bs->fdc, .events = POLLIN };
+	uint64_t start, now, deadline, due, interval = 0, sent[MAX_DEPTH];
+	struct timespec ts, *tsp;
+	int inflight = 0, busy[MAX_DEPTH] = { 0 }, done = 0, slot;
+	uint64_t submitted = 0;
+	struct crypt_op cop;
+
+	memset(iv, 0x23, sizeof(iv));
+	if (p->rate)
+		interval = 1000000000ULL / p->rate;
+	start = now = now_ns();
+	deadline = start + point_secs * 1e9;
+	for (;;) {
+		while (!done && inflight < p->depth) {
+			due = interval ? start + submitted * interval : now;
+			if (due > now)
+				break;
+			for (slot = 0; busy[slot]; slot++)
+				;
+			fill_cop(bs, p, &cop, bs->buf[slot], iv, mac[slot]);
+			if (ioctl(bs->fdc, CIOCASYNCCRYPT, &cop)) {
+				perror("ioctl(CIOCASYNCCRYPT)");
+				return -1;
+			}
+			busy[slot] = 1;
+			sent[slot] = due;
+			submitted++;
+			inflight++;
+		}
+		if (done && !inflight)
+			break;
+
+		/* Wake up for a completion, or when the next request is due */
+		tsp = NULL;
+		if (interval && !done && inflight < p->depth) {
+			due = start + submitted * interval;
+			due = due > now ? due - now : 0;
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			tsp = &ts;
+		}
+		if (ppoll(&pfd, 1, tsp, NULL) < 0) {
+			if (errno != EINTR) {
+				perror("ppoll()");
+				return -1;
+			}
+			pfd.revents = 0;
+		}
+		if (pfd.revents & POLLIN) {
+			if (ioctl(bs->fdc, CIOCASYNCFETCH, &cop)) {
+				perror("ioctl(CIOCASYNCFETCH)");
+				return -1;
+			}
+			now = now_ns();
+			/* Completions may come back out of order */
+			for (slot = 0; slot < p->depth && bs->buf[slot] != cop.src; slot++)
+				;
+			if (slot < p->depth) {
+				busy[slot] = 0;
+				hist_add(&p->lat, now - sent[slot]);
+			}
+			inflight--;
+			p->ops++;
+		} else {
+			now = now_ns();
+		}
+		if (now >= deadline)
+			done = 1;
+	}
+
+	p->bytes = p->ops * p->size;
+	p->secs = (now - start) / 1e9;
+	return 0;
+}
+#endif
+
+static int run_loop(struct bench_sess *bs, struct bench_point *p)
+{
+#ifdef ENABLE_ASYNC
+	if (p->async)
+		return run_async(bs, p);
+#endif
+	return run_sync(bs, p);
+}
+
+/* Run p on this thread, counting it if asked to */
+static int run_one(struct bench_sess *bs, struct bench_point *p)
+{
+	int ret;
+
+	if (!counters)
+		return run_loop(bs, p);
+	perf_open(&p->perf);
+	perf_start(&p->perf);
+	ret = run_loop(bs, p);
+	perf_stop(&p->perf);
+	perf_close(&p->perf);
+	return ret;
+}
+
+/* Give a worker the fd and session its topology calls for */
+static int worker_setup(struct bench_worker *w, struct bench_sess *shared)
+{
+	memset(&w->bs, 0, sizeof(w->bs));
+	w->bs.fdc = shared->fdc;
+	w->own_fd = w->own_sess = 0;
+	switch (w->p.topo) {
+	case TOPO_SHARED:
+		w->bs.sess = shared->sess;
+		w->bs.align = shared->align;
+		break;
+	case TOPO_FDS:
+		if ((w->bs.fdc = open_fdc()) < 0)
+			return -1;
+		w->own_fd = 1;
+		/* fall through */
+	case TOPO_SESSIONS:
+		if (open_session(&w->bs, w->p.alg) < 0)
+			return -1;
+		w->own_sess = 1;
+		break;
+	}
+	return alloc_bufs(&w->bs, w->p.size, w->p.depth);
+}
+
+static void worker_teardown(struct bench_worker *w)
+{
+	if (w->own_sess)
+		close_session(&w->bs);
+	else
+		free_bufs(&w->bs);
+	if (w->own_fd)
+		close(w->bs.fdc);
+}
+
+static void *worker_main(void *arg)
+{
+	struct bench_worker *w = arg;
+
+	pthread_barrier_wait(&start_barrier);
+	w->ret = run_one(&w->bs, &w->p);
+	return NULL;
+}
+
+/* Run p on p->threads threads started together, and add up their work */
+static int run_threads(struct bench_sess *bs, struct bench_point *p)
+{
+	static struct bench_worker workers[MAX_THREADS];
+	int i, n, ret = 0;
+
+	for (n = 0; n < p->threads; n++) {
+		workers[n].p = *p;
+		if (worker_setup(&workers[n], bs) < 0) {
+			worker_teardown(&workers[n]);
+			ret = -1;
+			break;
+		}
+	}
+	if (!ret) {
+		pthread_barrier_init(&start_barrier, NULL, n);
+		for (i = 0; i < n; i++) {
+			if ((errno = pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]))) {
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+		for (i = 0; i < n; i++) {
+			pthread_join(workers[i].tid, NULL);
+			p->ops += workers[i].p.ops;
+			p->bytes += workers[i].p.bytes;
+			p->secs = MAX(p->secs, workers[i].p.secs);
+			hist_merge(&p->lat, &workers[i].p.lat);
+			if (i)
+				perf_merge(&p->perf, &workers[i].p.perf);
+			else
+				p->perf = workers[i].p.perf;
+			ret |= workers[i].ret;
+		}
+		pthread_barrier_destroy(&start_barrier);
+	}
+	for (i = 0; i < n; i++)
+		worker_teardown(&workers[i]);
+	return ret;
+}
+
+static void print_header(void)
+{
+	struct utsname uts;
+	FILE *f;
+
+	/* The module exports its version once loaded */
+	if ((f = fopen("/sys/module/cryptodev/version", "r"))) {
+		if (fgets(version, sizeof(version), f))
+			version[strcspn(version, "\n")] = '\0';
+		fclose(f);
+	}
+	uname(&uts);
+	snprintf(kernel, sizeof(kernel), "%s", uts.release);
+
+	/* Whether the kernel's side of an ioctl will be counted */
+	if (counters) {
+		struct perf_counters pc;
+
+		memset(&pc, 0, sizeof(pc));
+		if (!perf_open(&pc)) {
+			fprintf(stderr, "No perf counters, going on without\n");
+			counters = 0;
+		}
+		perf_close(&pc);
+		counter_scope = pc.user_only ? "user" : "user+kernel";
+	}
+
+	switch (format) {
+	case FMT_TEXT:
+		printf("# kernel %s, cryptodev %s, %g s per point%s%s\n",
+		       kernel, version, point_secs,
+		       counters ? ", counting " : "", counter_scope);
+		printf("%-20s %-24s %-5s %-4s %7s %5s %-8s %4s %8s %12s %10s %10s %5s "
+		       "%9s %9s %9s %9s %9s",
+		       "alg", "driver", "mode", "zc", "size", "depth", "topology",
+		       "thr", "rate", "ops/s", "MB/s", "us/op", "eff",
+		       "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+		if (counters)
+			printf(" %8s %6s %9s %9s %9s",
+			       "cyc/B", "ipc", "miss/op", "cs/op", "pf/op");
+		printf("\n");
+		break;
+	case FMT_CSV:
+		printf("kernel,cryptodev,alg,kind,driver,mode,zc,size,depth,topology,threads,rate,"
+		       "ops,bytes,secs,ops_per_sec,mb_per_sec,us_per_op,efficiency,"
+		       "p50_us,p90_us,p99_us,p99_9_us,max_us");
+		if (counters)
+			printf(",counters,cycles,instructions,cache_misses,context_switches,"
+			       "page_faults,cycles_per_byte,ipc,cache_misses_per_op,"
+			       "context_switches_per_op,page_faults_per_op");
+		printf("\n");
+		break;
+	case FMT_JSON:
+		printf("{\n  \"kernel\": \"%s\",\n  \"machine\": \"%s\",\n"
+		       "  \"cryptodev\": \"%s\",\n  \"clock\": \"CLOCK_MONOTONIC\",\n",
+		       kernel, uts.machine, version);
+		if (counters)
+			printf("  \"counters\": \"%s\",\n", counter_scope);
+		printf("  \"secs_per_point\": %.3f,\n  \"results\": [", point_secs);
+		break;
+	}
+	fflush(stdout);
+}
+
+/*
+ * The counters of a point, raw and per byte or operation, after the
+ * rest of its row. A counter that could not be read is left blank.
+ */
+static void print_counters(const struct bench_point *p)
+{
+	static const char *names[] = { "cycles_per_byte", "ipc", "cache_misses_per_op",
+				       "context_switches_per_op", "page_faults_per_op" };
+	static const int width[] = { 8, 6, 9, 9, 9 };
+	const struct perf_counters *pc = &p->perf;
+	double v[5];
+	int have[5], i;
+
+	if (!counters)
+		return;
+	v[0] = perf_per(pc, PERF_CYCLES, p->bytes);
+	have[0] = perf_has(pc, PERF_CYCLES) && p->bytes;
+	v[1] = perf_ipc(pc);
+	have[1] = perf_has(pc, PERF_CYCLES) && perf_has(pc, PERF_INSTRUCTIONS);
+	for (i = 2; i < 5; i++) {
+		v[i] = perf_per(pc, PERF_CACHE_MISSES + i - 2, p->ops);
+		have[i] = perf_has(pc, PERF_CACHE_MISSES + i - 2);
+	}
+
+	switch (format) {
+	case FMT_TEXT:
+		for (i = 0; i < 5; i++) {
+			if (have[i])
+				printf(" %*.3g", width[i], v[i]);
+			else
+				printf(" %*s", width[i], "-");
+		}
+		break;
+	case FMT_CSV:
+		printf(",%s", counter_scope);
+		for (i = 0; i < PERF_NCOUNTERS; i++) {
+			if (perf_has(pc, i))
+				printf(",%.0f", pc->val[i]);
+			else
+				printf(",");
+		}
+		for (i = 0; i < 5; i++) {
+			if (have[i])
+				printf(",%.6g", v[i]);
+			else
+				printf(",");
+		}
+		break;
+	case FMT_JSON:
+		printf(", \"counters\": {");
+		for (i = 0; i < PERF_NCOUNTERS; i++) {
+			if (perf_has(pc, i))
+				printf("\"%s\": %.0f, ", perf_events[i].name, pc->val[i]);
+			else
+				printf("\"%s\": null, ", perf_events[i].name);
+		}
+		for (i = 0; i < 5; i++) {
+			if (have[i])
+				printf("\"%s\": %.6g%s", names[i], v[i], i < 4 ? ", " : "");
+			else
+				printf("\"%s\": null%s", names[i], i < 4 ? ", " : "");
+		}
+		printf("}");
+		break;
+	}
+}
+
+static void print_point(const struct bench_point *p)
+{
+	double ops_s = p->secs > 0 ? p->ops / p->secs : 0;
+	double mb_s = p->secs > 0 ? p->bytes / p->secs / 1e6 : 0;
+	/* Time per operation as seen by one thread */
+	double us_op = p->ops ? p->secs * 1e6 * p->threads / p->ops : 0;
+	const char *mode = p->async ? "async" : "sync";
+	const char *zc = p->zc ? "zc" : "nozc";
+	double p50 = hist_quantile(&p->lat, 0.5), p90 = hist_quantile(&p->lat, 0.9);
+	double p99 = hist_quantile(&p->lat, 0.99), p999 = hist_quantile(&p->lat, 0.999);
+	double max = p->lat.max / 1e3;
+
+	switch (format) {
+	case FMT_TEXT:
+		printf("%-20s %-24s %-5s %-4s %7d %5d %-8s %4d %8u %12.0f %10.2f %10.2f %5.2f "
+		       "%9.2f %9.2f %9.2f %9.2f %9.2f",
+		       p->alg->name, p->driver, mode, zc, p->size, p->depth,
+		       topo_names[p->topo], p->threads, p->rate, ops_s, mb_s, us_op,
+		       p->efficiency, p50, p90, p99, p999, max);
+		print_counters(p);
+		printf("\n");
+		break;
+	case FMT_CSV:
+		printf("%s,%s,%s,%s,%s,%s,%s,%d,%d,%s,%d,%u,%llu,%llu,%.6f,%.1f,%.3f,%.3f,%.3f,"
+		       "%.3f,%.3f,%.3f,%.3f,%.3f",
+		       kernel, version,
+		       p->alg->name, kind_names[p->alg->kind], p->driver, mode, zc,
+		       p->size, p->depth, topo_names[p->topo], p->threads, p->rate,
+		       (unsigned long long)p->ops, (unsigned long long)p->bytes,
+		       p->secs, ops_s, mb_s, us_op, p->efficiency,
+		       p50, p90, p99, p999, max);
+		print_counters(p);
+		printf("\n");
+		break;
+	case FMT_JSON:
+		printf("%s\n    {\"alg\": \"%s\", \"kind\": \"%s\", \"driver\": \"%s\", "
+		       "\"mode\": \"%s\", \"zc\": %s, \"size\": %d, \"depth\": %d, "
+		       "\"topology\": \"%s\", \"threads\": %d, \"rate\": %u, "
+		       "\"ops\": %llu, \"bytes\": %llu, \"secs\": %.6f, "
+		       "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"us_per_op\": %.3f, "
+		       "\"efficiency\": %.3f, \"latency_us\": {\"p50\": %.3f, \"p90\": %.3f, "
+		       "\"p99\": %.3f, \"p99.9\": %.3f, \"max\": %.3f}",
+		       npoints ? "," : "", p->alg->name, kind_names[p->alg->kind],
+		       p->driver, mode, p->zc ? "true" : "false", p->size, p->depth,
+		       topo_names[p->topo], p->threads, p->rate,
+		       (unsigned long long)p->ops, (unsigned long long)p->bytes,
+		       p->secs, ops_s, mb_s, us_op, p->efficiency,
+		       p50, p90, p99, p999, max);
+		print_counters(p);
+		printf("}");
+		break;
+	}
+	npoints++;
+	fflush(stdout);
+}
+
+static void print_footer(void)
+{
+	if (format == FMT_JSON)
+		printf("\n  ]\n}\n");
+}
+
+/*
+ * All sizes of one configuration, and at each size all thread counts.
+ * Efficiency compares the throughput per thread with that of the
+ * first thread count.
+ */
+static int sweep(struct bench_sess *bs, const struct bench_point *tmpl)
+{
+	struct bench_point p;
+	double rate, base = 0;
+	int size, t;
+
+	for (size = min_size; size <= max_size; size *= factor) {
+		for (t = 0; t < nthreads; t++) {
+			p = *tmpl;
+			p.size = size;
+			p.threads = threads[t];
+			if (p.threads == 1) {
+				if (alloc_bufs(bs, size, p.depth) < 0 || run_one(bs, &p) < 0)
+					return -1;
+			} else if (run_threads(bs, &p) < 0) {
+				return -1;
+			}
+			rate = p.secs > 0 ? p.ops / p.secs / p.threads : 0;
+			if (!t)
+				base = rate;
+			p.efficiency = base > 0 ? rate / base : 0;
+			print_point(&p);
+		}
+		if (size > max_size / factor)
+			break;
+	}
+	return 0;
+}
+
+/* Split a comma separated list in place, at most max items */
+static int split_list(char *s, char **items, int max)
+{
+	int n = 0;
+	char *tok;
+
+	for (tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ","))
+		items[n++] = tok;
+	return n;
+}
+
+static void usage(const char *prog)
+{
+	const struct bench_alg *a;
+
+	fprintf(stderr,
+		"Usage: %s [-a alg,...] [-m sync,async] [-z zc,nozc] [-s min[:max[:factor]]]\n"
+		"\t[-q depth,...] [-j threads,...] [-p shared,sessions,fds] [-r rate,...]\n"
+		"\t[-t secs] [-f text|csv|json] [-C]\n"
+		"Algorithms:", prog);
+	for (a = algs; a->name; a++)
+		fprintf(stderr, " %s", a->name);
+	fprintf(stderr, "\nQueue depths apply to async mode only, up to %d.\n"
+		"Threads share one fd and session, one fd, or nothing; async mode\n"
+		"with more than one thread needs an fd per thread.\n"
+		"Rates are requests per second per thread, 0 for as fast as it goes.\n"
+		"-C counts cycles, instructions, cache misses, context switches and\n"
+		"page faults of each point with perf_event_open.\n", MAX_DEPTH);
+}
+
+int main(int argc, char **argv)
+{
+	char *alg_names[32], *mode_names[2], *zc_names[2], *depth_names[16];
+	char *thread_names[16], *topo_names_arg[3];
+	char all_algs[512] = "", default_modes[] = "sync", default_zc[] = "zc,nozc";
+	char default_depths[] = "1,4,16", *alg_list = all_algs, *mode_list = default_modes;
+	char *zc_list = default_zc, *depth_list = default_depths;
+	char default_threads[] = "1", all_topos[] = "shared,sessions,fds", one_topo[] = "fds";
+	char *thread_list = default_threads, *topo_list = NULL;
+	char *rate_names[16], default_rates[] = "0", *rate_list = default_rates;
+	unsigned rates[16];
+	int nrates, r;
+	int nalgs, nmodes, nzc, ndepths, depths[16], ntopos, max_threads = 1;
+	enum topology topos[3];
+	int fdc, opt, ret = 0, a, m, z, q, t;
+	const struct bench_alg *alg;
+	struct bench_sess bs;
+	struct bench_point p;
+
+	for (alg = algs; alg->name; alg++) {
+		strcat(all_algs, alg->name);
+		strcat(all_algs, alg[1].name ? "," : "");
+	}
+
+	while ((opt = getopt(argc, argv, "a:m:z:s:q:j:p:r:t:f:Ch")) != -1) {
+		switch (opt) {
+		case 'a':
+			alg_list = optarg;
+			break;
+		case 'm':
+			mode_list = optarg;
+			break;
+		case 'z':
+			zc_list = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%d:%d:%d", &min_size, &max_size, &factor) < 1)
+				min_size = 0;
+			if (!strchr(optarg, ':'))
+				max_size = min_size;
+			if (min_size <= 0 || max_size < min_size || factor < 2) {
+				fprintf(stderr, "Bad size range %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'q':
+			depth_list = optarg;
+			break;
+		case 'j':
+			thread_list = optarg;
+			break;
+		case 'p':
+			topo_list = optarg;
+			break;
+		case 'r':
+			rate_list = optarg;
+			break;
+		case 't':
+			point_secs = atof(optarg);
+			break;
+		case 'C':
+			counters = 1;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "csv"))
+				format = FMT_CSV;
+			else if (!strcmp(optarg, "json"))
+				format = FMT_JSON;
+			else if (!strcmp(optarg, "text"))
+				format = FMT_TEXT;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (point_secs <= 0) {
+		fprintf(stderr, "Bad time per point\n");
+		return 1;
+	}
+
+	nalgs = split_list(alg_list, alg_names, 32);
+	nmodes = split_list(mode_list, mode_names, 2);
+	nzc = split_list(zc_list, zc_names, 2);
+	ndepths = split_list(depth_list, depth_names, 16);
+	for (a = 0; a < nalgs; a++) {
+		if (!find_alg(alg_names[a])) {
+			fprintf(stderr, "Unknown algorithm %s\n", alg_names[a]);
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	for (m = 0; m < nmodes; m++) {
+		if (strcmp(mode_names[m], "sync") && strcmp(mode_names[m], "async")) {
+			fprintf(stderr, "Unknown mode %s\n", mode_names[m]);
+			return 1;
+		}
+#ifndef ENABLE_ASYNC
+		if (!strcmp(mode_names[m], "async")) {
+			fprintf(stderr, "Built without ENABLE_ASYNC, no async mode\n");
+			return 1;
+		}
+#endif
+	}
+	for (z = 0; z < nzc; z++) {
+		if (strcmp(zc_names[z], "zc") && strcmp(zc_names[z], "nozc")) {
+			fprintf(stderr, "Unknown copy mode %s\n", zc_names[z]);
+			return 1;
+		}
+	}
+	for (q = 0; q < ndepths; q++) {
+		depths[q] = atoi(depth_names[q]);
+		if (depths[q] < 1 || depths[q] > MAX_DEPTH) {
+			fprintf(stderr, "Queue depth must be 1 to %d\n", MAX_DEPTH);
+			return 1;
+		}
+	}
+	nthreads = split_list(thread_list, thread_names, 16);
+	for (t = 0; t < nthreads; t++) {
+		threads[t] = atoi(thread_names[t]);
+		if (threads[t] < 1 || threads[t] > MAX_THREADS) {
+			fprintf(stderr, "Thread count must be 1 to %d\n", MAX_THREADS);
+			return 1;
+		}
+		max_threads = MAX(max_threads, threads[t]);
+	}
+	/* Topologies only differ with several threads */
+	if (!topo_list)
+		topo_list = max_threads > 1 ? all_topos : one_topo;
+	ntopos = split_list(topo_list, topo_names_arg, 3);
+	for (t = 0; t < ntopos; t++) {
+		for (topos[t] = TOPO_SHARED; topos[t] <= TOPO_FDS; topos[t]++)
+			if (!strcmp(topo_names_arg[t], topo_names[topos[t]]))
+				break;
+		if (topos[t] > TOPO_FDS) {
+			fprintf(stderr, "Unknown topology %s\n", topo_names_arg[t]);
+			return 1;
+		}
+	}
+
+	nrates = split_list(rate_list, rate_names, 16);
+	for (r = 0; r < nrates; r++) {
+		if (sscanf(rate_names[r], "%u", &rates[r]) != 1 || rates[r] > 1000000000) {
+			fprintf(stderr, "Bad rate %s\n", rate_names[r]);
+			return 1;
+		}
+	}
+
+	if ((fdc = open_fdc()) < 0)
+		return 1;
+
+	print_header();
+	memset(&bs, 0, sizeof(bs));
+	bs.fdc = fdc;
+	for (a = 0; a < nalgs && !ret; a++) {
+		alg = find_alg(alg_names[a]);
+		if (open_session(&bs, alg) < 0) {
+			/* Not every kernel has every algorithm, go on */
+			continue;
+		}
+		for (m = 0; m < nmodes && !ret; m++) {
+			int async = !strcmp(mode_names[m], "async");
+
+			/* There is no asynchronous CIOCAUTHCRYPT */
+			if (async && alg->kind == KIND_AEAD)
+				continue;
+			for (z = 0; z < nzc && !ret; z++) {
+				int zc = !strcmp(zc_names[z], "zc");
+
+				/* The AEAD path picks its own copy strategy */
+				if (!zc && alg->kind == KIND_AEAD)
+					continue;
+				for (q = 0; q < (async ? ndepths : 1) && !ret; q++) {
+					for (t = 0; t < ntopos && !ret; t++) {
+						/* Threads on one fd would fetch each other's results */
+						if (async && max_threads > 1 && topos[t] != TOPO_FDS)
+							continue;
+						for (r = 0; r < nrates && !ret; r++) {
+							memset(&p, 0, sizeof(p));
+							p.alg = alg;
+							p.driver = bs.driver;
+							p.async = async;
+							p.zc = zc;
+							p.depth = async ? depths[q] : 1;
+							p.topo = topos[t];
+							p.rate = rates[r];
+							if (sweep(&bs, &p) < 0)
+								ret = 1;
+						}
+					}
+				}
+			}
+		}
+		close_session(&bs);
+	}
+	print_footer();
+
+	close(fdc);
+	return ret;
+}
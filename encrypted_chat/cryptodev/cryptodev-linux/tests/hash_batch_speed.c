@@ -0,0 +1,187 @@
+/*
+ * hash_batch_speed - digests per second of small messages, one
+ * CIOCCRYPT each against CIOCHASHBATCH
+ *
+ * Placed under public domain.
+ *
+ * For SHA256 and HMAC-SHA256 at message sizes typical of integrity
+ * checks, this times digests of independent messages one request at
+ * a time, then in batches. Before timing, a batch's digests are
+ * checked against the single requests'.
+ */
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+#include <crypto/cryptodev.h>
+
+static const int sizes[] = { 64, 128, 256, 512, 1024, 0 };
+static const int batches[] = { 16, 64, HASH_BATCH_MAX, 0 };
+
+static volatile int must_finish;
+
+static void alarm_handler(int signo)
+{
+	must_finish = 1;
+}
+
+static double udifftimeval(struct timeval start, struct timeval end)
+{
+	return (double)(end.tv_usec - start.tv_usec) +
+	       (double)(end.tv_sec - start.tv_sec) * 1000 * 1000;
+}
+
+static int hash_one(int fdc, uint32_t ses, unsigned char *src, int len, unsigned char *mac)
+{
+	struct crypt_op cop;
+
+	memset(&cop, 0, sizeof(cop));
+	cop.ses = ses;
+	cop.op = COP_ENCRYPT;
+	cop.len = len;
+	cop.src = src;
+	cop.mac = mac;
+	if (ioctl(fdc, CIOCCRYPT, &cop)) {
+		perror("ioctl(CIOCCRYPT)");
+		return -1;
+	}
+	return 0;
+}
+
+static int hash_batch(int fdc, uint32_t ses, struct hash_batch_item *items, int n)
+{
+	struct hash_batch_op hbop;
+
+	hbop.ses = ses;
+	hbop.count = n;
+	hbop.items = items;
+	if (ioctl(fdc, CIOCHASHBATCH, &hbop)) {
+		perror("ioctl(CIOCHASHBATCH)");
+		return -1;
+	}
+	return 0;
+}
+
+static void report(const char *how, int size, double digests, struct timeval start,
+		   struct timeval end)
+{
+	double secs = udifftimeval(start, end) / 1000000.0;
+
+	printf("\t%5d bytes, %-12s %10.0f digests/sec, %8.2f MB/sec\n", size, how,
+	       digests / secs, digests * size / secs / 1000000);
+}
+
+static int test_alg(int fdc, const char *name, int mac, int mackeylen, int digestsize)
+{
+	static unsigned char mackey[32];
+	struct hash_batch_item items[HASH_BATCH_MAX];
+	unsigned char *msgs, *macs, single[AALG_MAX_RESULT_LEN];
+	struct timeval start, end;
+	struct session_op sess;
+	double digests;
+	int s, b, i, size, n, ret = 1;
+	char how[32];
+
+	memset(mackey, 0x24, sizeof(mackey));
+	memset(&sess, 0, sizeof(sess));
+	sess.mac = mac;
+	sess.mackeylen = mackeylen;
+	sess.mackey = mackey;
+	if (ioctl(fdc, CIOCGSESSION, &sess)) {
+		perror("ioctl(CIOCGSESSION)");
+		return 1;
+	}
+	printf("%s:\n", name);
+
+	msgs = malloc(HASH_BATCH_MAX * 1024);
+	macs = malloc(HASH_BATCH_MAX * AALG_MAX_RESULT_LEN);
+	if (!msgs || !macs) {
+		perror("malloc()");
+		goto out;
+	}
+	for (i = 0; i < HASH_BATCH_MAX * 1024; i++)
+		msgs[i] = i * 31 + i / 1024;
+
+	for (s = 0; (size = sizes[s]); s++) {
+		for (i = 0; i < HASH_BATCH_MAX; i++) {
+			items[i].len = size;
+			items[i].src = msgs + i * size;
+			items[i].mac = macs + i * AALG_MAX_RESULT_LEN;
+		}
+
+		if (hash_batch(fdc, sess.ses, items, HASH_BATCH_MAX))
+			goto out;
+		for (i = 0; i < HASH_BATCH_MAX; i++) {
+			if (hash_one(fdc, sess.ses, items[i].src, size, single))
+				goto out;
+			if (memcmp(single, items[i].mac, digestsize)) {
+				fprintf(stderr, "%s: digest %d of a batch of %d bytes differs\n",
+					name, i, size);
+				goto out;
+			}
+		}
+
+		digests = 0;
+		must_finish = 0;
+		alarm(1);
+		gettimeofday(&start, NULL);
+		for (i = 0; !must_finish; i = (i + 1) % HASH_BATCH_MAX) {
+			if (hash_one(fdc, sess.ses, items[i].src, size, items[i].mac))
+				goto out;
+			digests++;
+		}
+		gettimeofday(&end, NULL);
+		report("one by one", size, digests, start, end);
+
+		for (b = 0; (n = batches[b]); b++) {
+			digests = 0;
+			must_finish = 0;
+			alarm(1);
+			gettimeofday(&start, NULL);
+			do {
+				if (hash_batch(fdc, sess.ses, items, n))
+					goto out;
+				digests += n;
+			} while (!must_finish);
+			gettimeofday(&end, NULL);
+			snprintf(how, sizeof(how), "batch of %d", n);
+			report(how, size, digests, start, end);
+		}
+	}
+	ret = 0;
+out:
+	free(msgs);
+	free(macs);
+	ioctl(fdc, CIOCFSESSION, &sess.ses);
+	return ret;
+}
+
+int main(void)
+{
+	int fd, fdc = -1;
+
+	signal(SIGALRM, alarm_handler);
+
+	if ((fd = open("/dev/crypto", O_RDWR, 0)) < 0) {
+		perror("open()");
+		return 1;
+	}
+	if (ioctl(fd, CRIOGET, &fdc)) {
+		perror("ioctl(CRIOGET)");
+		return 1;
+	}
+
+	if (test_alg(fdc, "SHA256", CRYPTO_SHA2_256, 0, 32) ||
+	    test_alg(fdc, "HMAC-SHA256", CRYPTO_SHA2_256_HMAC, 32, 32))
+		return 1;
+
+	close(fdc);
+	close(fd);
+	return 0;
+}
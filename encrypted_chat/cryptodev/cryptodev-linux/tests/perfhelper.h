@@ -0,0 +1,161 @@
+/*
+ * perf_event_open(2) counters around a measurement window, shared by
+ * the speed tests.
+ *
+ * The counters follow the calling thread, in the kernel too when
+ * perf_event_paranoid allows it, so the work CIOCCRYPT does on behalf
+ * of the caller is counted. Requests that a kernel worker completes
+ * asynchronously are not. A counter the machine does not have (cycles
+ * in most VMs) is left out instead of failing the run.
+ */
+#ifndef __PERFHELPER_H
+#define __PERFHELPER_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum perf_counter {
+	PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES,
+	PERF_CTX_SWITCHES, PERF_PAGE_FAULTS, PERF_NCOUNTERS
+};
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} perf_events[PERF_NCOUNTERS] = {
+	{ "cycles",		PERF_TYPE_HARDWARE,	PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions",	PERF_TYPE_HARDWARE,	PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache_misses",	PERF_TYPE_HARDWARE,	PERF_COUNT_HW_CACHE_MISSES },
+	{ "context_switches",	PERF_TYPE_SOFTWARE,	PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "page_faults",	PERF_TYPE_SOFTWARE,	PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+struct perf_counters {
+	int fd[PERF_NCOUNTERS];
+	double val[PERF_NCOUNTERS];	/* scaled up if the counter was multiplexed */
+	unsigned have;			/* bit per counter that was counted */
+	int user_only;			/* the kernel's share is not in there */
+};
+
+/*
+ * Open what can be opened, stopped, on a zeroed pc. Returns how many
+ * counters that is.
+ */
+static inline int perf_open(struct perf_counters *pc)
+{
+	static unsigned warned;
+	struct perf_event_attr attr;
+	int i, n;
+
+restart:
+	for (i = 0, n = 0; i < PERF_NCOUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = pc->user_only;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+		pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (pc->fd[i] >= 0) {
+			n++;
+			continue;
+		}
+		/* perf_event_paranoid 2 keeps us out of the kernel */
+		if ((errno == EACCES || errno == EPERM) && !pc->user_only) {
+			while (i--)
+				if (pc->fd[i] >= 0)
+					close(pc->fd[i]);
+			pc->user_only = 1;
+			goto restart;
+		}
+		if (!(warned & (1 << i))) {
+			fprintf(stderr, "perf_event_open(%s): %s\n",
+				perf_events[i].name, strerror(errno));
+			warned |= 1 << i;
+		}
+	}
+	return n;
+}
+
+static inline void perf_start(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < PERF_NCOUNTERS; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+		ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static inline void perf_stop(struct perf_counters *pc)
+{
+	uint64_t v[3];		/* value, time enabled, time running */
+	int i;
+
+	pc->have = 0;
+	for (i = 0; i < PERF_NCOUNTERS; i++) {
+		pc->val[i] = 0;
+		if (pc->fd[i] < 0)
+			continue;
+		ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(pc->fd[i], v, sizeof(v)) != sizeof(v) || !v[2])
+			continue;
+		pc->val[i] = (double)v[0] * v[1] / v[2];
+		pc->have |= 1 << i;
+	}
+}
+
+static inline void perf_close(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < PERF_NCOUNTERS; i++) {
+		if (pc->fd[i] >= 0)
+			close(pc->fd[i]);
+		pc->fd[i] = -1;
+	}
+}
+
+/* Add another thread's counts; a counter only one of them had is lost */
+static inline void perf_merge(struct perf_counters *pc, const struct perf_counters *o)
+{
+	int i;
+
+	for (i = 0; i < PERF_NCOUNTERS; i++)
+		pc->val[i] += o->val[i];
+	pc->have &= o->have;
+	pc->user_only |= o->user_only;
+}
+
+static inline int perf_has(const struct perf_counters *pc, enum perf_counter c)
+{
+	return pc->have & (1 << c);
+}
+
+/* Derived figures; 0 when a counter is missing */
+static inline double perf_per(const struct perf_counters *pc, enum perf_counter c, double n)
+{
+	return perf_has(pc, c) && n > 0 ? pc->val[c] / n : 0;
+}
+
+static inline double perf_ipc(const struct perf_counters *pc)
+{
+	if (!perf_has(pc, PERF_CYCLES) || !perf_has(pc, PERF_INSTRUCTIONS) ||
+	    !pc->val[PERF_CYCLES])
+		return 0;
+	return pc->val[PERF_INSTRUCTIONS] / pc->val[PERF_CYCLES];
+}
+
+#endif /* __PERFHELPER_H */
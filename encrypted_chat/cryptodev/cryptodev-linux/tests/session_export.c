@@ -0,0 +1,246 @@
+/*
+ * Demo on how to share a /dev/crypto session between fds and
+ * processes with CIOCEXPORTSESSION and CIOCIMPORTSESSION.
+ *
+ * Placed under public domain.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <crypto/cryptodev.h>
+
+static int debug = 0;
+
+#define	DATA_SIZE	4096
+#define	BLOCK_SIZE	16
+#define	KEY_SIZE	16
+
+static int open_cfd(void)
+{
+	int fd, cfd = -1;
+
+	fd = open("/dev/crypto", O_RDWR, 0);
+	if (fd < 0) {
+		perror("open(/dev/crypto)");
+		return -1;
+	}
+	if (ioctl(fd, CRIOGET, &cfd)) {
+		perror("ioctl(CRIOGET)");
+		cfd = -1;
+	}
+	close(fd);
+	return cfd;
+}
+
+static int encrypt(int cfd, uint32_t ses, const uint8_t *in, uint8_t *out, uint8_t *mac)
+{
+	struct crypt_op cryp;
+	uint8_t iv[BLOCK_SIZE];
+
+	memset(iv, 0x03, sizeof(iv));
+	memset(&cryp, 0, sizeof(cryp));
+	cryp.ses = ses;
+	cryp.len = DATA_SIZE;
+	cryp.src = (uint8_t *)in;
+	cryp.dst = out;
+	cryp.mac = mac;
+	cryp.iv = out ? iv : NULL;
+	cryp.op = COP_ENCRYPT;
+	if (ioctl(cfd, CIOCCRYPT, &cryp)) {
+		perror("ioctl(CIOCCRYPT)");
+		return 1;
+	}
+	return 0;
+}
+
+static int import(int cfd, uint64_t handle, uint32_t *ses)
+{
+	struct session_export_op seop;
+
+	memset(&seop, 0, sizeof(seop));
+	seop.handle = handle;
+	if (ioctl(cfd, CIOCIMPORTSESSION, &seop))
+		return -1;
+	*ses = seop.ses;
+	return 0;
+}
+
+/* An exported session encrypts (or hashes) the same in a child process */
+static int test_fork(int cfd, struct session_op *sess, const uint8_t *in)
+{
+	struct session_export_op seop;
+	uint8_t out[DATA_SIZE], child[DATA_SIZE];
+	uint8_t mac[AALG_MAX_RESULT_LEN], child_mac[AALG_MAX_RESULT_LEN];
+	int pfd[2], status, ccfd;
+	uint32_t ses;
+	pid_t pid;
+
+	if (ioctl(cfd, CIOCGSESSION, sess)) {
+		perror("ioctl(CIOCGSESSION)");
+		return 1;
+	}
+	memset(&seop, 0, sizeof(seop));
+	seop.ses = sess->ses;
+	if (ioctl(cfd, CIOCEXPORTSESSION, &seop)) {
+		perror("ioctl(CIOCEXPORTSESSION)");
+		return 1;
+	}
+	if (debug)
+		printf("exported session 0x%08x as 0x%016llx\n", sess->ses,
+		       (unsigned long long)seop.handle);
+
+	memset(mac, 0, sizeof(mac));
+	if (encrypt(cfd, sess->ses, in, sess->cipher ? out : NULL, mac))
+		return 1;
+
+	if (pipe(pfd)) {
+		perror("pipe()");
+		return 1;
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork()");
+		return 1;
+	}
+	if (pid == 0) {
+		/* A fd of its own, no key */
+		close(pfd[0]);
+		if ((ccfd = open_cfd()) < 0)
+			_exit(1);
+		if (import(ccfd, seop.handle, &ses)) {
+			perror("ioctl(CIOCIMPORTSESSION)");
+			_exit(1);
+		}
+		memset(child_mac, 0, sizeof(child_mac));
+		if (encrypt(ccfd, ses, in, sess->cipher ? child : NULL, child_mac))
+			_exit(1);
+		if (write(pfd[1], child, sizeof(child)) != sizeof(child) ||
+		    write(pfd[1], child_mac, sizeof(child_mac)) != sizeof(child_mac))
+			_exit(1);
+		ioctl(ccfd, CIOCFSESSION, &ses);
+		close(ccfd);
+		_exit(0);
+	}
+
+	close(pfd[1]);
+	if (read(pfd[0], child, sizeof(child)) != sizeof(child) ||
+	    read(pfd[0], child_mac, sizeof(child_mac)) != sizeof(child_mac)) {
+		fprintf(stderr, "no result from the child\n");
+		return 1;
+	}
+	close(pfd[0]);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "child failed\n");
+		return 1;
+	}
+
+	if (sess->cipher && memcmp(out, child, DATA_SIZE)) {
+		fprintf(stderr, "imported session encrypts differently\n");
+		return 1;
+	}
+	if (sess->mac && memcmp(mac, child_mac, sizeof(mac))) {
+		fprintf(stderr, "imported session hashes differently\n");
+		return 1;
+	}
+	if (debug)
+		printf("fork test: passed\n");
+	return 0;
+}
+
+/* The handle lives as long as any of its sessions */
+static int test_lifetime(int cfd, struct session_op *sess, const uint8_t *in)
+{
+	struct session_export_op seop;
+	uint8_t out[DATA_SIZE], out2[DATA_SIZE];
+	uint32_t ses, ses2;
+	int cfd2;
+
+	if ((cfd2 = open_cfd()) < 0)
+		return 1;
+
+	memset(&seop, 0, sizeof(seop));
+	seop.ses = sess->ses;
+	if (ioctl(cfd, CIOCEXPORTSESSION, &seop)) {
+		perror("ioctl(CIOCEXPORTSESSION)");
+		return 1;
+	}
+	if (encrypt(cfd, sess->ses, in, out, NULL))
+		return 1;
+	if (import(cfd2, seop.handle, &ses)) {
+		perror("ioctl(CIOCIMPORTSESSION)");
+		return 1;
+	}
+
+	/* The exporting session goes, the imported one stays usable */
+	if (ioctl(cfd, CIOCFSESSION, &sess->ses)) {
+		perror("ioctl(CIOCFSESSION)");
+		return 1;
+	}
+	if (encrypt(cfd2, ses, in, out2, NULL))
+		return 1;
+	if (memcmp(out, out2, DATA_SIZE)) {
+		fprintf(stderr, "session outliving its exporter encrypts differently\n");
+		return 1;
+	}
+
+	/* And can be imported from in turn */
+	if (import(cfd, seop.handle, &ses2)) {
+		perror("ioctl(CIOCIMPORTSESSION)");
+		return 1;
+	}
+	ioctl(cfd, CIOCFSESSION, &ses2);
+	ioctl(cfd2, CIOCFSESSION, &ses);
+
+	/* With the last of them, the handle is gone */
+	if (import(cfd, seop.handle, &ses2) == 0 || errno != ENOENT) {
+		fprintf(stderr, "handle still valid after its last session\n");
+		return 1;
+	}
+	close(cfd2);
+	if (debug)
+		printf("lifetime test: passed\n");
+	return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+	uint8_t in[DATA_SIZE], key[KEY_SIZE], mackey[KEY_SIZE];
+	struct session_op sess;
+	int cfd;
+
+	if (argc > 1) debug = 1;
+
+	if ((cfd = open_cfd()) < 0)
+		return 1;
+
+	memset(in, 0x15, sizeof(in));
+	memset(key, 0x33, sizeof(key));
+	memset(mackey, 0x44, sizeof(mackey));
+
+	memset(&sess, 0, sizeof(sess));
+	sess.cipher = CRYPTO_AES_CBC;
+	sess.keylen = KEY_SIZE;
+	sess.key = key;
+	if (test_fork(cfd, &sess, in))
+		return 1;
+	if (test_lifetime(cfd, &sess, in))
+		return 1;
+
+	memset(&sess, 0, sizeof(sess));
+	sess.mac = CRYPTO_SHA1_HMAC;
+	sess.mackeylen = KEY_SIZE;
+	sess.mackey = mackey;
+	if (test_fork(cfd, &sess, in))
+		return 1;
+	ioctl(cfd, CIOCFSESSION, &sess.ses);
+
+	close(cfd);
+	return 0;
+}
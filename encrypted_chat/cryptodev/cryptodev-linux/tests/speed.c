@@ -28,7 +28,10 @@
 
 #include <crypto/cryptodev.h>
 
+#include "perfhelper.h"
+
 static int si = 1; /* SI by default */
+static int perf; /* perf_event counters around each run */
 
 static double udifftimeval(struct timeval start, struct timeval end)
 {
@@ -80,6 +83,7 @@ int encrypt_data(struct session_op *sess, int fdc, int chunksize, int alignmask)
 	double total = 0;
 	double secs, ddata, dspeed;
 	char metric[16];
+	struct perf_counters pc;
 
 	if (alignmask) {
 		if (posix_memalign((void **)&buffer, MAX(alignmask + 1, sizeof(void*)), chunksize)) {
@@ -100,9 +104,15 @@ int encrypt_data(struct session_op *sess, int fdc, int chunksize, int alignmask)
 
 	memset(buffer, val++, chunksize);
 
+	memset(&pc, 0, sizeof(pc));
+	if (perf)
+		perf_open(&pc);
+
 	must_finish = 0;
 	alarm(5);
 
+	if (perf)
+		perf_start(&pc);
 	gettimeofday(&start, NULL);
 	do {
 		memset(&cop, 0, sizeof(cop));
@@ -119,12 +129,29 @@ int encrypt_data(struct session_op *sess, int fdc, int chunksize, int alignmask)
 		total+=chunksize;
 	} while(must_finish==0);
 	gettimeofday(&end, NULL);
+	if (perf) {
+		perf_stop(&pc);
+		perf_close(&pc);
+	}
 
 	secs = udifftimeval(start, end)/ 1000000.0;
 
 	value2human(si, total, secs, &ddata, &dspeed, metric);
 	printf ("done. %.2f %s in %.2f secs: ", ddata, metric, secs);
 	printf ("%.2f %s/sec\n", dspeed, metric);
+	if (perf) {
+		printf("\t\t");
+		if (perf_has(&pc, PERF_CYCLES))
+			printf("%.2f cycles/byte, ", perf_per(&pc, PERF_CYCLES, total));
+		if (perf_has(&pc, PERF_CYCLES) && perf_has(&pc, PERF_INSTRUCTIONS))
+			printf("%.2f IPC, ", perf_ipc(&pc));
+		if (perf_has(&pc, PERF_CACHE_MISSES))
+			printf("%.3g cache misses/op, ", perf_per(&pc, PERF_CACHE_MISSES, total / chunksize));
+		printf("%.3g context switches/op, %.3g page faults/op%s\n",
+		       perf_per(&pc, PERF_CTX_SWITCHES, total / chunksize),
+		       perf_per(&pc, PERF_PAGE_FAULTS, total / chunksize),
+		       pc.user_only ? " (user only)" : "");
+	}
 
 	free(buffer);
 	return 0;
@@ -141,14 +168,17 @@ int main(int argc, char** argv)
 
 	signal(SIGALRM, alarm_handler);
 	
-	if (argc > 1) {
-		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
-			printf("Usage: speed [--kib]\n");
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+			printf("Usage: speed [--kib] [--perf]\n");
 			exit(0);
 		}
-		if (strcmp(argv[1], "--kib") == 0) {
+		if (strcmp(argv[i], "--kib") == 0) {
 			si = 0;
 		}
+		if (strcmp(argv[i], "--perf") == 0) {
+			perf = 1;
+		}
 	}
 
 	if ((fd = open("/dev/crypto", O_RDWR, 0)) < 0) {
@@ -0,0 +1,209 @@
+/*
+ * chat-addr.c
+ *
+ * Chat endpoint addresses: TCP/IP, AF_VSOCK or shared memory.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+#include "chat-addr.h"
+
+static int is_vsock(const char *s)
+{
+	return !strncmp(s, CHAT_VSOCK_PREFIX, strlen(CHAT_VSOCK_PREFIX));
+}
+
+/* Whole-string unsigned number, -1 if there is anything else */
+static long long parse_num(const char *s, unsigned long long max)
+{
+	unsigned long long v;
+	char *end;
+
+	if (!*s || *s == '-')
+		return -1;
+	errno = 0;
+	v = strtoull(s, &end, 0);
+	if (*end || errno || v > max)
+		return -1;
+	return v;
+}
+
+const char *chat_shm_path(const char *host)
+{
+	if (strncmp(host, CHAT_SHM_PREFIX, strlen(CHAT_SHM_PREFIX)))
+		return NULL;
+	return host + strlen(CHAT_SHM_PREFIX);
+}
+
+int chat_addr_resolve(const char *host, int port, union chat_sockaddr *addr)
+{
+	struct hostent *hp;
+	long long cid;
+
+	memset(addr, 0, sizeof(*addr));
+	if (chat_shm_path(host)) {
+		fprintf(stderr, "%s is a shared memory address, not a socket\n", host);
+		return -1;
+	}
+	if (is_vsock(host)) {
+		if ((cid = parse_num(host + strlen(CHAT_VSOCK_PREFIX), UINT32_MAX)) < 0) {
+			fprintf(stderr, "Bad vsock address %s, expected vsock:CID\n", host);
+			return -1;
+		}
+		addr->vm.svm_family = AF_VSOCK;
+		addr->vm.svm_cid = cid;
+		addr->vm.svm_port = port;
+		return 0;
+	}
+
+	/* Look up remote hostname on DNS */
+	if (!(hp = gethostbyname(host))) {
+		fprintf(stderr, "DNS lookup failed for host %s\n", host);
+		return -1;
+	}
+	addr->in.sin_family = AF_INET;
+	addr->in.sin_port = htons(port);
+	memcpy(&addr->in.sin_addr.s_addr, hp->h_addr, sizeof(struct in_addr));
+	return 0;
+}
+
+int chat_addr_listen(const char *spec, union chat_sockaddr *addr)
+{
+	const char *colon, *path;
+	long long cid = VMADDR_CID_ANY, port;
+
+	memset(addr, 0, sizeof(*addr));
+	if ((path = chat_shm_path(spec))) {
+		if (!*path || strlen(path) >= sizeof(addr->un.sun_path))
+			return -1;
+		addr->un.sun_family = AF_UNIX;
+		strcpy(addr->un.sun_path, path);
+		return 0;
+	}
+	if (!is_vsock(spec)) {
+		if ((port = parse_num(spec, UINT16_MAX)) < 0)
+			return -1;
+		addr->in.sin_family = AF_INET;
+		addr->in.sin_port = htons(port);
+		addr->in.sin_addr.s_addr = htonl(INADDR_ANY);
+		return 0;
+	}
+
+	spec += strlen(CHAT_VSOCK_PREFIX);
+	if ((colon = strchr(spec, ':'))) {
+		char buf[16];
+
+		if (colon - spec >= (int)sizeof(buf))
+			return -1;
+		memcpy(buf, spec, colon - spec);
+		buf[colon - spec] = '\0';
+		if ((cid = parse_num(buf, UINT32_MAX)) < 0)
+			return -1;
+		spec = colon + 1;
+	}
+	if ((port = parse_num(spec, UINT32_MAX)) < 0)
+		return -1;
+	addr->vm.svm_family = AF_VSOCK;
+	addr->vm.svm_cid = cid;
+	addr->vm.svm_port = port;
+	return 0;
+}
+
+socklen_t chat_addr_len(const union chat_sockaddr *addr)
+{
+	switch (addr->sa.sa_family) {
+	case AF_VSOCK:
+		return sizeof(addr->vm);
+	case AF_UNIX:
+		return sizeof(addr->un);
+	default:
+		return sizeof(addr->in);
+	}
+}
+
+const char *chat_addr_str(const union chat_sockaddr *addr, char *buf, size_t len)
+{
+	char ip[INET_ADDRSTRLEN];
+
+	switch (addr->sa.sa_family) {
+	case AF_INET:
+		if (!inet_ntop(AF_INET, &addr->in.sin_addr, ip, sizeof(ip)))
+			strcpy(ip, "?");
+		snprintf(buf, len, "%s:%d", ip, ntohs(addr->in.sin_port));
+		break;
+	case AF_VSOCK:
+		if (addr->vm.svm_cid == VMADDR_CID_ANY)
+			snprintf(buf, len, CHAT_VSOCK_PREFIX "*:%u", addr->vm.svm_port);
+		else
+			snprintf(buf, len, CHAT_VSOCK_PREFIX "%u:%u", addr->vm.svm_cid, addr->vm.svm_port);
+		break;
+	case AF_UNIX:
+		snprintf(buf, len, CHAT_SHM_PREFIX "%s", addr->un.sun_path);
+		break;
+	default:
+		snprintf(buf, len, "?");
+	}
+	return buf;
+}
+
+int chat_connect(const char *host, int port)
+{
+	union chat_sockaddr addr;
+	int sd, one = 1;
+
+	if (chat_addr_resolve(host, port, &addr) < 0)
+		return -1;
+	if ((sd = socket(addr.sa.sa_family, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(sd, &addr.sa, chat_addr_len(&addr)) < 0) {
+		perror("connect");
+		close(sd);
+		return -1;
+	}
+	if (addr.sa.sa_family == AF_INET)
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return sd;
+}
+
+int chat_listen(const char *spec, int backlog)
+{
+	union chat_sockaddr addr;
+	char name[CHAT_ADDR_STRLEN];
+	int sd, one = 1;
+
+	if (chat_addr_listen(spec, &addr) < 0) {
+		fprintf(stderr, "Bad listening address %s, expected [vsock:[CID:]]port or shm:/path\n", spec);
+		return -1;
+	}
+	if ((sd = socket(addr.sa.sa_family, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (addr.sa.sa_family == AF_INET)
+		setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* A socket left behind by an earlier server */
+	if (addr.sa.sa_family == AF_UNIX && unlink(addr.un.sun_path) < 0 && errno != ENOENT)
+		perror("unlink");
+	if (bind(sd, &addr.sa, chat_addr_len(&addr)) < 0) {
+		perror("bind");
+		close(sd);
+		return -1;
+	}
+	if (listen(sd, backlog) < 0) {
+		perror("listen");
+		close(sd);
+		return -1;
+	}
+	fprintf(stderr, "Listening on %s\n", chat_addr_str(&addr, name, sizeof(name)));
+	return sd;
+}
@@ -0,0 +1,52 @@
+/*
+ * chat-addr.h
+ *
+ * Chat endpoint addresses: TCP/IP, AF_VSOCK or shared memory.
+ *
+ * The transport follows from how the host is written:
+ *
+ *   hostname, 10.0.0.1   TCP/IP
+ *   vsock:CID            AF_VSOCK; 2 is the host seen from a guest,
+ *                        1 the local loopback transport
+ *   shm:/path            shared memory rings set up through the Unix
+ *                        socket at path (shm-ring.h), same host only
+ *
+ * Listening addresses are "[vsock:[CID:]]port" or "shm:/path"; a vsock
+ * listener without a CID accepts on every CID of the machine.
+ */
+
+#ifndef _CHAT_ADDR_H
+#define _CHAT_ADDR_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <linux/vm_sockets.h>
+
+#define CHAT_VSOCK_PREFIX	"vsock:"
+#define CHAT_SHM_PREFIX		"shm:"
+#define CHAT_ADDR_STRLEN	64
+
+union chat_sockaddr {
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_vm vm;
+	struct sockaddr_un un;
+};
+
+/* Socket path of a shm:/path host, NULL for the other transports */
+const char *chat_shm_path(const char *host);
+/* Address of host:port for connecting. -1 with a message if unknown. */
+int chat_addr_resolve(const char *host, int port, union chat_sockaddr *addr);
+/* Address to listen on, from "[vsock:[CID:]]port" or "shm:/path". -1 if malformed. */
+int chat_addr_listen(const char *spec, union chat_sockaddr *addr);
+socklen_t chat_addr_len(const union chat_sockaddr *addr);
+/* "10.0.0.1:35001", "vsock:3:35001", "shm:/run/chat" */
+const char *chat_addr_str(const union chat_sockaddr *addr, char *buf, size_t len);
+
+/* Connected stream socket to host:port, with Nagle off on TCP. -1 on error. */
+int chat_connect(const char *host, int port);
+/* Bound, listening socket for spec, with a message on stderr. -1 on error. */
+int chat_listen(const char *spec, int backlog);
+
+#endif /* _CHAT_ADDR_H */
@@ -0,0 +1,663 @@
+/*
+ * chat-history.c
+ *
+ * Per-room history in memory mapped, append-only log segments.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "chat-history.h"
+
+#define SEG_MAGIC	"CHHS"
+#define SEG_VERSION	1
+
+struct seg_hdr {
+	char magic[4];
+	uint16_t version;
+	uint16_t room;
+	uint64_t base_seq;		/* sequence number of the first message */
+	uint64_t created_ms;
+	uint8_t reserved[40];
+};
+
+/* A message, padded to 8 bytes. len goes in last, 0 past the end. */
+struct seg_rec {
+	uint32_t len;
+	uint32_t reserved;
+	uint64_t ts_ms;
+	unsigned char frame[];
+};
+
+struct seg_idx {
+	uint32_t off;			/* of the record */
+	uint32_t seq;			/* from the segment's base_seq */
+	uint64_t ts_ms;
+};
+
+struct segment {
+	uint64_t base_seq;
+	uint32_t count;			/* messages */
+	uint64_t first_ts, last_ts;
+	unsigned char *map;
+	size_t map_len;
+	size_t used;			/* header and messages */
+	size_t alloc;			/* disk space reserved, while active */
+	int fd;				/* -1 once sealed */
+	uint8_t unsynced;		/* sealed since the last history_sync() */
+	struct seg_idx *idx;
+	uint32_t nidx, idx_cap;
+	size_t idx_next;		/* offset due for the next index entry */
+};
+
+struct room_hist {
+	struct segment *segs;		/* oldest first, the last may be active */
+	unsigned int nsegs, cap;
+	uint64_t next_seq;
+	uint64_t last_ts;
+};
+
+static struct room_hist *rooms[UINT16_MAX + 1];
+static char *hist_dir;
+static struct history_opts hopts;
+
+static uint64_t wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t rec_size(uint32_t len)
+{
+	return (sizeof(struct seg_rec) + len + 7) & ~(size_t)7;
+}
+
+static void seg_path(char *buf, size_t sz, uint16_t room, uint64_t base)
+{
+	snprintf(buf, sz, "%s/%05u/%020llu.seg", hist_dir, room, (unsigned long long)base);
+}
+
+/* Index the record at off if it is due. Without memory the index just gets sparser. */
+static void idx_add(struct segment *s, size_t off, uint64_t ts)
+{
+	struct seg_idx *idx;
+	uint32_t cap;
+
+	if (off < s->idx_next)
+		return;
+	if (s->nidx == s->idx_cap) {
+		cap = s->idx_cap ? s->idx_cap * 2 : 64;
+		if (!(idx = realloc(s->idx, cap * sizeof(*idx))))
+			return;
+		s->idx = idx;
+		s->idx_cap = cap;
+	}
+	s->idx[s->nidx].off = off;
+	s->idx[s->nidx].seq = s->count;
+	s->idx[s->nidx].ts_ms = ts;
+	s->nidx++;
+	s->idx_next = off + HISTORY_INDEX_BYTES;
+}
+
+/* Count and index the messages of a segment loaded from disk */
+static void seg_scan(struct segment *s)
+{
+	size_t off = sizeof(struct seg_hdr);
+	struct seg_rec *rec;
+
+	while (off + sizeof(*rec) <= s->map_len) {
+		rec = (struct seg_rec *)(s->map + off);
+		if (!rec->len || rec_size(rec->len) > s->map_len - off)
+			break;
+		idx_add(s, off, rec->ts_ms);
+		if (!s->count)
+			s->first_ts = rec->ts_ms;
+		s->last_ts = rec->ts_ms;
+		s->count++;
+		off += rec_size(rec->len);
+	}
+	s->used = off;
+}
+
+static void seg_unmap(struct segment *s)
+{
+	if (s->map)
+		munmap(s->map, s->map_len);
+	if (s->fd >= 0)
+		close(s->fd);
+	free(s->idx);
+}
+
+/* Truncate a full segment to what it holds, it stays mapped for reads */
+static void seg_seal(struct segment *s)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t keep = (s->used + page - 1) & ~(size_t)(page - 1);
+
+	if (s->fd < 0)
+		return;
+	if (ftruncate(s->fd, s->used) < 0)
+		perror("history: ftruncate");
+	close(s->fd);
+	s->fd = -1;
+	s->unsynced = 1;		/* left to history_sync(), off the relay path */
+	if (keep < s->map_len) {
+		munmap(s->map + keep, s->map_len - keep);
+		s->map_len = keep;
+	}
+}
+
+/* Reserve disk space up to end, a chunk at a time */
+static int seg_reserve(struct segment *s, size_t end)
+{
+	size_t want;
+	int err;
+
+	if (end <= s->alloc)
+		return 0;
+	want = (end + HISTORY_ALLOC_CHUNK - 1) / HISTORY_ALLOC_CHUNK * HISTORY_ALLOC_CHUNK;
+	if (want > s->map_len)
+		want = s->map_len;
+	if ((err = posix_fallocate(s->fd, s->alloc, want - s->alloc))) {
+		errno = err;
+		return -1;
+	}
+	s->alloc = want;
+	return 0;
+}
+
+/*
+ * Map a segment found on disk. The last one is written to further if
+ * it was left unsealed at the current segment size.
+ */
+static int seg_load(uint16_t room, uint64_t base, int last, struct segment *s)
+{
+	const struct seg_hdr *hdr;
+	char path[4096];
+	struct stat st;
+	int fd, active;
+
+	seg_path(path, sizeof(path), room, base);
+	if ((fd = open(path, last ? O_RDWR : O_RDONLY)) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "history: %s is too short, skipped\n", path);
+		close(fd);
+		return -1;
+	}
+	active = last && (size_t)st.st_size == hopts.seg_size;
+
+	memset(s, 0, sizeof(*s));
+	s->map_len = st.st_size;
+	s->map = mmap(NULL, s->map_len, PROT_READ | (active ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	if (s->map == MAP_FAILED) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	hdr = (const struct seg_hdr *)s->map;
+	if (memcmp(hdr->magic, SEG_MAGIC, 4) || hdr->version != SEG_VERSION ||
+	    hdr->room != room || hdr->base_seq != base) {
+		fprintf(stderr, "history: %s is not a history segment, skipped\n", path);
+		munmap(s->map, s->map_len);
+		close(fd);
+		return -1;
+	}
+	s->base_seq = base;
+	s->fd = -1;
+	seg_scan(s);
+
+	if (active) {
+		s->fd = fd;
+		s->alloc = s->used;
+	} else {
+		close(fd);
+	}
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void room_drop_oldest(uint16_t room, struct room_hist *r)
+{
+	char path[4096];
+
+	seg_path(path, sizeof(path), room, r->segs[0].base_seq);
+	seg_unmap(&r->segs[0]);
+	if (unlink(path) < 0)
+		perror(path);
+	memmove(r->segs, r->segs + 1, --r->nsegs * sizeof(*r->segs));
+}
+
+/* Apply the retention limits, the segment being written always stays */
+static void room_expire(uint16_t room, struct room_hist *r)
+{
+	uint64_t now = hopts.max_age_ms ? wall_ms() : 0;
+
+	while (hopts.keep_segs && r->nsegs > hopts.keep_segs)
+		room_drop_oldest(room, r);
+	while (hopts.max_age_ms && r->nsegs > 1 &&
+	       r->segs[0].last_ts + hopts.max_age_ms < now)
+		room_drop_oldest(room, r);
+}
+
+static int room_grow(struct room_hist *r)
+{
+	struct segment *segs;
+	unsigned int cap;
+
+	if (r->nsegs < r->cap)
+		return 0;
+	cap = r->cap ? r->cap * 2 : 8;
+	if (!(segs = realloc(r->segs, cap * sizeof(*segs))))
+		return -1;
+	r->segs = segs;
+	r->cap = cap;
+	return 0;
+}
+
+/* Pick up the segments of a room left by an earlier run */
+static int room_load(uint16_t room, struct room_hist *r)
+{
+	uint64_t *bases = NULL, *b, base;
+	size_t nbases = 0, cap = 0, i;
+	char path[4096], *end;
+	struct dirent *de;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%05u", hist_dir, room);
+	if (!(d = opendir(path)))
+		return errno == ENOENT ? 0 : -1;
+	while ((de = readdir(d))) {
+		base = strtoull(de->d_name, &end, 10);
+		if (end == de->d_name || strcmp(end, ".seg"))
+			continue;
+		if (nbases == cap) {
+			cap = cap ? cap * 2 : 16;
+			if (!(b = realloc(bases, cap * sizeof(*b)))) {
+				closedir(d);
+				free(bases);
+				return -1;
+			}
+			bases = b;
+		}
+		bases[nbases++] = base;
+	}
+	closedir(d);
+	qsort(bases, nbases, sizeof(*bases), cmp_u64);
+
+	for (i = 0; i < nbases; i++) {
+		if (room_grow(r) < 0) {
+			free(bases);
+			return -1;
+		}
+		if (seg_load(room, bases[i], i == nbases - 1, &r->segs[r->nsegs]) == 0)
+			r->nsegs++;
+	}
+	free(bases);
+
+	if (r->nsegs) {
+		r->next_seq = r->segs[r->nsegs - 1].base_seq + r->segs[r->nsegs - 1].count;
+		r->last_ts = r->segs[r->nsegs - 1].last_ts;
+		room_expire(room, r);
+	}
+	return 0;
+}
+
+/* A room's history, loaded on first use. NULL if there is none and !create. */
+static struct room_hist *room_get(uint16_t room, int create)
+{
+	struct room_hist *r;
+	char path[4096];
+	struct stat st;
+
+	if (rooms[room])
+		return rooms[room];
+	if (!hist_dir)
+		return NULL;
+	if (!create) {
+		snprintf(path, sizeof(path), "%s/%05u", hist_dir, room);
+		if (stat(path, &st) < 0)
+			return NULL;
+	}
+	if (!(r = calloc(1, sizeof(*r))))
+		return NULL;
+	if (room_load(room, r) < 0) {
+		fprintf(stderr, "history: could not load room %u\n", room);
+		free(r->segs);
+		free(r);
+		return NULL;
+	}
+	return rooms[room] = r;
+}
+
+/* Start a new segment at the room's next sequence number */
+static struct segment *room_roll(uint16_t room, struct room_hist *r)
+{
+	struct segment *s;
+	struct seg_hdr *hdr;
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%05u", hist_dir, room);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		perror(path);
+		return NULL;
+	}
+	if (room_grow(r) < 0)
+		return NULL;
+
+	seg_path(path, sizeof(path), room, r->next_seq);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(path);
+		return NULL;
+	}
+	if (ftruncate(fd, hopts.seg_size) < 0) {
+		perror(path);
+		goto fail;
+	}
+
+	s = &r->segs[r->nsegs];
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->base_seq = r->next_seq;
+	s->map_len = hopts.seg_size;
+	s->map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (s->map == MAP_FAILED) {
+		perror(path);
+		goto fail;
+	}
+	madvise(s->map, s->map_len, MADV_SEQUENTIAL);
+	if (seg_reserve(s, sizeof(*hdr)) < 0) {
+		perror(path);
+		munmap(s->map, s->map_len);
+		goto fail;
+	}
+	hdr = (struct seg_hdr *)s->map;
+	memcpy(hdr->magic, SEG_MAGIC, 4);
+	hdr->version = SEG_VERSION;
+	hdr->room = room;
+	hdr->base_seq = s->base_seq;
+	hdr->created_ms = wall_ms();
+	s->used = sizeof(*hdr);
+	r->nsegs++;
+
+	room_expire(room, r);
+	return &r->segs[r->nsegs - 1];
+
+fail:
+	close(fd);
+	unlink(path);
+	return NULL;
+}
+
+int history_init(const char *dir, const struct history_opts *opts)
+{
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		perror(dir);
+		return -1;
+	}
+	if (!(hist_dir = strdup(dir)))
+		return -1;
+	hopts = *opts;
+	if (hopts.seg_size < sizeof(struct seg_hdr) + HISTORY_INDEX_BYTES)
+		hopts.seg_size = HISTORY_SEG_SIZE;
+	return 0;
+}
+
+void history_fini(void)
+{
+	struct room_hist *r;
+	unsigned int i, j;
+
+	for (i = 0; i <= UINT16_MAX; i++) {
+		if (!(r = rooms[i]))
+			continue;
+		for (j = 0; j < r->nsegs; j++)
+			seg_unmap(&r->segs[j]);
+		free(r->segs);
+		free(r);
+		rooms[i] = NULL;
+	}
+	free(hist_dir);
+	hist_dir = NULL;
+}
+
+int history_append(uint16_t room, const void *frame, uint32_t len, uint64_t *seq)
+{
+	struct room_hist *r;
+	struct segment *s;
+	struct seg_rec *rec;
+	size_t need = rec_size(len);
+	uint64_t ts;
+
+	if (!len || sizeof(struct seg_hdr) + need > hopts.seg_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (!(r = room_get(room, 1)))
+		return -1;
+
+	s = r->nsegs ? &r->segs[r->nsegs - 1] : NULL;
+	if (!s || s->fd < 0 || s->used + need > s->map_len) {
+		if (s)
+			seg_seal(s);
+		if (!(s = room_roll(room, r)))
+			return -1;
+	}
+	if (seg_reserve(s, s->used + need) < 0) {
+		perror("history: posix_fallocate");
+		return -1;
+	}
+
+	ts = wall_ms();
+	if (ts < r->last_ts)
+		ts = r->last_ts;	/* the clock went back, keep reads ordered */
+	rec = (struct seg_rec *)(s->map + s->used);
+	rec->reserved = 0;
+	rec->ts_ms = ts;
+	memcpy(rec->frame, frame, len);
+	rec->len = len;
+
+	idx_add(s, s->used, ts);
+	if (!s->count)
+		s->first_ts = ts;
+	s->last_ts = ts;
+	s->count++;
+	s->used += need;
+	if (seq)
+		*seq = r->next_seq;
+	r->next_seq++;
+	r->last_ts = ts;
+
+	if (hopts.max_age_ms && r->nsegs > 1)
+		room_expire(room, r);
+	return 0;
+}
+
+int history_sync(void)
+{
+	struct segment *s;
+	unsigned int i, j;
+	int ret = 0;
+
+	/* The active segments, and the ones sealed since the last time */
+	for (i = 0; i <= UINT16_MAX; i++) {
+		for (j = 0; rooms[i] && j < rooms[i]->nsegs; j++) {
+			s = &rooms[i]->segs[j];
+			if (s->fd < 0 && !s->unsynced)
+				continue;
+			if (msync(s->map, s->used, MS_SYNC) < 0) {
+				perror("history: msync");
+				ret = -1;
+				continue;
+			}
+			s->unsynced = 0;
+		}
+	}
+	return ret;
+}
+
+/* Offset of message rel of a segment, rel < count */
+static size_t seg_find_seq(const struct segment *s, uint32_t rel)
+{
+	const struct seg_rec *rec;
+	uint32_t lo = 0, hi = s->nidx, mid, seq = 0;
+	size_t off = sizeof(struct seg_hdr);
+
+	/* The last index entry at or before rel */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->idx[mid].seq <= rel)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo) {
+		off = s->idx[lo - 1].off;
+		seq = s->idx[lo - 1].seq;
+	}
+	for (; seq < rel; seq++) {
+		rec = (const struct seg_rec *)(s->map + off);
+		off += rec_size(rec->len);
+	}
+	return off;
+}
+
+/* Offset of the first message stamped since_ms or later, s->used if none */
+static size_t seg_find_ts(const struct segment *s, uint64_t since_ms)
+{
+	const struct seg_rec *rec;
+	uint32_t lo = 0, hi = s->nidx, mid;
+	size_t off = sizeof(struct seg_hdr);
+
+	/* The last index entry before since_ms, every later message is after it */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (s->idx[mid].ts_ms < since_ms)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo)
+		off = s->idx[lo - 1].off;
+	while (off < s->used) {
+		rec = (const struct seg_rec *)(s->map + off);
+		if (rec->ts_ms >= since_ms)
+			break;
+		off += rec_size(rec->len);
+	}
+	return off;
+}
+
+/* Hand up to max messages to fn, from offset off of segment i on */
+static uint32_t deliver(struct room_hist *r, unsigned int i, size_t off, uint32_t max,
+                        history_fn fn, void *arg)
+{
+	const struct seg_rec *rec;
+	const struct segment *s;
+	uint32_t n = 0;
+
+	for (; i < r->nsegs && n < max; i++, off = sizeof(struct seg_hdr)) {
+		s = &r->segs[i];
+		while (off < s->used && n < max) {
+			rec = (const struct seg_rec *)(s->map + off);
+			fn(arg, rec->frame, rec->len, rec->ts_ms);
+			off += rec_size(rec->len);
+			n++;
+		}
+	}
+	return n;
+}
+
+/* The last segment starting at or before seq, 0 if none */
+static unsigned int seg_of(const struct room_hist *r, uint64_t seq)
+{
+	unsigned int lo = 0, hi = r->nsegs, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (r->segs[mid].base_seq <= seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? lo - 1 : 0;
+}
+
+uint32_t history_last(uint16_t room, uint32_t n, history_fn fn, void *arg)
+{
+	struct room_hist *r = room_get(room, 0);
+	uint64_t start;
+	unsigned int lo;
+
+	if (!r || !r->nsegs || !n)
+		return 0;
+	if (n > r->next_seq - r->segs[0].base_seq)
+		n = r->next_seq - r->segs[0].base_seq;
+	start = r->next_seq - n;
+	lo = seg_of(r, start);
+	/* A segment skipped at load leaves a gap, carry on after it */
+	if (start < r->segs[lo].base_seq || start - r->segs[lo].base_seq >= r->segs[lo].count)
+		return deliver(r, lo + 1, sizeof(struct seg_hdr), n, fn, arg);
+	return deliver(r, lo, seg_find_seq(&r->segs[lo], start - r->segs[lo].base_seq),
+		       n, fn, arg);
+}
+
+uint32_t history_since(uint16_t room, uint64_t since_ms, uint32_t max,
+                       history_fn fn, void *arg)
+{
+	struct room_hist *r = room_get(room, 0);
+	unsigned int i;
+
+	if (!r || !max)
+		return 0;
+	/* Segments are in time order, the first one reaching since_ms */
+	for (i = 0; i < r->nsegs; i++)
+		if (r->segs[i].count && r->segs[i].last_ts >= since_ms)
+			break;
+	if (i == r->nsegs)
+		return 0;
+	return deliver(r, i, seg_find_ts(&r->segs[i], since_ms), max, fn, arg);
+}
+
+int history_get(uint16_t room, uint64_t seq, history_fn fn, void *arg)
+{
+	struct room_hist *r = room_get(room, 0);
+	const struct segment *s;
+
+	if (!r || !r->nsegs)
+		return 0;
+	s = &r->segs[seg_of(r, seq)];
+	if (seq < s->base_seq || seq - s->base_seq >= s->count)
+		return 0;
+	return deliver(r, s - r->segs, seg_find_seq(s, seq - s->base_seq), 1, fn, arg);
+}
+
+uint64_t history_first(uint16_t room)
+{
+	struct room_hist *r = room_get(room, 0);
+
+	if (!r)
+		return 0;
+	return r->nsegs ? r->segs[0].base_seq : r->next_seq;
+}
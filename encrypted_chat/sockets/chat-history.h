@@ -0,0 +1,70 @@
+/*
+ * chat-history.h
+ *
+ * Message history of the chat server, per room.
+ *
+ * A room's history is a directory of append-only log segments, each
+ * named after the sequence number of its first message. The segment
+ * being written is mapped at its full size and disk space is reserved
+ * a chunk ahead of the write position, so appending a message is a
+ * copy into the mapping and the kernel does the writing back. A full
+ * segment is truncated to what it holds, stays mapped for reads, and
+ * a new one is started; sealed segments past the retention limits are
+ * deleted, oldest first.
+ *
+ * Messages are kept as the frames the server relayed, header included
+ * and payload still encrypted, stamped with the wall clock in ms.
+ * Reads find where to start through a sparse index kept in memory, an
+ * entry per HISTORY_INDEX_BYTES of log, which is rebuilt by scanning
+ * the segments when a room is first used. Files are in host byte order.
+ */
+
+#ifndef _CHAT_HISTORY_H
+#define _CHAT_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTORY_SEG_SIZE	(16 * 1024 * 1024)
+#define HISTORY_KEEP_SEGS	8
+#define HISTORY_INDEX_BYTES	4096
+#define HISTORY_ALLOC_CHUNK	(1024 * 1024)	/* disk reserved ahead of the writer */
+
+struct history_opts {
+	size_t seg_size;		/* bytes per segment */
+	unsigned int keep_segs;		/* segments per room, 0 for no limit */
+	uint64_t max_age_ms;		/* drop older segments, 0 for no limit */
+};
+
+/* Called for each message read, oldest first. frame is valid during the call. */
+typedef void (*history_fn)(void *arg, const unsigned char *frame, uint32_t len,
+                           uint64_t ts_ms);
+
+/* Keep history under dir, created if need be. -1 on error. */
+int history_init(const char *dir, const struct history_opts *opts);
+/* Unmap everything, the data stays on disk */
+void history_fini(void);
+
+/*
+ * Store a frame relayed to room, its sequence number goes in *seq if
+ * seq is not NULL. -1 on error, the message is not kept.
+ */
+int history_append(uint16_t room, const void *frame, uint32_t len, uint64_t *seq);
+
+/* Write out what has been appended and wait for it. -1 on error. */
+int history_sync(void);
+
+/* The last n messages of room. Returns how many fn was called for. */
+uint32_t history_last(uint16_t room, uint32_t n, history_fn fn, void *arg);
+
+/* Up to max messages of room stamped since_ms or later. Returns how many. */
+uint32_t history_since(uint16_t room, uint64_t since_ms, uint32_t max,
+                       history_fn fn, void *arg);
+
+/* Message seq of room. Returns 1 if it is still kept, 0 if not. */
+int history_get(uint16_t room, uint64_t seq, history_fn fn, void *arg);
+
+/* Sequence number of the oldest message kept, the next one if none */
+uint64_t history_first(uint16_t room);
+
+#endif /* _CHAT_HISTORY_H */
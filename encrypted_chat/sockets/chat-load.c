@@ -0,0 +1,406 @@
+/*
+ * chat-load.c
+ *
+ * Many-connection load generator for the chat server, used to compare
+ * its I/O engines (see server-bench.sh).
+ *
+ * Opens -c connections and puts every -g of them in a room of their
+ * own. Each connection then sends -s byte messages at -r per second
+ * for -t seconds, staggered so the offered load is smooth. The payload
+ * carries the send time and every copy the server delivers is timed
+ * at the receiver. Messages are not encrypted: the server never looks
+ * inside them, so this measures the relay path only.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "socket-common.h"
+#include "chat-addr.h"
+#include "chat-proto.h"
+
+#define LOAD_MAGIC	0x4c4f414443484154ULL
+#define SETTLE_MS	1000
+#define DRAIN_SECS	2
+#define MAX_EVENTS	256
+
+struct load_stamp {
+	uint64_t magic;
+	uint64_t sent_ns;
+};
+
+struct load_conn {
+	int fd;
+	int dead;
+	int want_out;			/* registered for EPOLLOUT */
+	unsigned char *tx;
+	size_t tx_off, tx_len, tx_cap;
+	unsigned char *rx;
+	size_t rx_len;
+	size_t skip;			/* rest of a frame too big for rx */
+};
+
+static struct load_conn *conns;
+static uint32_t nconns;
+static size_t rx_size;
+static int epfd;
+
+static uint64_t *lat;			/* delivery latencies, ns */
+static size_t nlat, lat_cap;
+static uint64_t dead_conns;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void watch(uint32_t i, int want_out)
+{
+	struct epoll_event ev = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.u32 = i };
+
+	if (conns[i].want_out == want_out)
+		return;
+	conns[i].want_out = want_out;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, conns[i].fd, &ev) < 0)
+		perror("epoll_ctl");
+}
+
+static void load_connect(uint32_t i, const char *host, int port)
+{
+	struct load_conn *lc = &conns[i];
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+
+	if (!(lc->rx = malloc(rx_size))) {
+		perror("malloc");
+		exit(1);
+	}
+	if ((lc->fd = chat_connect(host, port)) < 0)
+		exit(1);
+	fcntl(lc->fd, F_SETFL, fcntl(lc->fd, F_GETFL) | O_NONBLOCK);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, lc->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+static void flush_tx(uint32_t i)
+{
+	struct load_conn *lc = &conns[i];
+	ssize_t r;
+
+	while (lc->tx_off < lc->tx_len) {
+		r = write(lc->fd, lc->tx + lc->tx_off, lc->tx_len - lc->tx_off);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			lc->dead = 1;
+			dead_conns++;
+			return;
+		}
+		lc->tx_off += r;
+	}
+	if (lc->tx_off == lc->tx_len)
+		lc->tx_off = lc->tx_len = 0;
+	watch(i, lc->tx_off < lc->tx_len);
+}
+
+/* Append a frame to the connection's transmit buffer and try to send it */
+static void send_frame(uint32_t i, uint16_t type, uint16_t room, const void *payload, uint32_t len)
+{
+	struct load_conn *lc = &conns[i];
+	struct chat_hdr hdr = { .len = len, .type = type, .room = room };
+	int was_idle = lc->tx_len == 0;
+
+	if (lc->dead)
+		return;
+	if (lc->tx_len + CHAT_HDR_SIZE + len > lc->tx_cap) {
+		lc->tx_cap = 2 * (lc->tx_len + CHAT_HDR_SIZE + len);
+		if (!(lc->tx = realloc(lc->tx, lc->tx_cap))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	chat_hdr_hton(&hdr);
+	memcpy(lc->tx + lc->tx_len, &hdr, CHAT_HDR_SIZE);
+	if (len)
+		memcpy(lc->tx + lc->tx_len + CHAT_HDR_SIZE, payload, len);
+	lc->tx_len += CHAT_HDR_SIZE + len;
+	/* Already waiting for EPOLLOUT otherwise */
+	if (was_idle)
+		flush_tx(i);
+}
+
+static void record_latency(uint64_t ns)
+{
+	if (nlat == lat_cap) {
+		lat_cap = lat_cap ? lat_cap * 2 : 65536;
+		if (!(lat = realloc(lat, lat_cap * sizeof(*lat)))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	lat[nlat++] = ns;
+}
+
+static void process_rx(uint32_t i)
+{
+	struct load_conn *lc = &conns[i];
+	struct load_stamp st;
+	struct chat_hdr hdr;
+	size_t off = 0;
+
+	while (lc->rx_len - off >= CHAT_HDR_SIZE) {
+		memcpy(&hdr, lc->rx + off, CHAT_HDR_SIZE);
+		chat_hdr_ntoh(&hdr);
+		if (CHAT_HDR_SIZE + hdr.len > rx_size) {
+			/* Not one of ours, throw it away as it comes */
+			lc->skip = CHAT_HDR_SIZE + hdr.len;
+			break;
+		}
+		if (lc->rx_len - off < CHAT_HDR_SIZE + hdr.len)
+			break;
+
+		if (hdr.type == CHAT_MSG_TEXT && hdr.len >= sizeof(st)) {
+			memcpy(&st, lc->rx + off + CHAT_HDR_SIZE, sizeof(st));
+			if (st.magic == LOAD_MAGIC)
+				record_latency(now_ns() - st.sent_ns);
+		} else if (hdr.type == CHAT_MSG_PING) {
+			send_frame(i, CHAT_MSG_PONG, hdr.room, NULL, 0);
+		}
+		off += CHAT_HDR_SIZE + hdr.len;
+	}
+	if (lc->skip) {
+		size_t n = MIN(lc->skip, lc->rx_len - off);
+
+		lc->skip -= n;
+		off += n;
+	}
+	memmove(lc->rx, lc->rx + off, lc->rx_len - off);
+	lc->rx_len -= off;
+}
+
+static void read_conn(uint32_t i)
+{
+	struct load_conn *lc = &conns[i];
+	ssize_t r;
+
+	for (;;) {
+		r = read(lc->fd, lc->rx + lc->rx_len, rx_size - lc->rx_len);
+		if (r <= 0) {
+			if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+				lc->dead = 1;
+				dead_conns++;
+				epoll_ctl(epfd, EPOLL_CTL_DEL, lc->fd, NULL);
+			}
+			return;
+		}
+		if (lc->skip) {
+			size_t n = MIN(lc->skip, (size_t)r);
+
+			lc->skip -= n;
+			memmove(lc->rx + lc->rx_len, lc->rx + lc->rx_len + n, r - n);
+			r -= n;
+		}
+		lc->rx_len += r;
+		process_rx(i);
+	}
+}
+
+/* Handle socket events until deadline (absolute, ns) or the first batch */
+static void pump(uint64_t deadline, int once)
+{
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t now;
+	int n, k;
+
+	do {
+		now = now_ns();
+		n = epoll_wait(epfd, events, MAX_EVENTS,
+			       deadline > now ? (deadline - now + 999999) / 1000000 : 0);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (k = 0; k < n; k++) {
+			uint32_t i = events[k].data.u32;
+
+			if (conns[i].dead)
+				continue;
+			if (events[k].events & EPOLLOUT)
+				flush_tx(i);
+			if (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				read_conn(i);
+		}
+	} while (!once && now_ns() < deadline);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c conns] [-g room_size] [-s size] [-r rate] [-t secs] hostname|vsock:CID port\n"
+			"  -c  connections to open (default 1000)\n"
+			"  -g  connections per room (default 10)\n"
+			"  -s  message payload size in bytes (default 256)\n"
+			"  -r  messages per second per connection (default 10)\n"
+			"  -t  seconds of load (default 10)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t i, group = 10, size = 256;
+	double rate = 10, secs = 10, elapsed;
+	uint64_t start, end, stop, gap, k, sent = 0, expected = 0, max_slip = 0;
+	unsigned char *payload;
+	struct load_stamp st;
+	union chat_sockaddr sa;
+	const char *host;
+	int opt, port;
+
+	nconns = 1000;
+	while ((opt = getopt(argc, argv, "c:g:s:r:t:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 'g':
+			group = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 't':
+			secs = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || !nconns || group < 2 || rate <= 0 || secs <= 0 ||
+	    size < sizeof(st) || size > CHAT_MAX_PAYLOAD)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	host = argv[optind];
+	port = atoi(argv[optind + 1]);
+	if (chat_addr_resolve(host, port, &sa) < 0)
+		exit(1);
+
+	rx_size = MAX(4096, 4 * (CHAT_HDR_SIZE + size));
+	if (!(conns = calloc(nconns, sizeof(*conns))) || !(payload = calloc(1, size))) {
+		perror("calloc");
+		exit(1);
+	}
+	if ((epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	/* Rooms from 1 up, the lobby would mix in everybody's notices */
+	fprintf(stderr, "Opening %u connections, %u per room\n", nconns, group);
+	for (i = 0; i < nconns; i++) {
+		load_connect(i, host, port);
+		send_frame(i, CHAT_MSG_JOIN, 1 + i / group, NULL, 0);
+		if (i % 256 == 255)
+			pump(0, 1);
+	}
+	pump(now_ns() + SETTLE_MS * 1000000ULL, 0);
+	if (dead_conns) {
+		fprintf(stderr, "%llu connections lost while joining\n", (unsigned long long)dead_conns);
+		exit(1);
+	}
+
+	/*
+	 * Connections take turns: with the same rate for all of them the
+	 * k-th message overall is due at start + k * gap, on connection
+	 * k mod nconns.
+	 */
+	fprintf(stderr, "Sending %.0f msg/s for %.0f s\n", rate * nconns, secs);
+	gap = 1e9 / (rate * nconns);
+	start = now_ns();
+	stop = start + secs * 1e9;
+	for (k = 0; start + k * gap < stop; ) {
+		uint64_t now = now_ns();
+
+		for (; start + k * gap <= now && start + k * gap < stop; k++) {
+			uint32_t c = k % nconns, members;
+
+			if (conns[c].dead)
+				continue;
+			st.magic = LOAD_MAGIC;
+			st.sent_ns = now_ns();
+			memcpy(payload, &st, sizeof(st));
+			send_frame(c, CHAT_MSG_TEXT, 1 + c / group, payload, size);
+			sent++;
+			members = MIN(group, nconns - c / group * group);
+			expected += members - 1;
+			if (now - (start + k * gap) > max_slip)
+				max_slip = now - (start + k * gap);
+		}
+		pump(MIN(start + k * gap, stop), 1);
+	}
+	end = now_ns();
+
+	/* Let in-flight messages arrive */
+	while (nlat < expected) {
+		size_t before = nlat;
+
+		pump(now_ns() + DRAIN_SECS * 1000000000ULL / 10, 0);
+		if (nlat == before && now_ns() - end > DRAIN_SECS * 1000000000ULL)
+			break;
+		if (nlat != before)
+			end = now_ns();
+	}
+	elapsed = (end - start) / 1e9;
+
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+#define PCT(p) (nlat ? lat[(size_t)((nlat - 1) * (p))] / 1000.0 : 0.0)
+	printf("conns=%u room_size=%u size=%u sent=%llu expected=%llu delivered=%zu (%.1f%%) "
+	       "secs=%.3f deliveries/s=%.0f max_send_lag_ms=%.1f dead=%llu\n",
+	       nconns, group, size, (unsigned long long)sent, (unsigned long long)expected, nlat,
+	       expected ? 100.0 * nlat / expected : 100.0, elapsed, nlat / elapsed,
+	       max_slip / 1e6, (unsigned long long)dead_conns);
+	printf("latency_us: p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+	       PCT(0.50), PCT(0.90), PCT(0.99), PCT(0.999), PCT(1.0));
+#undef PCT
+
+	for (i = 0; i < nconns; i++) {
+		close(conns[i].fd);
+		free(conns[i].tx);
+		free(conns[i].rx);
+	}
+	free(conns);
+	free(payload);
+	free(lat);
+
+	return 0;
+}
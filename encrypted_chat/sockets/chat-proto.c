@@ -0,0 +1,127 @@
+/*
+ * chat-proto.c
+ *
+ * Framing helpers for the chat wire protocol.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "chat-proto.h"
+
+void chat_hdr_hton(struct chat_hdr *hdr)
+{
+	hdr->len = htonl(hdr->len);
+	hdr->type = htons(hdr->type);
+	hdr->room = htons(hdr->room);
+}
+
+void chat_hdr_ntoh(struct chat_hdr *hdr)
+{
+	hdr->len = ntohl(hdr->len);
+	hdr->type = ntohs(hdr->type);
+	hdr->room = ntohs(hdr->room);
+}
+
+/* Insist until all of the data has been written */
+ssize_t insist_write(int fd, const void *buf, size_t cnt)
+{
+	ssize_t ret;
+	size_t orig_cnt = cnt;
+
+	while (cnt > 0) {
+		ret = write(fd, buf, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ret;
+		}
+		buf += ret;
+		cnt -= ret;
+	}
+
+	return orig_cnt;
+}
+
+/* Insist until all of the data has been read, 0 on early EOF */
+ssize_t insist_read(int fd, void *buf, size_t cnt)
+{
+	ssize_t ret;
+	size_t orig_cnt = cnt;
+
+	while (cnt > 0) {
+		ret = read(fd, buf, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ret;
+		}
+		if (ret == 0)
+			return 0;
+		buf += ret;
+		cnt -= ret;
+	}
+
+	return orig_cnt;
+}
+
+int chat_send(int fd, uint16_t type, uint16_t room, const void *payload, uint32_t len)
+{
+	struct chat_hdr hdr = { .len = len, .type = type, .room = room };
+	struct iovec iov[2];
+	size_t total = CHAT_HDR_SIZE + len;
+	ssize_t ret;
+
+	chat_hdr_hton(&hdr);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = CHAT_HDR_SIZE;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+
+	ret = writev(fd, iov, len ? 2 : 1);
+	if (ret < 0)
+		return -1;
+	if ((size_t)ret == total)
+		return 0;
+
+	/* Short write, finish the rest the slow way */
+	if ((size_t)ret < CHAT_HDR_SIZE) {
+		if (insist_write(fd, (char *)&hdr + ret, CHAT_HDR_SIZE - ret) < 0)
+			return -1;
+		ret = CHAT_HDR_SIZE;
+	}
+	ret -= CHAT_HDR_SIZE;
+	if (insist_write(fd, (const char *)payload + ret, len - ret) < 0)
+		return -1;
+
+	return 0;
+}
+
+int chat_recv(int fd, struct chat_hdr *hdr, void *buf, size_t bufsz)
+{
+	ssize_t n;
+
+	n = insist_read(fd, hdr, CHAT_HDR_SIZE);
+	if (n <= 0)
+		return n;
+	chat_hdr_ntoh(hdr);
+
+	if (hdr->len > bufsz) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (hdr->len == 0)
+		return 1;
+
+	n = insist_read(fd, buf, hdr->len);
+	if (n <= 0) {
+		if (n == 0)
+			errno = ECONNRESET;
+		return -1;
+	}
+	return 1;
+}
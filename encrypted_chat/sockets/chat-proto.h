@@ -0,0 +1,86 @@
+/*
+ * chat-proto.h
+ *
+ * Wire format shared by the chat server, client and tools.
+ *
+ * Every message is a fixed header followed by len bytes of payload.
+ * Header fields are in network byte order. The server never looks
+ * inside CHAT_MSG_TEXT payloads: they are encrypted by the clients.
+ */
+
+#ifndef _CHAT_PROTO_H
+#define _CHAT_PROTO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CHAT_MAX_PAYLOAD	(64 * 1024)
+
+/* Message types */
+#define CHAT_MSG_TEXT	1	/* encrypted chat message, relayed to the room */
+#define CHAT_MSG_NOTICE	2	/* plaintext notice from the server */
+#define CHAT_MSG_JOIN	3	/* switch the sender to room hdr.room */
+#define CHAT_MSG_PING	4	/* heartbeat, answered with CHAT_MSG_PONG */
+#define CHAT_MSG_PONG	5
+#define CHAT_MSG_HISTORY 6	/* ask for the history of the sender's room */
+#define CHAT_MSG_HELLO	7	/* the sender's name, to be kept messages while away */
+#define CHAT_MSG_TERMS	8	/* search terms of the sender's last message */
+#define CHAT_MSG_SEARCH	9	/* search the history of the sender's room */
+
+/* Rooms */
+#define CHAT_ROOM_LOBBY	0
+#define CHAT_ROOM_ECHO	0xffff	/* messages are reflected back to the sender */
+
+struct chat_hdr {
+	uint32_t len;
+	uint16_t type;
+	uint16_t room;
+} __attribute__((packed));
+
+#define CHAT_HDR_SIZE	sizeof(struct chat_hdr)
+
+/*
+ * CHAT_MSG_HISTORY payload. The server answers with the stored
+ * CHAT_MSG_TEXT frames, oldest first: those sent since since_ms (wall
+ * clock), or the last max if since_ms is 0. max 0 means the server's limit.
+ */
+struct chat_history_req {
+	uint64_t since_ms;
+	uint32_t max;
+} __attribute__((packed));
+
+/*
+ * Search terms are 32-bit tokens the clients derive from the words
+ * with their key, in network byte order. CHAT_MSG_TERMS carries
+ * one per word of the CHAT_MSG_TEXT just sent, in order.
+ *
+ * CHAT_MSG_SEARCH payload, followed by the tokens looked for. The
+ * server answers with the last max stored CHAT_MSG_TEXT frames holding
+ * all of them, or them in a row if CHAT_SEARCH_PHRASE, oldest first,
+ * then a CHAT_MSG_NOTICE with the count. max 0 means the server's limit.
+ */
+struct chat_search_req {
+	uint32_t max;
+	uint32_t flags;
+} __attribute__((packed));
+
+#define CHAT_SEARCH_PHRASE	0x1
+
+/* Convert a header between host and network byte order (in place) */
+void chat_hdr_hton(struct chat_hdr *hdr);
+void chat_hdr_ntoh(struct chat_hdr *hdr);
+
+/* Insist until all of the data has been written / read */
+ssize_t insist_write(int fd, const void *buf, size_t cnt);
+ssize_t insist_read(int fd, void *buf, size_t cnt);
+
+/* Send one message with a single writev(). Returns 0 or -1. */
+int chat_send(int fd, uint16_t type, uint16_t room, const void *payload, uint32_t len);
+
+/*
+ * Receive one message into hdr (host order) and buf, payload length is
+ * hdr->len. Returns 1 on success, 0 on EOF, -1 on error or oversized message.
+ */
+int chat_recv(int fd, struct chat_hdr *hdr, void *buf, size_t bufsz);
+
+#endif /* _CHAT_PROTO_H */
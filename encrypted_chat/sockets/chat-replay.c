@@ -0,0 +1,414 @@
+/*
+ * chat-replay.c
+ *
+ * Replay a traffic trace recorded with socket-server -T against any
+ * server build, at the recorded pace or accelerated, and report the
+ * delivered throughput and the delivery latency distribution.
+ *
+ * Every recorded connection gets its own socket. Messages keep their
+ * recorded size, room and send time; the payload carries the send
+ * timestamp so each delivered copy can be timed at the receiver.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "socket-common.h"
+#include "chat-addr.h"
+#include "chat-proto.h"
+#include "chat-trace.h"
+#include "crypto-provider.h"
+
+#define REPLAY_MAGIC	0x5245504c41594d53ULL
+#define DRAIN_SECS	2
+
+struct replay_stamp {
+	uint64_t magic;
+	uint64_t sent_ns;
+};
+
+struct replay_conn {
+	int fd;
+	int closing;
+	unsigned char *tx;
+	size_t tx_off, tx_len, tx_cap;
+	unsigned char *rx;
+	size_t rx_len;
+};
+
+static struct crypto_ctx crypto, *cryptop;
+static unsigned char iv[BLOCK_SIZE];
+
+static struct replay_conn **conns;	/* indexed by recorded connection id */
+static uint32_t nconns;
+
+static uint64_t *lat;			/* delivery latencies, ns */
+static size_t nlat, lat_cap;
+static uint64_t delivered_bytes;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static struct replay_conn *replay_connect(const char *host, int port)
+{
+	struct replay_conn *rc;
+
+	if (!(rc = calloc(1, sizeof(*rc))) ||
+	    !(rc->rx = malloc(2 * (CHAT_HDR_SIZE + CHAT_MAX_PAYLOAD)))) {
+		perror("malloc");
+		exit(1);
+	}
+	if ((rc->fd = chat_connect(host, port)) < 0)
+		exit(1);
+	fcntl(rc->fd, F_SETFL, fcntl(rc->fd, F_GETFL) | O_NONBLOCK);
+
+	return rc;
+}
+
+static void replay_free(struct replay_conn *rc)
+{
+	close(rc->fd);
+	free(rc->tx);
+	free(rc->rx);
+	free(rc);
+}
+
+/* Append a frame to the connection's transmit buffer */
+static void queue_frame(struct replay_conn *rc, uint16_t type, uint16_t room,
+                        const void *payload, uint32_t len)
+{
+	struct chat_hdr hdr = { .len = len, .type = type, .room = room };
+	size_t need = CHAT_HDR_SIZE + len;
+
+	if (rc->tx_off == rc->tx_len)
+		rc->tx_off = rc->tx_len = 0;
+	if (rc->tx_len + need > rc->tx_cap) {
+		rc->tx_cap = MAX(rc->tx_cap * 2, rc->tx_len + need);
+		if (!(rc->tx = realloc(rc->tx, rc->tx_cap))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	chat_hdr_hton(&hdr);
+	memcpy(rc->tx + rc->tx_len, &hdr, CHAT_HDR_SIZE);
+	memcpy(rc->tx + rc->tx_len + CHAT_HDR_SIZE, payload, len);
+	rc->tx_len += need;
+}
+
+static void queue_msg(struct replay_conn *rc, const struct trace_rec *rec)
+{
+	static unsigned char plain[CHAT_MAX_PAYLOAD], cipher[CHAT_MAX_PAYLOAD];
+	struct replay_stamp st = { .magic = REPLAY_MAGIC };
+	uint32_t len = rec->len;
+
+	/* Room for the stamp, whole cipher blocks when encrypting */
+	len = MAX(len, sizeof(st));
+	if (cryptop)
+		len = (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	if (len > CHAT_MAX_PAYLOAD)
+		len = CHAT_MAX_PAYLOAD;
+
+	st.sent_ns = now_ns();
+	memcpy(plain, &st, sizeof(st));
+	if (cryptop) {
+		if (crypto_encrypt(cryptop, plain, cipher, len, iv) < 0)
+			exit(1);
+		queue_frame(rc, CHAT_MSG_TEXT, rec->room, cipher, len);
+	} else {
+		queue_frame(rc, CHAT_MSG_TEXT, rec->room, plain, len);
+	}
+}
+
+static void record_latency(uint64_t ns)
+{
+	if (nlat == lat_cap) {
+		lat_cap = lat_cap ? lat_cap * 2 : 65536;
+		if (!(lat = realloc(lat, lat_cap * sizeof(*lat)))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	lat[nlat++] = ns;
+}
+
+static void process_rx(struct replay_conn *rc)
+{
+	static unsigned char plain[BLOCK_SIZE * 2];
+	struct replay_stamp st;
+	struct chat_hdr hdr;
+	size_t off = 0;
+
+	while (rc->rx_len - off >= CHAT_HDR_SIZE) {
+		memcpy(&hdr, rc->rx + off, CHAT_HDR_SIZE);
+		chat_hdr_ntoh(&hdr);
+		if (hdr.len > CHAT_MAX_PAYLOAD || rc->rx_len - off < CHAT_HDR_SIZE + hdr.len)
+			break;
+
+		if (hdr.type == CHAT_MSG_TEXT && hdr.len >= sizeof(st)) {
+			unsigned char *p = rc->rx + off + CHAT_HDR_SIZE;
+
+			/* The stamp lives in the first cipher block */
+			if (cryptop && hdr.len >= BLOCK_SIZE) {
+				crypto_decrypt(cryptop, p, plain, BLOCK_SIZE, iv);
+				p = plain;
+			}
+			memcpy(&st, p, sizeof(st));
+			if (st.magic == REPLAY_MAGIC) {
+				record_latency(now_ns() - st.sent_ns);
+				delivered_bytes += hdr.len;
+			}
+		} else if (hdr.type == CHAT_MSG_PING) {
+			queue_frame(rc, CHAT_MSG_PONG, hdr.room, NULL, 0);
+		}
+		off += CHAT_HDR_SIZE + hdr.len;
+	}
+	memmove(rc->rx, rc->rx + off, rc->rx_len - off);
+	rc->rx_len -= off;
+}
+
+/*
+ * Poll every open connection until deadline (absolute, ns), flushing
+ * transmit buffers and timing received messages.
+ */
+static void pump(uint64_t deadline)
+{
+	static struct pollfd *pfds;
+	static struct replay_conn **map;
+	static uint32_t cap;
+	uint32_t i, n;
+	uint64_t now;
+	ssize_t r;
+	int ready;
+
+	if (cap < nconns) {
+		cap = nconns;
+		pfds = realloc(pfds, cap * sizeof(*pfds));
+		map = realloc(map, cap * sizeof(*map));
+		if (!pfds || !map) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	do {
+		for (i = n = 0; i < nconns; i++) {
+			struct replay_conn *rc = conns[i];
+
+			if (!rc)
+				continue;
+			if (rc->closing && rc->tx_off == rc->tx_len) {
+				replay_free(rc);
+				conns[i] = NULL;
+				continue;
+			}
+			pfds[n].fd = rc->fd;
+			pfds[n].events = POLLIN | (rc->tx_off < rc->tx_len ? POLLOUT : 0);
+			map[n++] = rc;
+		}
+
+		now = now_ns();
+		ready = poll(pfds, n, deadline > now ? (deadline - now + 999999) / 1000000 : 0);
+		if (ready < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+
+		for (i = 0; ready > 0 && i < n; i++) {
+			struct replay_conn *rc = map[i];
+
+			if (pfds[i].revents & POLLOUT) {
+				r = write(rc->fd, rc->tx + rc->tx_off, rc->tx_len - rc->tx_off);
+				if (r > 0)
+					rc->tx_off += r;
+			}
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				r = read(rc->fd, rc->rx + rc->rx_len,
+					 2 * (CHAT_HDR_SIZE + CHAT_MAX_PAYLOAD) - rc->rx_len);
+				if (r > 0) {
+					rc->rx_len += r;
+					process_rx(rc);
+				} else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+					/* Server dropped us, forget pending output */
+					rc->tx_off = rc->tx_len;
+					rc->closing = 1;
+				}
+			}
+		}
+	} while (now_ns() < deadline);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-x speedup] [-c provider] tracefile hostname|vsock:CID port\n"
+			"  -x  replay speed factor (default 1, e.g. 10 for 10x faster)\n"
+			"  -c  encrypt messages with a crypto provider (default: none)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct chat_trace tr;
+	struct trace_rec rec, *recs = NULL;
+	size_t nrecs = 0, recs_cap = 0, i;
+	uint64_t start, due, expected = 0, msgs = 0, max_slip = 0, end;
+	double speed = 1.0, secs;
+	const char *provider = NULL;
+	unsigned char key[KEY_SIZE];
+	union chat_sockaddr sa;
+	const char *host;
+	int opt, ret, port;
+
+	while ((opt = getopt(argc, argv, "x:c:h")) != -1) {
+		switch (opt) {
+		case 'x':
+			speed = atof(optarg);
+			break;
+		case 'c':
+			provider = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 3 || speed <= 0)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Load the whole trace up front, so reading it does not skew timing */
+	if (trace_open(&tr, argv[optind]) < 0)
+		exit(1);
+	while ((ret = trace_read(&tr, &rec)) > 0) {
+		if (nrecs == recs_cap) {
+			recs_cap = recs_cap ? recs_cap * 2 : 4096;
+			if (!(recs = realloc(recs, recs_cap * sizeof(*recs)))) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		recs[nrecs++] = rec;
+		if (rec.conn >= nconns)
+			nconns = rec.conn + 1;
+	}
+	trace_close(&tr);
+	if (ret < 0)
+		fprintf(stderr, "Warning: trace is truncated after %zu records\n", nrecs);
+	if (!(conns = calloc(nconns ? nconns : 1, sizeof(*conns)))) {
+		perror("calloc");
+		exit(1);
+	}
+
+	/* Fail early on a bad address rather than at the first connection */
+	host = argv[optind + 1];
+	port = atoi(argv[optind + 2]);
+	if (chat_addr_resolve(host, port, &sa) < 0)
+		exit(1);
+
+	if (provider) {
+		sprintf((char *)key, "mariamarkosbffe");
+		sprintf((char *)iv, "mariamarkosbffe");
+		if (crypto_open(&crypto, provider, key, KEY_SIZE) < 0)
+			exit(1);
+		cryptop = &crypto;
+	}
+
+	fprintf(stderr, "Replaying %zu records over %u connections at %.1fx\n",
+		nrecs, nconns, speed);
+
+	start = now_ns();
+	for (i = 0; i < nrecs; i++) {
+		struct replay_conn *rc;
+
+		due = start + (uint64_t)(recs[i].t_us * 1000 / speed);
+		if (due > now_ns())
+			pump(due);
+		else if (now_ns() - due > max_slip)
+			max_slip = now_ns() - due;
+
+		rc = conns[recs[i].conn];
+		switch (recs[i].type) {
+		case TRACE_CONNECT:
+			if (!rc)
+				conns[recs[i].conn] = replay_connect(host, port);
+			break;
+		case TRACE_JOIN:
+			if (rc)
+				queue_frame(rc, CHAT_MSG_JOIN, recs[i].room, NULL, 0);
+			break;
+		case TRACE_MSG:
+			if (!rc)
+				rc = conns[recs[i].conn] = replay_connect(host, port);
+			queue_msg(rc, &recs[i]);
+			expected += recs[i].fanout;
+			msgs++;
+			break;
+		case TRACE_DISCONNECT:
+			if (rc)
+				rc->closing = 1;
+			break;
+		}
+	}
+	end = now_ns();
+
+	/* Let in-flight messages arrive */
+	while (nlat < expected) {
+		size_t before = nlat;
+
+		pump(now_ns() + DRAIN_SECS * 1000000000ULL / 10);
+		if (nlat == before && now_ns() - end > DRAIN_SECS * 1000000000ULL)
+			break;
+		if (nlat != before)
+			end = now_ns();
+	}
+	secs = (end - start) / 1e9;
+
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+#define PCT(p) (nlat ? lat[(size_t)((nlat - 1) * (p))] / 1000.0 : 0.0)
+	printf("messages=%llu expected_deliveries=%llu delivered=%zu (%.1f%%) secs=%.3f\n",
+	       (unsigned long long)msgs, (unsigned long long)expected, nlat,
+	       expected ? 100.0 * nlat / expected : 100.0, secs);
+	printf("throughput: %.0f deliveries/s %.2f MiB/s, max send lag %.1f ms\n",
+	       nlat / secs, delivered_bytes / secs / (1024 * 1024), max_slip / 1e6);
+	printf("latency_us: p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+	       PCT(0.50), PCT(0.90), PCT(0.99), PCT(0.999), PCT(1.0));
+#undef PCT
+
+	for (i = 0; i < nconns; i++)
+		if (conns[i])
+			replay_free(conns[i]);
+	if (cryptop)
+		crypto_close(cryptop);
+	free(conns);
+	free(recs);
+	free(lat);
+
+	return 0;
+}
@@ -0,0 +1,1028 @@
+/*
+ * chat-search.c
+ *
+ * Per-room inverted index over the history, in blocks of messages.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "chat-history.h"
+#include "chat-search.h"
+
+#define IDX_MAGIC	"CHIX"
+#define IDX_VERSION	1
+
+struct idx_hdr {
+	char magic[4];
+	uint16_t version;
+	uint16_t room;
+	uint64_t base_seq;
+	uint32_t nterms;
+	uint32_t count;			/* messages indexed */
+	uint8_t reserved[40];
+};
+
+/* The terms of an .idx file, sorted */
+struct idx_term {
+	uint32_t term;
+	uint32_t count;			/* messages it is in */
+	uint32_t off;			/* of its posting list in the file */
+	uint32_t len;
+};
+
+/* The terms of a message, in a .tok file or queued */
+struct tok_rec {
+	uint64_t seq;
+	uint32_t n;
+	uint32_t reserved;
+	uint32_t terms[];
+};
+
+/* A block written out */
+struct block {
+	uint64_t base;
+	unsigned char *map;
+	size_t map_len;
+	const struct idx_term *dict;
+	uint32_t nterms;
+};
+
+/* A term of the block being filled, same encoding as in the file */
+struct posting {
+	uint32_t term;
+	uint32_t count;
+	uint32_t last;			/* sequence number of the last message, in the block */
+	uint32_t len, cap;
+	unsigned char *buf;		/* NULL if the slot is free */
+};
+
+/* Owned by the indexing thread */
+struct room_idx {
+	uint16_t room;
+	uint8_t active;			/* a block is being filled */
+	struct block *blocks;		/* written out, oldest first */
+	unsigned int nblocks, cap;
+
+	uint64_t base;			/* of the block being filled */
+	uint32_t count;
+	struct posting *tab;		/* open addressing */
+	uint32_t tab_size, nterms;
+	int tok_fd;
+
+	uint64_t next_seq;		/* lower ones are already indexed */
+	uint64_t first;			/* oldest message left in the history */
+};
+
+/* Terms queued by the relay thread until search_flush() */
+struct pend {
+	unsigned char *buf;		/* struct tok_rec */
+	size_t len, cap;
+	uint8_t dirty;
+};
+
+/* Work for the indexing thread: terms to index, or a query */
+struct job {
+	struct job *next;
+	uint16_t room;
+	uint8_t query;
+	uint64_t first;
+	unsigned char *recs;
+	size_t len;
+
+	uint32_t terms[SEARCH_QUERY_TERMS];
+	unsigned int n;
+	int phrase;
+	uint32_t max, found;
+	uint64_t *seqs;			/* the matches, newest first */
+	uint64_t cookie;
+};
+
+/* A decoded posting list */
+struct plist {
+	uint32_t n;
+	uint32_t *seq;			/* in the block */
+	uint32_t *poff;			/* positions of message i are pos[poff[i]..poff[i + 1]) */
+	uint32_t *pos;
+	uint32_t npos, pos_cap;
+};
+
+static struct room_idx *rooms[UINT16_MAX + 1];
+static char *idx_dir;
+
+/* The relay thread's side */
+static struct pend *pends[UINT16_MAX + 1];
+static uint16_t *dirty;
+static uint32_t ndirty, dirty_cap;
+static uint32_t running;		/* queries not reaped yet */
+
+static pthread_t indexer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static struct job *jobs, **jobs_tail = &jobs;
+static struct job *done, **done_tail = &done;
+static int stopping;
+
+static size_t tok_size(uint32_t n)
+{
+	return sizeof(struct tok_rec) + n * sizeof(uint32_t);
+}
+
+static void blk_path(char *buf, size_t sz, uint16_t room, uint64_t base, const char *ext)
+{
+	snprintf(buf, sz, "%s/%05u/%020llu.%s", idx_dir, room, (unsigned long long)base, ext);
+}
+
+static size_t varint_put(unsigned char *p, uint32_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static int varint_get(const unsigned char **p, const unsigned char *end, uint32_t *v)
+{
+	uint32_t x = 0;
+	unsigned int shift;
+
+	for (shift = 0; *p < end && shift < 35; shift += 7) {
+		x |= (uint32_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			*v = x;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static uint32_t term_hash(uint32_t term, uint32_t size)
+{
+	return (term * 2654435761U) & (size - 1);
+}
+
+static int tab_grow(struct room_idx *r)
+{
+	struct posting *tab, *old = r->tab;
+	uint32_t size = r->tab_size ? r->tab_size * 2 : 1024, i, h;
+
+	if (!(tab = calloc(size, sizeof(*tab))))
+		return -1;
+	for (i = 0; i < r->tab_size; i++) {
+		if (!old[i].buf)
+			continue;
+		for (h = term_hash(old[i].term, size); tab[h].buf; h = (h + 1) & (size - 1))
+			;
+		tab[h] = old[i];
+	}
+	free(old);
+	r->tab = tab;
+	r->tab_size = size;
+	return 0;
+}
+
+/* The posting list of term in the block being filled, NULL if none and !create */
+static struct posting *tab_find(struct room_idx *r, uint32_t term, int create)
+{
+	struct posting *pe;
+	uint32_t h;
+
+	if (create && (r->nterms + 1) * 4 > r->tab_size * 3 && tab_grow(r) < 0)
+		return NULL;
+	if (!r->tab_size)
+		return NULL;
+	for (h = term_hash(term, r->tab_size); r->tab[h].buf; h = (h + 1) & (r->tab_size - 1))
+		if (r->tab[h].term == term)
+			return &r->tab[h];
+	if (!create)
+		return NULL;
+	pe = &r->tab[h];
+	if (!(pe->buf = malloc(16)))
+		return NULL;
+	pe->term = term;
+	pe->cap = 16;
+	r->nterms++;
+	return pe;
+}
+
+/* Add message seq, with the term at positions pos, to a posting list */
+static int posting_add(struct posting *pe, uint32_t seq, const uint32_t *pos, uint32_t npos)
+{
+	size_t need = pe->len + 5 * (2 + (size_t)npos);
+	unsigned char *buf;
+	uint32_t i, cap;
+
+	if (need > pe->cap) {
+		for (cap = pe->cap; cap < need; cap *= 2)
+			;
+		if (!(buf = realloc(pe->buf, cap)))
+			return -1;
+		pe->buf = buf;
+		pe->cap = cap;
+	}
+	pe->len += varint_put(pe->buf + pe->len, pe->count ? seq - pe->last : seq);
+	pe->len += varint_put(pe->buf + pe->len, npos);
+	for (i = 0; i < npos; i++)
+		pe->len += varint_put(pe->buf + pe->len, i ? pos[i] - pos[i - 1] : pos[i]);
+	pe->last = seq;
+	pe->count++;
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Add a message to the block being filled. Without memory some of its terms are lost. */
+static void index_msg(struct room_idx *r, uint32_t seq, const uint32_t *terms, uint32_t n)
+{
+	static uint64_t pairs[SEARCH_MSG_TERMS];
+	static uint32_t pos[SEARCH_MSG_TERMS];
+	struct posting *pe;
+	uint32_t i, j, k;
+
+	/* Group the positions of each term */
+	for (i = 0; i < n; i++)
+		pairs[i] = (uint64_t)terms[i] << 32 | i;
+	qsort(pairs, n, sizeof(*pairs), cmp_u64);
+	for (i = 0; i < n; i = j) {
+		for (j = i, k = 0; j < n && pairs[j] >> 32 == pairs[i] >> 32; j++)
+			pos[k++] = (uint32_t)pairs[j];
+		if (!(pe = tab_find(r, pairs[i] >> 32, 1)) || posting_add(pe, seq, pos, k) < 0)
+			fprintf(stderr, "search: out of memory, room %u message %llu not fully indexed\n",
+				r->room, (unsigned long long)(r->base + seq));
+	}
+	r->count++;
+}
+
+static void active_free(struct room_idx *r)
+{
+	uint32_t i;
+
+	for (i = 0; i < r->tab_size; i++)
+		free(r->tab[i].buf);
+	free(r->tab);
+	r->tab = NULL;
+	r->tab_size = r->nterms = r->count = 0;
+	if (r->tok_fd >= 0)
+		close(r->tok_fd);
+	r->tok_fd = -1;
+	r->active = 0;
+}
+
+static int cmp_posting(const void *a, const void *b)
+{
+	uint32_t x = ((const struct posting *)a)->term, y = ((const struct posting *)b)->term;
+
+	return (x > y) - (x < y);
+}
+
+static int block_grow(struct room_idx *r)
+{
+	struct block *blocks;
+	unsigned int cap;
+
+	if (r->nblocks < r->cap)
+		return 0;
+	cap = r->cap ? r->cap * 2 : 8;
+	if (!(blocks = realloc(r->blocks, cap * sizeof(*blocks))))
+		return -1;
+	r->blocks = blocks;
+	r->cap = cap;
+	return 0;
+}
+
+/* Map the .idx file of a block */
+static int block_load(uint16_t room, uint64_t base, struct block *b)
+{
+	const struct idx_hdr *hdr;
+	char path[4096];
+	struct stat st;
+	int fd;
+
+	blk_path(path, sizeof(path), room, base, "idx");
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "search: %s is too short, skipped\n", path);
+		close(fd);
+		return -1;
+	}
+	b->map_len = st.st_size;
+	b->map = mmap(NULL, b->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (b->map == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	hdr = (const struct idx_hdr *)b->map;
+	if (memcmp(hdr->magic, IDX_MAGIC, 4) || hdr->version != IDX_VERSION ||
+	    hdr->room != room || hdr->base_seq != base ||
+	    hdr->nterms > (b->map_len - sizeof(*hdr)) / sizeof(struct idx_term)) {
+		fprintf(stderr, "search: %s is not an index block, skipped\n", path);
+		munmap(b->map, b->map_len);
+		return -1;
+	}
+	b->base = base;
+	b->nterms = hdr->nterms;
+	b->dict = (const struct idx_term *)(b->map + sizeof(*hdr));
+	return 0;
+}
+
+static void block_drop_oldest(struct room_idx *r)
+{
+	char path[4096];
+
+	blk_path(path, sizeof(path), r->room, r->blocks[0].base, "idx");
+	munmap(r->blocks[0].map, r->blocks[0].map_len);
+	if (unlink(path) < 0)
+		perror(path);
+	memmove(r->blocks, r->blocks + 1, --r->nblocks * sizeof(*r->blocks));
+}
+
+/* Drop the blocks whose messages are all gone from the history */
+static void room_expire(struct room_idx *r)
+{
+	while (r->nblocks && r->blocks[0].base + SEARCH_BLOCK_MSGS <= r->first)
+		block_drop_oldest(r);
+}
+
+/* Write the block being filled out as an .idx file, it is searched from there on */
+static void seal(struct room_idx *r)
+{
+	struct idx_term *dict = NULL;
+	struct posting *terms = NULL;
+	struct idx_hdr hdr;
+	char path[4096], tmp[4096];
+	uint32_t i, n = 0;
+	size_t off;
+	FILE *fp;
+
+	blk_path(path, sizeof(path), r->room, r->base, "idx");
+	blk_path(tmp, sizeof(tmp), r->room, r->base, "idx.tmp");
+	if (block_grow(r) < 0 ||
+	    !(terms = malloc((r->nterms + 1) * sizeof(*terms))) ||
+	    !(dict = malloc((r->nterms + 1) * sizeof(*dict)))) {
+		fprintf(stderr, "search: out of memory, room %u stays in its .tok file\n", r->room);
+		goto out;
+	}
+	for (i = 0; i < r->tab_size; i++)
+		if (r->tab[i].buf && r->tab[i].count)
+			terms[n++] = r->tab[i];
+	qsort(terms, n, sizeof(*terms), cmp_posting);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IDX_MAGIC, 4);
+	hdr.version = IDX_VERSION;
+	hdr.room = r->room;
+	hdr.base_seq = r->base;
+	hdr.nterms = n;
+	hdr.count = r->count;
+	off = sizeof(hdr) + n * sizeof(*dict);
+	for (i = 0; i < n; i++) {
+		if (off + terms[i].len > UINT32_MAX) {
+			fprintf(stderr, "search: room %u block too large, stays in its .tok file\n", r->room);
+			goto out;
+		}
+		dict[i].term = terms[i].term;
+		dict[i].count = terms[i].count;
+		dict[i].off = off;
+		dict[i].len = terms[i].len;
+		off += terms[i].len;
+	}
+
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		goto out;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(dict, sizeof(*dict), n, fp);
+	for (i = 0; i < n; i++)
+		fwrite(terms[i].buf, 1, terms[i].len, fp);
+	if (fflush(fp) == EOF || ferror(fp) || fsync(fileno(fp)) < 0) {
+		perror(tmp);
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+	fclose(fp);
+	if (rename(tmp, path) < 0) {
+		perror(path);
+		unlink(tmp);
+		goto out;
+	}
+	blk_path(path, sizeof(path), r->room, r->base, "tok");
+	unlink(path);
+	if (block_load(r->room, r->base, &r->blocks[r->nblocks]) == 0)
+		r->nblocks++;
+	room_expire(r);
+out:
+	free(terms);
+	free(dict);
+	active_free(r);
+}
+
+/* Start filling the block at base */
+static void activate(struct room_idx *r, uint64_t base)
+{
+	char path[4096];
+
+	r->base = base;
+	r->active = 1;
+	blk_path(path, sizeof(path), r->room, base, "tok");
+	if ((r->tok_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+		perror(path);
+}
+
+static void write_tok(struct room_idx *r, const unsigned char *p, size_t len)
+{
+	ssize_t n;
+
+	while (len && r->tok_fd >= 0) {
+		if ((n = write(r->tok_fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("search: write");
+			close(r->tok_fd);
+			r->tok_fd = -1;	/* indexed in memory only, until the block is sealed */
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/* Index queued records, writing each block's to its .tok file unless replaying it */
+static void index_recs(struct room_idx *r, const unsigned char *p, size_t len, int log)
+{
+	const unsigned char *run = p, *end = p + len;
+	const struct tok_rec *rec;
+	uint64_t base;
+
+	while (p < end) {
+		rec = (const struct tok_rec *)p;
+		if (log && rec->seq < r->next_seq) {
+			/* Indexed already, left out of the .tok as well */
+			write_tok(r, run, p - run);
+			p += tok_size(rec->n);
+			run = p;
+			continue;
+		}
+		if (log)
+			r->next_seq = rec->seq + 1;
+		base = rec->seq - rec->seq % SEARCH_BLOCK_MSGS;
+		if (r->active && base != r->base) {
+			if (log)
+				write_tok(r, run, p - run);
+			run = p;
+			seal(r);
+		}
+		if (!r->active)
+			activate(r, base);
+		index_msg(r, rec->seq - base, rec->terms, rec->n);
+		p += tok_size(rec->n);
+	}
+	if (log)
+		write_tok(r, run, p - run);
+}
+
+/* Rebuild the block being filled from its .tok file */
+static void tok_replay(struct room_idx *r, uint64_t base)
+{
+	const struct tok_rec *rec;
+	unsigned char *map;
+	char path[4096];
+	size_t off = 0;
+	struct stat st;
+	int fd;
+
+	blk_path(path, sizeof(path), r->room, base, "tok");
+	if ((fd = open(path, O_RDWR)) < 0) {
+		perror(path);
+		return;
+	}
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(path);
+		close(fd);
+		return;
+	}
+	/* Whole records of this block, a torn one at the end is cut off */
+	while (off + sizeof(*rec) <= (size_t)st.st_size) {
+		rec = (const struct tok_rec *)(map + off);
+		if (rec->n > SEARCH_MSG_TERMS || tok_size(rec->n) > st.st_size - off ||
+		    rec->seq < base || rec->seq - base >= SEARCH_BLOCK_MSGS || rec->seq < r->next_seq)
+			break;
+		r->next_seq = rec->seq + 1;
+		off += tok_size(rec->n);
+	}
+	if (off < (size_t)st.st_size && ftruncate(fd, off) < 0)
+		perror(path);
+	close(fd);
+	if (off) {
+		activate(r, base);
+		index_recs(r, map, off, 0);
+	}
+	munmap(map, st.st_size);
+}
+
+static int cmp_block(const void *a, const void *b)
+{
+	return cmp_u64(&((const struct block *)a)->base, &((const struct block *)b)->base);
+}
+
+/* Pick up the index of a room left by an earlier run */
+static int room_load(struct room_idx *r)
+{
+	uint64_t *bases = NULL, *b, base;
+	size_t nbases = 0, cap = 0, i;
+	char path[4096], *end;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%05u", idx_dir, r->room);
+	if (!(d = opendir(path)))
+		return errno == ENOENT ? 0 : -1;
+	while ((de = readdir(d))) {
+		base = strtoull(de->d_name, &end, 10);
+		if (end == de->d_name || (strcmp(end, ".idx") && strcmp(end, ".tok")))
+			continue;
+		if (!strcmp(end, ".idx")) {
+			if (block_grow(r) == 0 && block_load(r->room, base, &r->blocks[r->nblocks]) == 0)
+				r->nblocks++;
+			continue;
+		}
+		if (nbases == cap) {
+			cap = cap ? cap * 2 : 4;
+			if (!(b = realloc(bases, cap * sizeof(*b)))) {
+				closedir(d);
+				free(bases);
+				return -1;
+			}
+			bases = b;
+		}
+		bases[nbases++] = base;
+	}
+	closedir(d);
+	qsort(r->blocks, r->nblocks, sizeof(*r->blocks), cmp_block);
+	if (r->nblocks)
+		r->next_seq = r->blocks[r->nblocks - 1].base + SEARCH_BLOCK_MSGS;
+
+	/* Normally the block being filled. Older ones were left by a crash while sealing. */
+	qsort(bases, nbases, sizeof(*bases), cmp_u64);
+	for (i = 0; i < nbases; i++) {
+		blk_path(path, sizeof(path), r->room, bases[i], "idx");
+		if (stat(path, &st) == 0) {
+			blk_path(path, sizeof(path), r->room, bases[i], "tok");
+			unlink(path);
+			continue;
+		}
+		if (r->active)
+			seal(r);
+		tok_replay(r, bases[i]);
+	}
+	free(bases);
+	room_expire(r);
+	return 0;
+}
+
+/* A room's index, loaded on first use. NULL if there is none and !create. */
+static struct room_idx *room_get(uint16_t room, int create, uint64_t first)
+{
+	struct room_idx *r;
+	char path[4096];
+	struct stat st;
+
+	if ((r = rooms[room])) {
+		r->first = first;
+		return r;
+	}
+	snprintf(path, sizeof(path), "%s/%05u", idx_dir, room);
+	if (stat(path, &st) < 0) {
+		if (!create)
+			return NULL;
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			perror(path);
+			return NULL;
+		}
+	}
+	if (!(r = calloc(1, sizeof(*r))))
+		return NULL;
+	r->room = room;
+	r->tok_fd = -1;
+	r->first = first;
+	if (room_load(r) < 0) {
+		fprintf(stderr, "search: could not load room %u\n", room);
+		active_free(r);
+		free(r->blocks);
+		free(r);
+		return NULL;
+	}
+	return rooms[room] = r;
+}
+
+static void plist_free(struct plist *pl)
+{
+	free(pl->seq);
+	free(pl->poff);
+	free(pl->pos);
+	memset(pl, 0, sizeof(*pl));
+}
+
+/* Decode a posting list of count messages. -1 if it is corrupt or out of memory. */
+static int plist_decode(const unsigned char *p, size_t len, uint32_t count, struct plist *pl)
+{
+	const unsigned char *end = p + len;
+	uint32_t i, j, v, npos, seq = 0, at, *pos;
+
+	memset(pl, 0, sizeof(*pl));
+	if (!(pl->seq = malloc((count + 1) * sizeof(uint32_t))) ||
+	    !(pl->poff = malloc((count + 1) * sizeof(uint32_t))))
+		goto fail;
+	for (i = 0; i < count; i++) {
+		if (varint_get(&p, end, &v) < 0 || varint_get(&p, end, &npos) < 0 ||
+		    npos > SEARCH_MSG_TERMS)
+			goto fail;
+		seq = i ? seq + v : v;
+		pl->seq[i] = seq;
+		pl->poff[i] = pl->npos;
+		if (pl->npos + npos > pl->pos_cap) {
+			pl->pos_cap = (pl->pos_cap + npos) * 2;
+			if (!(pos = realloc(pl->pos, pl->pos_cap * sizeof(*pos))))
+				goto fail;
+			pl->pos = pos;
+		}
+		for (j = 0, at = 0; j < npos; j++) {
+			if (varint_get(&p, end, &v) < 0)
+				goto fail;
+			at = j ? at + v : v;
+			pl->pos[pl->npos++] = at;
+		}
+	}
+	pl->poff[count] = pl->npos;
+	pl->n = count;
+	return 0;
+fail:
+	plist_free(pl);
+	return -1;
+}
+
+/* Index of message seq in a posting list, -1 if the term is not in it */
+static int64_t plist_find(const struct plist *pl, uint32_t seq)
+{
+	uint32_t lo = 0, hi = pl->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pl->seq[mid] < seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < pl->n && pl->seq[lo] == seq ? (int64_t)lo : -1;
+}
+
+static int has_pos(const struct plist *pl, uint32_t i, uint32_t at)
+{
+	uint32_t j;
+
+	for (j = pl->poff[i]; j < pl->poff[i + 1] && pl->pos[j] <= at; j++)
+		if (pl->pos[j] == at)
+			return 1;
+	return 0;
+}
+
+/* The posting list of term in block b, the one being filled if b is NULL. 0 if none. */
+static int block_term(struct room_idx *r, const struct block *b, uint32_t term,
+                      struct plist *pl)
+{
+	const struct posting *pe;
+	uint32_t lo, hi, mid;
+
+	if (!b) {
+		if (!(pe = tab_find(r, term, 0)) || !pe->count)
+			return 0;
+		return plist_decode(pe->buf, pe->len, pe->count, pl) == 0;
+	}
+	for (lo = 0, hi = b->nterms; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (b->dict[mid].term < term)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == b->nterms || b->dict[lo].term != term ||
+	    (size_t)b->dict[lo].off + b->dict[lo].len > b->map_len)
+		return 0;
+	return plist_decode(b->map + b->dict[lo].off, b->dict[lo].len, b->dict[lo].count, pl) == 0;
+}
+
+/* Matches in one block, newest first, appended to seqs up to max */
+static uint32_t block_query(struct room_idx *r, const struct block *b, const uint32_t *terms,
+                            unsigned int n, int phrase, uint64_t *seqs, uint32_t found,
+                            uint32_t max)
+{
+	struct plist pl[SEARCH_QUERY_TERMS] = { { 0 } };
+	int64_t at[SEARCH_QUERY_TERMS];
+	unsigned int i, k, d = 0;
+	uint32_t j, p, seq;
+	int match;
+
+	for (k = 0; k < n; k++)
+		if (!block_term(r, b, terms[k], &pl[k]))
+			goto out;
+	/* The rarest term leads, the others are looked up */
+	for (k = 1; k < n; k++)
+		if (pl[k].n < pl[d].n)
+			d = k;
+	for (j = pl[d].n; j-- > 0 && found < max; ) {
+		seq = pl[d].seq[j];
+		for (i = 0, match = 1; i < n && match; i++)
+			match = (at[i] = i == d ? j : plist_find(&pl[i], seq)) >= 0;
+		if (match && phrase) {
+			match = 0;
+			for (p = pl[0].poff[at[0]]; p < pl[0].poff[at[0] + 1] && !match; p++)
+				for (i = 1, match = 1; i < n && match; i++)
+					match = has_pos(&pl[i], at[i], pl[0].pos[p] + i);
+		}
+		if (match)
+			seqs[found++] = (b ? b->base : r->base) + seq;
+	}
+out:
+	while (k-- > 0)
+		plist_free(&pl[k]);
+	return found;
+}
+
+/* Runs on the indexing thread, the matches are left in the job */
+static void run_query(struct job *j)
+{
+	struct room_idx *r;
+	unsigned int b;
+
+	if (!j->n || !j->max || !(r = room_get(j->room, 0, j->first)))
+		return;
+	if (!(j->seqs = malloc(j->max * sizeof(*j->seqs))))
+		return;
+	if (r->active)
+		j->found = block_query(r, NULL, j->terms, j->n, j->phrase, j->seqs, 0, j->max);
+	for (b = r->nblocks; b-- > 0 && j->found < j->max; )
+		j->found = block_query(r, &r->blocks[b], j->terms, j->n, j->phrase,
+				       j->seqs, j->found, j->max);
+}
+
+static void *index_thread(void *arg)
+{
+	struct sched_param sp = { 0 };
+	struct room_idx *r;
+	struct job *j;
+
+	(void)arg;
+	/* Waking up for a batch must not preempt the relaying */
+	if (sched_setscheduler(0, SCHED_BATCH, &sp) < 0)
+		perror("search: sched_setscheduler");
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!jobs && !stopping)
+			pthread_cond_wait(&wake, &lock);
+		if (!(j = jobs))
+			break;			/* stopping, and nothing is left */
+		if (!(jobs = j->next))
+			jobs_tail = &jobs;
+		pthread_mutex_unlock(&lock);
+
+		if (j->query) {
+			run_query(j);
+		} else {
+			if ((r = room_get(j->room, 1, j->first)))
+				index_recs(r, j->recs, j->len, 1);
+			free(j->recs);
+		}
+
+		pthread_mutex_lock(&lock);
+		if (j->query) {
+			j->next = NULL;
+			*done_tail = j;
+			done_tail = &j->next;
+		} else {
+			free(j);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/* Hand a chain of jobs to the indexing thread */
+static void queue_jobs(struct job *first, struct job **last)
+{
+	pthread_mutex_lock(&lock);
+	*jobs_tail = first;
+	jobs_tail = last;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+}
+
+int search_init(const char *dir)
+{
+	int err;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		perror(dir);
+		return -1;
+	}
+	if (!(idx_dir = strdup(dir)))
+		return -1;
+	if ((err = pthread_create(&indexer, NULL, index_thread, NULL))) {
+		fprintf(stderr, "search: pthread_create: %s\n", strerror(err));
+		free(idx_dir);
+		idx_dir = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void search_fini(void)
+{
+	struct room_idx *r;
+	struct job *j;
+	unsigned int i, b;
+
+	if (!idx_dir)
+		return;
+	search_flush();
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+	pthread_join(indexer, NULL);
+	stopping = 0;
+
+	while ((j = done)) {
+		done = j->next;
+		free(j->seqs);
+		free(j);
+	}
+	done_tail = &done;
+	running = 0;
+	for (i = 0; i <= UINT16_MAX; i++) {
+		if ((r = rooms[i])) {
+			active_free(r);
+			for (b = 0; b < r->nblocks; b++)
+				munmap(r->blocks[b].map, r->blocks[b].map_len);
+			free(r->blocks);
+			free(r);
+			rooms[i] = NULL;
+		}
+		if (pends[i]) {
+			free(pends[i]->buf);
+			free(pends[i]);
+			pends[i] = NULL;
+		}
+	}
+	free(dirty);
+	dirty = NULL;
+	ndirty = dirty_cap = 0;
+	free(idx_dir);
+	idx_dir = NULL;
+}
+
+int search_add(uint16_t room, uint64_t seq, const uint32_t *terms, uint32_t n)
+{
+	struct tok_rec *rec;
+	struct pend *pd;
+	unsigned char *buf;
+	uint16_t *d;
+	size_t need, cap;
+
+	if (!n)
+		return 0;
+	if (n > SEARCH_MSG_TERMS)
+		n = SEARCH_MSG_TERMS;
+	if (!(pd = pends[room]) && !(pd = pends[room] = calloc(1, sizeof(*pd))))
+		return -1;
+	if (!pd->dirty && ndirty == dirty_cap) {
+		cap = dirty_cap ? dirty_cap * 2 : 64;
+		if (!(d = realloc(dirty, cap * sizeof(*d))))
+			return -1;
+		dirty = d;
+		dirty_cap = cap;
+	}
+	need = pd->len + tok_size(n);
+	if (need > pd->cap) {
+		for (cap = pd->cap ? pd->cap : 4096; cap < need; cap *= 2)
+			;
+		if (!(buf = realloc(pd->buf, cap)))
+			return -1;
+		pd->buf = buf;
+		pd->cap = cap;
+	}
+	rec = (struct tok_rec *)(pd->buf + pd->len);
+	rec->seq = seq;
+	rec->n = n;
+	rec->reserved = 0;
+	memcpy(rec->terms, terms, n * sizeof(*terms));
+	pd->len = need;
+	if (!pd->dirty) {
+		pd->dirty = 1;
+		dirty[ndirty++] = room;
+	}
+	return 0;
+}
+
+void search_flush(void)
+{
+	struct job *first = NULL, **last = &first, *j;
+	struct pend *pd;
+	uint32_t i;
+
+	for (i = 0; i < ndirty; i++) {
+		if (!(j = calloc(1, sizeof(*j)))) {
+			/* The rest waits for the next round */
+			memmove(dirty, dirty + i, (ndirty - i) * sizeof(*dirty));
+			break;
+		}
+		pd = pends[dirty[i]];
+		j->room = dirty[i];
+		j->first = history_first(j->room);
+		j->recs = pd->buf;
+		j->len = pd->len;
+		pd->buf = NULL;
+		pd->len = pd->cap = 0;
+		pd->dirty = 0;
+		*last = j;
+		last = &j->next;
+	}
+	ndirty -= i;
+	if (first)
+		queue_jobs(first, last);
+}
+
+int search_query(uint16_t room, const uint32_t *terms, unsigned int n, int phrase,
+		 uint32_t max, uint64_t cookie)
+{
+	struct job *j;
+
+	search_flush();			/* so that this round's messages are found */
+	if (!(j = calloc(1, sizeof(*j))))
+		return -1;
+	j->query = 1;
+	j->room = room;
+	j->first = history_first(room);
+	if (n <= SEARCH_QUERY_TERMS) {	/* or nothing matches */
+		memcpy(j->terms, terms, n * sizeof(*terms));
+		j->n = n;
+	}
+	j->phrase = phrase;
+	j->max = max;
+	j->cookie = cookie;
+	queue_jobs(j, &j->next);
+	running++;
+	return 0;
+}
+
+uint32_t search_reap(search_done_fn fn)
+{
+	struct job *j, *next;
+
+	if (!running)
+		return 0;
+	pthread_mutex_lock(&lock);
+	j = done;
+	done = NULL;
+	done_tail = &done;
+	pthread_mutex_unlock(&lock);
+	for (; j; j = next) {
+		next = j->next;
+		fn(j->cookie, j->room, j->seqs, j->found);
+		free(j->seqs);
+		free(j);
+		running--;
+	}
+	return running;
+}
@@ -0,0 +1,65 @@
+/*
+ * chat-search.h
+ *
+ * Inverted index over the chat history, per room.
+ *
+ * The server cannot read the messages it keeps, so it does not pick
+ * the terms: a client that opts in sends along with each message a
+ * list of 32-bit term tokens, one per word in order, that it derives
+ * from the words with its key (see socket-client.c), and searches with
+ * the tokens of the words it looks for. Tokens are deterministic, so
+ * the server sees which messages share a term and how common each term
+ * is, which is often enough to guess the words.
+ *
+ * A room's index is cut into blocks of SEARCH_BLOCK_MSGS history
+ * sequence numbers, kept next to the history segments. The block being
+ * filled lives in memory, as a hash table of posting lists, and its
+ * tokens are appended to a .tok file it is rebuilt from on restart.
+ * A full block is written out as an .idx file: a table of its terms,
+ * sorted, and their posting lists, each message as the delta of its
+ * sequence number and the positions of the term in it, as varints.
+ * Blocks are dropped once the history has dropped all their messages.
+ *
+ * Tokens are only queued when a message comes in, and search_flush()
+ * hands them, once per round after the relaying is done, to a thread
+ * of their own that indexes them and writes the blocks out. Queries run
+ * on that thread too, their matches are picked up with search_reap().
+ * Files are in host byte order.
+ */
+
+#ifndef _CHAT_SEARCH_H
+#define _CHAT_SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEARCH_BLOCK_MSGS	65536
+#define SEARCH_MSG_TERMS	1024	/* indexed per message, the rest are ignored */
+#define SEARCH_QUERY_TERMS	16
+
+/* Called with the matches of a query, newest first */
+typedef void (*search_done_fn)(uint64_t cookie, uint16_t room, const uint64_t *seqs, uint32_t n);
+
+/* Keep the index under dir, the history's, and start indexing. -1 on error. */
+int search_init(const char *dir);
+/* Index what is queued, stop and free everything, the data stays on disk */
+void search_fini(void);
+
+/* Queue the terms of message seq of room for indexing. -1 on error. */
+int search_add(uint16_t room, uint64_t seq, const uint32_t *terms, uint32_t n);
+
+/* Hand the terms queued so far to the indexing thread */
+void search_flush(void);
+
+/*
+ * Look for the last max messages of room holding all n terms, or the n
+ * terms next to each other and in order if phrase. The matches are
+ * passed to search_reap()'s fn along with cookie. -1 on error.
+ */
+int search_query(uint16_t room, const uint32_t *terms, unsigned int n, int phrase,
+		 uint32_t max, uint64_t cookie);
+
+/* Pass the queries done so far to fn. Returns how many are still running. */
+uint32_t search_reap(search_done_fn fn);
+
+#endif /* _CHAT_SEARCH_H */
@@ -0,0 +1,162 @@
+/*
+ * chat-trace.c
+ *
+ * Writer and reader for chat traffic traces.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "chat-trace.h"
+
+struct trace_file_hdr {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+	uint64_t start_realtime_us;	/* wall clock, informational only */
+} __attribute__((packed));
+
+static uint64_t clock_us(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void put_varint(FILE *fp, uint64_t v)
+{
+	while (v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, fp);
+		v >>= 7;
+	}
+	fputc(v, fp);
+}
+
+static int get_varint(FILE *fp, uint64_t *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		if ((c = fgetc(fp)) == EOF || shift > 63)
+			return -1;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+int trace_create(struct chat_trace *tr, const char *path)
+{
+	struct trace_file_hdr hdr;
+
+	if (!(tr->fp = fopen(path, "wb"))) {
+		perror(path);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHAT_TRACE_MAGIC, 4);
+	hdr.version = CHAT_TRACE_VERSION;
+	hdr.start_realtime_us = clock_us(CLOCK_REALTIME);
+	if (fwrite(&hdr, sizeof(hdr), 1, tr->fp) != 1) {
+		perror(path);
+		fclose(tr->fp);
+		return -1;
+	}
+	tr->start_us = tr->last_us = clock_us(CLOCK_MONOTONIC);
+
+	return 0;
+}
+
+int trace_open(struct chat_trace *tr, const char *path)
+{
+	struct trace_file_hdr hdr;
+
+	if (!(tr->fp = fopen(path, "rb"))) {
+		perror(path);
+		return -1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, tr->fp) != 1 ||
+	    memcmp(hdr.magic, CHAT_TRACE_MAGIC, 4) != 0 ||
+	    hdr.version != CHAT_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a chat trace\n", path);
+		fclose(tr->fp);
+		return -1;
+	}
+	tr->start_us = tr->last_us = 0;
+
+	return 0;
+}
+
+void trace_close(struct chat_trace *tr)
+{
+	if (tr->fp)
+		fclose(tr->fp);
+	tr->fp = NULL;
+}
+
+void trace_write(struct chat_trace *tr, uint8_t type, uint32_t conn,
+                 uint32_t room, uint32_t len, uint32_t fanout)
+{
+	uint64_t now = clock_us(CLOCK_MONOTONIC);
+
+	fputc(type, tr->fp);
+	put_varint(tr->fp, now - tr->last_us);
+	put_varint(tr->fp, conn);
+	tr->last_us = now;
+
+	switch (type) {
+	case TRACE_JOIN:
+		put_varint(tr->fp, room);
+		break;
+	case TRACE_MSG:
+		put_varint(tr->fp, room);
+		put_varint(tr->fp, len);
+		put_varint(tr->fp, fanout);
+		break;
+	}
+}
+
+int trace_read(struct chat_trace *tr, struct trace_rec *rec)
+{
+	uint64_t dt, v[4] = { 0 };
+	int c, i, nfields;
+
+	if ((c = fgetc(tr->fp)) == EOF)
+		return 0;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->type = c;
+	switch (rec->type) {
+	case TRACE_CONNECT:
+	case TRACE_DISCONNECT:
+		nfields = 1;
+		break;
+	case TRACE_JOIN:
+		nfields = 2;
+		break;
+	case TRACE_MSG:
+		nfields = 4;
+		break;
+	default:
+		return -1;
+	}
+
+	if (get_varint(tr->fp, &dt) < 0)
+		return -1;
+	for (i = 0; i < nfields; i++)
+		if (get_varint(tr->fp, &v[i]) < 0)
+			return -1;
+
+	tr->last_us += dt;
+	rec->t_us = tr->last_us;
+	rec->conn = v[0];
+	rec->room = v[1];
+	rec->len = v[2];
+	rec->fanout = v[3];
+
+	return 1;
+}
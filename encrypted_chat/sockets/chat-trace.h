@@ -0,0 +1,55 @@
+/*
+ * chat-trace.h
+ *
+ * Compact binary traces of server traffic, written by socket-server -T
+ * and played back by chat-replay.
+ *
+ * A trace is a fixed header followed by variable length records.
+ * Each record is a type byte and LEB128 varints: the time since the
+ * previous record in microseconds, the connection id, then type
+ * specific fields. A relayed message costs 6-10 bytes.
+ */
+
+#ifndef _CHAT_TRACE_H
+#define _CHAT_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CHAT_TRACE_MAGIC	"CHTR"
+#define CHAT_TRACE_VERSION	1
+
+/* Record types */
+#define TRACE_CONNECT		1	/* conn */
+#define TRACE_DISCONNECT	2	/* conn */
+#define TRACE_JOIN		3	/* conn, room */
+#define TRACE_MSG		4	/* conn, room, len, fanout */
+
+struct trace_rec {
+	uint8_t type;
+	uint64_t t_us;		/* time since the start of the trace */
+	uint32_t conn;
+	uint32_t room;
+	uint32_t len;
+	uint32_t fanout;	/* recipients the server relayed it to */
+};
+
+struct chat_trace {
+	FILE *fp;
+	uint64_t start_us;
+	uint64_t last_us;
+};
+
+/* Create a trace file for writing, -1 on error */
+int trace_create(struct chat_trace *tr, const char *path);
+/* Open a trace file for reading, -1 on error or bad header */
+int trace_open(struct chat_trace *tr, const char *path);
+void trace_close(struct chat_trace *tr);
+
+/* Append a record stamped with the current time */
+void trace_write(struct chat_trace *tr, uint8_t type, uint32_t conn,
+                 uint32_t room, uint32_t len, uint32_t fanout);
+/* Read the next record: 1 on success, 0 at end of trace, -1 if corrupt */
+int trace_read(struct chat_trace *tr, struct trace_rec *rec);
+
+#endif /* _CHAT_TRACE_H */
@@ -0,0 +1,304 @@
+/*
+ * client-bench.c
+ *
+ * Headless load generator mode of the chat client.
+ *
+ * Messages carry a sequence number and a send timestamp inside the
+ * encrypted payload. The server echo room reflects them back, so the
+ * round trip covers encrypt, send, relay, receive and decrypt.
+ * In open loop mode the timestamp is the scheduled send time, so a
+ * stalled server shows up in the latencies instead of being hidden
+ * by a slower send rate.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/select.h>
+
+#include "socket-common.h"
+#include "chat-proto.h"
+#include "client-bench.h"
+
+#define TX_LIMIT	(1024 * 1024)	/* stop queueing above this backlog */
+#define STALL_SECS	10
+
+struct bench_stamp {
+	uint64_t seq;
+	uint64_t sent_ns;
+};
+
+struct bench_state {
+	struct crypto_ctx *crypto;
+	const unsigned char *iv;
+	size_t size;
+
+	unsigned char *plain, *cipher;
+	unsigned char *tx;
+	size_t tx_off, tx_len, tx_cap;
+	unsigned char *rx;
+	size_t rx_len;
+
+	uint64_t *rtt;
+	int sent, received;
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Encrypt one stamped message and append its frame to the tx buffer */
+static int queue_msg(struct bench_state *st, uint64_t stamp)
+{
+	struct chat_hdr hdr = { .len = st->size, .type = CHAT_MSG_TEXT };
+	struct bench_stamp bs = { .seq = st->sent, .sent_ns = stamp };
+	size_t need = CHAT_HDR_SIZE + st->size;
+
+	if (st->tx_off == st->tx_len)
+		st->tx_off = st->tx_len = 0;
+	if (st->tx_len + need > st->tx_cap) {
+		memmove(st->tx, st->tx + st->tx_off, st->tx_len - st->tx_off);
+		st->tx_len -= st->tx_off;
+		st->tx_off = 0;
+		if (st->tx_len + need > st->tx_cap) {
+			size_t cap = MAX(st->tx_cap * 2, st->tx_len + need);
+			unsigned char *p = realloc(st->tx, cap);
+
+			if (!p)
+				return -1;
+			st->tx = p;
+			st->tx_cap = cap;
+		}
+	}
+
+	memcpy(st->plain, &bs, sizeof(bs));
+	if (crypto_encrypt(st->crypto, st->plain, st->cipher, st->size, st->iv) < 0)
+		return -1;
+
+	chat_hdr_hton(&hdr);
+	memcpy(st->tx + st->tx_len, &hdr, CHAT_HDR_SIZE);
+	memcpy(st->tx + st->tx_len + CHAT_HDR_SIZE, st->cipher, st->size);
+	st->tx_len += need;
+	st->sent++;
+
+	return 0;
+}
+
+/* Decrypt and time every complete frame in the rx buffer */
+static int process_rx(struct bench_state *st)
+{
+	struct chat_hdr hdr;
+	struct bench_stamp bs;
+	size_t off = 0;
+
+	while (st->rx_len - off >= CHAT_HDR_SIZE) {
+		memcpy(&hdr, st->rx + off, CHAT_HDR_SIZE);
+		chat_hdr_ntoh(&hdr);
+		if (hdr.len > CHAT_MAX_PAYLOAD) {
+			fprintf(stderr, "bench: oversized message from server\n");
+			return -1;
+		}
+		if (st->rx_len - off < CHAT_HDR_SIZE + hdr.len)
+			break;
+
+		if (hdr.type == CHAT_MSG_TEXT && hdr.len == st->size) {
+			if (crypto_decrypt(st->crypto, st->rx + off + CHAT_HDR_SIZE,
+					   st->plain, st->size, st->iv) < 0)
+				return -1;
+			memcpy(&bs, st->plain, sizeof(bs));
+			if (bs.seq < (uint64_t)st->sent && st->received < st->sent)
+				st->rtt[st->received++] = now_ns() - bs.sent_ns;
+		}
+		off += CHAT_HDR_SIZE + hdr.len;
+	}
+
+	memmove(st->rx, st->rx + off, st->rx_len - off);
+	st->rx_len -= off;
+	return 0;
+}
+
+static void report(struct bench_state *st, const struct bench_opts *opts, uint64_t elapsed)
+{
+	double secs = elapsed / 1e9;
+	int n = st->received;
+
+	qsort(st->rtt, n, sizeof(*st->rtt), cmp_u64);
+#define PCT(p) (n ? st->rtt[(int)((n - 1) * (p))] / 1000.0 : 0.0)
+	printf("provider=%s size=%zu mode=%s sent=%d recv=%d secs=%.3f msg/s=%.0f "
+	       "rtt_us: p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+	       st->crypto->prov->name, st->size, opts->rate > 0 ? "open" : "closed",
+	       st->sent, n, secs, n / secs,
+	       PCT(0.50), PCT(0.90), PCT(0.99), PCT(0.999), PCT(1.0));
+#undef PCT
+}
+
+int run_bench(int sd, struct shm_chan *shm, struct crypto_ctx *crypto,
+              const unsigned char *iv, const struct bench_opts *opts)
+{
+	struct bench_state st;
+	uint64_t start, now, next, interval = 0, last_progress;
+	int ret = -1, flags, last_received = 0, maxfd, can_read, can_write, ready;
+	ssize_t n;
+
+	memset(&st, 0, sizeof(st));
+	st.crypto = crypto;
+	st.iv = iv;
+	st.size = (MAX(opts->size, (int)sizeof(struct bench_stamp)) + BLOCK_SIZE - 1)
+		/ BLOCK_SIZE * BLOCK_SIZE;
+	st.plain = calloc(1, st.size);
+	st.cipher = malloc(st.size);
+	st.rx = malloc(2 * (CHAT_HDR_SIZE + CHAT_MAX_PAYLOAD));
+	st.rtt = malloc(opts->count * sizeof(*st.rtt));
+	if (!st.plain || !st.cipher || !st.rx || !st.rtt) {
+		perror("malloc");
+		goto out;
+	}
+	if (opts->rate > 0)
+		interval = 1e9 / opts->rate;
+
+	if ((shm ? shm_chat_send(shm, CHAT_MSG_JOIN, CHAT_ROOM_ECHO, NULL, 0) :
+		   chat_send(sd, CHAT_MSG_JOIN, CHAT_ROOM_ECHO, NULL, 0)) < 0) {
+		perror("write");
+		goto out;
+	}
+	flags = fcntl(sd, F_GETFL);
+	fcntl(sd, F_SETFL, flags | O_NONBLOCK);
+
+	start = last_progress = now_ns();
+	while (st.received < opts->count) {
+		fd_set inset, outset;
+		struct timeval tv, *tvp = NULL;
+
+		now = now_ns();
+		if (interval) {
+			while (st.sent < opts->count &&
+			       (next = start + st.sent * interval) <= now &&
+			       st.tx_len - st.tx_off < TX_LIMIT)
+				if (queue_msg(&st, next) < 0)
+					goto out;
+		} else {
+			while (st.sent < opts->count && st.sent - st.received < opts->window)
+				if (queue_msg(&st, now_ns()) < 0)
+					goto out;
+		}
+
+		if (st.received != last_received) {
+			last_received = st.received;
+			last_progress = now;
+		} else if (now - last_progress > STALL_SECS * 1000000000ULL) {
+			fprintf(stderr, "bench: no progress for %d seconds\n", STALL_SECS);
+			break;
+		}
+
+		FD_ZERO(&inset);
+		FD_ZERO(&outset);
+		FD_SET(sd, &inset);
+		maxfd = sd;
+		ready = 0;
+		if (shm) {
+			/* sd is our eventfd: ask to be kicked, unless there is work already */
+			ready = shm_arm_rx(shm) |
+				(st.tx_off < st.tx_len && shm_arm_tx(shm));
+			FD_SET(shm->sock, &inset);
+			maxfd = MAX(sd, shm->sock);
+		} else if (st.tx_off < st.tx_len) {
+			FD_SET(sd, &outset);
+		}
+
+		/* Wake up for the next scheduled send, or to check for stalls */
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if (interval && st.sent < opts->count && st.tx_off == st.tx_len) {
+			next = start + st.sent * interval;
+			next = next > now ? next - now : 0;
+			tv.tv_sec = next / 1000000000ULL;
+			tv.tv_usec = (next % 1000000000ULL) / 1000;
+		}
+		if (ready)
+			tv.tv_sec = tv.tv_usec = 0;
+		tvp = &tv;
+
+		if (select(maxfd + 1, &inset, &outset, NULL, tvp) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("select");
+			goto out;
+		}
+
+		if (shm) {
+			if (FD_ISSET(shm->sock, &inset)) {
+				fprintf(stderr, "bench: server closed connection\n");
+				break;
+			}
+			if (FD_ISSET(sd, &inset))
+				shm_ack(shm);
+			/* The rings are cheap to look at, just try both ways */
+			can_write = st.tx_off < st.tx_len;
+			can_read = 1;
+		} else {
+			can_write = FD_ISSET(sd, &outset);
+			can_read = FD_ISSET(sd, &inset);
+		}
+
+		if (can_write) {
+			if (shm)
+				n = shm_write(shm, st.tx + st.tx_off, st.tx_len - st.tx_off);
+			else
+				n = write(sd, st.tx + st.tx_off, st.tx_len - st.tx_off);
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("write");
+				goto out;
+			}
+			if (n > 0)
+				st.tx_off += n;
+		}
+
+		if (can_read) {
+			if (shm)
+				n = shm_read(shm, st.rx + st.rx_len,
+					     2 * (CHAT_HDR_SIZE + CHAT_MAX_PAYLOAD) - st.rx_len);
+			else
+				n = read(sd, st.rx + st.rx_len,
+					 2 * (CHAT_HDR_SIZE + CHAT_MAX_PAYLOAD) - st.rx_len);
+			if (n == 0) {
+				fprintf(stderr, "bench: server closed connection\n");
+				break;
+			}
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				perror("read");
+				goto out;
+			}
+			st.rx_len += n;
+			if (process_rx(&st) < 0)
+				goto out;
+		}
+	}
+
+	report(&st, opts, now_ns() - start);
+	ret = st.received == opts->count ? 0 : -1;
+out:
+	free(st.plain);
+	free(st.cipher);
+	free(st.tx);
+	free(st.rx);
+	free(st.rtt);
+	return ret;
+}
@@ -0,0 +1,31 @@
+/*
+ * client-bench.h
+ *
+ * Headless load generator mode of the chat client.
+ */
+
+#ifndef _CLIENT_BENCH_H
+#define _CLIENT_BENCH_H
+
+#include "crypto-provider.h"
+#include "shm-ring.h"
+
+#define BENCH_DEFAULT_SIZE	256
+#define BENCH_DEFAULT_COUNT	10000
+
+struct bench_opts {
+	int size;	/* plaintext bytes per message, rounded up to BLOCK_SIZE */
+	int count;	/* messages to send */
+	double rate;	/* > 0: open loop at rate msgs/sec */
+	int window;	/* closed loop: messages kept in flight */
+};
+
+/*
+ * Join the server echo room on sd, or through the shm rings if not
+ * NULL, and run the benchmark. Round-trip times include encryption
+ * and decryption of every message. Returns 0 on success, -1 on error.
+ */
+int run_bench(int sd, struct shm_chan *shm, struct crypto_ctx *crypto,
+              const unsigned char *iv, const struct bench_opts *opts);
+
+#endif /* _CLIENT_BENCH_H */
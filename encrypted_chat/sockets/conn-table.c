@@ -0,0 +1,168 @@
+/*
+ * conn-table.c
+ *
+ * Slab backed connection table and room membership.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "conn-table.h"
+
+struct conn_table conn_tbl;
+
+struct room {
+	uint32_t *members;
+	uint32_t count, cap;
+};
+
+/* Indexed by room number, allocated on first use */
+static struct room *rooms[UINT16_MAX + 1];
+
+/* Add a slab and put its entries on the free stack, lowest index on top */
+static int conn_grow(void)
+{
+	unsigned int s = conn_tbl.nslabs;
+	uint32_t *free_idx, i;
+
+	if (s == CONN_MAX_SLABS)
+		return -1;
+
+	free_idx = realloc(conn_tbl.free_idx, (s + 1) * CONN_SLAB_SIZE * sizeof(*free_idx));
+	if (!free_idx)
+		return -1;
+	conn_tbl.free_idx = free_idx;
+
+	conn_tbl.hot[s] = calloc(CONN_SLAB_SIZE, sizeof(struct conn_hot));
+	conn_tbl.cold[s] = calloc(CONN_SLAB_SIZE, sizeof(struct conn_cold));
+	if (!conn_tbl.hot[s] || !conn_tbl.cold[s]) {
+		free(conn_tbl.hot[s]);
+		free(conn_tbl.cold[s]);
+		return -1;
+	}
+
+	for (i = 0; i < CONN_SLAB_SIZE; i++)
+		conn_tbl.free_idx[conn_tbl.nfree++] = (s + 1) * CONN_SLAB_SIZE - 1 - i;
+	conn_tbl.nslabs++;
+
+	return 0;
+}
+
+static int fd_map_reserve(int fd)
+{
+	uint32_t len = conn_tbl.fd_map_len, *map;
+
+	if ((uint32_t)fd < len)
+		return 0;
+	len = len ? len : 1024;
+	while (len <= (uint32_t)fd)
+		len *= 2;
+	if (!(map = realloc(conn_tbl.fd_map, len * sizeof(*map))))
+		return -1;
+	memset(map + conn_tbl.fd_map_len, 0xff, (len - conn_tbl.fd_map_len) * sizeof(*map));
+	conn_tbl.fd_map = map;
+	conn_tbl.fd_map_len = len;
+
+	return 0;
+}
+
+uint32_t conn_alloc(int fd)
+{
+	struct conn_hot *h;
+	uint32_t idx;
+
+	if (fd_map_reserve(fd) < 0)
+		return CONN_NONE;
+	if (!conn_tbl.nfree && conn_grow() < 0)
+		return CONN_NONE;
+
+	idx = conn_tbl.free_idx[--conn_tbl.nfree];
+	h = conn_hot(idx);
+	memset(h, 0, sizeof(*h));
+	memset(conn_cold(idx), 0, sizeof(struct conn_cold));
+	h->fd = fd;
+	h->state = CONN_OPEN;
+	h->room_slot = CONN_NONE;
+
+	conn_tbl.fd_map[fd] = idx;
+	conn_tbl.count++;
+
+	return idx;
+}
+
+void conn_free(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+
+	room_del(idx);
+	if (h->fd >= 0 && (uint32_t)h->fd < conn_tbl.fd_map_len)
+		conn_tbl.fd_map[h->fd] = CONN_NONE;
+	h->state = CONN_FREE;
+	h->fd = -1;
+	conn_tbl.free_idx[conn_tbl.nfree++] = idx;
+	conn_tbl.count--;
+}
+
+uint32_t conn_by_fd(int fd)
+{
+	if (fd < 0 || (uint32_t)fd >= conn_tbl.fd_map_len)
+		return CONN_NONE;
+	return conn_tbl.fd_map[fd];
+}
+
+int room_add(uint32_t idx, uint16_t room)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct room *r = rooms[room];
+
+	if (h->room_slot != CONN_NONE && h->room == room)
+		return 0;
+	/* Make space first, on failure the connection stays where it was */
+	if (!r && !(r = rooms[room] = calloc(1, sizeof(*r))))
+		return -1;
+	if (r->count == r->cap) {
+		uint32_t cap = r->cap ? r->cap * 2 : 8, *m;
+
+		if (!(m = realloc(r->members, cap * sizeof(*m))))
+			return -1;
+		r->members = m;
+		r->cap = cap;
+	}
+	room_del(idx);
+	h->room = room;
+	h->room_slot = r->count;
+	r->members[r->count++] = idx;
+
+	return 0;
+}
+
+void room_del(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct room *r = rooms[h->room];
+	uint32_t last;
+
+	if (h->room_slot == CONN_NONE || !r)
+		return;
+
+	/* Move the last member into the hole */
+	last = r->members[--r->count];
+	r->members[h->room_slot] = last;
+	conn_hot(last)->room_slot = h->room_slot;
+	h->room_slot = CONN_NONE;
+
+	if (r->count == 0) {
+		free(r->members);
+		free(r);
+		rooms[h->room] = NULL;
+	}
+}
+
+const uint32_t *room_members(uint16_t room, uint32_t *count)
+{
+	struct room *r = rooms[room];
+
+	*count = r ? r->count : 0;
+	return r ? r->members : NULL;
+}
@@ -0,0 +1,139 @@
+/*
+ * conn-table.h
+ *
+ * Connection table of the chat server.
+ *
+ * Connections live in slabs of CONN_SLAB_SIZE entries and are named by
+ * a 32-bit index. Each entry is split in two parallel arrays:
+ *
+ *   conn_hot   what the relay loop touches on every message (fd,
+ *              state, room, pending bytes, ...); 20 bytes, three of
+ *              them per cache line.
+ *   conn_cold  everything else (reassembly state, outbound queue,
+ *              timer, peer address, nickname, statistics).
+ *
+ * Rooms keep a dense array of member indices, so broadcasting walks
+ * the members only instead of the whole table.
+ */
+
+#ifndef _CONN_TABLE_H
+#define _CONN_TABLE_H
+
+#include <stdint.h>
+
+#include "chat-addr.h"
+#include "chat-proto.h"
+#include "msgbuf.h"
+#include "offline-queue.h"
+#include "shm-ring.h"
+#include "timer-wheel.h"
+
+#define CONN_SLAB_SHIFT	12
+#define CONN_SLAB_SIZE	(1U << CONN_SLAB_SHIFT)	/* 4096 connections per slab */
+#define CONN_MAX_SLABS	256			/* up to 1M connections */
+#define CONN_NONE	UINT32_MAX
+
+#define CONN_NICK_LEN	32
+
+/* conn_hot.state */
+#define CONN_FREE	0
+#define CONN_OPEN	1
+
+/* conn_hot.flags */
+#define CONN_F_DIRTY	0x01	/* on the flush list */
+#define CONN_F_POLLOUT	0x02	/* registered for EPOLLOUT */
+#define CONN_F_NOPOLLIN	0x04	/* registered without EPOLLIN */
+#define CONN_F_THROTTLED 0x08	/* sender paused until its room drains */
+#define CONN_F_CONGESTED 0x10	/* outbound queue over the limit */
+#define CONN_F_KILL	0x20	/* slow consumer, drop at the next flush */
+#define CONN_F_SHM	0x40	/* shared memory client, fd is its eventfd */
+#define CONN_F_BACKLOG	0x80	/* catching up on its offline queue */
+
+struct conn_hot {
+	int32_t fd;
+	uint8_t state;
+	uint8_t flags;
+	uint16_t room;
+	uint32_t room_slot;	/* position in the room's member array */
+	uint32_t last_active;	/* coarse seconds, for idle timeouts and heartbeats */
+	uint32_t pending;	/* bytes waiting in the outbound queue */
+};
+
+struct conn_stats {
+	uint64_t msgs_in, msgs_out;
+	uint64_t bytes_in, bytes_out;
+	uint64_t drops, drop_bytes;	/* discarded by the slow consumer policy */
+	uint32_t throttled;		/* times this sender was paused */
+	uint32_t max_queue;		/* deepest outbound queue seen, bytes */
+	uint32_t connected_at;
+};
+
+struct conn_cold {
+	uint32_t id;			/* unique for the server lifetime */
+	/* Frame reassembly, see client_input() in socket-server.c */
+	unsigned char hdr[CHAT_HDR_SIZE];
+	uint32_t hdr_len;
+	struct msgbuf *in;
+	size_t in_len;
+
+	struct outq outq;
+
+	struct timer timer;		/* next idle or heartbeat deadline */
+	uint32_t pinged_at;		/* last heartbeat sent, coarse seconds */
+
+	union chat_sockaddr addr;
+	struct shm_chan *shm;		/* rings of a shared memory client */
+	uint8_t bus_link;		/* to another worker, see shard-bus.h */
+	uint8_t worker;			/* which, SHARD_NONE until it says */
+	char nick[CONN_NICK_LEN];
+	struct offq_user *user;		/* named with CHAT_MSG_HELLO, if queues are on */
+	uint64_t last_seq;		/* in the history of its last message, +1, 0 if none */
+	struct conn_stats stats;
+};
+
+struct conn_table {
+	struct conn_hot *hot[CONN_MAX_SLABS];
+	struct conn_cold *cold[CONN_MAX_SLABS];
+	unsigned int nslabs;
+
+	uint32_t *free_idx;		/* stack of free indices */
+	uint32_t nfree;
+
+	uint32_t *fd_map;		/* fd -> index */
+	uint32_t fd_map_len;
+
+	uint32_t count;			/* open connections */
+};
+
+extern struct conn_table conn_tbl;
+
+static inline struct conn_hot *conn_hot(uint32_t idx)
+{
+	return &conn_tbl.hot[idx >> CONN_SLAB_SHIFT][idx & (CONN_SLAB_SIZE - 1)];
+}
+
+static inline struct conn_cold *conn_cold(uint32_t idx)
+{
+	return &conn_tbl.cold[idx >> CONN_SLAB_SHIFT][idx & (CONN_SLAB_SIZE - 1)];
+}
+
+/* Number of index slots in use, for scans: 0 .. conn_table_span() - 1 */
+static inline uint32_t conn_table_span(void)
+{
+	return conn_tbl.nslabs * CONN_SLAB_SIZE;
+}
+
+/* Take a free entry for fd, zeroed and CONN_OPEN. CONN_NONE if full. */
+uint32_t conn_alloc(int fd);
+/* Return an entry to the table. The caller has closed the fd. */
+void conn_free(uint32_t idx);
+/* Look a connection up by fd, CONN_NONE if unknown */
+uint32_t conn_by_fd(int fd);
+
+/* Room membership */
+int room_add(uint32_t idx, uint16_t room);
+void room_del(uint32_t idx);
+/* Members of a room, *count is set to their number */
+const uint32_t *room_members(uint16_t room, uint32_t *count);
+
+#endif /* _CONN_TABLE_H */
@@ -0,0 +1,354 @@
+/*
+ * crypto-bench.c
+ *
+ * Compare the chat crypto providers: for each provider and message size,
+ * encrypt and decrypt messages back to back and report messages/sec
+ * and per-message latency (encrypt + decrypt), with the CPU the process
+ * used meanwhile as a share of the wall time. For the virtio device that
+ * share is what waiting for the host costs, which the guest driver's
+ * poll_ns and poll_max_ns in /sys/bus/virtio/devices/virtioN/ trade
+ * against latency; run once per setting to compare.
+ *
+ * With -L, split instead the cost of one encryption into the layers it
+ * crosses. OpenSSL is all cipher. For the ioctl providers a NULL cipher
+ * session on the same fd gives the floor: at the smallest size it is
+ * the system call, the growth with size is copying, and what AES adds
+ * on top is the cipher. The virtio device also says, through
+ * CIOCGTIMING, how long the guest copied, how long the request was on
+ * the ring (VM exit included), how long QEMU held it and how long the
+ * host ioctl took; whatever the host ioctl took beyond the cipher is
+ * the host's own system call and copies.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <sys/ioctl.h>
+#include <crypto/cryptodev.h>
+
+#include "socket-common.h"
+#include "crypto-provider.h"
+
+#define DEFAULT_ITERS	10000
+#define MAX_SIZES	16
+
+static const size_t default_sizes[] = { 16, 256, 1024, 4096, 16384, 65536 };
+
+/* As in virtio-cryptodev/guest/crypto.h */
+struct virtio_cryptodev_timing {
+	uint64_t copy_in_ns;
+	uint64_t ring_ns;
+	uint64_t copy_out_ns;
+	uint64_t backend_ns;
+	uint64_t host_ioctl_ns;
+};
+#define CIOCGTIMING	_IOR('c', 120, struct virtio_cryptodev_timing)
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned long long cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Run one provider at one message size, print a result row */
+static int bench_one(struct crypto_ctx *ctx, size_t size, int iters)
+{
+	unsigned char *in, *enc, *dec, iv[BLOCK_SIZE];
+	unsigned long long *lat, start, t0, total, cpu;
+	double secs, avg;
+	int i, ret = -1;
+
+	in = malloc(size);
+	enc = malloc(size);
+	dec = malloc(size);
+	lat = malloc(iters * sizeof(*lat));
+	if (!in || !enc || !dec || !lat) {
+		perror("malloc");
+		goto out;
+	}
+
+	for (i = 0; i < (int)size; i++)
+		in[i] = i;
+	memset(iv, 0x42, sizeof(iv));
+
+	cpu = cpu_ns();
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		t0 = now_ns();
+		if (crypto_encrypt(ctx, in, enc, size, iv) < 0 ||
+		    crypto_decrypt(ctx, enc, dec, size, iv) < 0)
+			goto out;
+		lat[i] = now_ns() - t0;
+	}
+	total = now_ns() - start;
+	cpu = cpu_ns() - cpu;
+
+	if (memcmp(in, dec, size) != 0) {
+		fprintf(stderr, "%s: decrypted data does not match\n", ctx->prov->name);
+		goto out;
+	}
+
+	qsort(lat, iters, sizeof(*lat), cmp_ull);
+	secs = total / 1e9;
+	avg = (double)total / iters / 1000.0;
+	printf("%-10s %8zu %12.0f %10.2f %9.2f %9.2f %9.2f %9.2f %7.1f\n",
+	       ctx->prov->name, size, iters / secs,
+	       (double)size * iters / secs / (1024 * 1024),
+	       avg, lat[iters / 2] / 1000.0, lat[(int)(iters * 0.99)] / 1000.0,
+	       lat[iters - 1] / 1000.0, 100.0 * cpu / total);
+	ret = 0;
+out:
+	free(in);
+	free(enc);
+	free(dec);
+	free(lat);
+	return ret;
+}
+
+/*
+ * Average ns of one CIOCCRYPT encryption of size bytes on session ses.
+ * If tm is given, add up the device's breakdown of each call in it;
+ * it is left zeroed if the device has none.
+ */
+static double cdev_op_ns(int fd, unsigned int ses, unsigned char *src, unsigned char *dst,
+			 size_t size, int iters, struct virtio_cryptodev_timing *tm)
+{
+	struct virtio_cryptodev_timing t;
+	unsigned char iv[BLOCK_SIZE];
+	unsigned long long total = 0, t0;
+	struct crypt_op cryp;
+	int i;
+
+	memset(iv, 0x42, sizeof(iv));
+	memset(&cryp, 0, sizeof(cryp));
+	cryp.ses = ses;
+	cryp.len = size;
+	cryp.src = src;
+	cryp.dst = dst;
+	cryp.iv = iv;
+	cryp.op = COP_ENCRYPT;
+	if (tm)
+		memset(tm, 0, sizeof(*tm));
+
+	for (i = 0; i < iters; i++) {
+		t0 = now_ns();
+		if (ioctl(fd, CIOCCRYPT, &cryp)) {
+			perror("ioctl(CIOCCRYPT)");
+			return -1;
+		}
+		total += now_ns() - t0;
+		if (!tm)
+			continue;
+		memset(&t, 0, sizeof(t));
+		if (ioctl(fd, CIOCGTIMING, &t)) {
+			tm = NULL;
+			continue;
+		}
+		tm->copy_in_ns += t.copy_in_ns;
+		tm->ring_ns += t.ring_ns;
+		tm->copy_out_ns += t.copy_out_ns;
+		tm->backend_ns += t.backend_ns;
+		tm->host_ioctl_ns += t.host_ioctl_ns;
+	}
+	return (double)total / iters;
+}
+
+static void print_ns(double ns, int known)
+{
+	if (known)
+		printf(" %9.0f", ns);
+	else
+		printf(" %9s", "-");
+}
+
+/* One row of the -L breakdown, in ns per encryption */
+static int layers_one(struct crypto_ctx *ctx, size_t size, int iters)
+{
+	struct virtio_cryptodev_timing tm;
+	struct session_op sess;
+	unsigned char *src, *dst, iv[BLOCK_SIZE];
+	unsigned long long t0;
+	double total, null_min, null_size, cipher, ring, n;
+	int i, ret = -1, timed;
+
+	src = calloc(1, size);
+	dst = malloc(size);
+	if (!src || !dst) {
+		perror("malloc");
+		goto out;
+	}
+	memset(iv, 0x42, sizeof(iv));
+
+	/* none and openssl: everything happens in this process */
+	if (!ctx->prov->default_dev) {
+		t0 = now_ns();
+		for (i = 0; i < iters; i++)
+			if (crypto_encrypt(ctx, src, dst, size, iv) < 0)
+				goto out;
+		total = (double)(now_ns() - t0) / iters;
+		printf("%-10s %8zu", ctx->prov->name, size);
+		print_ns(total, 1);
+		print_ns(0, 0);
+		print_ns(total, !strcmp(ctx->prov->name, "none"));
+		print_ns(0, 0);
+		print_ns(0, 0);
+		print_ns(0, 0);
+		print_ns(total, strcmp(ctx->prov->name, "none"));
+		printf("\n");
+		ret = 0;
+		goto out;
+	}
+
+	memset(&sess, 0, sizeof(sess));
+	sess.cipher = CRYPTO_NULL;
+	if (ioctl(ctx->fd, CIOCGSESSION, &sess)) {
+		perror("ioctl(CIOCGSESSION, CRYPTO_NULL)");
+		goto out;
+	}
+	null_min = cdev_op_ns(ctx->fd, sess.ses, src, dst, BLOCK_SIZE, iters, NULL);
+	null_size = cdev_op_ns(ctx->fd, sess.ses, src, dst, size, iters, NULL);
+	total = cdev_op_ns(ctx->fd, ctx->ses, src, dst, size, iters, &tm);
+	if (ioctl(ctx->fd, CIOCFSESSION, &sess.ses))
+		perror("ioctl(CIOCFSESSION)");
+	if (null_min < 0 || null_size < 0 || total < 0)
+		goto out;
+
+	cipher = total - null_size;
+	timed = tm.ring_ns != 0;
+	printf("%-10s %8zu", ctx->prov->name, size);
+	print_ns(total, 1);
+	if (timed) {
+		n = iters;
+		ring = tm.ring_ns / n;
+		print_ns(total - (tm.copy_in_ns + tm.copy_out_ns) / n - ring, 1);
+		print_ns((tm.copy_in_ns + tm.copy_out_ns) / n, 1);
+		print_ns(ring - tm.backend_ns / n, 1);
+		print_ns((tm.backend_ns - tm.host_ioctl_ns) / n, 1);
+		print_ns(tm.host_ioctl_ns / n - cipher, 1);
+	} else {
+		print_ns(null_min, 1);
+		print_ns(null_size - null_min, 1);
+		print_ns(0, 0);
+		print_ns(0, 0);
+		print_ns(0, 0);
+	}
+	print_ns(cipher, 1);
+	printf("\n");
+	ret = 0;
+out:
+	free(src);
+	free(dst);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s [-L] [-c provider[,provider...]] [-s size[,size...]] [-n iterations]\n",
+		prog);
+	fprintf(stderr, "  -L  split the time of one encryption into layers, in ns\n");
+	fprintf(stderr, "Crypto providers:\n");
+	for (i = 0; crypto_providers[i]; i++)
+		fprintf(stderr, "  %-10s %s\n", crypto_providers[i]->name,
+			crypto_providers[i]->descr);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char *providers = NULL, *spec, *save;
+	size_t sizes[MAX_SIZES];
+	int nsizes = 0, iters = DEFAULT_ITERS, layers = 0, opt, i;
+	unsigned char key[KEY_SIZE];
+	struct crypto_ctx ctx;
+
+	while ((opt = getopt(argc, argv, "c:s:n:Lh")) != -1) {
+		switch (opt) {
+		case 'c':
+			providers = optarg;
+			break;
+		case 's':
+			for (spec = strtok_r(optarg, ",", &save); spec && nsizes < MAX_SIZES;
+			     spec = strtok_r(NULL, ",", &save)) {
+				sizes[nsizes] = strtoul(spec, NULL, 0);
+				if (sizes[nsizes] == 0 || sizes[nsizes] % BLOCK_SIZE) {
+					fprintf(stderr, "Size %s is not a multiple of %d\n",
+						spec, BLOCK_SIZE);
+					exit(1);
+				}
+				nsizes++;
+			}
+			break;
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		case 'L':
+			layers = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (iters <= 0)
+		usage(argv[0]);
+	if (nsizes == 0) {
+		nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+		memcpy(sizes, default_sizes, sizeof(default_sizes));
+	}
+
+	memset(key, 0x17, sizeof(key));
+
+	if (layers)
+		printf("%-10s %8s %9s %9s %9s %9s %9s %9s %9s\n", "provider", "size",
+		       "total", "syscall", "copy", "vmexit", "device", "host", "cipher");
+	else
+		printf("%-10s %8s %12s %10s %9s %9s %9s %9s %7s\n", "provider", "size",
+		       "msg/s", "MiB/s", "avg(us)", "p50(us)", "p99(us)", "max(us)", "cpu(%)");
+
+	for (i = 0; ; i++) {
+		if (providers) {
+			spec = strtok_r(i == 0 ? providers : NULL, ",", &save);
+			if (!spec)
+				break;
+		} else {
+			if (!crypto_providers[i])
+				break;
+			spec = (char *)crypto_providers[i]->name;
+		}
+
+		if (crypto_open(&ctx, spec, key, KEY_SIZE) < 0) {
+			printf("%-10s unavailable\n", spec);
+			continue;
+		}
+		for (opt = 0; opt < nsizes; opt++)
+			if ((layers ? layers_one : bench_one)(&ctx, sizes[opt], iters) < 0)
+				break;
+		crypto_close(&ctx);
+	}
+
+	return 0;
+}
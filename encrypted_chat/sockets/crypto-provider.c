@@ -0,0 +1,272 @@
+/*
+ * crypto-provider.c
+ *
+ * Crypto backends for the chat client: none, userspace OpenSSL,
+ * host /dev/crypto and the virtio-cryptodev guest device.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <crypto/cryptodev.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include "crypto-provider.h"
+
+/*
+ * none: plain copy, used for the unencrypted chat and as a baseline
+ */
+static int none_open(struct crypto_ctx *ctx, const unsigned char *key, size_t keylen)
+{
+	return 0;
+}
+
+static int none_crypt(struct crypto_ctx *ctx, int encrypt,
+                      const unsigned char *src, unsigned char *dst,
+                      size_t len, const unsigned char *iv)
+{
+	if (src != dst)
+		memmove(dst, src, len);
+	return 0;
+}
+
+static void none_close(struct crypto_ctx *ctx)
+{
+}
+
+/*
+ * cryptodev: ioctl interface shared by the host /dev/crypto and
+ * the paravirtualized /dev/cryptodevN, which mirrors its ABI.
+ */
+static int cdev_open(struct crypto_ctx *ctx, const unsigned char *key, size_t keylen)
+{
+	struct session_op sess;
+
+	ctx->fd = open(ctx->dev, O_RDWR);
+	if (ctx->fd < 0) {
+		fprintf(stderr, "open(%s): %s\n", ctx->dev, strerror(errno));
+		return -1;
+	}
+
+	memset(&sess, 0, sizeof(sess));
+	sess.cipher = CRYPTO_AES_CBC;
+	sess.keylen = keylen;
+	sess.key = (__u8 *)key;
+	if (ioctl(ctx->fd, CIOCGSESSION, &sess)) {
+		perror("ioctl(CIOCGSESSION)");
+		close(ctx->fd);
+		ctx->fd = -1;
+		return -1;
+	}
+	ctx->ses = sess.ses;
+
+	return 0;
+}
+
+static int cdev_crypt(struct crypto_ctx *ctx, int encrypt,
+                      const unsigned char *src, unsigned char *dst,
+                      size_t len, const unsigned char *iv)
+{
+	struct crypt_op cryp;
+
+	memset(&cryp, 0, sizeof(cryp));
+	cryp.ses = ctx->ses;
+	cryp.len = len;
+	cryp.src = (__u8 *)src;
+	cryp.dst = dst;
+	cryp.iv = (__u8 *)iv;
+	cryp.op = encrypt ? COP_ENCRYPT : COP_DECRYPT;
+
+	if (ioctl(ctx->fd, CIOCCRYPT, &cryp)) {
+		perror("ioctl(CIOCCRYPT)");
+		return -1;
+	}
+	return 0;
+}
+
+static void cdev_close(struct crypto_ctx *ctx)
+{
+	if (ctx->fd < 0)
+		return;
+	if (ioctl(ctx->fd, CIOCFSESSION, &ctx->ses))
+		perror("ioctl(CIOCFSESSION)");
+	if (close(ctx->fd) < 0)
+		perror("close(crypto_fd)");
+	ctx->fd = -1;
+}
+
+#ifdef HAVE_OPENSSL
+/*
+ * openssl: userspace AES, no kernel round trip at all
+ */
+struct ossl_priv {
+	EVP_CIPHER_CTX *evp;
+	unsigned char key[KEY_SIZE];
+};
+
+static int ossl_open(struct crypto_ctx *ctx, const unsigned char *key, size_t keylen)
+{
+	struct ossl_priv *p;
+
+	if (keylen != KEY_SIZE) {
+		fprintf(stderr, "openssl: unsupported key length %zu\n", keylen);
+		return -1;
+	}
+	if (!(p = calloc(1, sizeof(*p))))
+		return -1;
+	if (!(p->evp = EVP_CIPHER_CTX_new())) {
+		free(p);
+		return -1;
+	}
+	memcpy(p->key, key, keylen);
+	ctx->priv = p;
+
+	return 0;
+}
+
+static int ossl_crypt(struct crypto_ctx *ctx, int encrypt,
+                      const unsigned char *src, unsigned char *dst,
+                      size_t len, const unsigned char *iv)
+{
+	struct ossl_priv *p = ctx->priv;
+	int outl;
+
+	if (!EVP_CipherInit_ex(p->evp, EVP_aes_128_cbc(), NULL, p->key, iv, encrypt))
+		goto err;
+	EVP_CIPHER_CTX_set_padding(p->evp, 0);
+	if (!EVP_CipherUpdate(p->evp, dst, &outl, src, len))
+		goto err;
+
+	return 0;
+err:
+	fprintf(stderr, "openssl: EVP cipher operation failed\n");
+	return -1;
+}
+
+static void ossl_close(struct crypto_ctx *ctx)
+{
+	struct ossl_priv *p = ctx->priv;
+
+	if (!p)
+		return;
+	EVP_CIPHER_CTX_free(p->evp);
+	free(p);
+	ctx->priv = NULL;
+}
+#endif
+
+static const struct crypto_provider provider_none = {
+	.name = "none",
+	.descr = "no encryption (plain copy)",
+	.open = none_open,
+	.crypt = none_crypt,
+	.close = none_close,
+};
+
+#ifdef HAVE_OPENSSL
+static const struct crypto_provider provider_openssl = {
+	.name = "openssl",
+	.descr = "userspace OpenSSL AES-128-CBC",
+	.open = ossl_open,
+	.crypt = ossl_crypt,
+	.close = ossl_close,
+};
+#endif
+
+static const struct crypto_provider provider_cryptodev = {
+	.name = "cryptodev",
+	.descr = "host cryptodev-linux",
+	.default_dev = "/dev/crypto",
+	.open = cdev_open,
+	.crypt = cdev_crypt,
+	.close = cdev_close,
+};
+
+static const struct crypto_provider provider_virtio = {
+	.name = "virtio",
+	.descr = "paravirtualized virtio-cryptodev guest device",
+	.default_dev = "/dev/cryptodev0",
+	.open = cdev_open,
+	.crypt = cdev_crypt,
+	.close = cdev_close,
+};
+
+const struct crypto_provider *crypto_providers[] = {
+	&provider_none,
+#ifdef HAVE_OPENSSL
+	&provider_openssl,
+#endif
+	&provider_cryptodev,
+	&provider_virtio,
+	NULL
+};
+
+const struct crypto_provider *crypto_provider_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; crypto_providers[i]; i++)
+		if (strcmp(crypto_providers[i]->name, name) == 0)
+			return crypto_providers[i];
+	return NULL;
+}
+
+int crypto_open(struct crypto_ctx *ctx, const char *spec,
+                const unsigned char *key, size_t keylen)
+{
+	char name[32];
+	const char *dev;
+	size_t n;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fd = -1;
+
+	dev = strchr(spec, ':');
+	n = dev ? (size_t)(dev - spec) : strlen(spec);
+	if (n >= sizeof(name)) {
+		fprintf(stderr, "Bad crypto provider \"%s\"\n", spec);
+		return -1;
+	}
+	memcpy(name, spec, n);
+	name[n] = '\0';
+
+	if (!(ctx->prov = crypto_provider_lookup(name))) {
+		fprintf(stderr, "Unknown crypto provider \"%s\"\n", name);
+		return -1;
+	}
+
+	if (dev)
+		snprintf(ctx->dev, sizeof(ctx->dev), "%s", dev + 1);
+	else if (ctx->prov->default_dev)
+		snprintf(ctx->dev, sizeof(ctx->dev), "%s", ctx->prov->default_dev);
+
+	return ctx->prov->open(ctx, key, keylen);
+}
+
+void crypto_close(struct crypto_ctx *ctx)
+{
+	if (ctx->prov)
+		ctx->prov->close(ctx);
+	ctx->prov = NULL;
+}
+
+int crypto_encrypt(struct crypto_ctx *ctx, const unsigned char *src,
+                   unsigned char *dst, size_t len, const unsigned char *iv)
+{
+	return ctx->prov->crypt(ctx, 1, src, dst, len, iv);
+}
+
+int crypto_decrypt(struct crypto_ctx *ctx, const unsigned char *src,
+                   unsigned char *dst, size_t len, const unsigned char *iv)
+{
+	return ctx->prov->crypt(ctx, 0, src, dst, len, iv);
+}
@@ -0,0 +1,63 @@
+/*
+ * crypto-provider.h
+ *
+ * Pluggable crypto backends for the chat client.
+ *
+ * Every provider implements the same AES-128-CBC transform (no padding,
+ * caller-supplied IV), so clients using different backends can talk to
+ * each other. The "none" provider just copies the buffer.
+ */
+
+#ifndef _CRYPTO_PROVIDER_H
+#define _CRYPTO_PROVIDER_H
+
+#include <stddef.h>
+
+#define KEY_SIZE	16	/* AES128 */
+#define BLOCK_SIZE	16
+
+#define CRYPTO_PROVIDER_DEFAULT "cryptodev"
+
+struct crypto_ctx;
+
+struct crypto_provider {
+	const char *name;
+	const char *descr;
+	/* Device node used when the spec does not name one, or NULL */
+	const char *default_dev;
+
+	int  (*open)(struct crypto_ctx *ctx, const unsigned char *key, size_t keylen);
+	int  (*crypt)(struct crypto_ctx *ctx, int encrypt,
+	              const unsigned char *src, unsigned char *dst,
+	              size_t len, const unsigned char *iv);
+	void (*close)(struct crypto_ctx *ctx);
+};
+
+struct crypto_ctx {
+	const struct crypto_provider *prov;
+	char dev[64];		/* device node for ioctl based providers */
+	int fd;
+	unsigned int ses;	/* cryptodev session id */
+	void *priv;		/* provider private data (e.g. EVP_CIPHER_CTX) */
+};
+
+/*
+ * Open a provider by spec. A spec is a provider name optionally
+ * followed by ":<device node>", e.g. "virtio:/dev/cryptodev1".
+ * Returns 0 on success, -1 on error (errno / message already printed).
+ */
+int crypto_open(struct crypto_ctx *ctx, const char *spec,
+                const unsigned char *key, size_t keylen);
+void crypto_close(struct crypto_ctx *ctx);
+
+/* len must be a multiple of BLOCK_SIZE for every provider but "none" */
+int crypto_encrypt(struct crypto_ctx *ctx, const unsigned char *src,
+                   unsigned char *dst, size_t len, const unsigned char *iv);
+int crypto_decrypt(struct crypto_ctx *ctx, const unsigned char *src,
+                   unsigned char *dst, size_t len, const unsigned char *iv);
+
+const struct crypto_provider *crypto_provider_lookup(const char *name);
+/* NULL terminated table of all compiled-in providers */
+extern const struct crypto_provider *crypto_providers[];
+
+#endif /* _CRYPTO_PROVIDER_H */
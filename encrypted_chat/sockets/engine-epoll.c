@@ -0,0 +1,174 @@
+/*
+ * engine-epoll.c
+ *
+ * epoll engine of the chat server.
+ *
+ * Level triggered. The event data carries (fd << 32 | index) so that
+ * events for a connection dropped earlier in the same batch, whose
+ * index may already be reused, can be told apart. Listening sockets
+ * have LISTEN_TOKEN set instead.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#include "conn-table.h"
+#include "server-engine.h"
+
+#define MAX_EVENTS	256
+#define LISTEN_TOKEN	(1ULL << 63)	/* | listening socket number */
+
+static int epfd;
+static const int *listen_sds;
+static int nlisten;
+static struct epoll_event events[MAX_EVENTS];
+static int nevents;
+
+static int ep_init(const int *sds, int n)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	int i;
+
+	if ((epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		fcntl(sds[i], F_SETFL, fcntl(sds[i], F_GETFL) | O_NONBLOCK);
+		ev.data.u64 = LISTEN_TOKEN | i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sds[i], &ev) < 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+	listen_sds = sds;
+	nlisten = n;
+	return 0;
+}
+
+static int ep_add(uint32_t idx)
+{
+	int fd = conn_hot(idx)->fd;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = ((uint64_t)fd << 32) | idx };
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	engine_syscalls++;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Bring the epoll registration in line with the connection: EPOLLOUT
+ * while output is pending, EPOLLIN unless the client is throttled.
+ * An eventfd is always writable, shared memory clients kick it when
+ * there is room again.
+ */
+static void ep_update(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct epoll_event ev;
+	uint8_t want;
+
+	want = (h->pending && !(h->flags & CONN_F_SHM) ? CONN_F_POLLOUT : 0) |
+	       (h->flags & CONN_F_THROTTLED ? CONN_F_NOPOLLIN : 0);
+	if ((h->flags & (CONN_F_POLLOUT | CONN_F_NOPOLLIN)) == want)
+		return;
+	ev.events = (want & CONN_F_NOPOLLIN ? 0 : EPOLLIN) |
+		    (want & CONN_F_POLLOUT ? EPOLLOUT : 0);
+	ev.data.u64 = ((uint64_t)h->fd << 32) | idx;
+	engine_syscalls++;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, h->fd, &ev) < 0)
+		perror("epoll_ctl");
+	h->flags = (h->flags & ~(CONN_F_POLLOUT | CONN_F_NOPOLLIN)) | want;
+}
+
+static int ep_send(uint32_t idx)
+{
+	ssize_t n;
+
+	engine_syscalls++;
+	if ((n = outq_flush(&conn_cold(idx)->outq, conn_hot(idx)->fd)) < 0)
+		return -1;
+	server_sent(idx, n);
+	return 0;
+}
+
+static void ep_close(uint32_t idx)
+{
+	/* Closing the last reference takes it out of the epoll set */
+	if (close(conn_hot(idx)->fd) < 0)
+		perror("close");
+}
+
+static void ep_listen(int on)
+{
+	struct epoll_event ev = { .events = on ? EPOLLIN : 0 };
+	int i;
+
+	for (i = 0; i < nlisten; i++) {
+		ev.data.u64 = LISTEN_TOKEN | i;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, listen_sds[i], &ev) < 0)
+			perror("epoll_ctl");
+	}
+}
+
+static int ep_wait(int timeout_ms)
+{
+	engine_syscalls++;
+	nevents = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+	if (nevents < 0) {
+		nevents = 0;
+		if (errno != EINTR) {
+			perror("epoll_wait");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void ep_dispatch(void)
+{
+	uint32_t idx;
+	int i;
+
+	for (i = 0; i < nevents; i++) {
+		if (events[i].data.u64 & LISTEN_TOKEN) {
+			server_accept_all(listen_sds[(uint32_t)events[i].data.u64]);
+			continue;
+		}
+		/* Skip events for a connection dropped earlier in this batch */
+		idx = (uint32_t)events[i].data.u64;
+		if (conn_hot(idx)->state != CONN_OPEN ||
+		    conn_hot(idx)->fd != (int)(events[i].data.u64 >> 32))
+			continue;
+
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			if (server_read(idx) < 0) {
+				server_drop(idx);
+				continue;
+			}
+		}
+		if (events[i].events & EPOLLOUT)
+			server_writable(idx);
+	}
+}
+
+const struct server_engine engine_epoll = {
+	.name = "epoll",
+	.descr = "readiness via epoll, level triggered",
+	.init = ep_init,
+	.add = ep_add,
+	.update = ep_update,
+	.send = ep_send,
+	.close = ep_close,
+	.listen = ep_listen,
+	.wait = ep_wait,
+	.dispatch = ep_dispatch,
+};
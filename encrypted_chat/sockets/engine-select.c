@@ -0,0 +1,158 @@
+/*
+ * engine-select.c
+ *
+ * select() engine of the chat server, the way the server worked
+ * originally: the fd sets are rebuilt from the connection table on
+ * every round, and descriptors past FD_SETSIZE cannot be watched.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/select.h>
+
+#include "socket-common.h"
+#include "conn-table.h"
+#include "server-engine.h"
+
+static fd_set rfds, wfds;
+static const int *listen_sds;
+static int nlisten, listening = 1, nready;
+
+static int sel_init(const int *sds, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (sds[i] >= FD_SETSIZE) {
+			fprintf(stderr, "select: listening socket %d past FD_SETSIZE\n", sds[i]);
+			return -1;
+		}
+		fcntl(sds[i], F_SETFL, fcntl(sds[i], F_GETFL) | O_NONBLOCK);
+	}
+	listen_sds = sds;
+	nlisten = n;
+	return 0;
+}
+
+static int sel_add(uint32_t idx)
+{
+	int fd = conn_hot(idx)->fd;
+
+	if (fd >= FD_SETSIZE) {
+		fprintf(stderr, "select: cannot watch fd %d, FD_SETSIZE is %d\n", fd, FD_SETSIZE);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+static void sel_update(uint32_t idx)
+{
+	/* The sets are rebuilt before every select() */
+}
+
+static int sel_send(uint32_t idx)
+{
+	ssize_t n;
+
+	engine_syscalls++;
+	if ((n = outq_flush(&conn_cold(idx)->outq, conn_hot(idx)->fd)) < 0)
+		return -1;
+	server_sent(idx, n);
+	return 0;
+}
+
+static void sel_close(uint32_t idx)
+{
+	if (close(conn_hot(idx)->fd) < 0)
+		perror("close");
+}
+
+static void sel_listen(int on)
+{
+	listening = on;
+}
+
+static int sel_wait(int timeout_ms)
+{
+	uint32_t idx, span = conn_table_span();
+	struct timeval tv, *tvp = NULL;
+	struct conn_hot *h;
+	int i, maxfd = -1;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	for (i = 0; listening && i < nlisten; i++) {
+		FD_SET(listen_sds[i], &rfds);
+		maxfd = MAX(maxfd, listen_sds[i]);
+	}
+	for (idx = 0; idx < span; idx++) {
+		h = conn_hot(idx);
+		if (h->state != CONN_OPEN)
+			continue;
+		if (!(h->flags & CONN_F_THROTTLED))
+			FD_SET(h->fd, &rfds);
+		/* Shared memory clients kick their eventfd when there is room */
+		if (h->pending && !(h->flags & CONN_F_SHM))
+			FD_SET(h->fd, &wfds);
+		maxfd = MAX(maxfd, h->fd);
+	}
+	if (timeout_ms >= 0) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		tvp = &tv;
+	}
+
+	engine_syscalls++;
+	nready = select(maxfd + 1, &rfds, &wfds, NULL, tvp);
+	if (nready < 0) {
+		nready = 0;
+		if (errno != EINTR) {
+			perror("select");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void sel_dispatch(void)
+{
+	uint32_t idx, span = conn_table_span();
+	struct conn_hot *h;
+	int i, fd;
+
+	if (!nready)
+		return;
+	/* Only clients from before the select(), accepted ones are not in the sets */
+	for (idx = 0; idx < span; idx++) {
+		h = conn_hot(idx);
+		if (h->state != CONN_OPEN)
+			continue;
+		fd = h->fd;
+		if (FD_ISSET(fd, &rfds) && server_read(idx) < 0) {
+			server_drop(idx);
+			continue;
+		}
+		if (FD_ISSET(fd, &wfds))
+			server_writable(idx);
+	}
+	for (i = 0; listening && i < nlisten; i++)
+		if (FD_ISSET(listen_sds[i], &rfds))
+			server_accept_all(listen_sds[i]);
+}
+
+const struct server_engine engine_select = {
+	.name = "select",
+	.descr = "readiness via select(), at most FD_SETSIZE clients",
+	.init = sel_init,
+	.add = sel_add,
+	.update = sel_update,
+	.send = sel_send,
+	.close = sel_close,
+	.listen = sel_listen,
+	.wait = sel_wait,
+	.dispatch = sel_dispatch,
+};
@@ -0,0 +1,804 @@
+/*
+ * engine-uring.c
+ *
+ * io_uring engine of the chat server.
+ *
+ * One multishot accept per listening socket, and one multishot receive
+ * per client, stay armed in the kernel. Receives land in a ring of
+ * provided buffers shared by all clients, so an idle connection pins
+ * no memory; the server copies each frame out and hands the buffer
+ * straight back. The sends queued during a round are submitted by the
+ * same io_uring_enter() that waits for the next completions, so under
+ * load a single system call carries any number of messages. A queue
+ * longer than one sendmsg() can describe goes out as a chain of linked
+ * requests, which the kernel runs in order.
+ *
+ * Throttling a sender cancels its receive, but buffers the kernel has
+ * already filled keep coming in for a while. They are held back on the
+ * connection, in arrival order, and fed to the server once the sender
+ * is let go again.
+ *
+ * Uses the raw system calls, liburing is not needed.
+ *
+ * A descriptor is only closed once the kernel has completed every
+ * request on it, so a completion can always be matched to its client
+ * by fd: the number cannot be handed out again before that.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "conn-table.h"
+#include "server-engine.h"
+
+#define URING_ENTRIES		4096
+#define URING_CQ_ENTRIES	(4 * URING_ENTRIES)
+
+#define RBUF_GROUP		0
+#define RBUF_COUNT		4096	/* receive buffers, a power of two */
+#define RBUF_SIZE		4096
+
+#define SEND_IOV		64	/* buffers per sendmsg() */
+#define SEND_CHAIN		4	/* linked sendmsg() requests per client */
+
+/* What a request was, in the top byte of user_data; the rest is the fd */
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_CANCEL, OP_CLOSE, OP_POLL };
+
+#define UDATA(op, fd)	((uint64_t)(op) << 56 | (uint32_t)(fd))
+#define UDATA_OP(ud)	((unsigned int)((ud) >> 56))
+#define UDATA_FD(ud)	((int)(uint32_t)(ud))
+
+enum { RECV_OFF, RECV_ARMED, RECV_CANCEL };
+
+/* One sendmsg() in flight, holding references on what it sends */
+struct send_req {
+	struct msghdr msg;
+	struct iovec iov[SEND_IOV];
+	struct msgbuf *mb[SEND_IOV];
+	unsigned int cnt;
+	struct send_req *next;
+};
+
+/* Per descriptor, lives until the descriptor is closed */
+struct uring_fd {
+	uint32_t idx;			/* CONN_NONE once the server let go */
+	uint16_t inflight;		/* requests the kernel still owns */
+	uint8_t recv;
+	uint8_t closing;
+	struct send_req *sends;		/* in flight, oldest first */
+	struct outq held;		/* received while throttled */
+};
+
+static struct {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_flags, sq_mask, sq_entries;
+	unsigned int sq_local;		/* our tail, published on submit */
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+} ring;
+
+static struct io_uring_buf_ring *rbuf_ring;
+static unsigned char *rbufs;
+static uint16_t rbuf_tail;
+
+static struct uring_fd *ufds;
+static unsigned int nufds;
+
+static struct send_req *free_reqs;
+
+static const int *listen_sds;
+static int nlisten, listening = 1;
+static unsigned int accept_armed;	/* bit per listening socket */
+
+/*
+ * Clients whose receive side needs another look after the batch: out
+ * of buffers, or let go with held data to replay.
+ */
+static int *kicked;
+static unsigned int nkicked, kicked_cap;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(unsigned int to_submit, unsigned int min_complete,
+			      unsigned int flags, void *arg, size_t argsz)
+{
+	engine_syscalls++;
+	return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+static int ring_setup(void)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	size_t sq_len, cq_len;
+	unsigned int i;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	p.cq_entries = URING_CQ_ENTRIES;
+	if ((ring.fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0) {
+		/* Older kernels: no task run hints */
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_CQ_ENTRIES;
+		if ((ring.fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0) {
+			perror("io_uring_setup");
+			return -1;
+		}
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		fprintf(stderr, "io_uring: kernel too old, need 5.11 or later\n");
+		return -1;
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len)
+		sq_len = cq_len;
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	cq = sq;
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring.sq_flags = (unsigned int *)(sq + p.sq_off.flags);
+	ring.sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	ring.sq_entries = p.sq_entries;
+	ring.sq_local = *ring.sq_tail;
+	/* SQ slots map one to one to SQEs */
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned int *)(sq + p.sq_off.array))[i] = i;
+
+	ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring.cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+static unsigned int sq_pending(void)
+{
+	return ring.sq_local - *ring.sq_tail;
+}
+
+/* Publish the SQEs we filled in, the next io_uring_enter() submits them */
+static unsigned int sq_publish(void)
+{
+	unsigned int n = sq_pending();
+
+	__atomic_store_n(ring.sq_tail, ring.sq_local, __ATOMIC_RELEASE);
+	return n;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring.sq_local - head == ring.sq_entries) {
+		/* Full: submit what we have, without waiting */
+		if (sys_io_uring_enter(sq_publish(), 0, 0, NULL, 0) < 0)
+			perror("io_uring_enter");
+		head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		if (ring.sq_local - head == ring.sq_entries)
+			return NULL;
+	}
+	sqe = &ring.sqes[ring.sq_local++ & ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void rbuf_recycle(unsigned int bid)
+{
+	struct io_uring_buf *b = &rbuf_ring->bufs[rbuf_tail & (RBUF_COUNT - 1)];
+
+	b->addr = (uintptr_t)(rbufs + (size_t)bid * RBUF_SIZE);
+	b->len = RBUF_SIZE;
+	b->bid = bid;
+	rbuf_tail++;
+}
+
+static void rbuf_publish(void)
+{
+	__atomic_store_n(&rbuf_ring->tail, rbuf_tail, __ATOMIC_RELEASE);
+}
+
+static int rbuf_setup(void)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	rbuf_ring = mmap(NULL, RBUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (rbuf_ring == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	if (!(rbufs = malloc((size_t)RBUF_COUNT * RBUF_SIZE))) {
+		perror("malloc");
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)rbuf_ring;
+	reg.ring_entries = RBUF_COUNT;
+	reg.bgid = RBUF_GROUP;
+	if (sys_io_uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		perror("io_uring_register(PBUF_RING)");
+		return -1;
+	}
+	for (i = 0; i < RBUF_COUNT; i++)
+		rbuf_recycle(i);
+	rbuf_publish();
+	return 0;
+}
+
+static struct uring_fd *ufd_get(int fd)
+{
+	unsigned int n = nufds ? nufds : 1024;
+	struct uring_fd *u;
+
+	if ((unsigned int)fd < nufds)
+		return &ufds[fd];
+	while (n <= (unsigned int)fd)
+		n *= 2;
+	if (!(u = realloc(ufds, n * sizeof(*u))))
+		return NULL;
+	memset(u + nufds, 0, (n - nufds) * sizeof(*u));
+	ufds = u;
+	nufds = n;
+	return &ufds[fd];
+}
+
+static void kick(int fd)
+{
+	if (nkicked == kicked_cap) {
+		unsigned int cap = kicked_cap ? kicked_cap * 2 : 256;
+		int *k = realloc(kicked, cap * sizeof(*k));
+
+		if (!k)
+			return;
+		kicked = k;
+		kicked_cap = cap;
+	}
+	kicked[nkicked++] = fd;
+}
+
+static int is_listener(int fd)
+{
+	int i;
+
+	for (i = 0; i < nlisten; i++)
+		if (listen_sds[i] == fd)
+			return 1;
+	return 0;
+}
+
+/* Listening socket i, accept_armed bit i; user_data carries i */
+static void arm_accept(int i)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = get_sqe()))
+		return;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_sds[i];
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = UDATA(OP_ACCEPT, i);
+	accept_armed |= 1U << i;
+}
+
+static void arm_recv(int fd, struct uring_fd *u)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = get_sqe()))
+		return;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RBUF_GROUP;
+	sqe->user_data = UDATA(OP_RECV, fd);
+	u->recv = RECV_ARMED;
+	u->inflight++;
+}
+
+/*
+ * Shared memory clients have nothing to receive, their eventfd is
+ * polled and the server reads the ring itself.
+ */
+static void arm_poll(int fd, struct uring_fd *u)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = get_sqe()))
+		return;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = UDATA(OP_POLL, fd);
+	u->recv = RECV_ARMED;
+	u->inflight++;
+}
+
+/* Cancel the requests matching user_data, or all of them on fd if 0 */
+static void cancel(int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = get_sqe()))
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	if (user_data) {
+		sqe->addr = user_data;
+	} else {
+		sqe->fd = fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	}
+	sqe->user_data = UDATA(OP_CANCEL, fd);
+	if (!is_listener(fd))
+		ufds[fd].inflight++;
+}
+
+/* A request on fd completed; close it once the kernel is done with it */
+static void ufd_put(int fd, struct uring_fd *u)
+{
+	struct io_uring_sqe *sqe;
+
+	if (--u->inflight || !u->closing)
+		return;
+	u->closing = 0;
+	if (!(sqe = get_sqe())) {
+		close(fd);
+		return;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->user_data = UDATA(OP_CLOSE, fd);
+}
+
+static struct send_req *req_alloc(void)
+{
+	struct send_req *r = free_reqs;
+
+	if (r) {
+		free_reqs = r->next;
+		return r;
+	}
+	return malloc(sizeof(*r));
+}
+
+static void req_free(struct send_req *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < r->cnt; i++)
+		msgbuf_put(r->mb[i]);
+	r->next = free_reqs;
+	free_reqs = r;
+}
+
+static int ur_init(const int *sds, int n)
+{
+	int i;
+
+	if (ring_setup() < 0 || rbuf_setup() < 0)
+		return -1;
+	listen_sds = sds;
+	nlisten = n;
+	for (i = 0; i < n; i++)
+		arm_accept(i);
+	return 0;
+}
+
+static int ur_add(uint32_t idx)
+{
+	int fd = conn_hot(idx)->fd;
+	struct uring_fd *u;
+
+	if (!(u = ufd_get(fd))) {
+		fprintf(stderr, "Out of memory for fd %d\n", fd);
+		return -1;
+	}
+	memset(u, 0, sizeof(*u));
+	u->idx = idx;
+	if (conn_hot(idx)->flags & CONN_F_SHM)
+		arm_poll(fd, u);
+	else
+		arm_recv(fd, u);
+	return 0;
+}
+
+static void ur_update(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct uring_fd *u = &ufds[h->fd];
+
+	/* The server leaves a throttled ring alone by itself */
+	if (h->flags & CONN_F_SHM)
+		return;
+	if (h->flags & CONN_F_THROTTLED) {
+		if (u->recv == RECV_ARMED) {
+			cancel(h->fd, UDATA(OP_RECV, h->fd));
+			u->recv = RECV_CANCEL;
+		}
+	} else if (u->held.count) {
+		/* Replayed from dispatch(), the server may be mid-round here */
+		kick(h->fd);
+	} else if (u->recv == RECV_OFF) {
+		arm_recv(h->fd, u);
+	}
+}
+
+/*
+ * Queue sendmsg() requests for the client's outbound queue. They go to
+ * the kernel with the next io_uring_enter(); the queue head stays
+ * pinned until they complete.
+ */
+static int ur_send(uint32_t idx)
+{
+	struct conn_cold *cc = conn_cold(idx);
+	int fd = conn_hot(idx)->fd;
+	struct uring_fd *u = &ufds[fd];
+	struct io_uring_sqe *sqe;
+	struct send_req *r, **tail;
+	struct outq_ent *e;
+	size_t off;
+	int k;
+
+	/* One chain at a time, its completion asks for the next one */
+	if (u->sends)
+		return 0;
+
+	tail = &u->sends;
+	e = cc->outq.head;
+	off = cc->outq.off;
+	for (k = 0; e && k < SEND_CHAIN; k++) {
+		if (!(r = req_alloc()) || !(sqe = get_sqe())) {
+			if (r)
+				req_free(r);
+			break;
+		}
+		for (r->cnt = 0; e && r->cnt < SEND_IOV; e = e->next, r->cnt++) {
+			r->iov[r->cnt].iov_base = e->mb->data + off;
+			r->iov[r->cnt].iov_len = e->mb->len - off;
+			r->mb[r->cnt] = msgbuf_get(e->mb);
+			off = 0;
+		}
+		memset(&r->msg, 0, sizeof(r->msg));
+		r->msg.msg_iov = r->iov;
+		r->msg.msg_iovlen = r->cnt;
+		r->next = NULL;
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)&r->msg;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = UDATA(OP_SEND, fd);
+		/*
+		 * Only with MSG_WAITALL does a short send break the chain: the
+		 * rest comes back cancelled, and once the chain is done the
+		 * queue is sent again from where the bytes really stopped.
+		 */
+		if (e && k + 1 < SEND_CHAIN) {
+			sqe->msg_flags |= MSG_WAITALL;
+			sqe->flags = IOSQE_IO_LINK;
+		}
+
+		*tail = r;
+		tail = &r->next;
+		cc->outq.pinned += r->cnt;
+		u->inflight++;
+	}
+	return 0;
+}
+
+static void ur_close(uint32_t idx)
+{
+	int fd = conn_hot(idx)->fd;
+	struct uring_fd *u = &ufds[fd];
+
+	u->idx = CONN_NONE;
+	u->closing = 1;
+	outq_clear(&u->held);
+	if (u->inflight) {
+		/* Pull everything back first, the close follows the last completion */
+		cancel(fd, 0);
+		return;
+	}
+	u->inflight = 1;
+	ufd_put(fd, u);
+}
+
+static void ur_listen(int on)
+{
+	int i;
+
+	listening = on;
+	for (i = 0; i < nlisten; i++) {
+		if (on && !(accept_armed & (1U << i)))
+			arm_accept(i);
+		else if (!on && (accept_armed & (1U << i)))
+			cancel(listen_sds[i], UDATA(OP_ACCEPT, i));
+	}
+}
+
+static int ur_wait(int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int ready, flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	unsigned int submit = sq_publish();
+
+	ready = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) - *ring.cq_head;
+	/* Completions waiting and nothing to submit: no system call at all */
+	if (ready && !submit && !(*ring.sq_flags & IORING_SQ_CQ_OVERFLOW))
+		return 0;
+
+	memset(&arg, 0, sizeof(arg));
+	/* Held input to replay: just submit and collect */
+	if (nkicked)
+		timeout_ms = 0;
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+		arg.ts = (uintptr_t)&ts;
+	}
+	if (sys_io_uring_enter(submit, ready || nkicked ? 0 : 1, flags, &arg, sizeof(arg)) < 0 &&
+	    errno != EINTR && errno != ETIME && errno != EBUSY) {
+		perror("io_uring_enter");
+		return -1;
+	}
+	return 0;
+}
+
+static void handle_accept(struct io_uring_cqe *cqe, int i)
+{
+	union chat_sockaddr sa;
+	socklen_t len = sizeof(sa);
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		accept_armed &= ~(1U << i);
+	if (cqe->res >= 0) {
+		engine_syscalls++;
+		memset(&sa, 0, sizeof(sa));
+		getpeername(cqe->res, &sa.sa, &len);
+		server_accept(cqe->res, &sa);
+	} else if (cqe->res != -ECANCELED) {
+		server_accept_failed(-cqe->res);
+	}
+	if (!(accept_armed & (1U << i)) && listening)
+		arm_accept(i);
+}
+
+/* Keep input of a throttled client for later, -1 if out of memory */
+static int hold(struct uring_fd *u, const unsigned char *data, size_t n)
+{
+	struct msgbuf *mb;
+	int ret;
+
+	if (!(mb = msgbuf_alloc(n)))
+		return -1;
+	memcpy(mb->data, data, n);
+	ret = outq_push(&u->held, mb);
+	msgbuf_put(mb);
+	return ret;
+}
+
+/* Feed held input to the server until it throttles the client again */
+static void replay(struct uring_fd *u)
+{
+	struct msgbuf *mb;
+
+	while (u->held.head && !(conn_hot(u->idx)->flags & CONN_F_THROTTLED)) {
+		mb = msgbuf_get(u->held.head->mb);
+		outq_consume(&u->held, mb->len);
+		if (server_input(u->idx, mb->data, mb->len) < 0) {
+			msgbuf_put(mb);
+			server_drop(u->idx);
+			return;
+		}
+		msgbuf_put(mb);
+	}
+}
+
+static void handle_recv(struct io_uring_cqe *cqe, int fd, struct uring_fd *u)
+{
+	unsigned char *data;
+	unsigned int bid;
+	int res = cqe->res;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		data = rbufs + (size_t)bid * RBUF_SIZE;
+		if (res > 0 && u->idx != CONN_NONE) {
+			if ((conn_hot(u->idx)->flags & CONN_F_THROTTLED) || u->held.count) {
+				if (hold(u, data, res) < 0) {
+					fprintf(stderr, "Out of memory, dropping fd %d\n", fd);
+					server_drop(u->idx);
+				}
+			} else if (server_input(u->idx, data, res) < 0) {
+				server_drop(u->idx);
+			}
+		}
+		rbuf_recycle(bid);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	/* The multishot receive is over */
+	u->recv = RECV_OFF;
+	if (u->idx != CONN_NONE) {
+		if (res == -ENOBUFS) {
+			kick(fd);
+		} else if (res == 0) {
+			server_drop(u->idx);
+		} else if (res < 0 && res != -ECANCELED) {
+			fprintf(stderr, "read from remote peer failed: %s\n", strerror(-res));
+			server_drop(u->idx);
+		} else if (!(conn_hot(u->idx)->flags & CONN_F_THROTTLED)) {
+			arm_recv(fd, u);
+		}
+	}
+	ufd_put(fd, u);
+}
+
+static void handle_poll(struct io_uring_cqe *cqe, int fd, struct uring_fd *u)
+{
+	if (cqe->res > 0 && u->idx != CONN_NONE && server_read(u->idx) < 0)
+		server_drop(u->idx);
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	u->recv = RECV_OFF;
+	if (u->idx != CONN_NONE) {
+		if (cqe->res < 0 && cqe->res != -ECANCELED) {
+			fprintf(stderr, "poll: %s\n", strerror(-cqe->res));
+			server_drop(u->idx);
+		} else {
+			arm_poll(fd, u);
+		}
+	}
+	ufd_put(fd, u);
+}
+
+static void handle_send(struct io_uring_cqe *cqe, int fd, struct uring_fd *u)
+{
+	struct send_req *r = u->sends;
+	uint32_t idx = u->idx;
+	struct outq *q;
+
+	u->sends = r->next;
+	req_free(r);
+
+	if (idx != CONN_NONE) {
+		q = &conn_cold(idx)->outq;
+		if (cqe->res >= 0) {
+			outq_consume(q, cqe->res);
+			server_sent(idx, cqe->res);
+		} else if (cqe->res != -ECANCELED) {
+			fprintf(stderr, "write to remote peer failed: %s\n", strerror(-cqe->res));
+			server_drop(idx);
+			idx = CONN_NONE;
+		}
+		/* Chain done: unpin and go again if more was queued meanwhile */
+		if (idx != CONN_NONE && !u->sends) {
+			q->pinned = 0;
+			if (q->count)
+				server_writable(idx);
+		}
+	}
+	ufd_put(fd, u);
+}
+
+static void ur_dispatch(void)
+{
+	unsigned int head = *ring.cq_head, tail, i;
+	struct io_uring_cqe *cqe;
+	struct uring_fd *u;
+	int fd;
+
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ring.cqes[head & ring.cq_mask];
+		fd = UDATA_FD(cqe->user_data);
+		u = fd < (int)nufds ? &ufds[fd] : NULL;
+
+		switch (UDATA_OP(cqe->user_data)) {
+		case OP_ACCEPT:
+			handle_accept(cqe, fd);
+			break;
+		case OP_RECV:
+			handle_recv(cqe, fd, u);
+			break;
+		case OP_SEND:
+			handle_send(cqe, fd, u);
+			break;
+		case OP_POLL:
+			handle_poll(cqe, fd, u);
+			break;
+		case OP_CANCEL:
+			if (!is_listener(fd))
+				ufd_put(fd, u);
+			break;
+		case OP_CLOSE:
+			if (cqe->res < 0)
+				fprintf(stderr, "close: %s\n", strerror(-cqe->res));
+			break;
+		}
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+	/* Buffers are all back now, starved receives can go again */
+	rbuf_publish();
+	for (i = 0; i < nkicked; i++) {
+		fd = kicked[i];
+		u = &ufds[fd];
+		if (u->idx == CONN_NONE)
+			continue;
+		replay(u);
+		if (u->idx != CONN_NONE && !u->held.count && u->recv == RECV_OFF &&
+		    !(conn_hot(u->idx)->flags & CONN_F_THROTTLED))
+			arm_recv(fd, u);
+	}
+	nkicked = 0;
+}
+
+/* Take the requests back so the listening socket is really closed on exit */
+static void ur_fini(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = get_sqe())) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		sqe->user_data = UDATA(OP_CANCEL, listen_sds[0]);
+	}
+	sys_io_uring_enter(sq_publish(), 0, 0, NULL, 0);
+	close(ring.fd);
+}
+
+const struct server_engine engine_uring = {
+	.name = "io_uring",
+	.descr = "completions via io_uring, multishot accept/recv, provided buffers",
+	.init = ur_init,
+	.add = ur_add,
+	.update = ur_update,
+	.send = ur_send,
+	.close = ur_close,
+	.listen = ur_listen,
+	.wait = ur_wait,
+	.dispatch = ur_dispatch,
+	.fini = ur_fini,
+};
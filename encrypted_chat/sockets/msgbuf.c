@@ -0,0 +1,255 @@
+/*
+ * msgbuf.c
+ *
+ * Message buffer arena and outbound queues.
+ *
+ * Buffers come in power of two size classes. Freed buffers are kept
+ * on a per-class free list, up to a cap, so the steady state relay
+ * path does not go through malloc at all.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+#include "msgbuf.h"
+
+#define MSGBUF_MIN_SHIFT	6	/* 64 byte smallest class */
+#define MSGBUF_CLASSES		12	/* up to 128 KiB */
+#define MSGBUF_CACHE_BYTES	(8 * 1024 * 1024)	/* per class */
+
+#define OUTQ_ENT_CACHE		4096
+
+static struct msgbuf *free_lists[MSGBUF_CLASSES];
+static size_t free_count[MSGBUF_CLASSES];
+static struct msgbuf_stats stats;
+
+static struct outq_ent *free_ents;
+static size_t free_ents_count;
+
+static inline size_t class_size(unsigned int cls)
+{
+	return (size_t)1 << (cls + MSGBUF_MIN_SHIFT);
+}
+
+static unsigned int size_class(size_t len)
+{
+	unsigned int cls = 0;
+
+	while (cls < MSGBUF_CLASSES && class_size(cls) < len)
+		cls++;
+	return cls;
+}
+
+struct msgbuf *msgbuf_alloc(size_t len)
+{
+	unsigned int cls = size_class(len);
+	struct msgbuf *mb;
+	size_t size;
+
+	if (cls < MSGBUF_CLASSES && (mb = free_lists[cls])) {
+		free_lists[cls] = mb->next_free;
+		free_count[cls]--;
+		stats.cached--;
+		stats.cached_bytes -= class_size(cls);
+	} else {
+		/* Oversized buffers get their own allocation, never cached */
+		size = cls < MSGBUF_CLASSES ? class_size(cls) : len;
+		if (!(mb = malloc(sizeof(*mb) + size)))
+			return NULL;
+		mb->cls = cls;
+	}
+
+	mb->refcnt = 1;
+	mb->len = len;
+	mb->next_free = NULL;
+	stats.live++;
+	stats.live_bytes += mb->cls < MSGBUF_CLASSES ? class_size(mb->cls) : len;
+
+	return mb;
+}
+
+void msgbuf_put(struct msgbuf *mb)
+{
+	unsigned int cls = mb->cls;
+
+	if (--mb->refcnt > 0)
+		return;
+
+	stats.live--;
+	if (cls >= MSGBUF_CLASSES) {
+		stats.live_bytes -= mb->len;
+		free(mb);
+		return;
+	}
+	stats.live_bytes -= class_size(cls);
+
+	if ((free_count[cls] + 1) * class_size(cls) > MSGBUF_CACHE_BYTES) {
+		free(mb);
+		return;
+	}
+	mb->next_free = free_lists[cls];
+	free_lists[cls] = mb;
+	free_count[cls]++;
+	stats.cached++;
+	stats.cached_bytes += class_size(cls);
+}
+
+void msgbuf_get_stats(struct msgbuf_stats *st)
+{
+	*st = stats;
+}
+
+static struct outq_ent *ent_alloc(void)
+{
+	struct outq_ent *e = free_ents;
+
+	if (e) {
+		free_ents = e->next;
+		free_ents_count--;
+		return e;
+	}
+	return malloc(sizeof(*e));
+}
+
+static void ent_free(struct outq_ent *e)
+{
+	if (free_ents_count >= OUTQ_ENT_CACHE) {
+		free(e);
+		return;
+	}
+	e->next = free_ents;
+	free_ents = e;
+	free_ents_count++;
+}
+
+int outq_push(struct outq *q, struct msgbuf *mb)
+{
+	struct outq_ent *e;
+
+	if (!(e = ent_alloc()))
+		return -1;
+	e->mb = msgbuf_get(mb);
+	e->next = NULL;
+	if (q->tail)
+		q->tail->next = e;
+	else
+		q->head = e;
+	q->tail = e;
+	q->bytes += mb->len;
+	q->count++;
+
+	return 0;
+}
+
+void outq_consume(struct outq *q, size_t n)
+{
+	struct outq_ent *e;
+
+	q->bytes -= n;
+	n += q->off;
+	while ((e = q->head) && n >= e->mb->len) {
+		n -= e->mb->len;
+		q->head = e->next;
+		q->count--;
+		if (q->pinned)
+			q->pinned--;
+		msgbuf_put(e->mb);
+		ent_free(e);
+	}
+	if (!q->head)
+		q->tail = NULL;
+	q->off = n;
+}
+
+int outq_iov(struct outq *q, struct iovec *iov, int max, size_t *bytes)
+{
+	struct outq_ent *e;
+	int cnt = 0;
+
+	*bytes = 0;
+	for (e = q->head; e && cnt < max; e = e->next, cnt++) {
+		iov[cnt].iov_base = e->mb->data;
+		iov[cnt].iov_len = e->mb->len;
+		*bytes += e->mb->len;
+	}
+	if (cnt) {
+		iov[0].iov_base = (char *)iov[0].iov_base + q->off;
+		iov[0].iov_len -= q->off;
+		*bytes -= q->off;
+	}
+	return cnt;
+}
+
+ssize_t outq_flush(struct outq *q, int fd)
+{
+	struct iovec iov[OUTQ_IOV_MAX];
+	ssize_t ret, total = 0;
+	size_t want;
+	int cnt;
+
+	while (q->head) {
+		cnt = outq_iov(q, iov, OUTQ_IOV_MAX, &want);
+		ret = writev(fd, iov, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		outq_consume(q, ret);
+		total += ret;
+		/* A short write means the socket buffer is full */
+		if ((size_t)ret < want)
+			break;
+	}
+
+	return total;
+}
+
+size_t outq_drop_oldest(struct outq *q)
+{
+	struct outq_ent *e, **link = &q->head, *prev = NULL;
+	unsigned int skip = q->pinned;
+	size_t len;
+
+	/* A partially written head must go out whole, or the stream breaks */
+	if (q->off && !skip)
+		skip = 1;
+	while (skip-- && *link) {
+		prev = *link;
+		link = &prev->next;
+	}
+	if (!(e = *link))
+		return 0;
+
+	*link = e->next;
+	if (q->tail == e)
+		q->tail = prev;
+	len = e->mb->len;
+	q->bytes -= len;
+	q->count--;
+	msgbuf_put(e->mb);
+	ent_free(e);
+
+	return len;
+}
+
+void outq_clear(struct outq *q)
+{
+	struct outq_ent *e;
+
+	while ((e = q->head)) {
+		q->head = e->next;
+		msgbuf_put(e->mb);
+		ent_free(e);
+	}
+	q->tail = NULL;
+	q->off = 0;
+	q->bytes = 0;
+	q->count = 0;
+	q->pinned = 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * msgbuf.h
+ *
+ * Reference counted message buffers and per-connection outbound queues.
+ *
+ * A received frame is stored once in a msgbuf. Relaying it to a room
+ * links the same msgbuf into every recipient's outbound queue, each
+ * link holding a reference; the buffer goes back to the arena when
+ * the last recipient has written it out. The server is single
+ * threaded, so reference counts are plain integers.
+ */
+
+#ifndef _MSGBUF_H
+#define _MSGBUF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct msgbuf {
+	unsigned int refcnt;
+	unsigned int cls;		/* arena size class */
+	size_t len;			/* bytes of data in use */
+	struct msgbuf *next_free;
+	unsigned char data[];
+};
+
+struct msgbuf_stats {
+	size_t live;			/* buffers referenced by someone */
+	size_t live_bytes;		/* their allocated size */
+	size_t cached;			/* buffers kept on the free lists */
+	size_t cached_bytes;
+};
+
+/* Get a buffer for len bytes with one reference, NULL if out of memory */
+struct msgbuf *msgbuf_alloc(size_t len);
+
+static inline struct msgbuf *msgbuf_get(struct msgbuf *mb)
+{
+	mb->refcnt++;
+	return mb;
+}
+
+/* Drop a reference, the buffer is recycled when it was the last one */
+void msgbuf_put(struct msgbuf *mb);
+
+void msgbuf_get_stats(struct msgbuf_stats *st);
+
+/*
+ * Outbound queue: the msgbufs still to be written to one connection.
+ * off is how much of the head buffer has already been sent. pinned
+ * head buffers are in an asynchronous send and must not be dropped.
+ */
+struct outq_ent {
+	struct msgbuf *mb;
+	struct outq_ent *next;
+};
+
+#define OUTQ_IOV_MAX	64		/* buffers per writev() */
+
+struct outq {
+	struct outq_ent *head, *tail;
+	size_t off;
+	size_t bytes;			/* unsent bytes in the queue */
+	unsigned int count;		/* queued buffers */
+	unsigned int pinned;
+};
+
+/* Queue a buffer, taking a new reference on it. -1 if out of memory. */
+int outq_push(struct outq *q, struct msgbuf *mb);
+
+/*
+ * Write as much of the queue as the socket takes with writev().
+ * Returns the bytes written (0 if the socket is full), -1 on error.
+ */
+ssize_t outq_flush(struct outq *q, int fd);
+
+/*
+ * Describe up to max buffers from the head of the queue, for callers
+ * doing their own I/O. Sets *bytes to their total, returns the count.
+ */
+int outq_iov(struct outq *q, struct iovec *iov, int max, size_t *bytes);
+
+/* Release n bytes written from the head, for callers doing their own I/O */
+void outq_consume(struct outq *q, size_t n);
+
+/*
+ * Drop the oldest buffer that has not started going out on the wire.
+ * Returns the bytes dropped, 0 if only sent or pinned buffers are left.
+ */
+size_t outq_drop_oldest(struct outq *q);
+
+/* Drop everything still queued */
+void outq_clear(struct outq *q);
+
+#endif /* _MSGBUF_H */
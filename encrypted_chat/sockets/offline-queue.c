@@ -0,0 +1,458 @@
+/*
+ * offline-queue.c
+ *
+ * Per-recipient queues for users who are away, spilling to disk.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "chat-proto.h"
+#include "offline-queue.h"
+
+struct park {
+	struct offq_user **users;
+	uint32_t count, cap;
+};
+
+static char *offq_dir;
+static size_t mem_budget, mem_used;
+
+/* Users by nick, chained */
+static struct offq_user **htab;
+static uint32_t hsize, nusers;
+
+/* Indexed by room number, allocated on first use */
+static struct park *parks[UINT16_MAX + 1];
+
+/* Users with spilled messages to write out */
+static struct offq_user **dirty;
+static uint32_t ndirty, dirty_cap;
+
+static uint64_t total_queued, total_drops;
+
+static uint32_t nick_hash(const char *nick)
+{
+	uint32_t h = 2166136261u;
+
+	while (*nick)
+		h = (h ^ (unsigned char)*nick++) * 16777619u;
+	return h;
+}
+
+/* Nicks are whatever the clients say, so files are named by their hex */
+static void seg_path(char *buf, size_t sz, const struct offq_user *u, uint64_t seg)
+{
+	char hex[2 * OFFQ_NICK_LEN + 1];
+	size_t i;
+
+	for (i = 0; u->nick[i]; i++)
+		sprintf(hex + 2 * i, "%02x", (unsigned char)u->nick[i]);
+	hex[2 * i] = '\0';
+	snprintf(buf, sz, "%s/%s-%llu.q", offq_dir, hex, (unsigned long long)seg);
+}
+
+static void seg_unlink(const struct offq_user *u, uint64_t seg)
+{
+	char path[4096];
+
+	seg_path(path, sizeof(path), u, seg);
+	if (unlink(path) < 0 && errno != ENOENT)
+		perror(path);
+}
+
+/* Remove what an earlier run left behind */
+static void clean_dir(void)
+{
+	char path[4096];
+	struct dirent *de;
+	size_t len;
+	DIR *d;
+
+	if (!(d = opendir(offq_dir)))
+		return;
+	while ((de = readdir(d))) {
+		len = strlen(de->d_name);
+		if (len < 3 || strcmp(de->d_name + len - 2, ".q"))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", offq_dir, de->d_name);
+		unlink(path);
+	}
+	closedir(d);
+}
+
+int offq_init(const char *dir, size_t total_mem)
+{
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		perror(dir);
+		return -1;
+	}
+	if (!(offq_dir = strdup(dir)))
+		return -1;
+	hsize = 256;
+	if (!(htab = calloc(hsize, sizeof(*htab))))
+		return -1;
+	mem_budget = total_mem;
+	clean_dir();
+	return 0;
+}
+
+static void user_free(struct offq_user *u)
+{
+	uint64_t seg;
+
+	outq_clear(&u->mem);
+	outq_clear(&u->spill);
+	if (u->next)
+		msgbuf_put(u->next);
+	if (u->spilled)
+		for (seg = u->rseg; seg <= u->wseg; seg++)
+			seg_unlink(u, seg);
+	free(u->rbuf);
+	free(u);
+}
+
+void offq_fini(void)
+{
+	struct offq_user *u;
+	uint32_t i;
+
+	for (i = 0; i < hsize; i++)
+		while ((u = htab[i])) {
+			htab[i] = u->hnext;
+			user_free(u);
+		}
+	for (i = 0; i <= UINT16_MAX; i++) {
+		if (parks[i])
+			free(parks[i]->users);
+		free(parks[i]);
+		parks[i] = NULL;
+	}
+	free(htab);
+	free(dirty);
+	free(offq_dir);
+	htab = NULL;
+	dirty = NULL;
+	offq_dir = NULL;
+	hsize = nusers = ndirty = dirty_cap = 0;
+	mem_used = 0;
+}
+
+static void htab_grow(void)
+{
+	struct offq_user **t, *u;
+	uint32_t size = hsize * 2, i, b;
+
+	if (!(t = calloc(size, sizeof(*t))))
+		return;		/* chains just get longer */
+	for (i = 0; i < hsize; i++)
+		while ((u = htab[i])) {
+			htab[i] = u->hnext;
+			b = nick_hash(u->nick) & (size - 1);
+			u->hnext = t[b];
+			t[b] = u;
+		}
+	free(htab);
+	htab = t;
+	hsize = size;
+}
+
+struct offq_user *offq_user(const char *nick, int create)
+{
+	struct offq_user *u;
+	uint32_t b;
+
+	if (!htab || !*nick)
+		return NULL;
+	b = nick_hash(nick) & (hsize - 1);
+	for (u = htab[b]; u; u = u->hnext)
+		if (!strncmp(u->nick, nick, OFFQ_NICK_LEN - 1))
+			return u;
+	if (!create || !(u = calloc(1, sizeof(*u))))
+		return NULL;
+
+	strncpy(u->nick, nick, OFFQ_NICK_LEN - 1);
+	u->conn = UINT32_MAX;
+	if (++nusers > hsize * 2)
+		htab_grow();
+	b = nick_hash(u->nick) & (hsize - 1);
+	u->hnext = htab[b];
+	htab[b] = u;
+	return u;
+}
+
+int offq_park(struct offq_user *u, uint16_t room)
+{
+	struct park *p = parks[room];
+
+	offq_unpark(u);
+	if (!p && !(p = parks[room] = calloc(1, sizeof(*p))))
+		return -1;
+	if (p->count == p->cap) {
+		uint32_t cap = p->cap ? p->cap * 2 : 8;
+		struct offq_user **users;
+
+		if (!(users = realloc(p->users, cap * sizeof(*users))))
+			return -1;
+		p->users = users;
+		p->cap = cap;
+	}
+	u->room = room;
+	u->room_slot = p->count;
+	u->parked = 1;
+	p->users[p->count++] = u;
+	return 0;
+}
+
+void offq_unpark(struct offq_user *u)
+{
+	struct park *p = parks[u->room];
+	struct offq_user *last;
+
+	if (!u->parked || !p)
+		return;
+
+	/* Move the last one into the hole */
+	last = p->users[--p->count];
+	p->users[u->room_slot] = last;
+	last->room_slot = u->room_slot;
+	u->parked = 0;
+
+	if (p->count == 0) {
+		free(p->users);
+		free(p);
+		parks[u->room] = NULL;
+	}
+}
+
+static int mark_dirty(struct offq_user *u)
+{
+	struct offq_user **d;
+	uint32_t cap;
+
+	if (u->dirty)
+		return 0;
+	if (ndirty == dirty_cap) {
+		cap = dirty_cap ? dirty_cap * 2 : 64;
+		if (!(d = realloc(dirty, cap * sizeof(*d))))
+			return -1;
+		dirty = d;
+		dirty_cap = cap;
+	}
+	dirty[ndirty++] = u;
+	u->dirty = 1;
+	return 0;
+}
+
+void offq_push(struct offq_user *u, struct msgbuf *mb)
+{
+	size_t len = mb->len;
+
+	total_queued++;
+	if (!u->spilled && u->mem.bytes + len <= OFFQ_USER_MEM &&
+	    mem_used + len <= mem_budget && outq_push(&u->mem, mb) == 0) {
+		mem_used += len;
+		return;
+	}
+	/* The rest waits for the end of the round, to go out in one writev() */
+	if (u->disk_bytes + u->spill.bytes + len > OFFQ_USER_DISK ||
+	    mark_dirty(u) < 0 || outq_push(&u->spill, mb) < 0) {
+		u->drops++;
+		total_drops++;
+		return;
+	}
+	u->spilled = 1;
+}
+
+void offq_push_room(uint16_t room, struct msgbuf *mb)
+{
+	struct park *p = parks[room];
+	uint32_t i;
+
+	if (!p)
+		return;
+	for (i = 0; i < p->count; i++)
+		offq_push(p->users[i], mb);
+}
+
+static void spill_write(struct offq_user *u)
+{
+	char path[4096];
+	ssize_t n;
+	int fd;
+
+	if (!u->spill.head)
+		return;
+	if (u->wseg_bytes >= OFFQ_SEG_SIZE) {
+		u->wseg++;
+		u->wseg_bytes = 0;
+	}
+	seg_path(path, sizeof(path), u, u->wseg);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600)) < 0) {
+		perror(path);
+		goto drop;
+	}
+	if ((n = outq_flush(&u->spill, fd)) < 0) {
+		perror(path);
+		/* No torn frame left behind for the reader */
+		if (ftruncate(fd, u->wseg_bytes) < 0)
+			perror(path);
+		close(fd);
+		goto drop;
+	}
+	close(fd);
+	u->wseg_bytes += n;
+	u->disk_bytes += n;
+	return;
+
+drop:
+	u->drops += u->spill.count;
+	total_drops += u->spill.count;
+	outq_clear(&u->spill);
+}
+
+void offq_flush(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < ndirty; i++) {
+		spill_write(dirty[i]);
+		dirty[i]->dirty = 0;
+	}
+	ndirty = 0;
+}
+
+/* Cut the next frame out of the segments, reading ahead a chunk at a time */
+static struct msgbuf *disk_next(struct offq_user *u)
+{
+	struct chat_hdr hdr;
+	struct msgbuf *mb;
+	size_t avail, len;
+	char path[4096];
+	ssize_t n;
+	int fd;
+
+	if (!u->rbuf && !(u->rbuf = malloc(OFFQ_READ_AHEAD)))
+		return NULL;
+	for (;;) {
+		avail = u->rlen - u->rpos;
+		if (avail >= CHAT_HDR_SIZE) {
+			memcpy(&hdr, u->rbuf + u->rpos, CHAT_HDR_SIZE);
+			len = CHAT_HDR_SIZE + ntohl(hdr.len);
+			if (len > OFFQ_READ_AHEAD)
+				break;
+			if (avail >= len) {
+				if (!(mb = msgbuf_alloc(len)))
+					return NULL;
+				memcpy(mb->data, u->rbuf + u->rpos, len);
+				u->rpos += len;
+				u->disk_bytes -= len;
+				return mb;
+			}
+		}
+
+		memmove(u->rbuf, u->rbuf + u->rpos, avail);
+		u->rlen = avail;
+		u->rpos = 0;
+		seg_path(path, sizeof(path), u, u->rseg);
+		if ((fd = open(path, O_RDONLY)) < 0) {
+			perror(path);
+			return NULL;
+		}
+		n = pread(fd, u->rbuf + u->rlen, OFFQ_READ_AHEAD - u->rlen, u->roff);
+		close(fd);
+		if (n < 0) {
+			perror(path);
+			return NULL;
+		}
+		if (n == 0) {
+			/* Frames never straddle segments */
+			if (u->rseg == u->wseg || avail)
+				break;
+			seg_unlink(u, u->rseg++);
+			u->roff = 0;
+			continue;
+		}
+		u->roff += n;
+		u->rlen += n;
+	}
+
+	fprintf(stderr, "Offline queue of %s is corrupt, %llu bytes lost\n", u->nick,
+		(unsigned long long)u->disk_bytes);
+	u->drops++;
+	total_drops++;
+	u->disk_bytes = 0;
+	u->rlen = u->rpos = 0;
+	return NULL;
+}
+
+struct msgbuf *offq_peek(struct offq_user *u)
+{
+	if (u->mem.head)
+		return u->mem.head->mb;
+	if (!u->next && u->disk_bytes)
+		u->next = disk_next(u);
+	if (u->next)
+		return u->next;
+	if (!u->disk_bytes && u->spill.head)
+		return u->spill.head->mb;
+	return NULL;
+}
+
+void offq_pop(struct offq_user *u)
+{
+	if (u->mem.head) {
+		mem_used -= outq_drop_oldest(&u->mem);
+		return;
+	}
+	if (u->next) {
+		msgbuf_put(u->next);
+		u->next = NULL;
+	} else if (u->spill.head) {
+		outq_drop_oldest(&u->spill);
+	}
+
+	/* Caught up with the disk: back to memory, from a new segment */
+	if (u->spilled && !u->next && !u->disk_bytes && !u->spill.head) {
+		seg_unlink(u, u->rseg);
+		if (u->wseg != u->rseg)
+			seg_unlink(u, u->wseg);
+		u->rseg = u->wseg = u->wseg + 1;
+		u->roff = u->wseg_bytes = 0;
+		free(u->rbuf);
+		u->rbuf = NULL;
+		u->rlen = u->rpos = 0;
+		u->spilled = 0;
+	}
+}
+
+int offq_pending(const struct offq_user *u)
+{
+	return u->mem.head || u->next || u->disk_bytes || u->spill.head;
+}
+
+void offq_get_stats(struct offq_stats *st)
+{
+	struct offq_user *u;
+	uint32_t i;
+
+	memset(st, 0, sizeof(*st));
+	st->users = nusers;
+	st->mem_bytes = mem_used;
+	st->queued = total_queued;
+	st->drops = total_drops;
+	for (i = 0; i < hsize; i++)
+		for (u = htab[i]; u; u = u->hnext) {
+			st->parked += u->parked;
+			st->spilled += u->spilled;
+			st->disk_bytes += u->disk_bytes;
+		}
+}
@@ -0,0 +1,92 @@
+/*
+ * offline-queue.h
+ *
+ * Messages held for named recipients who are not connected.
+ *
+ * A client names itself with CHAT_MSG_HELLO. When it goes away it is
+ * parked in its room, and what the room says meanwhile is queued for
+ * it: in memory, as references to the relayed msgbufs, until its own
+ * or the server-wide budget is reached, then on disk. Once a user has
+ * spilled, newer messages follow to disk until it has caught up, so
+ * the order holds. Spilled messages are written out once per round
+ * per user, as the raw frames, to segment files under the queue
+ * directory that are deleted as they are read back.
+ *
+ * The queues only live as long as the server; leftover segments are
+ * removed at startup.
+ */
+
+#ifndef _OFFLINE_QUEUE_H
+#define _OFFLINE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msgbuf.h"
+
+#define OFFQ_NICK_LEN		32
+#define OFFQ_USER_MEM		(256 * 1024)		/* in memory per user */
+#define OFFQ_TOTAL_MEM		(64 * 1024 * 1024)	/* in memory, all users */
+#define OFFQ_USER_DISK		(64ULL * 1024 * 1024)	/* on disk per user */
+#define OFFQ_SEG_SIZE		(4 * 1024 * 1024)
+#define OFFQ_READ_AHEAD		(256 * 1024)		/* bytes per read while draining */
+
+struct offq_user {
+	char nick[OFFQ_NICK_LEN];
+	struct offq_user *hnext;
+	uint32_t conn;			/* the server's, CONN_NONE while away */
+
+	uint16_t room;			/* parked in, if parked */
+	uint8_t parked;
+	uint8_t spilled;		/* newer messages go to disk */
+	uint8_t dirty;			/* spill waiting for offq_flush() */
+	uint32_t room_slot;
+
+	struct outq mem;		/* oldest messages */
+	struct outq spill;		/* newest, not written out yet */
+	uint64_t rseg, wseg;		/* segments being read and written */
+	uint64_t roff, wseg_bytes;
+	uint64_t disk_bytes;		/* written and not read back */
+	unsigned char *rbuf;		/* read ahead, while draining */
+	size_t rlen, rpos;
+	struct msgbuf *next;		/* frame taken off the disk */
+
+	uint64_t drops;			/* over the disk budget, since last asked */
+};
+
+struct offq_stats {
+	uint32_t users, parked, spilled;
+	size_t mem_bytes;
+	uint64_t disk_bytes;
+	uint64_t queued, drops;
+};
+
+/* Spill to dir, created if need be. -1 on error. */
+int offq_init(const char *dir, size_t total_mem);
+void offq_fini(void);
+
+/* Find a user by nick, creating it if create. NULL if unknown or out of memory. */
+struct offq_user *offq_user(const char *nick, int create);
+
+/* The user went away from room / came back */
+int offq_park(struct offq_user *u, uint16_t room);
+void offq_unpark(struct offq_user *u);
+
+/* Queue a message for one user, or for everyone parked in room */
+void offq_push(struct offq_user *u, struct msgbuf *mb);
+void offq_push_room(uint16_t room, struct msgbuf *mb);
+
+/*
+ * The oldest queued message, without taking it off the queue, NULL if
+ * there is none or the disk could not be read. offq_pop() drops it.
+ */
+struct msgbuf *offq_peek(struct offq_user *u);
+void offq_pop(struct offq_user *u);
+int offq_pending(const struct offq_user *u);
+
+/* Write the spilled messages of this round to disk */
+void offq_flush(void);
+
+void offq_get_stats(struct offq_stats *st);
+
+#endif /* _OFFLINE_QUEUE_H */
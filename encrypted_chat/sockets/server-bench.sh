@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Compare the server's I/O engines at different connection counts.
+# Usage: ./server-bench.sh [conns ...]   (default: 1000 10000)
+#
+# Set RATE (msg/s per connection), SECS, SIZE, GROUP (room size) and
+# PORT in the environment to change the load. With VSOCK_CID set, every
+# run is repeated over AF_VSOCK to that CID (1 = the local loopback
+# transport, needs the vsock_loopback module) to compare with TCP.
+# WORKERS=n shards the rooms over n server processes (-W).
+
+RATE=${RATE:-10}
+SECS=${SECS:-10}
+SIZE=${SIZE:-256}
+GROUP=${GROUP:-10}
+PORT=${PORT:-35100}
+LOG=$(mktemp)
+
+TRANSPORTS=tcp
+LISTEN="-l $PORT"
+if [ -n "$VSOCK_CID" ]; then
+	TRANSPORTS="tcp vsock"
+	LISTEN="$LISTEN -l vsock:$PORT"
+fi
+
+trap 'rm -f $LOG' EXIT
+ulimit -n $(ulimit -Hn) 2>/dev/null
+
+printf "%-9s %-6s %6s %12s %9s %9s %9s %10s\n" \
+	engine proto conns deliveries/s p50_us p99_us p99.9_us syscalls/msg
+for conns in ${@:-1000 10000}; do
+	for transport in $TRANSPORTS; do
+		host=127.0.0.1
+		[ $transport = vsock ] && host=vsock:$VSOCK_CID
+		for engine in select epoll io_uring; do
+			# select cannot watch descriptors past FD_SETSIZE (1024)
+			if [ $engine = select ] && [ $conns -gt 1000 ]; then
+				printf "%-9s %-6s %6s %12s\n" $engine $transport $conns n/a
+				continue
+			fi
+
+			./socket-server -e $engine ${WORKERS:+-W $WORKERS} $LISTEN >$LOG 2>&1 &
+			pid=$!
+			sleep 0.5
+			out=$(./chat-load -c $conns -g $GROUP -s $SIZE -r $RATE -t $SECS $host $PORT 2>/dev/null)
+			kill -INT $pid
+			wait $pid
+
+			rate=$(echo "$out" | sed -n 's/.*deliveries\/s=\([0-9]*\).*/\1/p')
+			p50=$(echo "$out" | sed -n 's/.* p50=\([0-9.]*\).*/\1/p')
+			p99=$(echo "$out" | sed -n 's/.* p99=\([0-9.]*\).*/\1/p')
+			p999=$(echo "$out" | sed -n 's/.* p99\.9=\([0-9.]*\).*/\1/p')
+			sys=$(sed -n 's/.* \([0-9.]*\) per message/\1/p' $LOG | head -1)
+			printf "%-9s %-6s %6s %12s %9s %9s %9s %10s\n" $engine $transport $conns \
+				"${rate:-fail}" "$p50" "$p99" "$p999" "$sys"
+		done
+	done
+done
@@ -0,0 +1,77 @@
+/*
+ * server-engine.h
+ *
+ * I/O engines of the chat server.
+ *
+ * The relay logic in socket-server.c does not care how bytes get in
+ * and out of the sockets. An engine watches the listening socket and
+ * the clients, and calls back into the server when something happens.
+ *
+ *   select    readiness, rebuilds the fd sets every round; FD_SETSIZE
+ *             clients at most, kept as the baseline
+ *   epoll     readiness, the default
+ *   io_uring  completions: accept and receive requests stay armed in
+ *             the kernel, sends are submitted together once per round
+ */
+
+#ifndef _SERVER_ENGINE_H
+#define _SERVER_ENGINE_H
+
+#include <stdint.h>
+
+#include "chat-addr.h"
+
+struct server_engine {
+	const char *name;
+	const char *descr;
+
+	/* Watch the n listening sockets */
+	int (*init)(const int *listen_sds, int n);
+	/* Start watching a new client, after conn_alloc(). -1 to refuse it. */
+	int (*add)(uint32_t idx);
+	/* The client's pending bytes or throttled flag changed */
+	void (*update)(uint32_t idx);
+	/* Write out the client's outbound queue, -1 if the connection failed */
+	int (*send)(uint32_t idx);
+	/* Stop watching a client and close its descriptor */
+	void (*close)(uint32_t idx);
+	/* Stop or resume accepting connections */
+	void (*listen)(int on);
+	/* Wait up to timeout_ms (-1 = forever) for I/O. -1 on error. */
+	int (*wait)(int timeout_ms);
+	/* Handle what the last wait() brought in */
+	void (*dispatch)(void);
+	/* Release kernel resources on shutdown, may be NULL */
+	void (*fini)(void);
+};
+
+extern const struct server_engine engine_select;
+extern const struct server_engine engine_epoll;
+extern const struct server_engine engine_uring;
+
+/* I/O system calls made by the server, for syscalls/message figures */
+extern uint64_t engine_syscalls;
+
+/*
+ * Callbacks into the server. Engines call them from dispatch() or,
+ * for server_sent(), from send().
+ */
+
+/* Accept every pending connection on a readable listening socket */
+void server_accept_all(int listen_sd);
+/* A connection was accepted, the server takes fd over */
+void server_accept(int fd, const union chat_sockaddr *sa);
+/* accept() failed with err */
+void server_accept_failed(int err);
+/* Readiness engines: the client is readable. -1 to drop it. */
+int server_read(uint32_t idx);
+/* Completion engines: n bytes arrived from the client. -1 to drop it. */
+int server_input(uint32_t idx, const unsigned char *data, size_t n);
+/* n bytes of the client's outbound queue are on the wire */
+void server_sent(uint32_t idx, size_t n);
+/* The client can take more output */
+void server_writable(uint32_t idx);
+/* The connection failed or the peer went away */
+void server_drop(uint32_t idx);
+
+#endif /* _SERVER_ENGINE_H */
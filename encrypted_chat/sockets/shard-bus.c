@@ -0,0 +1,220 @@
+/*
+ * shard-bus.c
+ *
+ * Worker processes, room ownership and subscriptions.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "chat-addr.h"
+#include "shard-bus.h"
+
+unsigned int shard_self;
+uint64_t shard_live;
+uint64_t shard_token;
+
+static const char *bus_dir;
+static pid_t workers[SHARD_MAX];	/* parent: pid per slot, 0 if free */
+
+/* Bit per worker subscribed to the room here */
+static uint64_t subs[UINT16_MAX + 1];
+
+static volatile sig_atomic_t sig_stop, sig_spawn, sig_dump;
+
+static const int master_signals[] = { SIGINT, SIGTERM, SIGUSR1, SIGUSR2, SIGCHLD };
+#define NMASTER_SIGNALS	(sizeof(master_signals) / sizeof(master_signals[0]))
+
+static void master_signal(int signo)
+{
+	if (signo == SIGUSR2)
+		sig_spawn = 1;
+	else if (signo == SIGUSR1)
+		sig_dump = 1;
+	else if (signo != SIGCHLD)
+		sig_stop = signo;
+}
+
+void shard_path(char *buf, size_t sz, unsigned int worker)
+{
+	snprintf(buf, sz, "%s/worker-%u.sock", bus_dir, worker);
+}
+
+/*
+ * Start a worker in slot. The bus socket is made before the fork, so
+ * it takes connections from newer workers as soon as they start.
+ * Returns 0 in the worker, 1 in the parent, -1 on error.
+ */
+static int spawn(unsigned int slot, int *bus_sd, uint64_t *peers, const sigset_t *orig)
+{
+	char path[108], spec[128];
+	unsigned int i;
+	pid_t pid;
+	int sd;
+
+	shard_path(path, sizeof(path), slot);
+	snprintf(spec, sizeof(spec), "shm:%s", path);
+	if ((sd = chat_listen(spec, SOMAXCONN)) < 0)
+		return -1;
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		close(sd);
+		return -1;
+	}
+	if (pid == 0) {
+		for (i = 0; i < NMASTER_SIGNALS; i++)
+			signal(master_signals[i], SIG_DFL);
+		sigprocmask(SIG_SETMASK, orig, NULL);
+		shard_self = slot;
+		shard_live = 1ULL << slot;
+		*bus_sd = sd;
+		*peers = 0;
+		for (i = 0; i < SHARD_MAX; i++)
+			if (workers[i])
+				*peers |= 1ULL << i;
+		return 0;
+	}
+	close(sd);
+	workers[slot] = pid;
+	fprintf(stderr, "Worker %u started, pid %d\n", slot, (int)pid);
+	return 1;
+}
+
+static void signal_workers(int signo)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHARD_MAX; i++)
+		if (workers[i])
+			kill(workers[i], signo);
+}
+
+int shard_start(unsigned int n, const char *dir, int *bus_sd, uint64_t *peers)
+{
+	unsigned int i, running;
+	struct sigaction act;
+	sigset_t block, orig;
+	int stopping = 0, status;
+	pid_t pid;
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		perror(dir);
+		return -1;
+	}
+	bus_dir = dir;
+	if (getrandom(&shard_token, sizeof(shard_token), 0) != sizeof(shard_token)) {
+		perror("getrandom");
+		return -1;
+	}
+
+	/* Signals are only taken in sigsuspend(), nothing is missed in between */
+	sigemptyset(&block);
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = master_signal;
+	for (i = 0; i < NMASTER_SIGNALS; i++) {
+		sigaddset(&block, master_signals[i]);
+		sigaction(master_signals[i], &act, NULL);
+	}
+	sigprocmask(SIG_BLOCK, &block, &orig);
+
+	for (i = 0; i < n && i < SHARD_MAX; i++)
+		if (spawn(i, bus_sd, peers, &orig) == 0)
+			return shard_self;
+
+	for (;;) {
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			for (i = 0; i < SHARD_MAX; i++)
+				if (workers[i] == pid) {
+					fprintf(stderr, "Worker %u (pid %d) exited with status %d\n",
+						i, (int)pid, status);
+					workers[i] = 0;
+				}
+		if (sig_stop) {
+			if (!stopping)
+				signal_workers(sig_stop);
+			stopping = 1;
+			sig_stop = 0;
+		}
+		if (sig_dump) {
+			sig_dump = 0;
+			signal_workers(SIGUSR1);
+		}
+		if (sig_spawn && !stopping) {
+			sig_spawn = 0;
+			for (i = 0; i < SHARD_MAX && workers[i]; i++)
+				;
+			if (i == SHARD_MAX)
+				fprintf(stderr, "Already running %d workers\n", SHARD_MAX);
+			else if (spawn(i, bus_sd, peers, &orig) == 0)
+				return shard_self;
+		}
+
+		for (i = running = 0; i < SHARD_MAX; i++)
+			running += workers[i] != 0;
+		if (!running) {
+			if (!stopping)
+				fprintf(stderr, "No workers left\n");
+			rmdir(bus_dir);
+			exit(!stopping);
+		}
+		sigsuspend(&orig);
+	}
+}
+
+/* splitmix64 finalizer */
+static uint64_t mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+unsigned int shard_owner(uint16_t room)
+{
+	uint64_t live = shard_live, best = 0, score;
+	unsigned int w, owner = shard_self;
+
+	/* Highest random weight: a new worker only takes the rooms it wins */
+	for (w = 0; live; w++, live >>= 1) {
+		if (!(live & 1))
+			continue;
+		score = mix((uint64_t)room << 8 | w);
+		if (score >= best) {
+			best = score;
+			owner = w;
+		}
+	}
+	return owner;
+}
+
+void shard_sub(uint16_t room, unsigned int worker)
+{
+	subs[room] |= 1ULL << worker;
+}
+
+void shard_unsub(uint16_t room, unsigned int worker)
+{
+	subs[room] &= ~(1ULL << worker);
+}
+
+uint64_t shard_subs(uint16_t room)
+{
+	return subs[room];
+}
+
+void shard_forget(unsigned int worker)
+{
+	uint32_t room;
+
+	for (room = 0; room <= UINT16_MAX; room++)
+		subs[room] &= ~(1ULL << worker);
+}
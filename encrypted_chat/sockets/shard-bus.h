@@ -0,0 +1,76 @@
+/*
+ * shard-bus.h
+ *
+ * Rooms sharded across worker processes of the chat server.
+ *
+ * With -W n the server forks n workers, which share the listening
+ * sockets and each keep the clients they accept. Every room is owned
+ * by one worker, picked by rendezvous hashing over the workers alive,
+ * so a new worker only takes over the rooms it wins and the others go
+ * on as they were.
+ *
+ * Workers are linked pairwise by the shared memory rings of shm-ring.h,
+ * set up through a bus socket per worker: a new worker connects to the
+ * bus socket of each one already running, which is how those learn
+ * about it, and a worker closes its links when it exits, which is how
+ * they learn it is gone; like a shared memory client, a worker that
+ * crashes is not noticed. Links are connections like the clients' in
+ * each worker's table.
+ *
+ * A worker with clients in a room it does not own subscribes to the
+ * room at its owner. A room message is delivered to the local members
+ * at once and sent to the owner, which passes it on to its other
+ * subscribers. Frames cross the rings untouched. When every worker's
+ * set of live workers is a subset of the next one's, as when workers
+ * are only added, a message cannot be passed around in a loop.
+ *
+ * The parent only supervises: SIGUSR2 starts one more worker, SIGINT,
+ * SIGTERM and SIGUSR1 are passed on to all of them.
+ */
+
+#ifndef _SHARD_BUS_H
+#define _SHARD_BUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHARD_MAX		64		/* workers, one bit each */
+#define SHARD_NONE		0xff
+#define SHARD_LINK_QUEUE	16		/* x max_queue, before a link drops messages */
+
+/* Frame types that only travel between workers */
+#define BUS_MSG_WORKER	0x8001	/* first frame on a link, struct bus_hello */
+#define BUS_MSG_SUB	0x8002	/* the sender has clients in hdr.room */
+#define BUS_MSG_UNSUB	0x8003	/* and now it has none */
+
+/* Same host, same binary: host byte order */
+struct bus_hello {
+	uint64_t token;			/* drawn by the parent, shared by its workers */
+	uint32_t worker;
+} __attribute__((packed));
+
+extern unsigned int shard_self;		/* this worker */
+extern uint64_t shard_live;		/* workers linked to, and this one */
+extern uint64_t shard_token;
+
+/*
+ * Fork n workers and supervise them, the parent never returns. In a
+ * worker, returns with its bus listening socket in *bus_sd and the
+ * workers it must link to in *peers. -1 if none could be started.
+ */
+int shard_start(unsigned int n, const char *dir, int *bus_sd, uint64_t *peers);
+
+/* Path of a worker's bus socket */
+void shard_path(char *buf, size_t sz, unsigned int worker);
+
+/* Owner of room among the live workers */
+unsigned int shard_owner(uint16_t room);
+
+/* Subscriptions held at this worker, as owner */
+void shard_sub(uint16_t room, unsigned int worker);
+void shard_unsub(uint16_t room, unsigned int worker);
+uint64_t shard_subs(uint16_t room);
+/* A worker went away, drop all of its subscriptions */
+void shard_forget(unsigned int worker);
+
+#endif /* _SHARD_BUS_H */
@@ -0,0 +1,522 @@
+/*
+ * shm-ring.c
+ *
+ * Shared memory transport between the chat server and clients on the
+ * same host.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+#include "socket-common.h"
+#include "shm-ring.h"
+
+#define SHM_MAP_SIZE	(SHM_HDR_SIZE + 2 * SHM_RING_SIZE)
+#define SHM_NFDS	3		/* memfd, client's eventfd, server's eventfd */
+
+static inline uint32_t load_acquire(const uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(uint32_t *p, uint32_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/*
+ * Publishing an index and then reading the peer's wanted flag must
+ * not be reordered, or both sides could go to sleep at once.
+ */
+static inline void full_fence(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void kick(struct shm_chan *c)
+{
+	uint64_t one = 1;
+
+	c->kicks++;
+	if (write(c->kick_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write");
+}
+
+/* Tell the peer about new data or room if it asked to be told */
+static void kick_if_wanted(struct shm_chan *c, uint32_t *wanted)
+{
+	full_fence();
+	if (__atomic_load_n(wanted, __ATOMIC_RELAXED)) {
+		__atomic_store_n(wanted, 0, __ATOMIC_RELAXED);
+		kick(c);
+	}
+}
+
+static void chan_setup(struct shm_chan *c, void *map, int server)
+{
+	unsigned char *data = (unsigned char *)map + SHM_HDR_SIZE;
+	int tx = server ? SHM_S2C : SHM_C2S;
+
+	c->region = map;
+	c->size = c->region->ring_size;
+	c->tx = &c->region->ring[tx];
+	c->rx = &c->region->ring[!tx];
+	c->txd = data + (size_t)tx * c->size;
+	c->rxd = data + (size_t)!tx * c->size;
+	/* Our own indices are kept here, a client cannot move them */
+	c->tx_tail = c->tx->tail;
+	c->rx_head = c->rx->head;
+	c->kicks = 0;
+}
+
+int shm_accept(int sock, struct shm_chan *c)
+{
+	int fds[SHM_NFDS] = { -1, -1, -1 };
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	void *map;
+
+	memset(c, 0, sizeof(*c));
+	c->wait_fd = c->kick_fd = -1;
+
+	/* Sealed, so the client cannot shrink it under us */
+	if ((fds[0] = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+		perror("memfd_create");
+		goto fail;
+	}
+	if (ftruncate(fds[0], SHM_MAP_SIZE) < 0 ||
+	    fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		perror("memfd setup");
+		goto fail;
+	}
+	map = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto fail;
+	}
+	((struct shm_region *)map)->magic = SHM_MAGIC;
+	((struct shm_region *)map)->ring_size = SHM_RING_SIZE;
+	/* Both sides start out asleep, the first frame each way kicks */
+	((struct shm_region *)map)->ring[SHM_C2S].data_wanted = 1;
+	((struct shm_region *)map)->ring[SHM_S2C].data_wanted = 1;
+	chan_setup(c, map, 1);
+
+	if ((fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+	    (fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("eventfd");
+		goto fail;
+	}
+
+	/* One byte of payload to carry the descriptors */
+	iov.iov_base = "S";
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != 1) {
+		perror("sendmsg");
+		goto fail;
+	}
+
+	close(fds[0]);
+	c->kick_fd = fds[1];
+	c->wait_fd = fds[2];
+	c->sock = sock;
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+		c->peer_pid = cred.pid;
+	return 0;
+
+fail:
+	if (c->region)
+		munmap(c->region, SHM_MAP_SIZE);
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	if (fds[2] >= 0)
+		close(fds[2]);
+	c->region = NULL;
+	return -1;
+}
+
+int shm_connect(const char *path, struct shm_chan *c)
+{
+	int fds[SHM_NFDS];
+	char cbuf[CMSG_SPACE(sizeof(fds))], byte;
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct stat st;
+	uint32_t size;
+	void *map;
+	int sd;
+
+	memset(c, 0, sizeof(*c));
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "Socket path %s too long\n", path);
+		return -1;
+	}
+	if ((sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (connect(sd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		perror("connect");
+		goto fail;
+	}
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+		fprintf(stderr, "Server at %s did not offer shared memory\n", path);
+		goto fail;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		fprintf(stderr, "Server at %s sent no descriptors\n", path);
+		goto fail;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if (fstat(fds[0], &st) < 0 || st.st_size < SHM_HDR_SIZE) {
+		fprintf(stderr, "Bad shared memory from the server\n");
+		goto fail_fds;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto fail_fds;
+	}
+	size = ((struct shm_region *)map)->ring_size;
+	if (((struct shm_region *)map)->magic != SHM_MAGIC || !size || (size & (size - 1)) ||
+	    SHM_HDR_SIZE + 2 * (off_t)((struct shm_region *)map)->ring_size != st.st_size) {
+		fprintf(stderr, "Bad shared memory from the server\n");
+		munmap(map, st.st_size);
+		goto fail_fds;
+	}
+	close(fds[0]);
+	chan_setup(c, map, 0);
+	c->wait_fd = fds[1];
+	c->kick_fd = fds[2];
+	c->sock = sd;
+	return 0;
+
+fail_fds:
+	close(fds[0]);
+	close(fds[1]);
+	close(fds[2]);
+fail:
+	close(sd);
+	return -1;
+}
+
+void shm_close(struct shm_chan *c)
+{
+	if (!c->region)
+		return;
+	store_release(&c->tx->closed, 1);
+	kick(c);
+	munmap(c->region, SHM_HDR_SIZE + 2 * (size_t)c->size);
+	c->region = NULL;
+	if (c->wait_fd >= 0)
+		close(c->wait_fd);
+	close(c->kick_fd);
+	close(c->sock);
+}
+
+/* Free space in the tx ring, -1 if the consumer's index is impossible */
+static int64_t tx_room(struct shm_chan *c)
+{
+	uint32_t used = c->tx_tail - load_acquire(&c->tx->head);
+
+	if (used > c->size)
+		return -1;
+	return c->size - used;
+}
+
+/* Copy into the tx ring at the local tail, the caller publishes */
+static void ring_put(struct shm_chan *c, const void *p, size_t n)
+{
+	uint32_t off = c->tx_tail & (c->size - 1);
+	size_t first = MIN(n, c->size - off);
+
+	memcpy(c->txd + off, p, first);
+	memcpy(c->txd, (const unsigned char *)p + first, n - first);
+	c->tx_tail += n;
+}
+
+ssize_t shm_writev(struct shm_chan *c, const struct iovec *iov, int cnt)
+{
+	int64_t room = tx_room(c);
+	size_t done = 0, n;
+	int i;
+
+	if (room < 0) {
+		errno = EPROTO;
+		return -1;
+	}
+	for (i = 0; i < cnt && room; i++) {
+		n = MIN(iov[i].iov_len, (size_t)room);
+		ring_put(c, iov[i].iov_base, n);
+		room -= n;
+		done += n;
+	}
+	if (!done) {
+		errno = EAGAIN;
+		return -1;
+	}
+	store_release(&c->tx->tail, c->tx_tail);
+	kick_if_wanted(c, &c->tx->data_wanted);
+	return done;
+}
+
+ssize_t shm_write(struct shm_chan *c, const void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return shm_writev(c, &iov, 1);
+}
+
+ssize_t shm_peek(struct shm_chan *c, struct iovec iov[2])
+{
+	uint32_t avail = load_acquire(&c->rx->tail) - c->rx_head;
+	uint32_t off = c->rx_head & (c->size - 1);
+
+	if (avail > c->size) {
+		errno = EPROTO;
+		return -1;
+	}
+	iov[0].iov_base = c->rxd + off;
+	iov[0].iov_len = MIN(avail, c->size - off);
+	iov[1].iov_base = c->rxd;
+	iov[1].iov_len = avail - iov[0].iov_len;
+	return avail;
+}
+
+void shm_consume(struct shm_chan *c, size_t n)
+{
+	if (!n)
+		return;
+	c->rx_head += n;
+	store_release(&c->rx->head, c->rx_head);
+	kick_if_wanted(c, &c->rx->room_wanted);
+}
+
+ssize_t shm_read(struct shm_chan *c, void *buf, size_t len)
+{
+	struct iovec iov[2];
+	ssize_t avail;
+	size_t first, n;
+
+	if ((avail = shm_peek(c, iov)) < 0)
+		return -1;
+	if (!avail) {
+		if (load_acquire(&c->rx->closed))
+			return 0;
+		errno = EAGAIN;
+		return -1;
+	}
+	n = MIN(len, (size_t)avail);
+	first = MIN(n, iov[0].iov_len);
+	memcpy(buf, iov[0].iov_base, first);
+	memcpy((unsigned char *)buf + first, iov[1].iov_base, n - first);
+	shm_consume(c, n);
+	return n;
+}
+
+/* Raise a wanted flag, and take it back if there is no need to sleep */
+static int arm(uint32_t *wanted, int (*ready)(struct shm_chan *), struct shm_chan *c)
+{
+	__atomic_store_n(wanted, 1, __ATOMIC_RELAXED);
+	full_fence();
+	if (!ready(c))
+		return 0;
+	/* Or the peer would kick us for nothing on its next move */
+	__atomic_store_n(wanted, 0, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static int rx_ready(struct shm_chan *c)
+{
+	return load_acquire(&c->rx->tail) != c->rx_head || load_acquire(&c->rx->closed);
+}
+
+static int tx_ready(struct shm_chan *c)
+{
+	return tx_room(c) != 0;
+}
+
+int shm_arm_rx(struct shm_chan *c)
+{
+	return arm(&c->rx->data_wanted, rx_ready, c);
+}
+
+int shm_arm_tx(struct shm_chan *c)
+{
+	return arm(&c->tx->room_wanted, tx_ready, c);
+}
+
+int shm_eof(struct shm_chan *c)
+{
+	return load_acquire(&c->rx->closed) && load_acquire(&c->rx->tail) == c->rx_head;
+}
+
+void shm_ack(struct shm_chan *c)
+{
+	uint64_t v;
+
+	if (read(c->wait_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		perror("eventfd read");
+}
+
+void shm_self_kick(struct shm_chan *c)
+{
+	uint64_t one = 1;
+
+	c->kicks++;
+	if (write(c->wait_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write");
+}
+
+/* Sleep until kicked. -1 with ECONNRESET once the server hangs up. */
+static int shm_wait(struct shm_chan *c)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = c->wait_fd, .events = POLLIN },
+		{ .fd = c->sock, .events = POLLIN },
+	};
+
+	if (poll(pfd, 2, -1) < 0)
+		return errno == EINTR ? 0 : -1;
+	/* Nothing is ever sent on it after the handshake */
+	if (pfd[1].revents) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	shm_ack(c);
+	return 0;
+}
+
+static int shm_insist_write(struct shm_chan *c, const void *buf, size_t cnt)
+{
+	ssize_t ret;
+
+	while (cnt > 0) {
+		if ((ret = shm_write(c, buf, cnt)) < 0) {
+			if (errno != EAGAIN)
+				return -1;
+			if (!shm_arm_tx(c) && shm_wait(c) < 0)
+				return -1;
+			continue;
+		}
+		buf = (const unsigned char *)buf + ret;
+		cnt -= ret;
+	}
+	return 0;
+}
+
+/* Returns 1, 0 on EOF before the first byte, -1 on error */
+static int shm_insist_read(struct shm_chan *c, void *buf, size_t cnt)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < cnt) {
+		if ((ret = shm_read(c, (unsigned char *)buf + done, cnt - done)) < 0) {
+			if (errno != EAGAIN)
+				return -1;
+			if (!shm_arm_rx(c) && shm_wait(c) < 0)
+				return -1;
+			continue;
+		}
+		if (ret == 0) {
+			if (!done)
+				return 0;
+			errno = ECONNRESET;
+			return -1;
+		}
+		done += ret;
+	}
+	return 1;
+}
+
+int shm_chat_send(struct shm_chan *c, uint16_t type, uint16_t room,
+		  const void *payload, uint32_t len)
+{
+	struct chat_hdr hdr = { .len = len, .type = type, .room = room };
+	struct iovec iov[2];
+	ssize_t ret;
+
+	/* Publish the frame in one go if it fits, like chat_send() */
+	chat_hdr_hton(&hdr);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = CHAT_HDR_SIZE;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+	if ((ret = shm_writev(c, iov, len ? 2 : 1)) < 0) {
+		if (errno != EAGAIN)
+			return -1;
+		ret = 0;
+	}
+	if ((size_t)ret == CHAT_HDR_SIZE + len)
+		return 0;
+
+	if ((size_t)ret < CHAT_HDR_SIZE) {
+		if (shm_insist_write(c, (char *)&hdr + ret, CHAT_HDR_SIZE - ret) < 0)
+			return -1;
+		ret = CHAT_HDR_SIZE;
+	}
+	ret -= CHAT_HDR_SIZE;
+	return shm_insist_write(c, (const char *)payload + ret, len - ret);
+}
+
+int shm_chat_recv(struct shm_chan *c, struct chat_hdr *hdr, void *buf, size_t bufsz)
+{
+	int ret;
+
+	if ((ret = shm_insist_read(c, hdr, CHAT_HDR_SIZE)) <= 0)
+		return ret;
+	chat_hdr_ntoh(hdr);
+	if (hdr->len > bufsz) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (hdr->len == 0)
+		return 1;
+	if ((ret = shm_insist_read(c, buf, hdr->len)) == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	return ret;
+}
@@ -0,0 +1,114 @@
+/*
+ * shm-ring.h
+ *
+ * Shared memory transport between the chat server and clients on the
+ * same host.
+ *
+ * A client connects to the server's Unix socket (shm:/path) and gets
+ * back, as SCM_RIGHTS, a memfd and two eventfds. The memfd holds two
+ * single-producer single-consumer byte rings, one per direction. Each
+ * side sleeps on its own eventfd and kicks the other one's. Frames go
+ * through the rings exactly as they would go through a TCP stream.
+ *
+ * A side only kicks its peer after the peer has said it is going to
+ * sleep (data_wanted, room_wanted), so while both are busy messages
+ * flow with no system calls at all. The Unix socket stays open
+ * without traffic: the client sees it hang up if the server dies.
+ *
+ * The server never trusts the indices the client writes; a ring that
+ * claims more than it can hold is a protocol error.
+ */
+
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "chat-proto.h"
+
+#define SHM_MAGIC		0x43485348	/* "CHSH" */
+#define SHM_RING_SIZE		(256 * 1024)	/* per direction, power of 2 */
+#define SHM_HDR_SIZE		4096		/* ring headers, then the data */
+
+#define SHM_C2S			0		/* client to server ring */
+#define SHM_S2C			1
+
+/*
+ * Ring header, in shared memory. Each cache line is written by one
+ * side only: head and data_wanted by the consumer, the rest by the
+ * producer. Indices run freely and wrap at 2^32.
+ */
+struct shm_ring {
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t data_wanted;		/* consumer is going to sleep */
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t room_wanted;		/* producer is going to sleep */
+	uint32_t closed;		/* producer has gone away */
+};
+
+struct shm_region {
+	uint32_t magic;
+	uint32_t ring_size;
+	struct shm_ring ring[2] __attribute__((aligned(64)));
+};
+
+/* One side's view of a connection */
+struct shm_chan {
+	struct shm_region *region;
+	struct shm_ring *tx, *rx;
+	unsigned char *txd, *rxd;
+	uint32_t size;
+	uint32_t tx_tail, rx_head;	/* ours, the shared copies are only published */
+	int wait_fd;			/* our eventfd, readable when kicked */
+	int kick_fd;			/* the peer's eventfd */
+	int sock;			/* Unix socket, only watched for hangup */
+	pid_t peer_pid;			/* server side: the client, for logs */
+	uint64_t kicks;			/* eventfd writes, for system call counts */
+};
+
+/* Client: map the connection offered by the server listening on path */
+int shm_connect(const char *path, struct shm_chan *c);
+/* Server: set up a connection for the client accepted on sock */
+int shm_accept(int sock, struct shm_chan *c);
+/* Unmap and close everything, waking the peer so it sees closed */
+void shm_close(struct shm_chan *c);
+
+/*
+ * Like read() and write() on a nonblocking socket: -1 with EAGAIN on
+ * an empty or full ring, 0 from shm_read() once the peer has closed,
+ * -1 with EPROTO if a client broke the ring.
+ */
+ssize_t shm_read(struct shm_chan *c, void *buf, size_t len);
+ssize_t shm_write(struct shm_chan *c, const void *buf, size_t len);
+ssize_t shm_writev(struct shm_chan *c, const struct iovec *iov, int cnt);
+
+/* Readable bytes in place: up to two pieces, because of the wrap. -1 on EPROTO. */
+ssize_t shm_peek(struct shm_chan *c, struct iovec iov[2]);
+/* Release n peeked bytes to the producer */
+void shm_consume(struct shm_chan *c, size_t n);
+
+/*
+ * About to sleep on wait_fd: ask the peer to kick it when data comes
+ * in (rx) or room frees up (tx). They return 1 if that has happened
+ * already, and the caller must not go to sleep.
+ */
+int shm_arm_rx(struct shm_chan *c);
+int shm_arm_tx(struct shm_chan *c);
+/* The peer has closed and everything it sent has been read */
+int shm_eof(struct shm_chan *c);
+/* Clear wait_fd after a wakeup */
+void shm_ack(struct shm_chan *c);
+/* Make our own wait_fd readable, to look at the ring again later */
+void shm_self_kick(struct shm_chan *c);
+
+/*
+ * Client side counterparts of chat_send() and chat_recv(), blocking
+ * on wait_fd as needed. The same return values.
+ */
+int shm_chat_send(struct shm_chan *c, uint16_t type, uint16_t room,
+		  const void *payload, uint32_t len);
+int shm_chat_recv(struct shm_chan *c, struct chat_hdr *hdr, void *buf, size_t bufsz);
+
+#endif /* _SHM_RING_H */
@@ -13,6 +13,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <endian.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
@@ -20,144 +21,313 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
-
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <sys/stat.h>
-#include <crypto/cryptodev.h>
+#include <netinet/tcp.h>
 
 #include "socket-common.h"
+#include "chat-addr.h"
+#include "chat-proto.h"
+#include "shm-ring.h"
+#include "crypto-provider.h"
+#include "client-bench.h"
+
+#define MSG_SIZE	256	/* interactive messages, one line at most */
+#define MSG_TERMS	(MSG_SIZE / 2)
+#define SEARCH_CMD	"/search "
+#define SEARCH_TERMS	16	/* the server looks at no more */
+
+/* Set when talking to the server through shared memory (shm:/path) */
+static struct shm_chan *shm;
+
+static int link_send(int sd, uint16_t type, uint16_t room, const void *payload, uint32_t len)
+{
+	if (shm)
+		return shm_chat_send(shm, type, room, payload, len);
+	return chat_send(sd, type, room, payload, len);
+}
+
+static int link_recv(int sd, struct chat_hdr *hdr, void *buf, size_t bufsz)
+{
+	if (shm)
+		return shm_chat_recv(shm, hdr, buf, bufsz);
+	return chat_recv(sd, hdr, buf, bufsz);
+}
+
+static int is_word(unsigned char c)
+{
+	return isalnum(c) || c >= 0x80;
+}
+
+/*
+ * Search token of a word: a hash of it encrypted with the chat key, cut
+ * to 32 bits. Equal words give equal tokens, so the server sees which
+ * messages share words and how often each one comes up, and anyone with
+ * the key, the fixed one of every client, can tell the words apart.
+ */
+static uint32_t term_token(struct crypto_ctx *crypto, const unsigned char *iv,
+                           const unsigned char *word, size_t len)
+{
+	unsigned char block[BLOCK_SIZE] = { 0 }, out[BLOCK_SIZE];
+	uint64_t h = 14695981039346656037ULL;	/* FNV-1a */
+	uint32_t token;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ tolower(word[i])) * 1099511628211ULL;
+	memcpy(block, &h, sizeof(h));
+	memcpy(block + sizeof(h), "term", 4);
+	if (crypto_encrypt(crypto, block, out, BLOCK_SIZE, iv) < 0)
+		memset(out, 0, sizeof(out));
+	memcpy(&token, out, sizeof(token));
+	return token;
+}
 
-#define KEY_SIZE	16
-#define BLOCK_SIZE      16
-
-/* Insist until all of the data has been written */
-ssize_t insist_write(int fd, const void *buf, size_t cnt){
-	ssize_t ret;
-	size_t orig_cnt = cnt;
-	
-	while (cnt > 0) {
-		ret = write(fd, buf, cnt);
-		if (ret < 0)
-				return ret;
-		buf += ret;
-		cnt -= ret;
+/* Tokens of the words of text, in order and in network byte order. Returns how many. */
+static uint32_t text_terms(struct crypto_ctx *crypto, const unsigned char *iv,
+                           const char *text, uint32_t *terms, uint32_t max)
+{
+	const unsigned char *p = (const unsigned char *)text, *word;
+	uint32_t n = 0;
+
+	while (*p && n < max) {
+		if (!is_word(*p)) {
+			p++;
+			continue;
+		}
+		for (word = p; is_word(*p); p++)
+			;
+		terms[n++] = htonl(term_token(crypto, iv, word, p - word));
 	}
+	return n;
+}
+
+/* Ask for the room's messages with all the words, or the quoted phrase */
+static int send_search(int sd, struct crypto_ctx *crypto, const unsigned char *iv,
+                       const char *query)
+{
+	struct {
+		struct chat_search_req req;
+		uint32_t terms[SEARCH_TERMS];
+	} q;
+	uint32_t n = text_terms(crypto, iv, query, q.terms, SEARCH_TERMS);
+
+	if (!n) {
+		fprintf(stderr, BLUE"Nothing to search for.\n"WHITE);
+		return 0;
+	}
+	q.req.max = 0;
+	q.req.flags = htonl(strchr(query, '"') ? CHAT_SEARCH_PHRASE : 0);
+	return link_send(sd, CHAT_MSG_SEARCH, 0, &q, sizeof(q.req) + n * sizeof(q.terms[0]));
+}
 
-	return orig_cnt;
+static void usage(const char *prog)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s [-c provider[:device]] [-u name] [-j room] [-g secs] [-i] hostname port\n"
+			"       %s -b [-s size] [-r rate | -w window] [-n count] [-c ...] hostname port\n"
+			"  -c  crypto provider (default " CRYPTO_PROVIDER_DEFAULT ")\n"
+			"  -u  name yourself, the server keeps messages for you while away\n"
+			"  -j  join chat room instead of the lobby\n"
+			"  -g  get the room's messages of the last secs seconds\n"
+			"  -i  let the server index your messages for " SEARCH_CMD "(it sees\n"
+			"      which of them share words)\n"
+			"  -b  headless benchmark against the server echo room\n"
+			"  -s  benchmark message size in bytes (default %d)\n"
+			"  -r  open loop: send rate in messages/sec\n"
+			"  -w  closed loop: messages in flight (default 1)\n"
+			"  -n  number of messages (default %d)\n"
+			"  hostname may be vsock:CID to go over AF_VSOCK, vsock:2 is the host,\n"
+			"  or shm:/path for shared memory with a server on this host (no port)\n",
+		prog, prog, BENCH_DEFAULT_SIZE, BENCH_DEFAULT_COUNT);
+	fprintf(stderr, "Crypto providers:\n");
+	for (i = 0; crypto_providers[i]; i++)
+		fprintf(stderr, "  %-10s %s\n", crypto_providers[i]->name,
+			crypto_providers[i]->descr);
+	exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-	int sd, port, crypto_fd;
-	ssize_t n;
-	unsigned char buf[256], buf_out[256];
+	int sd, port, opt, room = -1, bench = 0, history = 0, index = 0;
+	unsigned char buf[CHAT_MAX_PAYLOAD], buf_out[CHAT_MAX_PAYLOAD];
 	char *hostname;
-	struct hostent *hp;
-	struct sockaddr_in sa;
 	int shutdownSocket = 1;
 	unsigned char key[KEY_SIZE], iv[BLOCK_SIZE];
-	struct session_op sess;
-	struct crypt_op cryp;
+	uint32_t terms[MSG_TERMS], nterms;
+	const char *provider = CRYPTO_PROVIDER_DEFAULT;
+	const char *name = NULL;
+	struct crypto_ctx crypto;
+	struct bench_opts bopts = {
+		.size = BENCH_DEFAULT_SIZE,
+		.count = BENCH_DEFAULT_COUNT,
+		.window = 1,
+	};
+	struct chat_hdr hdr;
+	ssize_t n;
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s hostname port\n", argv[0]);
-		exit(1);
+	while ((opt = getopt(argc, argv, "c:u:j:g:ibs:r:w:n:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			provider = optarg;
+			break;
+		case 'j':
+			room = atoi(optarg);
+			break;
+		case 'u':
+			name = optarg;
+			break;
+		case 'g':
+			history = atoi(optarg);
+			break;
+		case 'i':
+			index = 1;
+			break;
+		case 'b':
+			bench = 1;
+			break;
+		case 's':
+			bopts.size = atoi(optarg);
+			break;
+		case 'r':
+			bopts.rate = atof(optarg);
+			break;
+		case 'w':
+			bopts.window = atoi(optarg);
+			break;
+		case 'n':
+			bopts.count = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
-	hostname = argv[1];
-	port = atoi(argv[2]);
+	if (argc - optind < 1 || bopts.count <= 0 || bopts.window <= 0 ||
+	    bopts.size <= 0 || bopts.size > CHAT_MAX_PAYLOAD)
+		usage(argv[0]);
+	hostname = argv[optind];
+	if (argc - optind != (chat_shm_path(hostname) ? 1 : 2))
+		usage(argv[0]);
+	port = chat_shm_path(hostname) ? 0 : atoi(argv[optind + 1]);
 
-	/* Create TCP/IP socket, used as main chat channel */
-	if ((sd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket");
-		exit(1);
+	/* TCP/IP or AF_VSOCK socket, or shared memory, used as main chat channel */
+	if (!bench) {
+		if (port)
+			fprintf(stderr, BLUE"Connecting to %s port %d... ", hostname, port);
+		else
+			fprintf(stderr, BLUE"Connecting to %s... ", hostname);
+		fflush(stderr);
 	}
-	fprintf(stderr, BLUE"Created TCP socket\n");
-	
-	/* Look up remote hostname on DNS */
-	if ( !(hp = gethostbyname(hostname))) {
-		printf("DNS lookup failed for host %s\n", hostname);
+	if (chat_shm_path(hostname)) {
+		if (!(shm = malloc(sizeof(*shm))) || shm_connect(chat_shm_path(hostname), shm) < 0)
+			exit(1);
+		/* Wakes us up for incoming messages */
+		sd = shm->wait_fd;
+	} else if ((sd = chat_connect(hostname, port)) < 0) {
 		exit(1);
 	}
 
-	/* Connect to remote TCP port */
-	sa.sin_family = AF_INET;
-	sa.sin_port = htons(port);
-	memcpy(&sa.sin_addr.s_addr, hp->h_addr, sizeof(struct in_addr));
-	fprintf(stderr, "Connecting to remote host... "); fflush(stderr);
-	if (connect(sd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
-		perror("connect");
-		exit(1);
-	}
-	fprintf(stderr, "You are connected.\nType \"exit\" to shut the connection.\n\n"WHITE);
-
 	// determine encryption key and initialization vector
 	sprintf((char *)key, "mariamarkosbffe");
 	sprintf((char *)iv, "mariamarkosbffe");
-	// open crypto device
-	crypto_fd = open("/dev/crypto", O_RDWR);
-	if (crypto_fd < 0) perror("open(/dev/crypto)");
 
-	memset(&sess, 0, sizeof(sess));
-	memset(&cryp, 0, sizeof(cryp));
+	// open crypto provider and get a session
+	if (crypto_open(&crypto, provider, key, KEY_SIZE) < 0)
+		return 1;
 
-	// get crypto session
-	sess.cipher = CRYPTO_AES_CBC;
-	sess.keylen = KEY_SIZE;
-	sess.key = key;
+	if (bench) {
+		n = run_bench(sd, shm, &crypto, iv, &bopts);
+		crypto_close(&crypto);
+		if (shm)
+			shm_close(shm);
+		else
+			close(sd);
+		return n < 0;
+	}
 
-	if (ioctl(crypto_fd, CIOCGSESSION, &sess)) {
-		perror("ioctl(CIOCGSESSION)");
-		return 1;
+	fprintf(stderr, "You are connected.\nType \"exit\" to shut the connection, "
+			"\"" SEARCH_CMD "words\" to search the room.\n\n"WHITE);
+
+	if (name && link_send(sd, CHAT_MSG_HELLO, 0, name, strlen(name)) < 0) {
+		perror("write");
+		exit(1);
+	}
+	if (room >= 0 && link_send(sd, CHAT_MSG_JOIN, room, NULL, 0) < 0) {
+		perror("write");
+		exit(1);
+	}
+	if (history > 0) {
+		struct chat_history_req req = { 0 };
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		req.since_ms = htobe64(((uint64_t)now.tv_sec - history) * 1000);
+		if (link_send(sd, CHAT_MSG_HISTORY, room < 0 ? 0 : room, &req, sizeof(req)) < 0) {
+			perror("write");
+			exit(1);
+		}
 	}
 
 	//chat
-	memset(buf, 0, sizeof(buf));
 	while(1){
 		fd_set inset;
-		int maxfd;
+		int maxfd, queued = 0;
+		struct timeval zero = { 0, 0 };
 		FD_ZERO(&inset);                 // initialization
-        FD_SET(STDIN_FILENO, &inset);   // select will check for input from stdin
+		FD_SET(STDIN_FILENO, &inset);   // select will check for input from stdin
 		FD_SET(sd, &inset);            // select will check for input from socket
-		
+
 		maxfd = MAX(STDIN_FILENO, sd) + 1;
+		if (shm) {
+			/* Messages already in the ring do not wake us up */
+			queued = shm_arm_rx(shm);
+			FD_SET(shm->sock, &inset);
+			maxfd = MAX(maxfd, shm->sock + 1);
+		}
 
-		int ready_fds = select(maxfd, &inset, NULL, NULL, NULL);
-		if (ready_fds <= 0) {
+		int ready_fds = select(maxfd, &inset, NULL, NULL, queued ? &zero : NULL);
+		if (ready_fds < 0) {
 				perror("select");
 				continue;        // try again
 		}
+		if (shm && FD_ISSET(shm->sock, &inset)) {
+			fprintf(stderr, BLUE"\nServer went away.\n"WHITE);
+			break;
+		}
+		if (queued)
+			FD_SET(sd, &inset);
 
 		// input from stdin (user has typed something)
-        if (FD_ISSET(STDIN_FILENO, &inset)) {
+		if (FD_ISSET(STDIN_FILENO, &inset)) {
 			/* Read from input and write it to socket */
-			memset(buf, 0, sizeof(buf)); //clear the buffer
-			n = read(STDIN_FILENO, buf, sizeof(buf));
+			memset(buf, 0, MSG_SIZE); //clear the buffer
+			n = read(STDIN_FILENO, buf, MSG_SIZE - 1);
 			if (n < 0) {
 				perror("read");
 				exit(1);
 			}
+			if (n == 0 || memcmp(buf, "exit", 4) == 0) break;
 
-			buf[sizeof(buf) - 1] = '\0';
-			if (memcmp(buf, "exit", 4) == 0) break;
+			if (!memcmp(buf, SEARCH_CMD, strlen(SEARCH_CMD))) {
+				if (send_search(sd, &crypto, iv, (char *)buf + strlen(SEARCH_CMD)) < 0) {
+					perror("write");
+					exit(1);
+				}
+				continue;
+			}
+			/* Computed before buf is padded */
+			nterms = index ? text_terms(&crypto, iv, (char *)buf, terms, MSG_TERMS) : 0;
 
 			/*
-			 * Encrypt buf to buf_out
+			 * Encrypt buf to buf_out, the terminating NUL and the
+			 * zero padding up to a whole block go along.
 			 */
-			cryp.ses = sess.ses;
-			cryp.len = sizeof(buf);
-			cryp.src = buf;
-			cryp.dst = buf_out;
-			cryp.iv = iv;
-			cryp.op = COP_ENCRYPT;
-
-
-			if (ioctl(crypto_fd, CIOCCRYPT, &cryp)) {
-				perror("ioctl(CIOCCRYPT)");
+			n = (n + BLOCK_SIZE) / BLOCK_SIZE * BLOCK_SIZE;
+			if (crypto_encrypt(&crypto, buf, buf_out, n, iv) < 0)
 				return 1;
-			}
 
-			if (insist_write(sd, buf_out, 256) != 256) { // all 256 bytes contain the encrypted text
+			if (link_send(sd, CHAT_MSG_TEXT, 0, buf_out, n) < 0 ||
+			    (nterms && link_send(sd, CHAT_MSG_TERMS, 0, terms,
+						 nterms * sizeof(*terms)) < 0)) {
 				perror("write");
 				exit(1);
 			}
@@ -166,45 +336,49 @@ int main(int argc, char *argv[])
 		// input from socket
 		if(FD_ISSET(sd, &inset)){
 			/* Read answer and write it to standard output */
-			memset(buf, 0, sizeof(buf)); //clear the buffer
-			n = read(sd, buf, sizeof(buf));
-			memcpy(buf_out, buf, n); // copy buf to buf_out, in case the message is from server, therefor doesn't need decryption
-
+			if (shm)
+				shm_ack(shm);
+			n = link_recv(sd, &hdr, buf, sizeof(buf) - 1);
 			if (n < 0) {
 				perror("read");
 				exit(1);
 			}
 			if(n == 0){  // server closed connection
-				if (close(sd) < 0)
+				if (!shm && close(sd) < 0)
 					perror("close");
 				shutdownSocket = 0;
 				break;
 			}
 
-			fprintf(stderr, BLUE"");
-			if(memcmp(buf, "Wait for peer to connect.\n", 27) != 0 
-						&& memcmp(buf, "Peer connected.\n", 17) != 0
-						&& memcmp(buf, "Peer left. Type exit to shut connection\n", 41) != 0){
-				fprintf(stderr, GREEN"Peer says: ");
+			switch (hdr.type) {
+			case CHAT_MSG_PING:  // server heartbeat, just show we are alive
+				if (link_send(sd, CHAT_MSG_PONG, 0, NULL, 0) < 0) {
+					perror("write to remote peer failed");
+					exit(1);
+				}
+				break;
+			case CHAT_MSG_NOTICE:  // message from server, no decryption needed
+				buf[hdr.len] = '\0';
+				fprintf(stderr, BLUE"%s"WHITE, buf);
+				break;
+			case CHAT_MSG_TEXT:
 				/*
 				 * Decrypt buf to buf_out
 				 */
-				cryp.ses = sess.ses;
-				cryp.len = sizeof(buf);
-				cryp.src = buf;
-				cryp.dst = buf_out;
-				cryp.iv = iv;
-				cryp.op = COP_DECRYPT;
-				if (ioctl(crypto_fd, CIOCCRYPT, &cryp)) {
-					perror("ioctl(CIOCCRYPT)");
-				return 1;
+				if (!hdr.len || hdr.len % BLOCK_SIZE ||
+				    crypto_decrypt(&crypto, buf, buf_out, hdr.len, iv) < 0) {
+					fprintf(stderr, "Could not decrypt message\n");
+					break;
 				}
+				buf_out[hdr.len - 1] = '\0';
+				fprintf(stderr, GREEN"Peer says: ");
+				if (insist_write(1, buf_out, strlen((char *)buf_out)) < 0) {
+					perror("write");
+					exit(1);
+				}
+				fprintf(stderr, WHITE"");
+				break;
 			}
-			if (insist_write(0, buf_out, n) != n) {
-				perror("write");
-				exit(1);
-			}
-			fprintf(stderr, WHITE"");
 		}
 	}
 
@@ -214,17 +388,15 @@ int main(int argc, char *argv[])
 	 * Let the remote know we're not going to write anything else.
 	 * Try removing the shutdown() call and see what happens.
 	 */
-	if (shutdownSocket && shutdown(sd, SHUT_WR) < 0) {
+	if (shm)
+		shm_close(shm);
+	else if (shutdownSocket && shutdown(sd, SHUT_WR) < 0) {
 		perror("shutdown");
 		exit(1);
 	}
-	
+
 	/* Finish crypto session */
-	if (ioctl(crypto_fd, CIOCFSESSION, &sess.ses)) {
-		perror("ioctl(CIOCFSESSION)");
-		return 1;
-	}
-	if (close(crypto_fd) < 0) perror("close(fd)");
+	crypto_close(&crypto);
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -11,11 +11,12 @@
 
 /* Compile-time options */
 #define TCP_PORT    35001
-#define TCP_BACKLOG 5
+#define TCP_BACKLOG 128
 
 #define HELLO_THERE "Hello there!"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define GREEN "\033[32m"
 #define YELLOW "\033[33m"
 #define BLUE "\033[34m"
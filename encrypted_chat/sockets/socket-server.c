@@ -13,203 +13,1616 @@
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "socket-common.h"
+#include "chat-addr.h"
+#include "chat-proto.h"
+#include "chat-trace.h"
+#include "chat-history.h"
+#include "chat-search.h"
+#include "offline-queue.h"
+#include "shard-bus.h"
+#include "msgbuf.h"
+#include "conn-table.h"
+#include "timer-wheel.h"
+#include "server-engine.h"
 
-/* Convert a buffer to upercase */
-void toupper_buf(char *buf, size_t n){
-	size_t i;
+#define DEFAULT_MAX_QUEUE	(256 * 1024)	/* outbound bytes per connection */
+#define THROTTLE_HARD_CAP	4		/* x max_queue, then drop anyway */
+#define STATS_TOP		10		/* deepest queues shown on SIGUSR1 */
 
+#define TICK_MS			10		/* timer wheel resolution */
+#define TICKS_PER_SEC		(1000 / TICK_MS)
+#define ACCEPT_RETRY_MS		100		/* out of fds, try accept() again */
+#define MAX_LISTEN		4		/* -l addresses */
+#define HISTORY_JOIN_DEFAULT	20		/* messages replayed to a joiner */
+#define HISTORY_REPLAY_MAX	1000		/* per CHAT_MSG_HISTORY request */
+
+/* What to do with a recipient whose outbound queue is full */
+enum slow_policy {
+	POLICY_DROP,		/* discard its oldest unsent messages */
+	POLICY_DISCONNECT,	/* close the connection */
+	POLICY_THROTTLE,	/* stop reading from the sender until it drains */
+};
+
+static const char *policy_names[] = { "drop", "disconnect", "throttle" };
+
+static const struct server_engine *engines[] = {
+	&engine_select,
+	&engine_epoll,
+	&engine_uring,
+	NULL
+};
+static const struct server_engine *engine = &engine_epoll;
+
+uint64_t engine_syscalls;
+static uint64_t msgs_relayed;		/* frames queued to clients */
+
+static uint32_t next_client_id;
+static uint64_t now_ms;			/* monotonic, updated once per round */
+static uint32_t now_sec;		/* coarse clock for idle timeouts */
+static unsigned int idle_timeout;	/* seconds, 0 = never */
+static unsigned int hb_interval;	/* seconds of silence before a ping, 0 = never */
+
+/*
+ * Idle timeouts, heartbeats and retries all hang off one timing wheel.
+ * Each connection has a single timer for its next deadline; activity
+ * only updates last_active and the timer catches up lazily when it
+ * fires, so the relay path never touches the wheel.
+ */
+static struct timer_wheel wheel;
+static struct timer accept_retry;
+static struct timer search_poll;	/* while searches are running */
+
+/* Shared, never freed: every heartbeat queues the same buffers */
+static struct msgbuf *ping_mb, *pong_mb;
+
+/* Connections with newly queued output, written out once per round */
+static uint32_t *dirty;
+static uint32_t ndirty, dirty_cap;
+static int dirty_overflow;		/* some are only flagged, see mark_dirty() */
+
+/* Backpressure, see send_to() */
+static size_t max_queue = DEFAULT_MAX_QUEUE;
+static uint8_t room_policy[UINT16_MAX + 1];
+static uint32_t *throttled;		/* senders with EPOLLIN turned off */
+static uint32_t nthrottled, throttled_cap;
+static int drained;			/* a congested client caught up */
+
+static struct {
+	uint64_t drops, drop_bytes;
+	uint64_t slow_disconnects;
+	uint64_t throttles;
+} bp_stats;
+
+/* All clients read into this first, complete frames are carved out of it */
+static unsigned char rx_staging[CHAT_HDR_SIZE + CHAT_MAX_PAYLOAD];
+
+/* Traffic trace, when started with -T */
+static struct chat_trace trace;
+static int history_on;
+static uint32_t history_join = HISTORY_JOIN_DEFAULT;
+static int offq_on;
+
+/* Rooms sharded across worker processes, see shard-bus.h */
+static int shard_on;
+static uint32_t shard_link[SHARD_MAX];		/* to each worker, CONN_NONE if none */
+static uint8_t shard_sub_to[UINT16_MAX + 1];	/* owner told we have clients in the room */
+static char bus_path[108];			/* our bus socket */
+static volatile sig_atomic_t must_finish, must_dump;
+
+static void finish_handler(int signo)
+{
+	must_finish = 1;
+}
+
+static void dump_handler(int signo)
+{
+	must_dump = 1;
+}
+
+static uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const char *conn_name(uint32_t idx)
+{
+	static char buf[CHAT_ADDR_STRLEN];
+
+	return chat_addr_str(&conn_cold(idx)->addr, buf, sizeof(buf));
+}
+
+static void mark_dirty(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+
+	if (h->flags & CONN_F_DIRTY)
+		return;
+	h->flags |= CONN_F_DIRTY;
+	if (ndirty == dirty_cap) {
+		uint32_t cap = dirty_cap ? dirty_cap * 2 : 1024, *d;
+
+		if (!(d = realloc(dirty, cap * sizeof(*d)))) {
+			/* flush_dirty() finds it by the flag */
+			dirty_overflow = 1;
+			return;
+		}
+		dirty = d;
+		dirty_cap = cap;
+	}
+	dirty[ndirty++] = idx;
+}
+
+/* Build a frame originating at the server */
+static struct msgbuf *make_frame(uint16_t type, uint16_t room, const void *payload, uint32_t len)
+{
+	struct chat_hdr hdr = { .len = len, .type = type, .room = room };
+	struct msgbuf *mb;
+
+	if (!(mb = msgbuf_alloc(CHAT_HDR_SIZE + len)))
+		return NULL;
+	chat_hdr_hton(&hdr);
+	memcpy(mb->data, &hdr, CHAT_HDR_SIZE);
+	if (len)
+		memcpy(mb->data + CHAT_HDR_SIZE, payload, len);
+	return mb;
+}
+
+/* Build a plaintext notice frame */
+static struct msgbuf *make_notice(uint16_t room, const char *msg)
+{
+	return make_frame(CHAT_MSG_NOTICE, room, msg, strlen(msg) + 1);
+}
+
+/* Stop reading from a sender whose room cannot keep up */
+static void throttle(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+
+	if (h->flags & CONN_F_THROTTLED)
+		return;
+	if (nthrottled == throttled_cap) {
+		uint32_t cap = throttled_cap ? throttled_cap * 2 : 64, *t;
+
+		if (!(t = realloc(throttled, cap * sizeof(*t))))
+			return;
+		throttled = t;
+		throttled_cap = cap;
+	}
+	throttled[nthrottled++] = idx;
+	h->flags |= CONN_F_THROTTLED;
+	conn_cold(idx)->stats.throttled++;
+	bp_stats.throttles++;
+	engine->update(idx);
+}
+
+static int room_congested(uint16_t room)
+{
+	const uint32_t *members;
+	uint32_t i, cnt;
+
+	members = room_members(room, &cnt);
+	for (i = 0; i < cnt; i++)
+		if (conn_hot(members[i])->flags & CONN_F_CONGESTED)
+			return 1;
+	return 0;
+}
+
+/* Resume the throttled senders whose rooms have drained */
+static void unthrottle(void)
+{
+	struct conn_hot *h;
+	uint32_t i = 0, idx;
+
+	while (i < nthrottled) {
+		idx = throttled[i];
+		h = conn_hot(idx);
+		if (h->state == CONN_OPEN && (h->flags & CONN_F_THROTTLED)) {
+			if (room_congested(h->room)) {
+				i++;
+				continue;
+			}
+			h->flags &= ~CONN_F_THROTTLED;
+			engine->update(idx);
+			/* Its ring may be full already, nobody is going to kick us */
+			if (h->flags & CONN_F_SHM)
+				shm_self_kick(conn_cold(idx)->shm);
+		}
+		throttled[i] = throttled[--nthrottled];
+	}
+}
+
+/*
+ * Queue a message for a client, it is written out at the end of the
+ * round. from is the client whose message this is, CONN_NONE for
+ * server notices. When the queue would grow past max_queue the room's
+ * slow consumer policy decides what gives.
+ */
+static void send_to(uint32_t idx, struct msgbuf *mb, uint32_t from)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct conn_cold *cc = conn_cold(idx);
+	size_t n, limit = max_queue;
+
+	if (h->flags & CONN_F_KILL)
+		return;
+
+	/* A worker falls behind for everyone at once, give it more slack */
+	if (cc->bus_link)
+		limit *= SHARD_LINK_QUEUE;
+	if (cc->outq.bytes + mb->len > limit) {
+		switch (cc->bus_link ? POLICY_DROP : room_policy[h->room]) {
+		case POLICY_DISCONNECT:
+			h->flags |= CONN_F_KILL;
+			mark_dirty(idx);
+			return;
+
+		case POLICY_THROTTLE:
+			if (cc->outq.bytes + mb->len <= max_queue * THROTTLE_HARD_CAP) {
+				h->flags |= CONN_F_CONGESTED;
+				if (from != CONN_NONE)
+					throttle(from);
+				break;
+			}
+			/* Past the hard cap the sender is not listening, drop */
+			/* fall through */
+		case POLICY_DROP:
+			while (cc->outq.bytes + mb->len > limit &&
+			       (n = outq_drop_oldest(&cc->outq))) {
+				cc->stats.drops++;
+				cc->stats.drop_bytes += n;
+				bp_stats.drops++;
+				bp_stats.drop_bytes += n;
+			}
+			if (cc->outq.bytes + mb->len > limit) {
+				/* Only a partly sent message left, drop the new one */
+				cc->stats.drops++;
+				cc->stats.drop_bytes += mb->len;
+				bp_stats.drops++;
+				bp_stats.drop_bytes += mb->len;
+				return;
+			}
+			break;
+		}
+	}
+
+	if (outq_push(&cc->outq, mb) < 0) {
+		fprintf(stderr, "Out of memory, dropping message to %s\n", conn_name(idx));
+		return;
+	}
+	h->pending = cc->outq.bytes;
+	if (h->pending > cc->stats.max_queue)
+		cc->stats.max_queue = h->pending;
+	cc->stats.msgs_out++;
+	msgs_relayed++;
+	mark_dirty(idx);
+}
+
+static void conn_timeout(struct timer *t);
+
+static void bus_send(unsigned int w, uint16_t type, uint16_t room)
+{
+	struct msgbuf *mb;
+
+	if (shard_link[w] == CONN_NONE || !(mb = make_frame(type, room, NULL, 0)))
+		return;
+	send_to(shard_link[w], mb, CONN_NONE);
+	msgbuf_put(mb);
+}
+
+/* Keep the owner of room told whether we have clients in it */
+static void shard_resub(uint16_t room)
+{
+	unsigned int want = SHARD_NONE, owner;
+	uint32_t cnt;
+
+	room_members(room, &cnt);
+	if (cnt && room != CHAT_ROOM_ECHO && (owner = shard_owner(room)) != shard_self)
+		want = owner;
+	if (want == shard_sub_to[room])
+		return;
+	if (shard_sub_to[room] != SHARD_NONE)
+		bus_send(shard_sub_to[room], BUS_MSG_UNSUB, room);
+	if (want != SHARD_NONE)
+		bus_send(want, BUS_MSG_SUB, room);
+	shard_sub_to[room] = want;
+}
+
+/* A worker came or went, rooms may have new owners */
+static void shard_rehome(void)
+{
+	uint32_t room, cnt;
+
+	for (room = 0; room <= UINT16_MAX; room++) {
+		room_members(room, &cnt);
+		if (cnt || shard_sub_to[room] != SHARD_NONE)
+			shard_resub(room);
+	}
+}
+
+/*
+ * Pass a room message on to the other workers. from is the worker it
+ * came from, SHARD_NONE for our own clients; it has been delivered to
+ * our members already.
+ */
+static void shard_route(uint16_t room, struct msgbuf *mb, unsigned int from)
+{
+	unsigned int owner = shard_owner(room), w;
+	uint64_t subs;
+
+	if (owner != shard_self) {
+		/* Ours, or from a worker that does not know the owner yet */
+		if (from != owner && shard_link[owner] != CONN_NONE)
+			send_to(shard_link[owner], mb, CONN_NONE);
+		return;
+	}
+	subs = shard_subs(room) & shard_live & ~(1ULL << shard_self);
+	for (w = 0; subs; w++, subs >>= 1)
+		if ((subs & 1) && w != from)
+			send_to(shard_link[w], mb, CONN_NONE);
+}
+
+static void shard_link_up(uint32_t idx, unsigned int w)
+{
+	conn_cold(idx)->worker = w;
+	shard_link[w] = idx;
+	shard_live |= 1ULL << w;
+	fprintf(stderr, "Worker %u: linked to worker %u\n", shard_self, w);
+	shard_rehome();
+}
+
+/* Link up with an older worker, through its bus socket */
+static void shard_connect(unsigned int w)
+{
+	struct bus_hello hello = { .token = shard_token, .worker = shard_self };
+	struct shm_chan *c;
+	struct msgbuf *mb;
+	uint32_t idx;
+	char path[108];
+
+	shard_path(path, sizeof(path), w);
+	if (!(c = malloc(sizeof(*c))))
+		return;
+	if (shm_connect(path, c) < 0) {
+		fprintf(stderr, "Worker %u: could not link to worker %u\n", shard_self, w);
+		free(c);
+		return;
+	}
+	if ((idx = conn_alloc(c->wait_fd)) == CONN_NONE)
+		goto fail;
+	conn_hot(idx)->flags |= CONN_F_SHM;
+	conn_cold(idx)->shm = c;
+	if (engine->add(idx) < 0) {
+		conn_free(idx);
+		goto fail;
+	}
+	conn_cold(idx)->id = next_client_id++;
+	conn_cold(idx)->addr.un.sun_family = AF_UNIX;
+	snprintf(conn_cold(idx)->addr.un.sun_path, sizeof(conn_cold(idx)->addr.un.sun_path),
+		 "worker %u", w);
+	conn_cold(idx)->bus_link = 1;
+	timer_init(&conn_cold(idx)->timer, conn_timeout, idx);
+
+	/* Who we are goes first, then our subscriptions */
+	if ((mb = make_frame(BUS_MSG_WORKER, 0, &hello, sizeof(hello)))) {
+		send_to(idx, mb, CONN_NONE);
+		msgbuf_put(mb);
+	}
+	shard_link_up(idx, w);
+	return;
+
+fail:
+	shm_close(c);
+	free(c);
+}
+
+/* Accepted on our bus socket rather than the clients' */
+static int is_bus_link(int sock)
+{
+	struct sockaddr_un sun;
+	socklen_t len = sizeof(sun);
+
+	memset(&sun, 0, sizeof(sun));
+	if (getsockname(sock, (struct sockaddr *)&sun, &len) < 0)
+		return 0;
+	return !strcmp(sun.sun_path, bus_path);
+}
+
+/* Send a plaintext notice to every client in room, except skip */
+static void notify_room(uint16_t room, uint32_t skip, const char *msg)
+{
+	const uint32_t *members;
+	struct msgbuf *mb;
+	uint32_t i, cnt;
+
+	members = room_members(room, &cnt);
+	if (!cnt || !(mb = make_notice(room, msg)))
+		return;
+	for (i = 0; i < cnt; i++)
+		if (members[i] != skip)
+			send_to(members[i], mb, CONN_NONE);
+	if (shard_on && room != CHAT_ROOM_ECHO)
+		shard_route(room, mb, SHARD_NONE);
+	msgbuf_put(mb);
+}
+
+struct replay {
+	uint32_t idx;
+	uint32_t sent, skipped;
+};
+
+/* Queue a stored frame to a client, as long as it fits in its queue */
+static void replay_one(void *arg, const unsigned char *frame, uint32_t len, uint64_t ts_ms)
+{
+	struct replay *rp = arg;
+	struct msgbuf *mb;
+
+	if (rp->skipped || conn_cold(rp->idx)->outq.bytes + len > max_queue ||
+	    !(mb = msgbuf_alloc(len))) {
+		rp->skipped++;
+		return;
+	}
+	memcpy(mb->data, frame, len);
+	send_to(rp->idx, mb, CONN_NONE);
+	msgbuf_put(mb);
+	rp->sent++;
+}
+
+/* Send a client the history of its room, the last n or since since_ms */
+static void replay_history(uint32_t idx, uint64_t since_ms, uint32_t n)
+{
+	struct replay rp = { .idx = idx };
+	uint16_t room = conn_hot(idx)->room;
+	struct msgbuf *mb;
+
+	if (since_ms)
+		history_since(room, since_ms, n, replay_one, &rp);
+	else
+		history_last(room, n, replay_one, &rp);
+	if (rp.skipped && (mb = make_notice(room, "History truncated.\n"))) {
+		send_to(idx, mb, CONN_NONE);
+		msgbuf_put(mb);
+	}
+}
+
+/* Index the search terms of the sender's last message */
+static void index_terms(uint32_t idx, const struct msgbuf *mb, uint32_t len)
+{
+	uint32_t terms[SEARCH_MSG_TERMS], i, n = len / sizeof(uint32_t);
+	struct conn_cold *cc = conn_cold(idx);
+
+	if (!cc->last_seq)
+		return;
+	if (n > SEARCH_MSG_TERMS)
+		n = SEARCH_MSG_TERMS;
+	memcpy(terms, mb->data + CHAT_HDR_SIZE, n * sizeof(*terms));
 	for (i = 0; i < n; i++)
-		buf[i] = toupper(buf[i]);
+		terms[i] = ntohl(terms[i]);
+	if (search_add(conn_hot(idx)->room, cc->last_seq - 1, terms, n) < 0)
+		perror("search_add");
+	cc->last_seq = 0;
 }
 
-/* Insist until all of the data has been written */
-ssize_t insist_write(int fd, const void *buf, size_t cnt){
-	ssize_t ret;
-	size_t orig_cnt = cnt;
-	
-	while (cnt > 0) {
-	        ret = write(fd, buf, cnt);
-	        if (ret < 0) return ret;
-	        buf += ret;
-	        cnt -= ret;
+/* Send the matches of a search to the client that asked, if still there */
+static void search_done(uint64_t cookie, uint16_t room, const uint64_t *seqs, uint32_t n)
+{
+	struct replay rp = { .idx = (uint32_t)cookie };
+	struct msgbuf *mb;
+	char msg[64];
+
+	if (rp.idx >= conn_table_span() || conn_hot(rp.idx)->state != CONN_OPEN ||
+	    conn_cold(rp.idx)->id != cookie >> 32 || conn_hot(rp.idx)->room != room)
+		return;
+	while (n-- > 0)
+		history_get(room, seqs[n], replay_one, &rp);
+	snprintf(msg, sizeof(msg), "%u match%s%s.\n", rp.sent, rp.sent == 1 ? "" : "es",
+		 rp.skipped ? ", the rest did not fit in your queue" : "");
+	if ((mb = make_notice(room, msg))) {
+		send_to(rp.idx, mb, CONN_NONE);
+		msgbuf_put(mb);
 	}
+}
 
-	return orig_cnt;
+/* Searches run on the indexing thread, look for the results every tick */
+static void search_reap_all(struct timer *t)
+{
+	if (search_reap(search_done))
+		tw_add(&wheel, t, now_ms / TICK_MS + 1);
 }
 
-int main(void)
+/* Start a search of the client's room, the matches are sent when done */
+static void search_history(uint32_t idx, const struct msgbuf *mb, uint32_t len)
 {
-	unsigned char buf[256];
-	char addrstr[INET_ADDRSTRLEN];
-	int sd, client, client2, left = 0;
-	ssize_t n;
-	socklen_t len;
-	struct sockaddr_in sa;
-	
-	/* Make sure a broken connection doesn't kill us */
-	signal(SIGPIPE, SIG_IGN);
+	uint32_t terms[SEARCH_QUERY_TERMS], i, n;
+	uint16_t room = conn_hot(idx)->room;
+	struct chat_search_req req;
+	struct msgbuf *nb;
 
-	/* Create TCP/IP socket, used as main chat channel */
-	if ((sd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket");
-		exit(1);
+	if (len < sizeof(req))
+		return;
+	memcpy(&req, mb->data + CHAT_HDR_SIZE, sizeof(req));
+	req.max = ntohl(req.max);
+	req.flags = ntohl(req.flags);
+	if (!req.max || req.max > HISTORY_REPLAY_MAX)
+		req.max = HISTORY_REPLAY_MAX;
+	/* Past the first SEARCH_QUERY_TERMS the search only gets wider */
+	n = (len - sizeof(req)) / sizeof(*terms);
+	if (n > SEARCH_QUERY_TERMS)
+		n = SEARCH_QUERY_TERMS;
+	memcpy(terms, mb->data + CHAT_HDR_SIZE + sizeof(req), n * sizeof(*terms));
+	for (i = 0; i < n; i++)
+		terms[i] = ntohl(terms[i]);
+
+	if (search_query(room, terms, n, req.flags & CHAT_SEARCH_PHRASE, req.max,
+			 (uint64_t)conn_cold(idx)->id << 32 | idx) < 0) {
+		if ((nb = make_notice(room, "Search failed.\n"))) {
+			send_to(idx, nb, CONN_NONE);
+			msgbuf_put(nb);
+		}
+		return;
 	}
-	fprintf(stderr, "Created TCP socket\n");
+	if (!timer_pending(&search_poll))
+		tw_add(&wheel, &search_poll, now_ms / TICK_MS + 1);
+}
 
-	/* Bind to a well-known port */
-	memset(&sa, 0, sizeof(sa));
-	sa.sin_family = AF_INET;
-	sa.sin_port = htons(TCP_PORT);
-	sa.sin_addr.s_addr = htonl(INADDR_ANY);
-	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
-		perror("bind");
-		exit(1);
+/* Enter a room and tell everyone who is there */
+static void join_room(uint32_t idx, uint16_t room)
+{
+	uint16_t old = conn_hot(idx)->room;
+	int was_member = conn_hot(idx)->room_slot != CONN_NONE;
+	uint32_t cnt;
+
+	if (conn_hot(idx)->flags & CONN_F_CONGESTED)
+		drained = 1;	/* no longer holding back the old room */
+	if (room_add(idx, room) < 0) {
+		fprintf(stderr, "Out of memory, %s stays in room %u\n", conn_name(idx), old);
+		return;
+	}
+	conn_cold(idx)->last_seq = 0;
+	if (trace.fp)
+		trace_write(&trace, TRACE_JOIN, conn_cold(idx)->id, room, 0, 0);
+	if (shard_on) {
+		if (was_member)
+			shard_resub(old);
+		shard_resub(room);
 	}
-	fprintf(stderr, "Bound TCP socket to port %d\n", TCP_PORT);
+	if (was_member && old != CHAT_ROOM_ECHO)
+		notify_room(old, CONN_NONE, "Peer left.\n");
 
-	/* Listen for incoming connections */
-	if (listen(sd, TCP_BACKLOG) < 0) {
-		perror("listen");
-		exit(1);
+	if (room == CHAT_ROOM_ECHO)
+		return;
+	/* Back from away, the offline queue has what was missed */
+	if (history_on && history_join && !(conn_hot(idx)->flags & CONN_F_BACKLOG))
+		replay_history(idx, 0, history_join);
+	room_members(room, &cnt);
+	if (cnt == 1) {
+		struct msgbuf *mb = make_notice(room, "Wait for peer to connect.\n");
+
+		if (mb) {
+			send_to(idx, mb, CONN_NONE);
+			msgbuf_put(mb);
+		}
+	} else {
+		notify_room(room, CONN_NONE, "Peer connected.\n");
+	}
+}
+
+/* Move a returning user's queued messages to its outbound queue, as far as they fit */
+static void offline_drain(uint32_t idx)
+{
+	struct conn_cold *cc = conn_cold(idx);
+	struct offq_user *u = cc->user;
+	struct msgbuf *mb;
+
+	while ((mb = offq_peek(u)) && cc->outq.bytes + mb->len <= max_queue) {
+		send_to(idx, mb, CONN_NONE);
+		offq_pop(u);
+	}
+	if (!offq_pending(u))
+		conn_hot(idx)->flags &= ~CONN_F_BACKLOG;
+}
+
+/* A client names itself, and gets what its room said while it was away */
+static void say_hello(uint32_t idx, const char *name, uint32_t len)
+{
+	struct conn_cold *cc = conn_cold(idx);
+	struct offq_user *u;
+	struct msgbuf *mb;
+	char msg[96];
+	uint16_t room;
+
+	if (cc->nick[0] || !len)
+		return;
+	memcpy(cc->nick, name, MIN(len, CONN_NICK_LEN - 1));
+	if (!offq_on || !cc->nick[0])
+		return;
+	if (!(u = offq_user(cc->nick, 1))) {
+		fprintf(stderr, "Out of memory, not keeping messages for %s\n", cc->nick);
+		return;
+	}
+	if (u->conn != CONN_NONE) {
+		if ((mb = make_notice(conn_hot(idx)->room, "Name in use, messages are not kept for you.\n"))) {
+			send_to(idx, mb, CONN_NONE);
+			msgbuf_put(mb);
+		}
+		return;
+	}
+	u->conn = idx;
+	cc->user = u;
+
+	if (u->drops) {
+		snprintf(msg, sizeof(msg), "%llu messages to you were dropped while you were away.\n",
+			 (unsigned long long)u->drops);
+		u->drops = 0;
+		if ((mb = make_notice(conn_hot(idx)->room, msg))) {
+			send_to(idx, mb, CONN_NONE);
+			msgbuf_put(mb);
+		}
+	}
+	if (u->parked) {
+		room = u->room;
+		offq_unpark(u);
+		conn_hot(idx)->flags |= CONN_F_BACKLOG;
+		if (room != conn_hot(idx)->room)
+			join_room(idx, room);
+	}
+	if (offq_pending(u)) {
+		conn_hot(idx)->flags |= CONN_F_BACKLOG;
+		offline_drain(idx);
+	} else {
+		conn_hot(idx)->flags &= ~CONN_F_BACKLOG;
+	}
+}
+
+/* Arm the connection timer for the nearest of its deadlines */
+static void conn_timer_arm(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct conn_cold *cc = conn_cold(idx);
+	uint32_t due = UINT32_MAX, hb;
+
+	if (idle_timeout)
+		due = h->last_active + idle_timeout;
+	if (hb_interval) {
+		hb = MAX(h->last_active, cc->pinged_at) + hb_interval;
+		if (hb < due)
+			due = hb;
 	}
+	if (due != UINT32_MAX)
+		tw_add(&wheel, &cc->timer, (uint64_t)due * TICKS_PER_SEC);
+}
+
+static void accept_resume(struct timer *t)
+{
+	engine->listen(1);
+}
+
+void server_accept_failed(int err)
+{
+	fprintf(stderr, "accept: %s\n", strerror(err));
+	/* Out of descriptors or memory: stop accepting for a while */
+	if (err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM)
+		return;
+	if (timer_pending(&accept_retry))
+		return;
+	engine->listen(0);
+	tw_add(&wheel, &accept_retry, (now_ms + ACCEPT_RETRY_MS) / TICK_MS);
+}
+
+void server_accept_all(int sd)
+{
+	union chat_sockaddr sa;
+	socklen_t len;
+	int fd;
 
-	/* Loop forever, accept()ing connections until two clients connect */
 	for (;;) {
-		fprintf(stderr, "Waiting for two incoming connections...\n");
+		len = sizeof(sa);
+		engine_syscalls++;
+		if ((fd = accept(sd, (struct sockaddr *)&sa, &len)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				server_accept_failed(errno);
+			return;
+		}
+		server_accept(fd, &sa);
+	}
+}
 
-		/* Accept the first incoming connection */
-		len = sizeof(struct sockaddr_in);
-		if ((client = accept(sd, (struct sockaddr *)&sa, &len)) < 0) {
-			perror("accept");
-			exit(1);
+/*
+ * Hand a client on the shm:/path socket its rings. The socket stays
+ * open, unwatched, so the client notices if we go away.
+ */
+static struct shm_chan *shm_client(int sock, union chat_sockaddr *peer)
+{
+	struct shm_chan *c;
+
+	if (!(c = malloc(sizeof(*c)))) {
+		perror("malloc");
+		close(sock);
+		return NULL;
+	}
+	if (shm_accept(sock, c) < 0) {
+		free(c);
+		close(sock);
+		return NULL;
+	}
+	engine_syscalls++;
+	snprintf(peer->un.sun_path, sizeof(peer->un.sun_path), "pid %d", (int)c->peer_pid);
+	return c;
+}
+
+static void shm_client_free(struct shm_chan *c)
+{
+	shm_close(c);
+	free(c);
+}
+
+void server_accept(int fd, const union chat_sockaddr *sa)
+{
+	union chat_sockaddr peer = *sa;
+	struct shm_chan *shm = NULL;
+	uint32_t idx;
+	int one = 1;
+
+	/* A shared memory client is watched through its eventfd */
+	if (sa->sa.sa_family == AF_UNIX) {
+		if (!(shm = shm_client(fd, &peer)))
+			return;
+		fd = shm->wait_fd;
+	}
+	if ((idx = conn_alloc(fd)) == CONN_NONE) {
+		fprintf(stderr, "Too many clients, rejecting connection\n");
+		goto reject;
+	}
+	if (sa->sa.sa_family == AF_INET)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (shm) {
+		conn_hot(idx)->flags |= CONN_F_SHM;
+		conn_cold(idx)->shm = shm;
+	}
+	if (engine->add(idx) < 0) {
+		conn_free(idx);
+		goto reject;
+	}
+
+	conn_cold(idx)->id = next_client_id++;
+	conn_cold(idx)->addr = peer;
+	conn_cold(idx)->stats.connected_at = now_sec;
+	conn_hot(idx)->last_active = now_sec;
+	timer_init(&conn_cold(idx)->timer, conn_timeout, idx);
+	if (shm && shard_on && is_bus_link(shm->sock)) {
+		/* Another worker, which says who it is in its first frame */
+		conn_cold(idx)->bus_link = 1;
+		conn_cold(idx)->worker = SHARD_NONE;
+		return;
+	}
+	conn_timer_arm(idx);
+	fprintf(stderr, "Incoming connection from %s\n", conn_name(idx));
+
+	if (trace.fp)
+		trace_write(&trace, TRACE_CONNECT, conn_cold(idx)->id, 0, 0, 0);
+	join_room(idx, CHAT_ROOM_LOBBY);
+	return;
+
+reject:
+	if (shm)
+		shm_client_free(shm);
+	else
+		close(fd);
+}
+
+static void drop_client(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct conn_cold *cc = conn_cold(idx);
+	uint16_t room = h->room;
+	int bus_link = cc->bus_link;
+	unsigned int w = cc->worker;
+
+	fprintf(stderr, "Peer %s went away\n", conn_name(idx));
+	if (trace.fp)
+		trace_write(&trace, TRACE_DISCONNECT, cc->id, 0, 0, 0);
+	engine->close(idx);
+	if (cc->shm) {
+		/* The engine has closed the eventfd */
+		cc->shm->wait_fd = -1;
+		shm_client_free(cc->shm);
+	}
+	if (h->flags & CONN_F_CONGESTED)
+		drained = 1;
+	tw_del(&wheel, &cc->timer);
+	outq_clear(&cc->outq);
+	if (cc->user) {
+		cc->user->conn = CONN_NONE;
+		if (room != CHAT_ROOM_ECHO && offq_park(cc->user, room) < 0)
+			fprintf(stderr, "Out of memory, not keeping messages for %s\n", cc->user->nick);
+	}
+	if (cc->in)
+		msgbuf_put(cc->in);
+	conn_free(idx);
+
+	if (bus_link) {
+		if (w != SHARD_NONE) {
+			fprintf(stderr, "Worker %u: lost worker %u\n", shard_self, w);
+			shard_link[w] = CONN_NONE;
+			shard_live &= ~(1ULL << w);
+			shard_forget(w);
+			shard_rehome();
 		}
-		if (!inet_ntop(AF_INET, &sa.sin_addr, addrstr, sizeof(addrstr))) {
-			perror("could not format IP address");
-			exit(1);
+		return;
+	}
+	if (shard_on)
+		shard_resub(room);
+	if (room != CHAT_ROOM_ECHO)
+		notify_room(room, CONN_NONE, "Peer left.\n");
+}
+
+void server_drop(uint32_t idx)
+{
+	drop_client(idx);
+}
+
+/* A connection deadline came up, see what is actually due by now */
+static void conn_timeout(struct timer *t)
+{
+	uint32_t idx = t->data, silent;
+	struct conn_hot *h = conn_hot(idx);
+	struct conn_cold *cc = conn_cold(idx);
+
+	/* A throttled client is quiet because we stopped reading */
+	if (h->flags & CONN_F_THROTTLED)
+		h->last_active = now_sec;
+	silent = now_sec - h->last_active;
+
+	if (idle_timeout && silent >= idle_timeout) {
+		fprintf(stderr, "Peer %s idle for %us, closing\n", conn_name(idx), silent);
+		drop_client(idx);
+		return;
+	}
+	if (hb_interval && silent >= hb_interval && now_sec - cc->pinged_at >= hb_interval) {
+		send_to(idx, ping_mb, CONN_NONE);
+		cc->pinged_at = now_sec;
+	}
+	conn_timer_arm(idx);
+}
+
+/* A frame from another worker */
+static void bus_frame(uint32_t idx, struct msgbuf *mb, const struct chat_hdr *hdr)
+{
+	struct conn_cold *cc = conn_cold(idx);
+	const uint32_t *members;
+	struct bus_hello hello;
+	uint32_t i, cnt;
+
+	if (cc->worker == SHARD_NONE) {
+		/* Nothing before it says which worker it is */
+		if (hdr->type != BUS_MSG_WORKER || hdr->len != sizeof(hello))
+			goto bad;
+		memcpy(&hello, mb->data + CHAT_HDR_SIZE, sizeof(hello));
+		if (hello.token != shard_token || hello.worker >= SHARD_MAX ||
+		    hello.worker == shard_self || shard_link[hello.worker] != CONN_NONE)
+			goto bad;
+		shard_link_up(idx, hello.worker);
+		return;
+	}
+
+	switch (hdr->type) {
+	case BUS_MSG_SUB:
+		shard_sub(hdr->room, cc->worker);
+		break;
+
+	case BUS_MSG_UNSUB:
+		shard_unsub(hdr->room, cc->worker);
+		break;
+
+	case CHAT_MSG_TEXT:
+	case CHAT_MSG_NOTICE:
+		members = room_members(hdr->room, &cnt);
+		for (i = 0; i < cnt; i++)
+			send_to(members[i], mb, CONN_NONE);
+		shard_route(hdr->room, mb, cc->worker);
+		break;
+	}
+	return;
+
+bad:
+	fprintf(stderr, "Unexpected frame on bus link %s, closing it\n", conn_name(idx));
+	conn_hot(idx)->flags |= CONN_F_KILL;
+	mark_dirty(idx);
+}
+
+/* Handle one complete frame, mb holds the header and the payload */
+static void handle_frame(uint32_t idx, struct msgbuf *mb)
+{
+	struct conn_hot *h = conn_hot(idx);
+	const uint32_t *members;
+	struct chat_history_req req;
+	struct chat_hdr hdr;
+	uint32_t i, cnt, fanout = 0;
+	uint64_t seq;
+
+	memcpy(&hdr, mb->data, CHAT_HDR_SIZE);
+	chat_hdr_ntoh(&hdr);
+	conn_cold(idx)->stats.msgs_in++;
+	conn_cold(idx)->stats.bytes_in += mb->len;
+	if (conn_cold(idx)->bus_link) {
+		bus_frame(idx, mb, &hdr);
+		return;
+	}
+
+	switch (hdr.type) {
+	case CHAT_MSG_JOIN:
+		if (hdr.room != h->room)
+			join_room(idx, hdr.room);
+		break;
+
+	case CHAT_MSG_TEXT:
+		/* The frame is relayed untouched, header included, never copied */
+		if (h->room == CHAT_ROOM_ECHO) {
+			send_to(idx, mb, idx);
+			fanout = 1;
+		} else {
+			if (shard_on) {
+				/* Other workers go by the room in the header */
+				uint16_t room = htons(h->room);
+
+				memcpy(mb->data + offsetof(struct chat_hdr, room), &room, sizeof(room));
+			}
+			members = room_members(h->room, &cnt);
+			for (i = 0; i < cnt; i++) {
+				if (members[i] == idx)
+					continue;
+				/* Still catching up, stay behind the backlog */
+				if (conn_hot(members[i])->flags & CONN_F_BACKLOG)
+					offq_push(conn_cold(members[i])->user, mb);
+				else
+					send_to(members[i], mb, idx);
+				fanout++;
+			}
+			if (offq_on)
+				offq_push_room(h->room, mb);
+			if (shard_on)
+				shard_route(h->room, mb, SHARD_NONE);
 		}
-		fprintf(stderr, "Incoming connection from %s:%d\n",
-			addrstr, ntohs(sa.sin_port));
-		sprintf((char *)buf, "Wait for peer to connect.\n");
-		if (insist_write(client, buf, 27) != 27) {
-			perror("write to remote peer failed");
+		if (trace.fp)
+			trace_write(&trace, TRACE_MSG, conn_cold(idx)->id, h->room, hdr.len, fanout);
+		if (history_on && h->room != CHAT_ROOM_ECHO) {
+			conn_cold(idx)->last_seq = 0;
+			if (history_append(h->room, mb->data, mb->len, &seq) < 0)
+				perror("history_append");
+			else
+				conn_cold(idx)->last_seq = seq + 1;
 		}
+		break;
 
-		/* Accept the second incoming connection */
-		len = sizeof(struct sockaddr_in);
-		if ((client2 = accept(sd, (struct sockaddr *)&sa, &len)) < 0) {
-			perror("accept");
-			exit(1);
+	case CHAT_MSG_TERMS:
+		if (history_on)
+			index_terms(idx, mb, hdr.len);
+		break;
+
+	case CHAT_MSG_SEARCH:
+		if (history_on && h->room != CHAT_ROOM_ECHO)
+			search_history(idx, mb, hdr.len);
+		break;
+
+	case CHAT_MSG_HISTORY:
+		if (!history_on || h->room == CHAT_ROOM_ECHO)
+			break;
+		memset(&req, 0, sizeof(req));
+		memcpy(&req, mb->data + CHAT_HDR_SIZE, hdr.len < sizeof(req) ? hdr.len : sizeof(req));
+		req.since_ms = be64toh(req.since_ms);
+		req.max = ntohl(req.max);
+		if (!req.max || req.max > HISTORY_REPLAY_MAX)
+			req.max = HISTORY_REPLAY_MAX;
+		replay_history(idx, req.since_ms, req.max);
+		break;
+
+	case CHAT_MSG_HELLO:
+		say_hello(idx, (const char *)mb->data + CHAT_HDR_SIZE, hdr.len);
+		break;
+
+	case CHAT_MSG_PING:
+		send_to(idx, pong_mb, CONN_NONE);
+		break;
+
+	case CHAT_MSG_PONG:
+		/* Being alive is all it says, last_active is already updated */
+		break;
+
+	default:
+		fprintf(stderr, "Ignoring message of unknown type %u\n", hdr.type);
+		break;
+	}
+}
+
+/* Validate a frame header, -1 if the client is misbehaving */
+static int check_hdr(uint32_t idx, const unsigned char *raw, struct chat_hdr *hdr)
+{
+	memcpy(hdr, raw, CHAT_HDR_SIZE);
+	chat_hdr_ntoh(hdr);
+	if (hdr->len > CHAT_MAX_PAYLOAD) {
+		fprintf(stderr, "Oversized message from %s\n", conn_name(idx));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Feed bytes received from a client through frame reassembly and handle
+ * every complete frame. Returns -1 when the client must be dropped.
+ */
+static int client_input(uint32_t idx, const unsigned char *p, size_t n)
+{
+	struct conn_cold *cc = conn_cold(idx);
+	struct chat_hdr hdr;
+	struct msgbuf *mb;
+	size_t take;
+
+	for (;;) {
+		/* Body of a frame whose header we have */
+		if (cc->in) {
+			take = MIN(n, cc->in->len - cc->in_len);
+			memcpy(cc->in->data + cc->in_len, p, take);
+			cc->in_len += take;
+			p += take;
+			n -= take;
+			if (cc->in_len < cc->in->len)
+				return 0;
+			mb = cc->in;
+			cc->in = NULL;
+			handle_frame(idx, mb);
+			msgbuf_put(mb);
 		}
-		if (!inet_ntop(AF_INET, &sa.sin_addr, addrstr, sizeof(addrstr))) {
-			perror("could not format IP address");
-			exit(1);
+		if (!n)
+			return 0;
+
+		take = MIN(n, CHAT_HDR_SIZE - cc->hdr_len);
+		memcpy(cc->hdr + cc->hdr_len, p, take);
+		cc->hdr_len += take;
+		p += take;
+		n -= take;
+		if (cc->hdr_len < CHAT_HDR_SIZE)
+			return 0;
+		cc->hdr_len = 0;
+
+		if (check_hdr(idx, cc->hdr, &hdr) < 0)
+			return -1;
+		if (!(mb = msgbuf_alloc(CHAT_HDR_SIZE + hdr.len))) {
+			fprintf(stderr, "Out of memory, dropping %s\n", conn_name(idx));
+			return -1;
 		}
-		fprintf(stderr, "Incoming connection from %s:%d\n",
-			addrstr, ntohs(sa.sin_port));
-		sprintf((char *)buf, "Peer connected.\n");
-		if (insist_write(client, buf, 17) != 17) {
-			perror("write to remote peer failed");
-		}
-
-		/* Both clients connected. They communicate */
-		while(1){
-			fd_set inset;
-			int maxfd;
-			FD_ZERO(&inset);             // initialization
-			FD_SET(client, &inset);     // select will check for input from client's socket
-			FD_SET(client2, &inset);   // select will check for input from client2's socket
-			
-			maxfd = MAX(client, client2) + 1;
-
-			int ready_fds = select(maxfd, &inset, NULL, NULL, NULL);
-			if (ready_fds <= 0) {
-					perror("select");
-					continue;    // try again
-			}
+		memcpy(mb->data, cc->hdr, CHAT_HDR_SIZE);
+		cc->in = mb;
+		cc->in_len = CHAT_HDR_SIZE;
+	}
+}
 
-			// input from client
-			if (FD_ISSET(client, &inset)) {
-				n = read(client, buf, sizeof(buf));
-				if (n <= 0) {
-					if (n < 0)
-						perror("read from remote peer failed");
-					else{
-						fprintf(stderr, "Peer went away\n");
-						left = 1;
-						if (close(client) < 0)
-							perror("close");
-						break;
-					}
-				}
-				if (insist_write(client2, buf, n) != n) {
-					perror("write to remote peer failed");
-				}
-			}
+int server_input(uint32_t idx, const unsigned char *data, size_t n)
+{
+	conn_hot(idx)->last_active = now_sec;
+	return client_input(idx, data, n);
+}
 
-			// input from client2
-			if (FD_ISSET(client2, &inset)) {
-				n = read(client2, buf, sizeof(buf));
-				if (n <= 0) {
-					if (n < 0)
-						perror("read from remote peer failed");
-					else{
-						fprintf(stderr, "Peer went away\n");
-						left = 2;
-						if (close(client2) < 0)
-							perror("close");
-						break;
-					}
-				}
-				if (insist_write(client, buf, n) != n) {
-					perror("write to remote peer failed");
-				}
-			}
+/*
+ * A shared memory client kicked its eventfd, or we did. Frames are
+ * taken straight from its ring; once it is empty, ask for a kick on
+ * new data before the engine goes back to sleep. After a full ring's
+ * worth, let the other clients have a turn.
+ */
+static int shm_input(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct shm_chan *c = conn_cold(idx)->shm;
+	uint64_t kicks = c->kicks;
+	size_t budget = c->size;
+	struct iovec iov[2];
+	ssize_t n;
+	int ret = 0;
+
+	h->last_active = now_sec;
+	engine_syscalls++;
+	shm_ack(c);
+	/* Or the kick was about room for output waiting in the queue */
+	if (h->pending)
+		mark_dirty(idx);
+
+	while (!(h->flags & CONN_F_THROTTLED)) {
+		if ((n = shm_peek(c, iov)) < 0) {
+			fprintf(stderr, "Peer %s corrupted its ring\n", conn_name(idx));
+			ret = -1;
+			break;
 		}
-		
-		/* One client disconnected */
-		if(left == 1){                                                  // First client left. Wait till first one leaves too
-			sprintf((char *)buf, "Peer left. Type exit to shut connection\n"); // inform the second client
-			if (insist_write(client2, buf, 41) != 41) {
-				perror("write to remote peer failed");
-			}
-			while(1){                                              // while the second client stays connected
-				n = read(client2, buf, sizeof(buf));              // ignore what they write
-				if (n <= 0) {                                    // second client left
-					fprintf(stderr, "Peer went away\n");
-					if (close(client2) < 0){
-						perror("close");
-					}
-					break;
-				}
+		if (!n) {
+			if (shm_eof(c)) {
+				ret = -1;
+				break;
 			}
+			if (!shm_arm_rx(c))
+				break;
+			continue;
+		}
+		if (!budget) {
+			shm_self_kick(c);
+			break;
+		}
+		if (client_input(idx, iov[0].iov_base, iov[0].iov_len) < 0 ||
+		    client_input(idx, iov[1].iov_base, iov[1].iov_len) < 0) {
+			ret = -1;
+			break;
 		}
-		if(left == 2){                                                  // First client left. Wait till first one leaves too
-			sprintf((char *)buf, "Peer left. Type exit to shut connection\n"); // inform the first client
-			if (insist_write(client, buf, 41) != 41) {
-				perror("write to remote peer failed");
+		shm_consume(c, n);
+		budget -= MIN(budget, (size_t)n);
+	}
+	engine_syscalls += c->kicks - kicks;
+	return ret;
+}
+
+/* Copy the outbound queue into the client's ring, as far as it fits */
+static int shm_output(uint32_t idx)
+{
+	struct conn_cold *cc = conn_cold(idx);
+	struct shm_chan *c = cc->shm;
+	struct iovec iov[OUTQ_IOV_MAX];
+	uint64_t kicks = c->kicks;
+	size_t total = 0, want;
+	ssize_t n;
+	int cnt;
+
+	while ((cnt = outq_iov(&cc->outq, iov, OUTQ_IOV_MAX, &want))) {
+		if ((n = shm_writev(c, iov, cnt)) < 0) {
+			if (errno != EAGAIN)
+				return -1;
+			/* Full: the client kicks us when it has made room */
+			if (!shm_arm_tx(c))
+				break;
+			continue;
+		}
+		outq_consume(&cc->outq, n);
+		total += n;
+	}
+	engine_syscalls += c->kicks - kicks;
+	if (total)
+		server_sent(idx, total);
+	return 0;
+}
+
+int server_read(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct conn_cold *cc = conn_cold(idx);
+	struct msgbuf *mb;
+	ssize_t n;
+
+	if (h->flags & CONN_F_SHM)
+		return shm_input(idx);
+	h->last_active = now_sec;
+	engine_syscalls++;
+
+	/* Rest of a large frame: read it in place, no staging copy */
+	if (cc->in && cc->in->len - cc->in_len >= sizeof(rx_staging) / 2) {
+		n = read(h->fd, cc->in->data + cc->in_len, cc->in->len - cc->in_len);
+		if (n <= 0)
+			goto read_failed;
+		cc->in_len += n;
+		if (cc->in_len == cc->in->len) {
+			mb = cc->in;
+			cc->in = NULL;
+			handle_frame(idx, mb);
+			msgbuf_put(mb);
+		}
+		return 0;
+	}
+
+	n = read(h->fd, rx_staging, sizeof(rx_staging));
+	if (n <= 0)
+		goto read_failed;
+	return client_input(idx, rx_staging, n);
+
+read_failed:
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		perror("read from remote peer failed");
+	}
+	return -1;
+}
+
+void server_writable(uint32_t idx)
+{
+	mark_dirty(idx);
+}
+
+void server_sent(uint32_t idx, size_t n)
+{
+	struct conn_hot *h = conn_hot(idx);
+	struct conn_cold *cc = conn_cold(idx);
+
+	cc->stats.bytes_out += n;
+	if (h->flags & CONN_F_BACKLOG)
+		offline_drain(idx);
+	h->pending = cc->outq.bytes;
+	if ((h->flags & CONN_F_CONGESTED) && h->pending <= max_queue / 2) {
+		h->flags &= ~CONN_F_CONGESTED;
+		drained = 1;
+	}
+	engine->update(idx);
+}
+
+/*
+ * Write out everything queued in this round. Messages that arrived
+ * together leave together, in one writev() or sendmsg() per client.
+ */
+static void flush_one(uint32_t idx)
+{
+	struct conn_hot *h = conn_hot(idx);
+
+	if (h->state != CONN_OPEN || !(h->flags & CONN_F_DIRTY))
+		return;
+	h->flags &= ~CONN_F_DIRTY;
+
+	if (h->flags & CONN_F_KILL) {
+		fprintf(stderr, "Peer %s too slow, %u bytes queued, disconnecting\n",
+			conn_name(idx), h->pending);
+		bp_stats.slow_disconnects++;
+		drop_client(idx);
+		return;
+	}
+
+	if ((h->flags & CONN_F_SHM ? shm_output(idx) : engine->send(idx)) < 0) {
+		perror("write to remote peer failed");
+		drop_client(idx);
+	}
+}
+
+static void flush_dirty(void)
+{
+	uint32_t i, idx;
+
+	do {
+		/* drop_client() may queue notices and grow the list while we walk it */
+		for (i = 0; i < ndirty; i++)
+			flush_one(dirty[i]);
+		ndirty = 0;
+		/* Without memory for the list, look through the whole table */
+		if (dirty_overflow) {
+			dirty_overflow = 0;
+			for (idx = 0; idx < conn_table_span(); idx++)
+				flush_one(idx);
+		}
+	} while (ndirty || dirty_overflow);
+
+	if (drained) {
+		drained = 0;
+		unthrottle();
+	}
+}
+
+/* Backpressure counters and the deepest outbound queues, on SIGUSR1 */
+static void dump_stats(void)
+{
+	uint32_t top[STATS_TOP], ntop = 0, idx, span = conn_table_span();
+	struct offq_stats ost;
+	struct conn_cold *cc;
+	struct conn_hot *h;
+	unsigned int i, j;
+
+	if (shard_on)
+		fprintf(stderr, "worker %u, linked to %d workers\n", shard_self,
+			__builtin_popcountll(shard_live) - 1);
+	fprintf(stderr, "%u clients, max queue %zu bytes, %u senders throttled\n",
+		conn_tbl.count - (__builtin_popcountll(shard_live) - shard_on), max_queue, nthrottled);
+	if (offq_on) {
+		offq_get_stats(&ost);
+		fprintf(stderr, "offline: %u users, %u away, %u spilled, %zu bytes in memory, "
+			"%llu on disk, %llu queued, %llu dropped\n",
+			ost.users, ost.parked, ost.spilled, ost.mem_bytes,
+			(unsigned long long)ost.disk_bytes, (unsigned long long)ost.queued,
+			(unsigned long long)ost.drops);
+	}
+	fprintf(stderr, "%s: %llu messages relayed, %llu I/O system calls\n", engine->name,
+		(unsigned long long)msgs_relayed, (unsigned long long)engine_syscalls);
+	fprintf(stderr, "drops %llu (%llu bytes), slow disconnects %llu, throttles %llu\n",
+		(unsigned long long)bp_stats.drops, (unsigned long long)bp_stats.drop_bytes,
+		(unsigned long long)bp_stats.slow_disconnects,
+		(unsigned long long)bp_stats.throttles);
+
+	/* Insertion into a short sorted array, the table may be large */
+	for (idx = 0; idx < span; idx++) {
+		h = conn_hot(idx);
+		if (h->state != CONN_OPEN || !h->pending)
+			continue;
+		for (i = ntop; i > 0 && conn_hot(top[i - 1])->pending < h->pending; i--)
+			;
+		if (i == STATS_TOP)
+			continue;
+		j = ntop < STATS_TOP ? ntop++ : STATS_TOP - 1;
+		for (; j > i; j--)
+			top[j] = top[j - 1];
+		top[i] = idx;
+	}
+	for (i = 0; i < ntop; i++) {
+		h = conn_hot(top[i]);
+		cc = conn_cold(top[i]);
+		fprintf(stderr, "  %-21s room %5u queued %u (max %u) drops %llu%s\n",
+			conn_name(top[i]), h->room, h->pending, cc->stats.max_queue,
+			(unsigned long long)cc->stats.drops,
+			h->flags & CONN_F_THROTTLED ? " throttled" : "");
+	}
+}
+
+static int parse_policy(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+		if (!strcmp(name, policy_names[i]))
+			return i;
+	return -1;
+}
+
+/* -P policy sets the default, -P room:policy a single room */
+static int set_policy(const char *arg, int *def)
+{
+	const char *colon = strchr(arg, ':');
+	int policy = parse_policy(colon ? colon + 1 : arg);
+
+	if (policy < 0)
+		return -1;
+	if (!colon)
+		*def = policy;
+	else
+		room_policy[atoi(arg) & UINT16_MAX] = policy | 0x80;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *listen_spec[MAX_LISTEN];
+	int listen_sds[MAX_LISTEN + 1], nlisten = 0;	/* and the bus socket */
+	char default_spec[16], bus_default[64], worker_trace[4096];
+	unsigned int nworkers = 0, w;
+	const char *bus_dir = NULL;
+	uint64_t peers;
+	int bus_sd;
+	int i, opt;
+	struct sigaction act;
+	const char *trace_path = NULL;
+	const char *history_path = NULL;
+	const char *offq_path = NULL;
+	size_t offq_mem = OFFQ_TOTAL_MEM;
+	struct history_opts hopts = {
+		.seg_size = HISTORY_SEG_SIZE,
+		.keep_segs = HISTORY_KEEP_SEGS,
+	};
+	struct msgbuf_stats mstats;
+	int64_t next;
+	int def_policy = POLICY_DROP;
+
+	while ((opt = getopt(argc, argv, "p:l:T:i:H:q:P:e:S:N:R:Q:M:W:B:")) != -1) {
+		switch (opt) {
+		case 'e':
+			for (i = 0; engines[i] && strcmp(engines[i]->name, optarg); i++)
+				;
+			if (!(engine = engines[i])) {
+				fprintf(stderr, "Unknown engine '%s'. Engines:\n", optarg);
+				for (i = 0; engines[i]; i++)
+					fprintf(stderr, "  %-10s %s\n", engines[i]->name, engines[i]->descr);
+				exit(1);
 			}
-			while(1){                                             // while the first client stays connected
-				n = read(client, buf, sizeof(buf));              // ignore what they write
-				if (n <= 0) {                                   // first client left
-					fprintf(stderr, "Peer went away\n");
-					if (close(client) < 0){
-						perror("close");
-					}
-					break;
-				}
+			break;
+		case 'p':
+		case 'l':
+			if (nlisten == MAX_LISTEN) {
+				fprintf(stderr, "At most %d listening addresses\n", MAX_LISTEN);
+				exit(1);
 			}
+			listen_spec[nlisten++] = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'S':
+			history_path = optarg;
+			break;
+		case 'N':
+			history_join = atoi(optarg);
+			break;
+		case 'R':
+			hopts.max_age_ms = strtoull(optarg, NULL, 0) * 3600 * 1000;
+			break;
+		case 'Q':
+			offq_path = optarg;
+			break;
+		case 'M':
+			offq_mem = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			nworkers = atoi(optarg);
+			break;
+		case 'B':
+			bus_dir = optarg;
+			break;
+		case 'i':
+			idle_timeout = atoi(optarg);
+			break;
+		case 'H':
+			hb_interval = atoi(optarg);
+			break;
+		case 'q':
+			max_queue = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			if (set_policy(optarg, &def_policy) == 0)
+				break;
+			fprintf(stderr, "Unknown policy '%s', use drop, disconnect or throttle\n", optarg);
+			/* fall through */
+		default:
+			fprintf(stderr, "Usage: %s [-l [vsock:[CID:]]port | shm:/path]... [-e select|epoll|io_uring]\n"
+				"\t[-T tracefile] [-i idle_secs] [-H heartbeat_secs] [-q max_queue_bytes]\n"
+				"\t[-P [room:]drop|disconnect|throttle]\n"
+				"\t[-S history_dir [-N join_replay] [-R retention_hours]]\n"
+				"\t[-Q offline_queue_dir [-M offline_mem_bytes]]\n"
+				"\t[-W workers [-B bus_dir]]\n", argv[0]);
+			exit(1);
+		}
+	}
+	/* A queue must hold at least one frame of the largest size */
+	if (max_queue < CHAT_HDR_SIZE + CHAT_MAX_PAYLOAD)
+		max_queue = CHAT_HDR_SIZE + CHAT_MAX_PAYLOAD;
+	/* Rooms set explicitly are marked with 0x80, the rest get the default */
+	for (i = 0; i <= UINT16_MAX; i++)
+		room_policy[i] = room_policy[i] & 0x80 ? room_policy[i] & 0x7f : def_policy;
+	if (nworkers > SHARD_MAX) {
+		fprintf(stderr, "At most %d workers\n", SHARD_MAX);
+		exit(1);
+	}
+	/* Both are kept per process for now, they would not see each other's rooms */
+	if (nworkers && (history_path || offq_path)) {
+		fprintf(stderr, "-S and -Q do not work with -W yet\n");
+		exit(1);
+	}
+
+	/* TCP on the well-known port unless told otherwise */
+	if (!nlisten) {
+		snprintf(default_spec, sizeof(default_spec), "%d", TCP_PORT);
+		listen_spec[nlisten++] = default_spec;
+	}
+	for (i = 0; i < nlisten; i++)
+		if ((listen_sds[i] = chat_listen(listen_spec[i], TCP_BACKLOG)) < 0)
+			exit(1);
+
+	/* Workers share the listening sockets, the parent stays in shard_start() */
+	if (nworkers) {
+		if (!bus_dir) {
+			snprintf(bus_default, sizeof(bus_default), "/tmp/chat-bus.%d", (int)getpid());
+			bus_dir = bus_default;
+		}
+		if (shard_start(nworkers, bus_dir, &bus_sd, &peers) < 0)
+			exit(1);
+		shard_on = 1;
+		shard_path(bus_path, sizeof(bus_path), shard_self);
+		listen_sds[nlisten++] = bus_sd;
+		for (i = 0; i < SHARD_MAX; i++)
+			shard_link[i] = CONN_NONE;
+		memset(shard_sub_to, SHARD_NONE, sizeof(shard_sub_to));
+		if (trace_path) {
+			snprintf(worker_trace, sizeof(worker_trace), "%s.%u", trace_path, shard_self);
+			trace_path = worker_trace;
+		}
+	}
+
+	/* Make sure a broken connection doesn't kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Interrupt the engine's wait on SIGINT/SIGTERM so the trace gets flushed */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = finish_handler;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	act.sa_handler = dump_handler;
+	sigaction(SIGUSR1, &act, NULL);
+
+	if (!(ping_mb = make_frame(CHAT_MSG_PING, 0, NULL, 0)) ||
+	    !(pong_mb = make_frame(CHAT_MSG_PONG, 0, NULL, 0))) {
+		perror("msgbuf_alloc");
+		exit(1);
+	}
+
+	if (trace_path) {
+		if (trace_create(&trace, trace_path) < 0)
+			exit(1);
+		fprintf(stderr, "Recording traffic trace to %s\n", trace_path);
+	}
+	if (history_path) {
+		if (history_init(history_path, &hopts) < 0)
+			exit(1);
+		if (search_init(history_path) < 0)
+			exit(1);
+		history_on = 1;
+		fprintf(stderr, "Keeping room history and its search index in %s\n", history_path);
+	}
+	if (offq_path) {
+		if (offq_init(offq_path, offq_mem) < 0)
+			exit(1);
+		offq_on = 1;
+		fprintf(stderr, "Queueing messages for users away, spilling to %s\n", offq_path);
+	}
+
+	if (engine->init(listen_sds, nlisten) < 0) {
+		fprintf(stderr, "Could not start the %s engine\n", engine->name);
+		exit(1);
+	}
+	fprintf(stderr, "Using the %s engine\n", engine->name);
+	now_ms = monotonic_ms();
+	now_sec = now_ms / 1000;
+	tw_init(&wheel, now_ms / TICK_MS);
+	timer_init(&accept_retry, accept_resume, 0);
+	timer_init(&search_poll, search_reap_all, 0);
+	for (w = 0; shard_on && w < SHARD_MAX; w++)
+		if (peers & (1ULL << w))
+			shard_connect(w);
+
+	/* Relay messages between the clients of each room, until told to stop */
+	while (!must_finish) {
+		if (must_dump) {
+			must_dump = 0;
+			dump_stats();
 		}
+		next = tw_next_expiry(&wheel);
+		if (engine->wait(next < 0 ? -1 : next * TICK_MS) < 0)
+			exit(1);
+		now_ms = monotonic_ms();
+		now_sec = now_ms / 1000;
+		engine->dispatch();
+
+		/* Timers may drop clients and queue pings, before the flush */
+		tw_advance(&wheel, now_ms / TICK_MS);
+		flush_dirty();
+		if (offq_on)
+			offq_flush();
+		/* Indexing waits until this round's messages are on their way */
+		if (history_on)
+			search_flush();
 	}
 
-	/* This will never happen */
-	return 1;
-}
\ No newline at end of file
+	/* Close the links, so the other workers take over our rooms */
+	for (w = 0; shard_on && w < SHARD_MAX; w++)
+		if (shard_link[w] != CONN_NONE)
+			drop_client(shard_link[w]);
+	if (engine->fini)
+		engine->fini();
+	msgbuf_put(ping_mb);
+	msgbuf_put(pong_mb);
+	msgbuf_get_stats(&mstats);
+	fprintf(stderr, "Shutting down, %u clients, %zu message buffers (%zu bytes) still queued\n",
+		conn_tbl.count, mstats.live, mstats.live_bytes);
+	fprintf(stderr, "%s: %llu messages relayed, %llu I/O system calls, %.3f per message\n",
+		engine->name, (unsigned long long)msgs_relayed, (unsigned long long)engine_syscalls,
+		msgs_relayed ? (double)engine_syscalls / msgs_relayed : 0.0);
+	trace_close(&trace);
+	if (history_on) {
+		search_fini();
+		history_sync();
+		history_fini();
+	}
+	if (offq_on)
+		offq_fini();
+	if (shard_on)
+		unlink(bus_path);
+	return 0;
+}
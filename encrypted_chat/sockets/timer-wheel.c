@@ -0,0 +1,120 @@
+/*
+ * timer-wheel.c
+ *
+ * Hierarchical timing wheel, see timer-wheel.h.
+ */
+
+#include <string.h>
+
+#include "timer-wheel.h"
+
+#define TW_MASK		(TW_SLOTS - 1)
+
+static inline unsigned int slot_of(uint64_t expires, unsigned int level)
+{
+	return (expires >> (level * TW_BITS)) & TW_MASK;
+}
+
+void tw_init(struct timer_wheel *tw, uint64_t now)
+{
+	memset(tw, 0, sizeof(*tw));
+	tw->now = now;
+}
+
+/* Link t into its slot, t->expires is not before tw->now */
+static void link_timer(struct timer_wheel *tw, struct timer *t)
+{
+	uint64_t delta = t->expires - tw->now;
+	unsigned int level = 0;
+	struct timer **head;
+
+	if (delta > TW_MAX_DELTA)
+		t->expires = tw->now + TW_MAX_DELTA;
+	while (level < TW_LEVELS - 1 &&
+	       (t->expires >> ((level + 1) * TW_BITS)) != (tw->now >> ((level + 1) * TW_BITS)))
+		level++;
+
+	head = &tw->slots[level][slot_of(t->expires, level)];
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+}
+
+static void unlink_timer(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void tw_add(struct timer_wheel *tw, struct timer *t, uint64_t expires)
+{
+	if (timer_pending(t))
+		unlink_timer(t);
+	else
+		tw->count++;
+	/* Overdue timers go in the next slot, never the one being run */
+	t->expires = expires > tw->now ? expires : tw->now + 1;
+	link_timer(tw, t);
+}
+
+void tw_del(struct timer_wheel *tw, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+	unlink_timer(t);
+	tw->count--;
+}
+
+/* Move the timers of one coarse slot down to the finer levels */
+static void cascade(struct timer_wheel *tw, unsigned int level)
+{
+	struct timer *t, *list = tw->slots[level][slot_of(tw->now, level)];
+
+	tw->slots[level][slot_of(tw->now, level)] = NULL;
+	while ((t = list)) {
+		list = t->next;
+		link_timer(tw, t);
+	}
+}
+
+void tw_advance(struct timer_wheel *tw, uint64_t now)
+{
+	struct timer *t, **head;
+	unsigned int level;
+
+	while (tw->now < now) {
+		/* Nothing armed: jump straight to now */
+		if (!tw->count) {
+			tw->now = now;
+			break;
+		}
+		tw->now++;
+		for (level = 1; level < TW_LEVELS && slot_of(tw->now, level - 1) == 0; level++)
+			cascade(tw, level);
+
+		head = &tw->slots[0][slot_of(tw->now, 0)];
+		while ((t = *head)) {
+			unlink_timer(t);
+			tw->count--;
+			t->fn(t);
+		}
+	}
+}
+
+int64_t tw_next_expiry(const struct timer_wheel *tw)
+{
+	unsigned int i, base = slot_of(tw->now, 0);
+
+	if (!tw->count)
+		return -1;
+	for (i = 1; i < TW_SLOTS; i++)
+		if (tw->slots[0][(base + i) & TW_MASK])
+			return i;
+	/* Only coarser timers left, wake up for the next cascade */
+	return TW_SLOTS - base;
+}
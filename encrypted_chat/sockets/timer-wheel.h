@@ -0,0 +1,77 @@
+/*
+ * timer-wheel.h
+ *
+ * Hierarchical timing wheel.
+ *
+ * TW_LEVELS wheels of TW_SLOTS slots each; level n slots are
+ * TW_SLOTS^n ticks wide. A timer is linked into the slot of the
+ * coarsest level that still tells its expiry apart from now, and moves
+ * down a level each time the finer wheel wraps around (cascading).
+ * Adding, cancelling and firing a timer are O(1); a timer is cascaded
+ * at most TW_LEVELS - 1 times over its life.
+ *
+ * Timers are intrusive: the owner embeds struct timer and keeps it
+ * for as long as it is armed. The wheel does not know what a tick is,
+ * the caller picks the unit and feeds the current time to tw_advance().
+ */
+
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TW_BITS		6
+#define TW_SLOTS	(1U << TW_BITS)		/* 64 slots per level */
+#define TW_LEVELS	4			/* 2^24 ticks of range */
+#define TW_MAX_DELTA	((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+
+struct timer {
+	struct timer *next, **pprev;	/* pprev is NULL when not armed */
+	uint64_t expires;		/* absolute, in ticks */
+	void (*fn)(struct timer *t);
+	uint32_t data;			/* for the callback, e.g. a connection index */
+};
+
+struct timer_wheel {
+	uint64_t now;			/* last tick processed */
+	uint32_t count;			/* armed timers */
+	struct timer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+void tw_init(struct timer_wheel *tw, uint64_t now);
+
+static inline void timer_init(struct timer *t, void (*fn)(struct timer *), uint32_t data)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->fn = fn;
+	t->data = data;
+}
+
+static inline int timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+/*
+ * Arm t to fire at tick expires, re-arming it if it already is. An
+ * expiry in the past fires on the next tw_advance(); one further out
+ * than TW_MAX_DELTA is clamped to it.
+ */
+void tw_add(struct timer_wheel *tw, struct timer *t, uint64_t expires);
+/* Disarm t, a no-op if it is not armed */
+void tw_del(struct timer_wheel *tw, struct timer *t);
+
+/*
+ * Run every timer due up to tick now. Callbacks may add and delete
+ * timers, including their own.
+ */
+void tw_advance(struct timer_wheel *tw, uint64_t now);
+
+/*
+ * Ticks until tw_advance() has something to do, at most the distance
+ * to the next cascade; -1 when no timer is armed. For poll timeouts.
+ */
+int64_t tw_next_expiry(const struct timer_wheel *tw);
+
+#endif /* _TIMER_WHEEL_H */
@@ -10,6 +10,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "qemu/iov.h"
 #include "hw/qdev.h"
 #include "hw/virtio/virtio.h"
@@ -21,6 +22,228 @@
 #include <sys/ioctl.h>
 #include <crypto/cryptodev.h>
 
+/* Same layout as in the guest driver's crypto.h */
+struct virtio_cryptodev_host_timing {
+    uint64_t backend_ns;
+    uint64_t host_ioctl_ns;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Multi-descriptor payloads go to the host one segment per CIOCCRYPT,
+ * chaining the IV, as long as segments end on whole blocks (16 bytes
+ * covers every block size /dev/crypto has). Otherwise they are bounced
+ * through one buffer.
+ */
+#define CRYPT_SEG_ALIGN 16
+
+/*
+ * Take the in_sg descriptors from *i on that hold len bytes. A field
+ * always has at least one, even when empty, so single-descriptor
+ * guests parse as before. Returns how many, or 0 if they run out.
+ */
+static unsigned int take_in_sg(VirtQueueElement *elem, unsigned int *i,
+                               size_t len)
+{
+    unsigned int first = *i;
+    size_t got = 0;
+
+    do {
+        if (*i >= elem->in_num) {
+            return 0;
+        }
+        got += elem->in_sg[(*i)++].iov_len;
+    } while (got < len);
+    return *i - first;
+}
+
+static bool iov_seg_aligned(const struct iovec *iov, unsigned int num,
+                            size_t len)
+{
+    size_t off = 0;
+    unsigned int i;
+
+    for (i = 0; i + 1 < num; i++) {
+        off += iov[i].iov_len;
+        if (off < len && off % CRYPT_SEG_ALIGN) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* CIOCCRYPT of crypt->len bytes from the src to the dst descriptors */
+static int crypt_iov(int fd, struct crypt_op *crypt,
+                     const struct iovec *src, unsigned int src_num,
+                     const struct iovec *dst, unsigned int dst_num)
+{
+    size_t len = crypt->len, done = 0, src_off = 0, dst_off = 0, n;
+    unsigned int s = 0, d = 0;
+    uint16_t flags = crypt->flags;
+    uint8_t *buf;
+    int ret = 0;
+
+    if (src_num == 1 && dst_num == 1) {
+        crypt->src = src[0].iov_base;
+        crypt->dst = dst[0].iov_base;
+        return ioctl(fd, CIOCCRYPT, crypt);
+    }
+
+    if (!iov_seg_aligned(src, src_num, len) ||
+        !iov_seg_aligned(dst, dst_num, len)) {
+        buf = g_malloc(len);
+        iov_to_buf(src, src_num, 0, buf, len);
+        crypt->src = crypt->dst = buf;
+        ret = ioctl(fd, CIOCCRYPT, crypt);
+        if (!ret) {
+            iov_from_buf(dst, dst_num, 0, buf, len);
+        }
+        g_free(buf);
+        return ret;
+    }
+
+    while (done < len) {
+        n = MIN(src[s].iov_len - src_off, dst[d].iov_len - dst_off);
+        n = MIN(n, len - done);
+        if (n) {
+            crypt->src = (uint8_t *)src[s].iov_base + src_off;
+            crypt->dst = (uint8_t *)dst[d].iov_base + dst_off;
+            crypt->len = n;
+            /* the next segment carries on from this one's IV */
+            crypt->flags = done + n < len ? flags | COP_FLAG_WRITE_IV : flags;
+            if ((ret = ioctl(fd, CIOCCRYPT, crypt))) {
+                break;
+            }
+            done += n;
+            src_off += n;
+            dst_off += n;
+        }
+        if (src_off == src[s].iov_len) {
+            s++;
+            src_off = 0;
+        }
+        if (dst_off == dst[d].iov_len) {
+            d++;
+            dst_off = 0;
+        }
+    }
+    crypt->len = len;
+    crypt->flags = flags;
+    return ret;
+}
+
+/*
+ * A guest open() gets a handle onto one of the device's host fds
+ * rather than a host fd of its own. Host session ids are unique per
+ * host fd, so they pass through as they are; each handle only gets to
+ * use the sessions it created, and closing it frees them.
+ */
+typedef struct CryptodevHandle {
+    unsigned int pool;      /* index into pool_fd */
+    GHashTable *sessions;   /* host session ids created through it */
+} CryptodevHandle;
+
+/* The least used host fd, opened on first use */
+static int pool_get(VirtCryptodev *vcd)
+{
+    unsigned int i, best = 0;
+
+    for (i = 1; i < vcd->host_fds; i++) {
+        if (vcd->pool_users[i] < vcd->pool_users[best] ||
+            (vcd->pool_users[i] == vcd->pool_users[best] &&
+             vcd->pool_fd[best] < 0 && vcd->pool_fd[i] >= 0)) {
+            best = i;
+        }
+    }
+    if (vcd->pool_fd[best] < 0 &&
+        (vcd->pool_fd[best] = open(CRYPTODEV_FILENAME, O_RDWR)) < 0) {
+        DEBUG("error open file");
+        return -1;
+    }
+    return best;
+}
+
+static int handle_open(VirtCryptodev *vcd)
+{
+    CryptodevHandle *h;
+    int pool, id;
+
+    if ((pool = pool_get(vcd)) < 0) {
+        return -1;
+    }
+    do {
+        id = vcd->next_handle;
+        vcd->next_handle = (vcd->next_handle + 1) & INT_MAX;
+    } while (g_hash_table_contains(vcd->handles, GINT_TO_POINTER(id)));
+
+    h = g_new0(CryptodevHandle, 1);
+    h->pool = pool;
+    h->sessions = g_hash_table_new(NULL, NULL);
+    g_hash_table_insert(vcd->handles, GINT_TO_POINTER(id), h);
+    vcd->pool_users[pool]++;
+    return id;
+}
+
+static CryptodevHandle *handle_lookup(VirtCryptodev *vcd, int id)
+{
+    return g_hash_table_lookup(vcd->handles, GINT_TO_POINTER(id));
+}
+
+static bool handle_owns(CryptodevHandle *h, uint32_t ses)
+{
+    return h && g_hash_table_contains(h->sessions, GUINT_TO_POINTER(ses));
+}
+
+/* Frees what the handle left behind; the host fd stays open for others */
+static void handle_free(VirtCryptodev *vcd, CryptodevHandle *h)
+{
+    GHashTableIter iter;
+    gpointer ses;
+    uint32_t sid;
+
+    g_hash_table_iter_init(&iter, h->sessions);
+    while (g_hash_table_iter_next(&iter, &ses, NULL)) {
+        sid = GPOINTER_TO_UINT(ses);
+        if (ioctl(vcd->pool_fd[h->pool], CIOCFSESSION, &sid)) {
+            DEBUG("ioctl(CIOCFSESSION)");
+        }
+    }
+    g_hash_table_destroy(h->sessions);
+    vcd->pool_users[h->pool]--;
+    g_free(h);
+}
+
+static void handle_close(VirtCryptodev *vcd, int id)
+{
+    CryptodevHandle *h = handle_lookup(vcd, id);
+
+    if (!h) {
+        DEBUG("unknown handle");
+        return;
+    }
+    g_hash_table_remove(vcd->handles, GINT_TO_POINTER(id));
+    handle_free(vcd, h);
+}
+
+static void handle_close_all(VirtCryptodev *vcd)
+{
+    GHashTableIter iter;
+    gpointer h;
+
+    g_hash_table_iter_init(&iter, vcd->handles);
+    while (g_hash_table_iter_next(&iter, NULL, &h)) {
+        handle_free(vcd, h);
+        g_hash_table_iter_remove(&iter);
+    }
+}
+
 static uint64_t get_features(VirtIODevice *vdev, uint64_t features,
                              Error **errp)
 {
@@ -46,13 +269,20 @@ static void set_status(VirtIODevice *vdev, uint8_t status)
 static void vser_reset(VirtIODevice *vdev)
 {
     DEBUG_IN();
+    /* The guest driver starts over, its handles are gone */
+    handle_close_all(VIRTIO_CRYPTODEV(vdev));
 }
 
 static void vq_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtCryptodev *vcd = VIRTIO_CRYPTODEV(vdev);
     VirtQueueElement *elem;
     unsigned int *syscall_type;
-    int *host_fd;
+    int *host_fd;   /* what the guest calls its host fd is our handle */
+    CryptodevHandle *h;
+    int fd;
+    struct virtio_cryptodev_host_timing *timing = NULL;
+    uint64_t t_start = now_ns(), t_ioctl;
 
     DEBUG_IN();
 
@@ -72,18 +302,16 @@ static void vq_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         DEBUG("VIRTIO_CRYPTODEV_SYSCALL_TYPE_OPEN");
         /* ?? */
         host_fd = elem->in_sg[0].iov_base;
-        if ( (*host_fd = open("/dev/crypto", O_RDWR)) < 0 ){
-            DEBUG("error open file");
-        }
+        *host_fd = handle_open(vcd);
         DEBUG("I opened the file:)");
-        printf("Host fd = %d\n", *host_fd);
+        printf("Guest handle = %d\n", *host_fd);
         break;
 
     case VIRTIO_CRYPTODEV_SYSCALL_TYPE_CLOSE:
         DEBUG("VIRTIO_CRYPTODEV_SYSCALL_TYPE_CLOSE");
         /* ?? */
         host_fd = elem->out_sg[1].iov_base;
-        close(*host_fd);
+        handle_close(vcd, *host_fd);
         DEBUG("I closed the file:(");
         break;
 
@@ -93,12 +321,16 @@ static void vq_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         host_fd = elem->out_sg[1].iov_base;
         unsigned int *cmd = elem->out_sg[2].iov_base;
         struct session_op *sess;
-        __u8 *key, *src, *dst, *iv;
+        __u8 *key, *iv;
+        unsigned int i, src_num, dst_num;
         __u32 *ses;
         struct crypt_op *crypt;
         int *host_return_val;
 
-        printf("Host fd = %d\n", *host_fd);
+        h = handle_lookup(vcd, *host_fd);
+        fd = h ? vcd->pool_fd[h->pool] : -1;
+
+        printf("Host fd = %d\n", fd);
         printf("cmd = %u\n", *cmd);
 
         switch (*cmd) {
@@ -109,9 +341,11 @@ static void vq_handle_output(VirtIODevice *vdev, VirtQueue *vq)
                 host_return_val = elem->in_sg[2].iov_base;
                 sess->key = key;
 
-                if ((*host_return_val = ioctl(*host_fd, CIOCGSESSION, sess))) {
+                if ((*host_return_val = ioctl(fd, CIOCGSESSION, sess))) {
                     DEBUG("error ioctl(CIOCGSESSION)");
+                    break;
                 }
+                g_hash_table_add(h->sessions, GUINT_TO_POINTER(sess->ses));
 
                 DEBUG("CIOCGSESSION: Success");
                 break;
@@ -121,9 +355,16 @@ static void vq_handle_output(VirtIODevice *vdev, VirtQueue *vq)
                 ses = elem->in_sg[0].iov_base;
                 host_return_val = elem->in_sg[1].iov_base;
 
-                if ((*host_return_val = ioctl(*host_fd, CIOCFSESSION, ses))) {
+                if (!handle_owns(h, *ses)) {
+                    DEBUG("CIOCFSESSION: not this handle's session");
+                    *host_return_val = -1;
+                    break;
+                }
+                if ((*host_return_val = ioctl(fd, CIOCFSESSION, ses))) {
                     DEBUG("ioctl(CIOCFSESSION)");
-	            }
+                    break;
+                }
+                g_hash_table_remove(h->sessions, GUINT_TO_POINTER(*ses));
 
                 DEBUG("CIOCFSESSION: Success");
                 break;
@@ -131,17 +372,38 @@ static void vq_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             case CIOCCRYPT:
                 DEBUG("CIOCCRYPT");
                 crypt = elem->in_sg[0].iov_base;
-                src = elem->in_sg[1].iov_base;
-                dst = elem->in_sg[2].iov_base;
-                iv = elem->in_sg[3].iov_base;
-                host_return_val = elem->in_sg[4].iov_base;
-                crypt->src = src;
-                crypt->dst = dst;
+                /* src and dst may each span several descriptors */
+                i = 1;
+                src_num = take_in_sg(elem, &i, crypt->len);
+                dst_num = take_in_sg(elem, &i, crypt->len);
+                if (!src_num || !dst_num || i + 2 > elem->in_num) {
+                    DEBUG("CIOCCRYPT: short descriptor chain");
+                    break;
+                }
+                iv = elem->in_sg[i++].iov_base;
+                host_return_val = elem->in_sg[i++].iov_base;
                 crypt->iv = iv;
-                
-                if ((*host_return_val = ioctl(*host_fd, CIOCCRYPT, crypt))) {
+                if (!handle_owns(h, crypt->ses)) {
+                    DEBUG("CIOCCRYPT: not this handle's session");
+                    *host_return_val = -1;
+                    break;
+                }
+                /* Newer guests want to know where the time went */
+                if (elem->in_num > i &&
+                    elem->in_sg[i].iov_len >= sizeof(*timing)) {
+                    timing = elem->in_sg[i].iov_base;
+                }
+
+                t_ioctl = now_ns();
+                if ((*host_return_val = crypt_iov(fd, crypt,
+                                                  &elem->in_sg[1], src_num,
+                                                  &elem->in_sg[1 + src_num],
+                                                  dst_num))) {
                     DEBUG("ioctl(CIOCCRYPT)");
                 }
+                if (timing) {
+                    timing->host_ioctl_ns = now_ns() - t_ioctl;
+                }
 
                 DEBUG("CIOCCRYPT: Success");
                 break;
@@ -159,6 +421,9 @@ static void vq_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         break;
     }
 
+    if (timing) {
+        timing->backend_ns = now_ns() - t_start;
+    }
     virtqueue_push(vq, elem, 0);
     virtio_notify(vdev, vq);
     g_free(elem);
@@ -167,19 +432,46 @@ static void vq_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_cryptodev_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VirtCryptodev *vcd = VIRTIO_CRYPTODEV(dev);
+    unsigned int i;
 
     DEBUG_IN();
 
+    if (vcd->host_fds < 1) {
+        error_setg(errp, "host-fds must be at least 1");
+        return;
+    }
+    vcd->pool_fd = g_new(int, vcd->host_fds);
+    for (i = 0; i < vcd->host_fds; i++) {
+        vcd->pool_fd[i] = -1;
+    }
+    vcd->pool_users = g_new0(unsigned int, vcd->host_fds);
+    vcd->handles = g_hash_table_new(NULL, NULL);
+
     virtio_init(vdev, "virtio-cryptodev", VIRTIO_ID_CRYPTODEV, 0);
     virtio_add_queue(vdev, 128, vq_handle_output);
 }
 
 static void virtio_cryptodev_unrealize(DeviceState *dev, Error **errp)
 {
+    VirtCryptodev *vcd = VIRTIO_CRYPTODEV(dev);
+    unsigned int i;
+
     DEBUG_IN();
+
+    handle_close_all(vcd);
+    g_hash_table_destroy(vcd->handles);
+    for (i = 0; i < vcd->host_fds; i++) {
+        if (vcd->pool_fd[i] >= 0) {
+            close(vcd->pool_fd[i]);
+        }
+    }
+    g_free(vcd->pool_fd);
+    g_free(vcd->pool_users);
 }
 
 static Property virtio_cryptodev_properties[] = {
+    DEFINE_PROP_UINT32("host-fds", VirtCryptodev, host_fds, 4),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -14,6 +14,9 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/scatterlist.h>
+#include <linux/gfp.h>
 #include <linux/virtio.h>
 #include <linux/virtio_config.h>
 
@@ -53,6 +56,97 @@ out:
 	return crdev;
 }
 
+/**
+ * CIOCCRYPT payloads go to the host as lists of pages, so they need no
+ * contiguous allocation. Chunks are taken as large as the allocator
+ * gives them up to CRYPTO_DATA_MAX_ORDER, at most CRYPTO_DATA_MAX_SEGS
+ * of them per buffer; src and dst get the same chunks, which the host
+ * then encrypts one after the other.
+ **/
+#define CRYPTO_DATA_MAX_ORDER	4
+#define CRYPTO_DATA_MAX_SEGS	256
+
+static void crypto_data_free(struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	int i;
+
+	if (!sgt->sgl)
+		return;
+	for_each_sg(sgt->sgl, sg, sgt->nents, i)
+		__free_pages(sg_page(sg), get_order(max_t(unsigned int, sg->length, 1)));
+	sg_free_table(sgt);
+	sgt->sgl = NULL;
+}
+
+static int crypto_data_alloc(struct sg_table *sgt, size_t len)
+{
+	struct scatterlist *sg, *last = NULL;
+	struct page *page;
+	size_t left = len, seg;
+	unsigned int nents, order;
+	int ret;
+
+	/* Enough entries for order-0 pages, or as many as we allow */
+	nents = min_t(size_t, max_t(size_t, DIV_ROUND_UP(len, PAGE_SIZE), 1),
+	              CRYPTO_DATA_MAX_SEGS);
+	if ((ret = sg_alloc_table(sgt, nents, GFP_KERNEL)))
+		return ret;
+
+	sgt->nents = 0;
+	sg = sgt->sgl;
+	do {
+		if (sgt->nents == nents) {
+			debug("%zu bytes do not fit in %u chunks", len, nents);
+			crypto_data_free(sgt);
+			return -ENOMEM;
+		}
+		order = min(get_order(max_t(size_t, left, 1)), CRYPTO_DATA_MAX_ORDER);
+		while (!(page = alloc_pages(GFP_KERNEL | (order ? __GFP_NORETRY | __GFP_NOWARN : 0),
+		                            order))) {
+			if (!order--) {
+				crypto_data_free(sgt);
+				return -ENOMEM;
+			}
+		}
+		seg = min_t(size_t, left, PAGE_SIZE << order);
+		sg_set_page(sg, page, seg, 0);
+		sgt->nents++;
+		left -= seg;
+		last = sg;
+		sg = sg_next(sg);
+	} while (left);
+	sg_mark_end(last);
+
+	return 0;
+}
+
+static int crypto_data_from_user(struct sg_table *sgt, const __u8 __user *src)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		if (copy_from_user(sg_virt(sg), src, sg->length))
+			return -EFAULT;
+		src += sg->length;
+	}
+	return 0;
+}
+
+static int crypto_data_to_user(__u8 __user *dst, struct sg_table *sgt)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		if (copy_to_user(dst, sg_virt(sg), sg->length))
+			return -EFAULT;
+		dst += sg->length;
+	}
+	return 0;
+}
+
 /*************************************
  * Implementation of file operations
  * for the Crypto character device
@@ -97,7 +191,6 @@ static int crypto_chrdev_open(struct inode *inode, struct file *filp)
 		ret = -ENOMEM;
 		goto fail;
 	}
-	sema_init(&crdev->lock, 1); // initiallize semaphore
 
 	crof->crdev = crdev;
 	crof->host_fd = -1;
@@ -123,7 +216,7 @@ static int crypto_chrdev_open(struct inode *inode, struct file *filp)
 	/**
 	 * Wait for the host to process our data.
 	 **/
-	while (virtqueue_get_buf(vq, &len) == NULL); // do nothing while waiting
+	crypto_wait_host(crdev, 0, &len);
 
 	crof->host_fd = *host_fd;
 
@@ -180,7 +273,7 @@ static int crypto_chrdev_release(struct inode *inode, struct file *filp)
 	/**
 	 * Wait for the host to process our data.
 	 **/
-	while (virtqueue_get_buf(vq, &len) == NULL); // do nothing while waiting
+	crypto_wait_host(crdev, 0, &len);
 
 	up(&crdev->lock); //unlock crypto device
 
@@ -200,7 +293,7 @@ static long crypto_chrdev_ioctl(struct file *filp, unsigned int cmd,
 	struct crypto_open_file *crof = filp->private_data;
 	struct crypto_device *crdev = crof->crdev;
 	struct virtqueue *vq = crdev->vq;
-	struct scatterlist syscall_type_sg, host_fd_sg, cmd_sg, session_sg, sess_ses_sg, session_key_sg, crypt_sg, crypto_src_sg, crypto_dst_sg, crypto_iv_sg, host_return_val_sg, *sgs[8];
+	struct scatterlist syscall_type_sg, host_fd_sg, cmd_sg, session_sg, sess_ses_sg, session_key_sg, crypt_sg, crypto_iv_sg, host_return_val_sg, host_timing_sg, *sgs[9];
 	unsigned int num_out, num_in, len;
 #define MSG_LEN 100
 	int *host_return_val = NULL;
@@ -208,11 +301,22 @@ static long crypto_chrdev_ioctl(struct file *filp, unsigned int cmd,
 	unsigned long flags;
 	struct session_op *user_session, *copied_session = NULL;
 	struct crypt_op *user_crypt, *copied_crypt = NULL;
-	__u8 *session_key = NULL, *crypto_src = NULL, *crypto_dst = NULL, *crypto_iv = NULL;
+	__u8 *session_key = NULL, *crypto_iv = NULL;
+	struct sg_table crypto_src = {}, crypto_dst = {};
 	__u32 *user_sess_ses, *copied_sess_ses = NULL;
+	struct virtio_cryptodev_host_timing *host_timing = NULL;
+	u64 t_start, t_kick, t_done;
 
 	debug("Entering");
 
+	/* Answered here, the host is not involved */
+	if (cmd == CIOCGTIMING) {
+		if (copy_to_user((void __user *)arg, &crof->timing, sizeof(crof->timing)))
+			return -EFAULT;
+		return 0;
+	}
+	t_start = ktime_get_ns();
+
 	/**
 	 * Allocate all data that will be sent to the host.
 	 **/
@@ -304,13 +408,15 @@ static long crypto_chrdev_ioctl(struct file *filp, unsigned int cmd,
 			goto fail;
 		}
 
-		crypto_src = kzalloc(copied_crypt->len * sizeof(__u8), GFP_KERNEL);
-		if((ret = copy_from_user(crypto_src, user_crypt->src, copied_crypt->len * sizeof(__u8)))) {
+		if ((ret = crypto_data_alloc(&crypto_src, copied_crypt->len)))
+			goto fail;
+		if ((ret = crypto_data_from_user(&crypto_src, user_crypt->src))) {
 			debug("Failed to copy_from_user (crypto_src).");
 			goto fail;
 		}
 
-		crypto_dst = kzalloc(copied_crypt->len * sizeof(__u8), GFP_KERNEL);
+		if ((ret = crypto_data_alloc(&crypto_dst, copied_crypt->len)))
+			goto fail;
 
 		crypto_iv = kzalloc(16 * sizeof(__u8), GFP_KERNEL);
 		if((ret = copy_from_user(crypto_iv, user_crypt->iv, 16 * sizeof(__u8)))) {
@@ -320,10 +426,8 @@ static long crypto_chrdev_ioctl(struct file *filp, unsigned int cmd,
 
 		sg_init_one(&crypt_sg, copied_crypt, sizeof(*copied_crypt));
 		sgs[num_out + num_in++] = &crypt_sg;
-		sg_init_one(&crypto_src_sg, crypto_src, copied_crypt->len * sizeof(__u8));
-		sgs[num_out + num_in++] = &crypto_src_sg;
-		sg_init_one(&crypto_dst_sg, crypto_dst, copied_crypt->len * sizeof(__u8));
-		sgs[num_out + num_in++] = &crypto_dst_sg;
+		sgs[num_out + num_in++] = crypto_src.sgl;
+		sgs[num_out + num_in++] = crypto_dst.sgl;
 		sg_init_one(&crypto_iv_sg, crypto_iv, 16 * sizeof(__u8));
 		sgs[num_out + num_in++] = &crypto_iv_sg;
 
@@ -339,6 +443,17 @@ static long crypto_chrdev_ioctl(struct file *filp, unsigned int cmd,
 	sg_init_one(&host_return_val_sg, host_return_val, sizeof(*host_return_val));
 	sgs[num_out + num_in++] = &host_return_val_sg;
 
+	/* The host says how long it took, after everything else */
+	if (cmd == CIOCCRYPT) {
+		host_timing = kzalloc(sizeof(*host_timing), GFP_KERNEL);
+		if (!host_timing) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		sg_init_one(&host_timing_sg, host_timing, sizeof(*host_timing));
+		sgs[num_out + num_in++] = &host_timing_sg;
+	}
+
 
 	/**
 	 * Wait for the host to process our data.
@@ -346,11 +461,19 @@ static long crypto_chrdev_ioctl(struct file *filp, unsigned int cmd,
 	if(down_interruptible(&crdev->lock)) //lock crypto device
 		return -ERESTARTSYS;
 
+	t_kick = ktime_get_ns();
 	err = virtqueue_add_sgs(vq, sgs, num_out, num_in,
 	                        &syscall_type_sg, GFP_ATOMIC);
+	if (err < 0) {
+		/* e.g. more chunks than the ring takes without indirect descriptors */
+		debug("virtqueue_add_sgs failed: %d", err);
+		up(&crdev->lock);
+		ret = err;
+		goto fail;
+	}
 	virtqueue_kick(vq);
-	while (virtqueue_get_buf(vq, &len) == NULL)
-		/* do nothing */;
+	crypto_wait_host(crdev, cmd == CIOCCRYPT ? copied_crypt->len : 0, &len);
+	t_done = ktime_get_ns();
 
 	if(cmd == CIOCGSESSION) {
 		if((ret = copy_to_user(user_session, copied_session, sizeof(*copied_session)))) {
@@ -359,7 +482,7 @@ static long crypto_chrdev_ioctl(struct file *filp, unsigned int cmd,
 	}
 
 	if(cmd == CIOCCRYPT) {
-		if((ret = copy_to_user(user_crypt->dst, crypto_dst, copied_crypt->len * sizeof(__u8)))) {
+		if ((ret = crypto_data_to_user(user_crypt->dst, &crypto_dst))) {
 			debug("Failed to copy_to_user (user_crypt->dst).");
 		}
 	}
@@ -367,6 +490,13 @@ static long crypto_chrdev_ioctl(struct file *filp, unsigned int cmd,
 	ret = *host_return_val;
 	printk(KERN_DEBUG "*host_return_val: %d", *host_return_val);
 
+	if (cmd == CIOCCRYPT) {
+		crof->timing.copy_in_ns = t_kick - t_start;
+		crof->timing.ring_ns = t_done - t_kick;
+		crof->timing.copy_out_ns = ktime_get_ns() - t_done;
+		crof->timing.host = *host_timing;
+	}
+
 	up(&crdev->lock); //unlock crypto device
 
 fail:
@@ -382,9 +512,10 @@ fail:
 
 		case CIOCCRYPT:
 			kfree(copied_crypt);
-			kfree(crypto_src);
-			kfree(crypto_dst);
+			crypto_data_free(&crypto_src);
+			crypto_data_free(&crypto_dst);
 			kfree(crypto_iv);
+			kfree(host_timing);
 			break;
 	}
 
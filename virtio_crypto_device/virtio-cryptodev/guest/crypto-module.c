@@ -2,6 +2,9 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/virtio.h>
 #include <linux/virtio_config.h>
 
@@ -13,10 +16,158 @@ struct crypto_driver_data crdrvdata;  // struct "crypto_driver_data" is defined
 
 static void vq_has_data(struct virtqueue *vq)
 {
+	struct crypto_device *crdev = vq->vdev->priv;
+
 	debug("Entering");
+	wake_up(&crdev->wq);
 	debug("Leaving");
 }
 
+static unsigned int lat_bucket(size_t size)
+{
+	return size ? min_t(unsigned int, ilog2(size) + 1, CRYPTO_LAT_BUCKETS - 1) : 0;
+}
+
+/* How long to spin before sleeping, < 0 for as long as it takes */
+static long poll_window(struct crypto_device *crdev, unsigned int bucket)
+{
+	long poll_ns = READ_ONCE(crdev->poll_ns);
+	unsigned long max_ns = READ_ONCE(crdev->poll_max_ns);
+	u64 mean = crdev->lat_ns[bucket];
+
+	if (poll_ns)
+		return poll_ns;
+	if (!mean)
+		return max_ns;
+	if (mean > max_ns)
+		return 0;
+	return min_t(u64, 2 * mean, max_ns);
+}
+
+/**
+ * Wait for the host to give back the buffer we just kicked, called with
+ * crdev->lock held. Callbacks stay disabled while we spin and are only
+ * armed to sleep. size is the request's payload, for the latency
+ * history.
+ **/
+void *crypto_wait_host(struct crypto_device *crdev, size_t size, unsigned int *len)
+{
+	struct virtqueue *vq = crdev->vq;
+	unsigned int bucket = lat_bucket(size);
+	long window = poll_window(crdev, bucket);
+	u64 t0 = ktime_get_ns(), spun, lat, old;
+	void *buf;
+
+	while (!(buf = virtqueue_get_buf(vq, len))) {
+		spun = ktime_get_ns() - t0;
+		if (window >= 0 && spun >= window) {
+			crdev->spin_ns += spun;
+			crdev->slept++;
+			virtqueue_enable_cb(vq);
+			wait_event(crdev->wq, (buf = virtqueue_get_buf(vq, len)) != NULL);
+			virtqueue_disable_cb(vq);
+			goto done;
+		}
+		cpu_relax();
+	}
+	crdev->spin_ns += ktime_get_ns() - t0;
+	crdev->polled++;
+done:
+	lat = ktime_get_ns() - t0;
+	old = crdev->lat_ns[bucket];
+	crdev->lat_ns[bucket] = old ? old - (old >> 3) + (lat >> 3) : lat;
+	return buf;
+}
+
+/**
+ * Per device tunables and what they bought, under
+ * /sys/bus/virtio/devices/virtioN/. Setting poll_ns clears poll_stats.
+ **/
+static ssize_t poll_ns_show(struct device *dev, struct device_attribute *attr,
+                            char *buf)
+{
+	struct crypto_device *crdev = dev_to_virtio(dev)->priv;
+
+	return sprintf(buf, "%ld\n", READ_ONCE(crdev->poll_ns));
+}
+
+static ssize_t poll_ns_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+	struct crypto_device *crdev = dev_to_virtio(dev)->priv;
+	long val;
+
+	if (kstrtol(buf, 0, &val) || val < -1)
+		return -EINVAL;
+	if (down_interruptible(&crdev->lock))
+		return -ERESTARTSYS;
+	crdev->poll_ns = val;
+	crdev->polled = crdev->slept = crdev->spin_ns = 0;
+	up(&crdev->lock);
+	return count;
+}
+static DEVICE_ATTR_RW(poll_ns);
+
+static ssize_t poll_max_ns_show(struct device *dev, struct device_attribute *attr,
+                                char *buf)
+{
+	struct crypto_device *crdev = dev_to_virtio(dev)->priv;
+
+	return sprintf(buf, "%lu\n", READ_ONCE(crdev->poll_max_ns));
+}
+
+static ssize_t poll_max_ns_store(struct device *dev, struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+	struct crypto_device *crdev = dev_to_virtio(dev)->priv;
+	unsigned long val;
+
+	if (kstrtoul(buf, 0, &val) || val > LONG_MAX)
+		return -EINVAL;
+	WRITE_ONCE(crdev->poll_max_ns, val);
+	return count;
+}
+static DEVICE_ATTR_RW(poll_max_ns);
+
+/* "polled slept spin_ns" */
+static ssize_t poll_stats_show(struct device *dev, struct device_attribute *attr,
+                               char *buf)
+{
+	struct crypto_device *crdev = dev_to_virtio(dev)->priv;
+
+	return sprintf(buf, "%llu %llu %llu\n", crdev->polled, crdev->slept,
+	               crdev->spin_ns);
+}
+static DEVICE_ATTR_RO(poll_stats);
+
+/* One "size mean_ns" line per size learned, size rounded down to a power of 2 */
+static ssize_t latency_ns_show(struct device *dev, struct device_attribute *attr,
+                               char *buf)
+{
+	struct crypto_device *crdev = dev_to_virtio(dev)->priv;
+	ssize_t n = 0;
+	int i;
+
+	for (i = 0; i < CRYPTO_LAT_BUCKETS; i++)
+		if (crdev->lat_ns[i])
+			n += scnprintf(buf + n, PAGE_SIZE - n, "%lu %llu\n",
+			               i ? 1UL << (i - 1) : 0UL, crdev->lat_ns[i]);
+	return n;
+}
+static DEVICE_ATTR_RO(latency_ns);
+
+static struct attribute *crypto_dev_attrs[] = {
+	&dev_attr_poll_ns.attr,
+	&dev_attr_poll_max_ns.attr,
+	&dev_attr_poll_stats.attr,
+	&dev_attr_latency_ns.attr,
+	NULL,
+};
+
+static const struct attribute_group crypto_dev_group = {
+	.attrs = crypto_dev_attrs,
+};
+
 static struct virtqueue *find_vq(struct virtio_device *vdev)
 {
 	int err;
@@ -54,15 +205,22 @@ static int virtcons_probe(struct virtio_device *vdev)
 
 	crdev->vdev = vdev;
 	vdev->priv = crdev;
+	init_waitqueue_head(&crdev->wq);
+	crdev->poll_max_ns = CRYPTO_POLL_MAX_NS;
 
 	crdev->vq = find_vq(vdev);
 	if (!(crdev->vq)) {
 		ret = -ENXIO;
-		goto out;		
+		goto out_free;
 	}
+	/* We poll, the callback is only armed by those going to sleep */
+	virtqueue_disable_cb(crdev->vq);
 
 	/* Other initializations. */
-	/* ?? */
+	sema_init(&crdev->lock, 1);
+	ret = sysfs_create_group(&vdev->dev.kobj, &crypto_dev_group);
+	if (ret)
+		goto out_del_vqs;
 
 	/**
 	 * Grab the next minor number and put the device in the driver's list. 
@@ -74,7 +232,13 @@ static int virtcons_probe(struct virtio_device *vdev)
 	debug("Got minor = %u", crdev->minor);
 
 	debug("Leaving");
+	return 0;
 
+out_del_vqs:
+	vdev->config->del_vqs(vdev);
+out_free:
+	vdev->priv = NULL;
+	kfree(crdev);
 out:
 	return ret;
 }
@@ -85,6 +249,8 @@ static void virtcons_remove(struct virtio_device *vdev)
 
 	debug("Entering");
 
+	sysfs_remove_group(&vdev->dev.kobj, &crypto_dev_group);
+
 	/* Delete virtio device list entry. */
 	spin_lock_irq(&crdrvdata.lock);
 	list_del(&crdev->list);
@@ -10,6 +10,25 @@
 /* The Virtio ID for virtio crypto ports */
 #define VIRTIO_ID_CRYPTODEV            30
 
+/**
+ * Where the time of the last CIOCCRYPT on an open file went, read with
+ * CIOCGTIMING by benchmarks. The host fills in its part in an extra
+ * buffer after host_return_val; an older host leaves it at zero.
+ **/
+struct virtio_cryptodev_host_timing {
+	__u64 backend_ns;	/* device: from popping the request to pushing it back */
+	__u64 host_ioctl_ns;	/* device: the ioctl(CIOCCRYPT) on the host /dev/crypto */
+};
+
+struct virtio_cryptodev_timing {
+	__u64 copy_in_ns;	/* copy_from_user of the request and its data */
+	__u64 ring_ns;		/* kick to used buffer, VM exit and host included */
+	__u64 copy_out_ns;	/* copy_to_user of the result */
+	struct virtio_cryptodev_host_timing host;
+};
+
+#define CIOCGTIMING	_IOR('c', 120, struct virtio_cryptodev_timing)
+
 /**
  * Global driver data.
  **/
@@ -25,6 +44,17 @@ struct crypto_driver_data {
 extern struct crypto_driver_data crdrvdata;
 
 
+/**
+ * Completion is hybrid: spin on the vq for a window, then arm the vq
+ * callback and sleep. Per device, in sysfs, poll_ns is -1 to spin until
+ * done, 0 for a window learned from recent latencies of requests of
+ * about the same size, or a fixed window in ns. The learned window is
+ * twice the mean latency, at most poll_max_ns; requests that take longer
+ * than that on average sleep right away.
+ **/
+#define CRYPTO_POLL_MAX_NS	50000
+#define CRYPTO_LAT_BUCKETS	25	/* log2 of the payload size, up to 16M */
+
 /**
  * Device info.
  **/
@@ -38,6 +68,15 @@ struct crypto_device {
 	struct virtqueue *vq;
 	struct semaphore lock;
 
+	/* Woken by the vq callback, when we sleep for the host. */
+	wait_queue_head_t wq;
+	long poll_ns;
+	unsigned long poll_max_ns;
+	/* Moving average of kick-to-done ns, by log2 of the payload size. */
+	u64 lat_ns[CRYPTO_LAT_BUCKETS];
+	/* Completions caught spinning and slept for, and ns spent spinning. */
+	u64 polled, slept, spin_ns;
+
 	/* The minor number of the device. */
 	unsigned int minor;
 };
@@ -52,6 +91,11 @@ struct crypto_open_file {
 
 	/* The fd that this device has on the Host. */
 	int host_fd;
+
+	/* Breakdown of the last CIOCCRYPT, for CIOCGTIMING. */
+	struct virtio_cryptodev_timing timing;
 };
 
+void *crypto_wait_host(struct crypto_device *crdev, size_t size, unsigned int *len);
+
 #endif